@@ -13,9 +13,58 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <time.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <pthread.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#endif
 
 #include "md5.h"
+#include "wire.h"
 #include "api.h"
+#include "pool.h"
+#include "trace.h"
+#include "threadpool.h"
+
+_Atomic long debug_ram;
+
+static pthread_mutex_t stBudgetLock = PTHREAD_MUTEX_INITIALIZER; // guards the two below
+static long *lMemoryBudget = NULL;          // readBlock heap budget of each fd, 0 = unlimited
+static int iMemoryBudgetSize = 0;           // number of entries in lMemoryBudget
+
+#ifdef HAVE_OPENSSL
+
+// struct SSLSession
+//
+// The last TLS session (ticket) received from each router, so the next
+// apiConnectSSL to the same address and port resumes it instead of
+// doing a full handshake.
+
+struct SSLSession {
+        char szIPaddr[64];           // router address
+        int iPort;                   // router port
+        SSL_SESSION *session;        // resumable session, NULL if none yet
+        struct SSLSession *stNext;   // next cached router
+};
+
+#define SSL_MAX_FDS 65536 // sslSock entries when the fd limit is unlimited
+
+// sslSock is sized once, for every fd the process may open, so apiRead
+// and apiWrite index it without a lock.  The context, the session list
+// and the CA file are only used under stSSLLock.
+
+static pthread_mutex_t stSSLLock = PTHREAD_MUTEX_INITIALIZER;
+static SSL_CTX *sslContext = NULL;          // shared by all TLS connections
+static SSL **sslSock = NULL;                // TLS state of each fd, NULL for plain TCP
+static int iSSLSockSize = 0;                // number of entries in sslSock
+static struct SSLSession *stSSLSessions = NULL;
+static char *szSSLCAFile = NULL;            // verify the router against this CA when set
+
+#endif
 
 
 // ********************************************************************
@@ -29,6 +78,26 @@ void apiInitialize(void) {
 // ********************************************************************
 
 void apiTerminate(void) {
+#ifdef HAVE_OPENSSL
+   struct SSLSession *stNext;
+
+   while (stSSLSessions) {
+      stNext = stSSLSessions->stNext;
+      if (stSSLSessions->session) SSL_SESSION_free(stSSLSessions->session);
+      free(stSSLSessions);
+      stSSLSessions = stNext;
+   }
+   if (sslContext) SSL_CTX_free(sslContext);
+   sslContext = NULL;
+   free(sslSock);
+   sslSock = NULL;
+   iSSLSockSize = 0;
+#endif
+   free(lMemoryBudget);
+   lMemoryBudget = NULL;
+   iMemoryBudgetSize = 0;
+   clearConnectionPools();
+   clearSharedThreadPool();
    if (debug_ram) printf("ERROR: Still using %ld bytes of RAM.\n",debug_ram);
 }
 
@@ -79,6 +148,7 @@ int apiConnect(char *szIPaddr, int iPort) {
    int fdSock;
    struct sockaddr_in address;
    int iLen;
+   TRACE_START(llTrace);
 
    fdSock = socket(AF_INET, SOCK_STREAM, 0);
    address.sin_family = AF_INET;
@@ -86,8 +156,13 @@ int apiConnect(char *szIPaddr, int iPort) {
    address.sin_port = htons(iPort);
    iLen = sizeof(address);
 
-   if (connect(fdSock, (struct sockaddr *)&address, iLen) == -1) return (0);
-   else return (fdSock);
+   if (connect(fdSock, (struct sockaddr *)&address, iLen) == -1) {
+      close(fdSock);
+      TRACE_SPAN(llTrace, "apiConnect failed", 0, szIPaddr);
+      return (0);
+   }
+   TRACE_SPAN(llTrace, "apiConnect", fdSock, szIPaddr);
+   return (fdSock);
 }
 
 
@@ -97,10 +172,266 @@ int apiConnect(char *szIPaddr, int iPort) {
 // CLOSE THE SOCKET.
 
 void apiDisconnect(int fdSock) {
+#ifdef HAVE_OPENSSL
+   if ((fdSock < iSSLSockSize) && sslSock[fdSock]) {
+      SSL_shutdown(sslSock[fdSock]);
+      SSL_free(sslSock[fdSock]);
+      sslSock[fdSock] = NULL;
+   }
+#endif
+   closeConnectionPool(fdSock); // a new connection on this fd starts with an empty pool.
    close(fdSock);
 }
 
 
+#ifdef HAVE_OPENSSL
+
+// ********************************************************************
+// sslFindSession
+// ********************************************************************
+// RETURN THE SESSION CACHE ENTRY OF A ROUTER, CREATING IT IF NEEDED.
+
+static struct SSLSession *sslFindSession(char *szIPaddr, int iPort) {
+   struct SSLSession *stSession;
+
+   for (stSession = stSSLSessions; stSession; stSession = stSession->stNext) {
+      if ((stSession->iPort == iPort) && (strcmp(stSession->szIPaddr, szIPaddr) == 0)) return (stSession);
+   }
+
+   stSession = calloc(1, sizeof(struct SSLSession));
+   snprintf(stSession->szIPaddr, sizeof stSession->szIPaddr, "%s", szIPaddr);
+   stSession->iPort = iPort;
+   stSession->stNext = stSSLSessions;
+   stSSLSessions = stSession;
+   return (stSession);
+}
+
+
+// ********************************************************************
+// sslSetPeerName
+// ********************************************************************
+// MAKE THE HANDSHAKE CHECK THAT THE CERTIFICATE NAMES THE ROUTER.
+//
+// An IP address must match an IP SAN of the certificate; OpenSSL
+// before 3.0 would check it as a DNS name with SSL_set1_host, which
+// never matches.  Anything else is checked as a host name.  Returns 1,
+// or 0 if the name could not be set.
+
+static int sslSetPeerName(SSL *ssl, char *szIPaddr) {
+   unsigned char cAddr[sizeof(struct in6_addr)];
+
+   if ((inet_pton(AF_INET, szIPaddr, cAddr) == 1) || (inet_pton(AF_INET6, szIPaddr, cAddr) == 1)) {
+      return (X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), szIPaddr) == 1);
+   }
+   return (SSL_set1_host(ssl, szIPaddr) == 1);
+}
+
+
+// ********************************************************************
+// sslNewSession
+// ********************************************************************
+// OPENSSL CALLBACK FOR EVERY NEW SESSION OR TICKET FROM THE ROUTER.
+//
+// TLS 1.3 sends tickets after the handshake, so they are picked up
+// here rather than right after SSL_connect, on whichever thread is
+// reading.  Returning 1 keeps the reference to session.
+
+static int sslNewSession(SSL *ssl, SSL_SESSION *session) {
+   struct SSLSession *stSession = SSL_get_app_data(ssl);
+
+   if (stSession == NULL) return (0);
+   pthread_mutex_lock(&stSSLLock);
+   if (stSession->session) SSL_SESSION_free(stSession->session);
+   stSession->session = session;
+   pthread_mutex_unlock(&stSSLLock);
+   return (1);
+}
+
+
+// ********************************************************************
+// sslInitialize
+// ********************************************************************
+// CREATE THE SHARED TLS CONTEXT ON FIRST USE.
+//
+// RouterOS api-ssl without a certificate only offers anonymous DH
+// ciphers, so those are allowed along with the defaults, but only as
+// long as no CA file is set: anonymous ciphers have no certificate to
+// verify.  With apiSetCAFile the defaults apply and the router must
+// present a certificate signed by that CA.  Call with stSSLLock held.
+
+static int sslInitialize(void) {
+   struct rlimit stLimit;
+
+   if (sslContext) return (1);
+
+   if (sslSock == NULL) { // one entry for every fd the process may open.
+      iSSLSockSize = SSL_MAX_FDS;
+      if ((getrlimit(RLIMIT_NOFILE, &stLimit) == 0) && (stLimit.rlim_cur != RLIM_INFINITY))
+         iSSLSockSize = (int)stLimit.rlim_cur;
+      sslSock = calloc(iSSLSockSize, sizeof(SSL *));
+   }
+
+   if ((sslContext = SSL_CTX_new(TLS_client_method())) == NULL) return (0);
+   SSL_CTX_set_session_cache_mode(sslContext, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+   SSL_CTX_set_mode(sslContext, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER); // non-blocking writers retry from a buffer that may move.
+   SSL_CTX_sess_set_new_cb(sslContext, sslNewSession);
+   if (szSSLCAFile == NULL) {
+      SSL_CTX_set_cipher_list(sslContext, "DEFAULT:ADH:@SECLEVEL=0");
+   } else if (SSL_CTX_load_verify_locations(sslContext, szSSLCAFile, NULL) == 1) {
+      SSL_CTX_set_verify(sslContext, SSL_VERIFY_PEER, NULL);
+   } else {
+      fprintf(stderr,"apiSetCAFile(): cannot load %s.\n", szSSLCAFile);
+      SSL_CTX_free(sslContext);
+      sslContext = NULL;
+      return (0);
+   }
+   return (1);
+}
+
+#endif
+
+
+// ********************************************************************
+// apiSetCAFile
+// ********************************************************************
+// VERIFY API-SSL ROUTERS AGAINST THE CERTIFICATES IN szCAFile.
+//
+// Without it the router's certificate is not checked.  With it the
+// router must present a certificate signed by one of these CAs and
+// issued for the address connected to.  Connections made from now on
+// use the new setting; open ones keep the one they were made with.
+// NULL goes back to unverified connections.
+//
+// Return 1, or 0 if szCAFile cannot be loaded.  apiConnectSSL then
+// fails until a good file is set.  Always 0 when built without
+// HAVE_OPENSSL.
+
+int apiSetCAFile(char *szCAFile) {
+#ifdef HAVE_OPENSSL
+   int iReturn;
+
+   pthread_mutex_lock(&stSSLLock);
+   szSSLCAFile = szCAFile;
+   if (sslContext) SSL_CTX_free(sslContext); // open connections hold their own reference.
+   sslContext = NULL;
+   iReturn = sslInitialize();
+   pthread_mutex_unlock(&stSSLLock);
+   return (iReturn);
+#else
+   return (0);
+#endif
+}
+
+
+// ********************************************************************
+// apiConnectSSL
+// ********************************************************************
+// CONNECT TO THE API-SSL SERVICE (PORT 8729) OF A ROUTER.
+//
+// Same as apiConnect followed by a TLS handshake.  The fd returned
+// works with every function of the API; reads and writes on it go
+// through TLS.  The session ticket of the last connection to the same
+// address and port is offered, so reconnects resume the session
+// instead of doing a full handshake.  apiSSLResumed tells whether
+// that worked.
+//
+// Return the socket or 0 if error.  Always 0 when built without
+// HAVE_OPENSSL.
+
+int apiConnectSSL(char *szIPaddr, int iPort) {
+#ifdef HAVE_OPENSSL
+   struct SSLSession *stSession;
+   SSL *ssl;
+   int fdSock;
+
+   pthread_mutex_lock(&stSSLLock);
+   if (!sslInitialize()) {
+      pthread_mutex_unlock(&stSSLLock);
+      return (0);
+   }
+   stSession = sslFindSession(szIPaddr, iPort);
+   ssl = SSL_new(sslContext);
+   SSL_set_app_data(ssl, stSession);
+   if (stSession->session) SSL_set_session(ssl, stSession->session);
+   if (szSSLCAFile && !sslSetPeerName(ssl, szIPaddr)) { // the certificate must name the router.
+      pthread_mutex_unlock(&stSSLLock);
+      fprintf(stderr,"apiConnectSSL(): cannot verify the certificate of %s.\n", szIPaddr);
+      SSL_free(ssl);
+      return (0);
+   }
+   pthread_mutex_unlock(&stSSLLock);
+
+   if ((fdSock = apiConnect(szIPaddr, iPort)) == 0) {
+      SSL_free(ssl);
+      return (0);
+   }
+   if (fdSock >= iSSLSockSize) {
+      fprintf(stderr,"apiConnectSSL(): fd %d is above the open file limit.\n", fdSock);
+      SSL_free(ssl);
+      close(fdSock);
+      return (0);
+   }
+   SSL_set_fd(ssl, fdSock);
+
+   if (SSL_connect(ssl) != 1) {
+      fprintf(stderr,"apiConnectSSL(): TLS handshake with %s:%d failed.\n", szIPaddr, iPort);
+      SSL_free(ssl);
+      close(fdSock);
+      return (0);
+   }
+
+   sslSock[fdSock] = ssl;
+   return (fdSock);
+#else
+   fprintf(stderr,"apiConnectSSL(): built without HAVE_OPENSSL.\n");
+   return (0);
+#endif
+}
+
+
+// ********************************************************************
+// apiSSLResumed
+// ********************************************************************
+// RETURN 1 IF THE TLS CONNECTION ON fdSock RESUMED A CACHED SESSION.
+
+int apiSSLResumed(int fdSock) {
+#ifdef HAVE_OPENSSL
+   if ((fdSock < iSSLSockSize) && sslSock[fdSock]) return (SSL_session_reused(sslSock[fdSock]));
+#endif
+   return (0);
+}
+
+
+// ********************************************************************
+// apiRead
+// ********************************************************************
+// READ UP TO iLen BYTES FROM A PLAIN OR TLS CONNECTION.
+//
+// Every read of the API goes through here.  TLS records are decrypted
+// by SSL_read straight into the caller's buffer.  Returns the number
+// of bytes read or <= 0 on error or close.
+
+int apiRead(int fdSock, void *buf, int iLen) {
+#ifdef HAVE_OPENSSL
+   if ((fdSock < iSSLSockSize) && sslSock[fdSock]) return (SSL_read(sslSock[fdSock], buf, iLen));
+#endif
+   return (read(fdSock, buf, iLen));
+}
+
+
+// ********************************************************************
+// apiWrite
+// ********************************************************************
+// WRITE iLen BYTES TO A PLAIN OR TLS CONNECTION.
+
+int apiWrite(int fdSock, void *buf, int iLen) {
+#ifdef HAVE_OPENSSL
+   if ((fdSock < iSSLSockSize) && sslSock[fdSock]) return (SSL_write(sslSock[fdSock], buf, iLen));
+#endif
+   return (write(fdSock, buf, iLen));
+}
+
+
 // ********************************************************************
 // hexStringToChar
 // ********************************************************************
@@ -289,10 +620,12 @@ void addPartWordToSentence(struct Sentence *stSentence, char *szWordToAdd) {
 // ********************************************************************
 // INITIALIZE A BLOCK.
 //
-// Initialize block by setting iLength to 0.
+// Initialize block by setting iLength to 0 and no spill mapping.
 
 void initializeBlock(struct Block *stBlock) {
    stBlock->iLength = 0;
+   stBlock->cMap = NULL;
+   stBlock->lMapSize = 0;
 }
 
 
@@ -307,17 +640,26 @@ void initializeBlock(struct Block *stBlock) {
 // pointers to the sentences.  Lastly set iLength = 0.
 
 void clearBlock(struct Block *stBlock) {
+   struct Sentence *stSentence;
    int i;
 
    if (stBlock->iLength == 0) return; // skip empty blocks.
 
    for (i = 0; i < stBlock->iLength; i++)  {
-      clearSentence(stBlock->stSentence[i]); // free words.
+      stSentence = stBlock->stSentence[i];
+      if (stBlock->cMap && (stSentence->iLength > 0) &&
+          (stSentence->szWord[0] >= stBlock->cMap) && (stSentence->szWord[0] < stBlock->cMap + stBlock->lMapSize)) {
+         debug_ram -= (sizeof(char *) * stSentence->iLength);
+         free(stSentence->szWord); // words are in the spill mapping
+      } else {
+         clearSentence(stSentence); // free words.
+      }
       debug_ram -= sizeof(struct Sentence);
       free(stBlock->stSentence[i]); // sentence pointer from the array
    }
    debug_ram -= (sizeof(struct Sentence *) * stBlock->iLength);
    free(stBlock->stSentence); // pointer to array of sentence pointers
+   if (stBlock->cMap) munmap(stBlock->cMap, stBlock->lMapSize);
    initializeBlock(stBlock);
 }
 
@@ -457,6 +799,8 @@ void addSentenceToBlock(struct Block *stBlock, struct Sentence *stSentence) {
    if (stBlock->iLength == 0) { // first sentence pointer.
       stBlock->stSentence = malloc(sizeof(struct Sentence *));
       debug_ram += sizeof(struct Sentence *);
+      stBlock->cMap = NULL; // an empty block has no spill mapping, even if set up with just iLength = 0.
+      stBlock->lMapSize = 0;
    } else { // add one more sentence pointer.
       stBlock->stSentence = realloc(stBlock->stSentence, (stBlock->iLength + 1) * sizeof(struct Sentence *));
       debug_ram += sizeof(struct Sentence *);
@@ -477,50 +821,13 @@ void addSentenceToBlock(struct Block *stBlock, struct Sentence *stSentence) {
 // ********************************************************************
 // WRITE ENCODED MESSAGE LENGTH TO THE SOCKET.
 //
-// Encode message length and write it out to the socket.
+// Encode message length and write it out to the socket.  Lengths of
+// up to 0xFFFFFFFF are encoded in 1 to 5 bytes; see wire.h.
 
 void writeLen(int fdSock, int iLen) {
-   char *cEncodedLength;  // encoded length to send to the api socket
-   char *cLength;         // exactly what is in memory at &iLen integer
-
-   cEncodedLength = calloc(sizeof(int), 1);
-   cLength = (char *)&iLen; // set cLength address to be same as iLen
-
-   if (iLen < 0x80) { // write 1 byte
-
-      cEncodedLength[0] = (char)iLen;
-      write(fdSock, cEncodedLength, 1);
-
-   } else if (iLen < 0x4000) { // write 2 bytes
-
-      cEncodedLength[0] = cLength[1] | 0x80;
-      cEncodedLength[1] = cLength[0];
-      write(fdSock, cEncodedLength, 2);
-
-   } else if (iLen < 0x200000) { // write 3 bytes
-
-      cEncodedLength[0] = cLength[2] | 0xc0;
-      cEncodedLength[1] = cLength[1];
-      cEncodedLength[2] = cLength[0];
-      write(fdSock, cEncodedLength, 3);
-
-   } else if (iLen < 0x10000000) { // write 4 bytes this code SHOULD work, but is untested
-
-      cEncodedLength[0] = cLength[3] | 0xe0;
-      cEncodedLength[1] = cLength[2];
-      cEncodedLength[2] = cLength[1];
-      cEncodedLength[3] = cLength[0];
-      write(fdSock, cEncodedLength, 4);
-
-   } else  { // this should never happen
-
-      fprintf(stderr,"writeLen(): length of word is %d which is too long.\n", iLen);
-      exit(1);
-
-   }
-
-   free(cEncodedLength);
+   unsigned char cEncodedLength[WIRE_MAX_LEN_SIZE]; // encoded length to send to the api socket
 
+   apiWrite(fdSock, cEncodedLength, wireEncodeLen((unsigned int)iLen, cEncodedLength));
 }
 
 
@@ -528,11 +835,21 @@ void writeLen(int fdSock, int iLen) {
 // writeWord
 // ********************************************************************
 // WRITE A WORD TO THE SOCKET.
+//
+// Short words are encoded together with their length into a buffer on
+// the stack and written with one call, which also keeps them in one
+// TLS record.
 
 void writeWord(int fdSock, char *szWord) {
+   unsigned char cEncoded[256 + WIRE_MAX_LEN_SIZE];
+   int iLen = strlen(szWord);
 
-   writeLen(fdSock, strlen(szWord));
-   write(fdSock, szWord, strlen(szWord));
+   if (iLen <= 256) {
+      apiWrite(fdSock, cEncoded, wireEncodeWord(szWord, iLen, cEncoded));
+   } else {
+      writeLen(fdSock, iLen);
+      apiWrite(fdSock, szWord, iLen);
+   }
 }
 
 
@@ -546,10 +863,12 @@ void writeWord(int fdSock, char *szWord) {
 
 void writeSentence(int fdSock, struct Sentence *stWriteSentence) {
    int i;
+   TRACE_START(llTrace);
    
    if (stWriteSentence->iLength == 0) return; // nothing to write
    for (i = 0; i < stWriteSentence->iLength; i++) writeWord(fdSock, stWriteSentence->szWord[i]);
    writeWord(fdSock, "");
+   TRACE_SPAN(llTrace, "writeSentence", fdSock, traceSentenceTag(stWriteSentence->szWord, stWriteSentence->iLength));
 }
 
 // ********************************************************************
@@ -578,53 +897,57 @@ void writeBlock(int fdSock, struct Block *stBlock) {
 // ********************************************************************
 // READ THE MESSAGE LENGTH FROM THE SOCKET.
 //
-// A message length is itself between 1 and 4 bytes in length.
+// A message length is itself between 1 and 5 bytes in length.
 // The first byte returned determines how many bytes need to be read
 // in order to receive the full message length.
 //
 // 80 = 10000000 (2 character encoded length)
 // C0 = 11000000 (3 character encoded length)
 // E0 = 11100000 (4 character encoded length)
+// F0 = 11110000 (5 character encoded length)
 //
-// Message length is returned.  No memory is allocated.
+// Message length is returned.  -1 is returned if the connection was
+// closed, a reserved first byte was received or the length does not
+// fit an int with room for the NULL.  No memory is allocated.
 
 int readLen(int fdSock) {
-   char cFirstChar; // first character read from socket
-   char cLength[sizeof(int)]; // length of next message to read...will be cast to int at the end
-   int *iLen;       // calculated length of next message (Cast to int)
-
-   read(fdSock, &cFirstChar, 1);
+   unsigned char cLength[WIRE_MAX_LEN_SIZE]; // encoded length as read from the socket
+   unsigned int iLen = 0;
+   int iSize;
+   int i;
 
-   // this code SHOULD work, but is untested
+   if (apiRead(fdSock, cLength, 1) != 1) return (-1);
+   if ((iSize = wirePrefixSize(cLength[0])) == 0) return (-1);
 
-   if ((cFirstChar & 0xE0) == 0xE0) { // read 4 bytes
-      cLength[3] = cFirstChar;
-      cLength[3] &= 0x1f;        // mask out the 1st 3 bits
-      read(fdSock, &cLength[2], 1);
-      read(fdSock, &cLength[1], 1);
-      read(fdSock, &cLength[0], 1);
-   } else if ((cFirstChar & 0xC0) == 0xC0) { // read 3 bytes
-      cLength[3] = 0;
-      cLength[2] = cFirstChar;
-      cLength[2] &= 0x3f;        // mask out the 1st 2 bits
-      read(fdSock, &cLength[1], 1);
-      read(fdSock, &cLength[0], 1);
-   } else if ((cFirstChar & 0x80) == 0x80) { // read 2 bytes
-      cLength[3] = 0;
-      cLength[2] = 0;
-      cLength[1] = cFirstChar;
-      cLength[1] &= 0x7f;        // mask out the 1st bit
-      read(fdSock, &cLength[0], 1);
-   } else { // assume 1-byte encoded length.
-      cLength[3] = 0;
-      cLength[2] = 0;
-      cLength[1] = 0;
-      cLength[0] = cFirstChar;
+   for (i = 1; i < iSize; i++) {
+      if (apiRead(fdSock, &cLength[i], 1) != 1) return (-1);
    }
 
-   iLen = (int *)cLength;
+   wireDecodeLen(cLength, iSize, &iLen);
+   if (iLen >= INT_MAX) return (-1);
+   return ((int)iLen);
+}
+
+
+// ********************************************************************
+// readWordData
+// ********************************************************************
+// READ EXACTLY iLen BYTES OF A WORD INTO szWord AND NULL TERMINATE IT.
+//
+// Returns the number of bytes read, less than iLen if the connection
+// was closed.
+
+static int readWordData(int fdSock, char *szWord, int iLen) {
+   int iRead;
+   int iBytesRead;
+
+   for (iRead = 0; iRead < iLen; iRead += iBytesRead) {
+      iBytesRead = apiRead(fdSock, szWord + iRead, iLen - iRead);
+      if (iBytesRead <= 0) break; // connection closed.
+   }
+   szWord[iRead] = 0;
 
-   return *iLen;
+   return (iRead);
 }
 
 
@@ -640,29 +963,59 @@ int readLen(int fdSock) {
 //             Free words added to sentences with clearSentence.
 
 char *readWord(int fdSock) {
-   int iBytesToRead = 0;
-   int iBytesRead = 0;
    int iLen;
    char *szRetWord;
-   char *szTmpWord;
 
    if ((iLen = readLen(fdSock)) <= 0) return (NULL); // how many bytes to read.
 
-   // allocate memory for strings
-   szRetWord = calloc(sizeof(char), iLen + 1); // allocate memory for read data plus NULL
+   szRetWord = malloc(iLen + 1); // allocate memory for read data plus NULL
    debug_ram += (sizeof(char) * (iLen + 1));
-   szTmpWord = calloc(sizeof(char), 1024 + 1); // allocate memory for temp data plus a NULL
+   readWordData(fdSock, szRetWord, iLen);
 
-   while (iLen > 0) {
-      iBytesToRead = iLen > 1024 ? 1024 : iLen; // limit to 1024 bytes max.
-      iBytesRead = read(fdSock, szTmpWord, iBytesToRead); // read iBytesToRead from the socket
-      szTmpWord[iBytesRead] = 0; // terminate szTmpWord
-      strcat(szRetWord, szTmpWord); // concatenate szTmpWord to szRetWord
-      iLen -= iBytesRead;
+   return (szRetWord);
+}
+
+
+// ********************************************************************
+// readWordBuffer
+// ********************************************************************
+// READ A WORD FROM THE SOCKET INTO A REUSABLE BUFFER.
+//
+// Same as readWord, but the word is read straight into *pszBuffer,
+// which is grown with realloc as needed and kept by the caller between
+// calls.  This saves a malloc and a copy per word for callers that
+// store the word somewhere else anyway.  *pszBuffer may start as NULL
+// with *piSize = 0.
+//
+// Returns the length of the word, or 0 at the end of the sentence.
+//
+// IMPORTANT:  You must free *pszBuffer when finished with it.
+
+int readWordBuffer(int fdSock, char **pszBuffer, int *piSize) {
+   int iLen;
+
+   if ((iLen = readLen(fdSock)) <= 0) return (0); // end of sentence.
+
+   if (*piSize < iLen + 1) { // grow the buffer to hold the word plus NULL
+      *pszBuffer = realloc(*pszBuffer, iLen + 1);
+      debug_ram += (iLen + 1 - *piSize);
+      *piSize = iLen + 1;
    }
 
-   free(szTmpWord); // deallocate szTmpWord
-   return (szRetWord);
+   return (readWordData(fdSock, *pszBuffer, iLen));
+}
+
+
+// ********************************************************************
+// setReturnValue
+// ********************************************************************
+// SET iReturnValue OF A SENTENCE FROM A REPLY WORD.
+
+static void setReturnValue(struct Sentence *stSentence, char *szWord) {
+   if (strstr(szWord, "!done") != NULL) stSentence->iReturnValue = DONE;
+   else if (strstr(szWord, "!re") != NULL) stSentence->iReturnValue = DATA;
+   else if (strstr(szWord, "!trap") != NULL) stSentence->iReturnValue = TRAP;
+   else if (strstr(szWord, "!fatal") != NULL) stSentence->iReturnValue = FATAL;
 }
 
 
@@ -679,20 +1032,179 @@ char *readWord(int fdSock) {
 
 void readSentence(int fdSock, struct Sentence *stReturnSentence) {
    char *szWord;
+   TRACE_START(llTrace);
 
    initializeSentence(stReturnSentence);
 
    while ((szWord = readWord(fdSock)) != NULL) { // must free szWord
       addWordToSentence(stReturnSentence, szWord);
-
-      if (strstr(szWord, "!done") != NULL) stReturnSentence->iReturnValue = DONE;
-      else if (strstr(szWord, "!re") != NULL) stReturnSentence->iReturnValue = DATA;
-      else if (strstr(szWord, "!trap") != NULL) stReturnSentence->iReturnValue = TRAP;
-      else if (strstr(szWord, "!fatal") != NULL) stReturnSentence->iReturnValue = FATAL;
+      setReturnValue(stReturnSentence, szWord);
 
       debug_ram -= (strlen(szWord) + 1);
       free(szWord);
    }
+   TRACE_SPAN(llTrace, "readSentence", fdSock, traceSentenceTag(stReturnSentence->szWord, stReturnSentence->iLength));
+}
+
+
+// ********************************************************************
+// apiSetMemoryBudget
+// ********************************************************************
+// LIMIT THE HEAP readBlock MAY USE FOR ONE REPLY ON A CONNECTION.
+//
+// Once the sentences of a reply use more than lBytes, the rest of the
+// reply is written to a temporary file (in $TMPDIR, or /tmp) that is
+// mmapped back when the reply is complete.  The Block looks the same
+// to the caller, the words of the spilled sentences just live in the
+// mapping instead of the heap.  0 turns the budget off (the default).
+// If the spill file cannot be written, the spilled sentences are
+// dropped and the block ends with a !fatal sentence instead.
+
+void apiSetMemoryBudget(int fdSock, long lBytes) {
+   if (fdSock < 0) return;
+
+   pthread_mutex_lock(&stBudgetLock);
+   if (fdSock >= iMemoryBudgetSize) { // grow the fd table.
+      lMemoryBudget = realloc(lMemoryBudget, (fdSock + 1) * sizeof(long));
+      memset(lMemoryBudget + iMemoryBudgetSize, 0, (fdSock + 1 - iMemoryBudgetSize) * sizeof(long));
+      iMemoryBudgetSize = fdSock + 1;
+   }
+   lMemoryBudget[fdSock] = lBytes;
+   pthread_mutex_unlock(&stBudgetLock);
+}
+
+
+// ********************************************************************
+// memoryBudget
+// ********************************************************************
+// RETURN THE HEAP BUDGET OF fdSock, 0 IF THERE IS NONE.
+
+static long memoryBudget(int fdSock) {
+   long lBytes = 0;
+
+   pthread_mutex_lock(&stBudgetLock);
+   if ((fdSock >= 0) && (fdSock < iMemoryBudgetSize)) lBytes = lMemoryBudget[fdSock];
+   pthread_mutex_unlock(&stBudgetLock);
+   return (lBytes);
+}
+
+
+// ********************************************************************
+// openSpillFile
+// ********************************************************************
+// CREATE AN ANONYMOUS TEMPORARY FILE FOR readBlock.
+//
+// The file is unlinked right away; its space is returned when the
+// mapping is removed by clearBlock.  NULL is returned on error.
+
+static FILE *openSpillFile(void) {
+   char szPath[1024];
+   char *szDir;
+   FILE *fSpill;
+   int fd;
+
+   if ((szDir = getenv("TMPDIR")) == NULL) szDir = "/tmp";
+   snprintf(szPath, sizeof(szPath), "%s/mkspill-XXXXXX", szDir);
+
+   if ((fd = mkstemp(szPath)) < 0) {
+      fprintf(stderr,"readBlock(): can't create spill file in %s, staying in memory.\n", szDir);
+      return (NULL);
+   }
+   unlink(szPath);
+
+   if ((fSpill = fdopen(fd, "w+")) == NULL) close(fd);
+   return (fSpill);
+}
+
+
+// ********************************************************************
+// readSpillSentence
+// ********************************************************************
+// READ A SENTENCE FROM THE SOCKET, WRITING ITS WORDS TO THE SPILL FILE.
+//
+// The word strings go to fSpill, NULL terminated, and only the pointer
+// array is allocated.  Until mapSpillFile runs, each word pointer holds
+// the offset of the word in the file instead of an address.  A failed
+// write leaves an error on fSpill for mapSpillFile to find; the rest
+// of the reply is still read so the connection stays in step.
+
+static void readSpillSentence(int fdSock, struct Sentence *stSentence, FILE *fSpill, long *plSpilled, char **pszWord, int *piSize) {
+   int iLen;
+
+   initializeSentence(stSentence);
+
+   while ((iLen = readWordBuffer(fdSock, pszWord, piSize)) > 0) {
+      setReturnValue(stSentence, *pszWord);
+
+      if (stSentence->iLength == 0) stSentence->szWord = malloc(sizeof(char *));
+      else stSentence->szWord = realloc(stSentence->szWord, (stSentence->iLength + 1) * sizeof(char *));
+      debug_ram += sizeof(char *);
+
+      stSentence->szWord[stSentence->iLength++] = (char *)(intptr_t)*plSpilled;
+      if (!ferror(fSpill)) fwrite(*pszWord, 1, iLen + 1, fSpill); // short writes set the error.
+      *plSpilled += iLen + 1;
+   }
+}
+
+
+// ********************************************************************
+// mapSpillFile
+// ********************************************************************
+// MAP THE SPILL FILE AND POINT THE SPILLED WORDS INTO THE MAPPING.
+//
+// The mapping is private and writable, so callers can still change
+// words in place as with heap words; the file is never written back.
+// If the file cannot be mapped the words are read back to the heap
+// instead and the block is not spilled after all.  Returns 0 if the
+// file could not be written (disk full ...): the spilled words are
+// lost and the caller must drop those sentences.
+
+static int mapSpillFile(struct Block *stBlock, FILE *fSpill, long lSpilled, int iFirstSpilled) {
+   struct Sentence *stSentence;
+   char *cMap = MAP_FAILED;
+   char *cFile;
+   int iLen;
+   int i, j;
+
+   if ((fflush(fSpill) != 0) || ferror(fSpill)) {
+      fprintf(stderr,"readBlock(): can't write spill file of %ld bytes.\n", lSpilled);
+      fclose(fSpill);
+      return (0);
+   }
+   if (lSpilled == 0) { // the connection closed before any word was spilled.
+      fclose(fSpill);
+      return (1);
+   }
+   cMap = mmap(NULL, lSpilled, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fSpill), 0);
+
+   if (cMap == MAP_FAILED) { // no room to map it: copy the words back to the heap.
+      if (((cFile = malloc(lSpilled)) == NULL) || (pread(fileno(fSpill), cFile, lSpilled, 0) != lSpilled)) {
+         fprintf(stderr,"readBlock(): can't read back spill file of %ld bytes.\n", lSpilled);
+         free(cFile);
+         fclose(fSpill);
+         return (0);
+      }
+      fclose(fSpill);
+      for (i = iFirstSpilled; i < stBlock->iLength; i++) {
+         stSentence = stBlock->stSentence[i];
+         for (j = 0; j < stSentence->iLength; j++) {
+            iLen = strlen(cFile + (intptr_t)stSentence->szWord[j]) + 1;
+            stSentence->szWord[j] = memcpy(malloc(iLen), cFile + (intptr_t)stSentence->szWord[j], iLen);
+            debug_ram += iLen;
+         }
+      }
+      free(cFile);
+      return (1);
+   }
+   fclose(fSpill); // the mapping keeps the file alive.
+
+   stBlock->cMap = cMap;
+   stBlock->lMapSize = lSpilled;
+   for (i = iFirstSpilled; i < stBlock->iLength; i++) {
+      stSentence = stBlock->stSentence[i];
+      for (j = 0; j < stSentence->iLength; j++) stSentence->szWord[j] = cMap + (intptr_t)stSentence->szWord[j];
+   }
+   return (1);
 }
 
 
@@ -722,15 +1234,141 @@ void readSentence(int fdSock, struct Sentence *stReturnSentence) {
 
 void readBlock(int fdSock, struct Block *stBlock) {
    struct Sentence stSentence;
+   long lBudget = 0;        // heap budget of this connection, 0 = unlimited
+   long lUsed = 0;          // heap used by the sentences read so far
+   FILE *fSpill = NULL;     // spill file once the budget is exceeded
+   long lSpilled = 0;       // bytes written to fSpill
+   int iFirstSpilled = 0;   // first sentence stored in fSpill
+   char *szWord = NULL;     // word buffer of readSpillSentence
+   int iSize = 0;
+   int i;
+   TRACE_START(llTrace);
 
    initializeBlock(stBlock);
    initializeSentence(&stSentence);
+   lBudget = memoryBudget(fdSock);
 
    do {
-      readSentence(fdSock,&stSentence);
+      if ((fSpill == NULL) && (lBudget > 0) && (lUsed > lBudget)) {
+         if ((fSpill = openSpillFile()) == NULL) lBudget = 0; // stay on the heap
+         iFirstSpilled = stBlock->iLength;
+      }
+
+      if (fSpill) {
+         readSpillSentence(fdSock, &stSentence, fSpill, &lSpilled, &szWord, &iSize);
+      } else {
+         readSentence(fdSock,&stSentence);
+         lUsed += sizeof(struct Sentence) + sizeof(struct Sentence *);
+         for (i = 0; i < stSentence.iLength; i++) lUsed += sizeof(char *) + strlen(stSentence.szWord[i]) + 1;
+      }
       addSentenceToBlock(stBlock,&stSentence);
       // We don't free &stSentence here since we're loading the block.
+
+      // time to the first reply: mostly the router working on the command.
+      if (stBlock->iLength == 1) TRACE_SPAN(llTrace, "readBlock wait", fdSock, traceSentenceTag(stSentence.szWord, stSentence.iLength));
    } while ((stSentence.iReturnValue == DATA) || (stSentence.iReturnValue == TRAP));
+
+   if (fSpill) {
+      debug_ram -= iSize;
+      free(szWord);
+      if (!mapSpillFile(stBlock, fSpill, lSpilled, iFirstSpilled)) { // the spilled words are lost.
+         for (i = iFirstSpilled; i < stBlock->iLength; i++) {
+            debug_ram -= sizeof(char *) * stBlock->stSentence[i]->iLength + sizeof(struct Sentence) + sizeof(struct Sentence *);
+            free(stBlock->stSentence[i]->szWord); // only offsets into the file.
+            free(stBlock->stSentence[i]);
+         }
+         stBlock->iLength = iFirstSpilled;
+         initializeSentence(&stSentence); // end the block like a lost connection would.
+         addWordToSentence(&stSentence, "!fatal");
+         addWordToSentence(&stSentence, "=message=readBlock(): spill file failed");
+         stSentence.iReturnValue = FATAL;
+         addSentenceToBlock(stBlock, &stSentence);
+      }
+   }
+   TRACE_SPAN(llTrace, "readBlock", fdSock, traceSentenceTag(stSentence.szWord, stSentence.iLength));
+}
+
+
+// ********************************************************************
+// apiCancel
+// ********************************************************************
+// CANCEL A TAGGED COMMAND AND DRAIN ITS REMAINING REPLIES.
+//
+// Streaming commands (/tool/torch, /interface/monitor-traffic, /ping
+// without count ...) send !re sentences until cancelled, so readBlock
+// never returns for them.  Send them with a .tag, read as many
+// sentences as needed with readSentence, then call apiCancel.
+//
+// "/cancel =tag=szTag" is sent and replies are read until the !done of
+// the cancelled command and the !done of the /cancel have both
+// arrived.  The connection is then ready for the next command.  The
+// cancelled command's replies are discarded word by word without
+// building sentences.  Replies of other tagged commands still running
+// on the connection are added to stOther, or dropped if it is NULL.
+// The /cancel itself is untagged, so don't leave untagged commands in
+// flight when calling this.
+//
+// Returns the number of sentences of the command that were discarded,
+// or -1 if the connection failed (!fatal or closed).
+
+int apiCancel(int fdSock, char *szTag, struct Block *stOther) {
+   struct Sentence stSentence;
+   char *szWord;
+   int iSize;
+   int iWords;
+   int iMine;              // sentence has .tag=szTag
+   int iTagged;            // sentence has a .tag
+   int iCommandDone = 0;   // !done of the cancelled command seen
+   int iCancelDone = 0;    // !done of the /cancel seen
+   int iCancelTrap = 0;    // the /cancel failed: the command had already ended
+   int iDrained = 0;
+   TRACE_START(llTrace);
+
+   iSize = strlen(szTag) + 6;
+   szWord = malloc(iSize); // also the word buffer below
+   debug_ram += iSize;
+   sprintf(szWord, "=tag=%s", szTag);
+   initializeSentence(&stSentence);
+   addWordToSentence(&stSentence, "/cancel");
+   addWordToSentence(&stSentence, szWord);
+   writeSentence(fdSock, &stSentence);
+   clearSentence(&stSentence);
+
+   while (!iCancelDone || !(iCommandDone || iCancelTrap)) {
+      initializeSentence(&stSentence);
+      iWords = iMine = iTagged = 0;
+      while (readWordBuffer(fdSock, &szWord, &iSize) > 0) {
+         if (iWords++ == 0) setReturnValue(&stSentence, szWord);
+         if (strncmp(szWord, ".tag=", 5) == 0) {
+            iTagged = 1;
+            iMine = (strcmp(szWord + 5, szTag) == 0);
+         }
+         if (stOther) addWordToSentence(&stSentence, szWord);
+      }
+      if ((iWords == 0) || (stSentence.iReturnValue == FATAL)) { // connection gone
+         clearSentence(&stSentence);
+         iDrained = -1;
+         break;
+      }
+
+      if (iMine) {
+         iDrained++;
+         if (stSentence.iReturnValue == DONE) iCommandDone = 1;
+      } else if (!iTagged) {
+         if (stSentence.iReturnValue == DONE) iCancelDone = 1;
+         else if (stSentence.iReturnValue == TRAP) iCancelTrap = 1;
+      } else if (stOther) {
+         addSentenceToBlock(stOther, &stSentence); // the block owns the words now
+         continue;
+      }
+      clearSentence(&stSentence);
+   }
+
+   debug_ram -= iSize;
+   free(szWord);
+   TRACE_SPAN(llTrace, "apiCancel", fdSock, szTag);
+
+   return (iDrained);
 }
 
 
@@ -750,6 +1388,7 @@ int login(int fdSock, char *username, char *password) {
    unsigned char digest[64];
    char tmp[256];
    MD5_CTX md5hash;
+   TRACE_START(llTrace);
 
    writeWord(fdSock, "/login");
    writeWord(fdSock, "");
@@ -798,6 +1437,7 @@ int login(int fdSock, char *username, char *password) {
 
    readSentence(fdSock,&stReadSentence);
 
+   TRACE_SPAN(llTrace, "login", fdSock, NULL);
    if (stReadSentence.iReturnValue == DONE) {
       clearSentence(&stReadSentence);
       return 1;
@@ -819,6 +1459,7 @@ int login(int fdSock, char *username, char *password) {
 int login_643(int fdSock, char *username, char *password) {
    struct Sentence stReadSentence;
    struct Sentence stWriteSentence;
+   TRACE_START(llTrace);
 
    initializeSentence(&stWriteSentence);
    addWordToSentence(&stWriteSentence,"/login");
@@ -830,6 +1471,7 @@ int login_643(int fdSock, char *username, char *password) {
    clearSentence(&stWriteSentence);
 
    readSentence(fdSock,&stReadSentence);
+   TRACE_SPAN(llTrace, "login", fdSock, NULL);
 
    if (stReadSentence.iReturnValue != DONE) {
       fprintf(stderr,"login(): error logging in.\n");
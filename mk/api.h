@@ -32,19 +32,30 @@ struct Sentence {
 // iLength tells us how many Sentence structures the block holds.
 // **stSentence is a pointer to a block of memory where you will
 // find Sentence structures stored in an array.
+//
+// When readBlock spilled part of a reply to disk (see apiSetMemoryBudget)
+// the words of the spilled sentences point into the mapping cMap
+// instead of the heap.  Don't use addPartWordToSentence on those.
 
 struct Block {
         struct Sentence **stSentence; // pointer to array of Sentences.
         int iLength; // length of stSentence (number of pointers in array)
+        char *cMap;     // mapped spill file, NULL if nothing was spilled
+        long lMapSize;  // bytes mapped at cMap
 };
 
-long debug_ram;
+extern _Atomic long debug_ram; // bytes currently allocated by the API (leak check, thread safe)
 
 void apiInitialize(void);
 void apiTerminate(void);
 int parse(char *, char *, char *);
 int apiConnect(char *szIPaddr, int iPort);
 void apiDisconnect(int fdSock);
+int apiSetCAFile(char *szCAFile);
+int apiConnectSSL(char *szIPaddr, int iPort);
+int apiSSLResumed(int fdSock);
+int apiRead(int fdSock, void *buf, int iLen);
+int apiWrite(int fdSock, void *buf, int iLen);
 char hexStringToChar(char *cToConvert);
 char *md5ToBinary(char *szHex);
 char *md5DigestToHexString(unsigned char *binaryDigest);
@@ -66,8 +77,12 @@ void writeSentence(int fdSock, struct Sentence *stWriteSentence);
 void writeBlock(int fdSock, struct Block *stBlock);
 int readLen(int fdSock);
 char *readWord(int fdSock);
+int readWordBuffer(int fdSock, char **pszBuffer, int *piSize);
 void readSentence(int fdSock, struct Sentence *stReturnSentence);
 void readBlock(int fdSock, struct Block *stBlock);
+void apiSetMemoryBudget(int fdSock, long lBytes);
+int apiCancel(int fdSock, char *szTag, struct Block *stOther);
 int login(int fdSock, char *username, char *password);
+int login_643(int fdSock, char *username, char *password);
 
 #endif // MK_API
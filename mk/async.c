@@ -0,0 +1,442 @@
+//
+// Mikrotik API 2.0 // Non-blocking connection.
+//
+// Connects, logs in and runs commands without ever blocking, so any
+// number of routers can share the caller's own event loop and thread.
+// The loop only needs the fd, the events it should wait for, and to
+// call asyncStep when they come:
+//
+//    struct AsyncConnection stConn[1000];
+//    struct pollfd stPoll[1000];
+//    char *szWords[] = { "/system/resource/print", NULL };
+//
+//    for (i = 0; i < 1000; i++) {
+//       asyncConnect(&stConn[i], szIPaddr[i], 8728, "admin", "", NULL, NULL);
+//       asyncSubmit(&stConn[i], szWords, onResource, NULL);
+//    }
+//    while (iBusy) {
+//       for (i = 0; i < 1000; i++) {
+//          stPoll[i].fd = asyncFd(&stConn[i]);
+//          stPoll[i].events = asyncEvents(&stConn[i]);
+//       }
+//       poll(stPoll, 1000, 1000);
+//       for (i = 0; i < 1000; i++) if (stPoll[i].revents) asyncStep(&stConn[i]);
+//    }
+//    for (i = 0; i < 1000; i++) clearAsyncConnection(&stConn[i]);
+//
+// Logs in the way login_643 does.  Plain TCP only: a TLS handshake
+// would have to be driven the same way and is not.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "api.h"
+#include "wire.h"
+#include "decoder.h"
+#include "async.h"
+
+static void onAsyncSentence(struct Sentence *stSentence, void *pData);
+
+
+// ********************************************************************
+// newRequest
+// ********************************************************************
+// ENCODE A COMMAND (NULL TERMINATED WORDS) WITH THE NEXT .tag.
+
+static struct AsyncRequest *newRequest(struct AsyncConnection *stConn, char **szWords,
+                                       void (*onDone)(struct AsyncRequest *, void *), void *pData) {
+   struct AsyncRequest *stRequest;
+   char szTag[32];
+   int iLen = 1; // final empty word
+   int i;
+
+   stRequest = calloc(1, sizeof(struct AsyncRequest));
+   stRequest->lTag = stConn->lNextTag++;
+   stRequest->onDone = onDone;
+   stRequest->pData = pData;
+   initializeBlock(&stRequest->stReply);
+
+   snprintf(szTag, sizeof(szTag), ".tag=%ld", stRequest->lTag);
+   for (i = 0; szWords[i] != NULL; i++) iLen += strlen(szWords[i]) + WIRE_MAX_LEN_SIZE;
+   iLen += strlen(szTag) + WIRE_MAX_LEN_SIZE;
+   stRequest->cCommand = malloc(iLen);
+   for (i = 0; szWords[i] != NULL; i++) {
+      stRequest->iCommandLen += wireEncodeWord(szWords[i], strlen(szWords[i]), stRequest->cCommand + stRequest->iCommandLen);
+   }
+   stRequest->iCommandLen += wireEncodeWord(szTag, strlen(szTag), stRequest->cCommand + stRequest->iCommandLen);
+   stRequest->cCommand[stRequest->iCommandLen++] = 0;
+   debug_ram += sizeof(struct AsyncRequest) + stRequest->iCommandLen;
+
+   return (stRequest);
+}
+
+
+// ********************************************************************
+// completeRequest
+// ********************************************************************
+// SET THE RESULT OF A REQUEST, CALL ITS CALLBACK AND FREE IT.
+
+static void completeRequest(struct AsyncRequest *stRequest, int iResult) {
+   stRequest->iResult = iResult;
+   if (stRequest->onDone) stRequest->onDone(stRequest, stRequest->pData);
+
+   clearBlock(&stRequest->stReply);
+   debug_ram -= sizeof(struct AsyncRequest) + stRequest->iCommandLen;
+   free(stRequest->cCommand);
+   free(stRequest);
+}
+
+
+// ********************************************************************
+// sendRequest
+// ********************************************************************
+// APPEND A REQUEST TO THE OUTPUT BUFFER AND PUT IT IN FLIGHT.
+
+static void sendRequest(struct AsyncConnection *stConn, struct AsyncRequest *stRequest) {
+   int iBucket;
+
+   if (stConn->iOutLen + stRequest->iCommandLen > stConn->iOutSize) {
+      debug_ram -= stConn->iOutSize;
+      while (stConn->iOutLen + stRequest->iCommandLen > stConn->iOutSize) stConn->iOutSize *= 2;
+      stConn->cOut = realloc(stConn->cOut, stConn->iOutSize);
+      debug_ram += stConn->iOutSize;
+   }
+   memcpy(stConn->cOut + stConn->iOutLen, stRequest->cCommand, stRequest->iCommandLen);
+   stConn->iOutLen += stRequest->iCommandLen;
+
+   iBucket = stRequest->lTag & (ASYNC_BUCKETS - 1);
+   stRequest->stNext = stConn->stBucket[iBucket];
+   stConn->stBucket[iBucket] = stRequest;
+   stConn->lInFlight++;
+}
+
+
+// ********************************************************************
+// failConnection
+// ********************************************************************
+// THE CONNECTION IS GONE: COMPLETE EVERY REQUEST WITH FATAL.
+//
+// Requests submitted from now on fail straight away.  onState is only
+// told if iNotify is set.
+
+static void failConnection(struct AsyncConnection *stConn, int iNotify) {
+   struct AsyncRequest *stRequest;
+   int i;
+
+   if (stConn->iState == ASYNC_FAILED) return;
+   stConn->iState = ASYNC_FAILED;
+   stConn->iOutLen = stConn->iOutSent = 0;
+
+   for (i = 0; i < ASYNC_BUCKETS; i++) {
+      while ((stRequest = stConn->stBucket[i]) != NULL) {
+         stConn->stBucket[i] = stRequest->stNext;
+         completeRequest(stRequest, FATAL);
+      }
+   }
+   stConn->lInFlight = 0;
+   while ((stRequest = stConn->stQueued) != NULL) {
+      stConn->stQueued = stRequest->stNext;
+      completeRequest(stRequest, FATAL);
+   }
+   stConn->stQueuedLast = NULL;
+
+   if (iNotify && stConn->onState) stConn->onState(stConn, stConn->pData);
+}
+
+
+// ********************************************************************
+// onLogin
+// ********************************************************************
+// THE /login REPLY: SEND WHAT WAS QUEUED, OR GIVE UP.
+
+static void onLogin(struct AsyncRequest *stRequest, void *pData) {
+   struct AsyncConnection *stConn = pData;
+   struct AsyncRequest *stQueued;
+
+   if (stConn->iState == ASYNC_FAILED) return; // failed or cleared meanwhile
+   if (stRequest->iResult != DONE) {
+      fprintf(stderr, "asyncStep(): error logging in.\n");
+      failConnection(stConn, 1);
+      return;
+   }
+
+   stConn->iState = ASYNC_READY;
+   while ((stQueued = stConn->stQueued) != NULL) {
+      stConn->stQueued = stQueued->stNext;
+      sendRequest(stConn, stQueued);
+   }
+   stConn->stQueuedLast = NULL;
+   if (stConn->onState) stConn->onState(stConn, stConn->pData);
+}
+
+
+// ********************************************************************
+// asyncConnect
+// ********************************************************************
+// START CONNECTING AND LOGGING IN TO A ROUTER.
+//
+// Returns at once.  The connect and login go on in asyncStep; onState
+// (may be NULL) is called when the connection becomes ASYNC_READY or
+// ASYNC_FAILED.  Returns 0 if the connect could not even be started,
+// in which case the connection is ASYNC_FAILED already.
+//
+// IMPORTANT: Use clearAsyncConnection when finished with it, whatever
+// this returned.
+
+int asyncConnect(struct AsyncConnection *stConn, char *szIPaddr, int iPort, char *szUsername, char *szPassword,
+                 void (*onState)(struct AsyncConnection *, void *), void *pData) {
+   char *szLogin[4];
+   struct AsyncRequest *stLogin;
+
+   memset(stConn, 0, sizeof(struct AsyncConnection));
+   stConn->fdSock = -1;
+   stConn->iState = ASYNC_CONNECTING;
+   stConn->onState = onState;
+   stConn->pData = pData;
+   stConn->iOutSize = ASYNC_OUT_SIZE;
+   stConn->cOut = malloc(ASYNC_OUT_SIZE);
+   debug_ram += ASYNC_OUT_SIZE;
+   initializeDecoder(&stConn->stDecoder, onAsyncSentence, stConn);
+
+   // the login goes first in the output buffer; it is written once connected.
+   szLogin[0] = "/login";
+   szLogin[1] = malloc(strlen(szUsername) + 7);
+   szLogin[2] = malloc(strlen(szPassword) + 11);
+   szLogin[3] = NULL;
+   sprintf(szLogin[1], "=name=%s", szUsername);
+   sprintf(szLogin[2], "=password=%s", szPassword);
+   stLogin = newRequest(stConn, szLogin, onLogin, stConn);
+   free(szLogin[1]);
+   free(szLogin[2]);
+   sendRequest(stConn, stLogin);
+
+   stConn->stAddress.sin_family = AF_INET;
+   stConn->stAddress.sin_addr.s_addr = inet_addr(szIPaddr);
+   stConn->stAddress.sin_port = htons(iPort);
+
+   stConn->fdSock = socket(AF_INET, SOCK_STREAM, 0);
+   if (stConn->fdSock < 0) {
+      failConnection(stConn, 0);
+      return (0);
+   }
+   fcntl(stConn->fdSock, F_SETFL, fcntl(stConn->fdSock, F_GETFL) | O_NONBLOCK);
+   fcntl(stConn->fdSock, F_SETFD, FD_CLOEXEC);
+
+   if (connect(stConn->fdSock, (struct sockaddr *)&stConn->stAddress, sizeof(stConn->stAddress)) == 0) {
+      stConn->iState = ASYNC_LOGIN;
+   } else if (errno != EINPROGRESS) {
+      failConnection(stConn, 0);
+      return (0);
+   }
+   return (1);
+}
+
+
+// ********************************************************************
+// asyncFd
+// ********************************************************************
+// RETURN THE SOCKET TO WATCH, -1 IF THERE IS NONE.
+//
+// The fd stays the same from asyncConnect to clearAsyncConnection, also
+// after the connection failed, so it can be taken out of an epoll set.
+
+int asyncFd(struct AsyncConnection *stConn) {
+   return (stConn->fdSock);
+}
+
+
+// ********************************************************************
+// asyncEvents
+// ********************************************************************
+// RETURN THE poll EVENTS asyncStep IS WAITING FOR.
+//
+// POLLOUT while connecting or while output is left to write, POLLIN
+// once connected, 0 after the connection failed.  Check it again after
+// every asyncStep and asyncSubmit.
+
+int asyncEvents(struct AsyncConnection *stConn) {
+   switch (stConn->iState) {
+   case ASYNC_CONNECTING:
+      return (POLLOUT);
+   case ASYNC_LOGIN:
+   case ASYNC_READY:
+      return (POLLIN | ((stConn->iOutSent < stConn->iOutLen) ? POLLOUT : 0));
+   }
+   return (0);
+}
+
+
+// ********************************************************************
+// flushOutput
+// ********************************************************************
+// WRITE AS MUCH OF THE OUTPUT BUFFER AS THE SOCKET TAKES.
+
+static void flushOutput(struct AsyncConnection *stConn) {
+   int iWritten;
+
+   while (stConn->iOutSent < stConn->iOutLen) {
+      iWritten = apiWrite(stConn->fdSock, stConn->cOut + stConn->iOutSent, stConn->iOutLen - stConn->iOutSent);
+      if (iWritten < 0) {
+         if (errno == EINTR) continue;
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+      }
+      if (iWritten <= 0) {
+         failConnection(stConn, 1);
+         return;
+      }
+      stConn->iOutSent += iWritten;
+   }
+   stConn->iOutLen = stConn->iOutSent = 0;
+}
+
+
+// ********************************************************************
+// asyncStep
+// ********************************************************************
+// ADVANCE THE CONNECTION AS FAR AS IT GOES WITHOUT BLOCKING.
+//
+// Finishes the connect, writes pending commands and decodes every reply
+// that has arrived, calling the completion callbacks on the way.  Safe
+// to call at any time, ready or not.  Callbacks may submit more work
+// but must not clear the connection.  Returns the new state.
+
+int asyncStep(struct AsyncConnection *stConn) {
+   int iRead;
+
+   if (stConn->iState == ASYNC_CONNECTING) {
+      // a second connect tells how the first one went, without waiting.
+      if (connect(stConn->fdSock, (struct sockaddr *)&stConn->stAddress, sizeof(stConn->stAddress)) == 0) {
+         stConn->iState = ASYNC_LOGIN;
+      } else if (errno == EISCONN) {
+         stConn->iState = ASYNC_LOGIN;
+      } else if ((errno == EINPROGRESS) || (errno == EALREADY) || (errno == EINTR)) {
+         return (stConn->iState);
+      } else {
+         failConnection(stConn, 1);
+         return (stConn->iState);
+      }
+   }
+   if (stConn->iState == ASYNC_FAILED) return (stConn->iState);
+
+   flushOutput(stConn);
+
+   while (stConn->iState != ASYNC_FAILED) {
+      iRead = decoderRead(&stConn->stDecoder, stConn->fdSock);
+      if (iRead > 0) continue;
+      if ((iRead < 0) && (errno == EINTR)) continue;
+      if ((iRead < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) break;
+      failConnection(stConn, 1);
+   }
+
+   // the callbacks may have submitted more.
+   if (stConn->iState != ASYNC_FAILED) flushOutput(stConn);
+   return (stConn->iState);
+}
+
+
+// ********************************************************************
+// onAsyncSentence
+// ********************************************************************
+// DECODER CALLBACK: ADD A REPLY SENTENCE TO ITS REQUEST.
+//
+// The request completes with its !done.  An untagged !fatal means the
+// router is closing the session.
+
+static void onAsyncSentence(struct Sentence *stSentence, void *pData) {
+   struct AsyncConnection *stConn = pData;
+   struct AsyncRequest **pstLink;
+   struct AsyncRequest *stRequest = NULL;
+   long lTag = -1;
+   int i;
+
+   for (i = 1; i < stSentence->iLength; i++) {
+      if (strncmp(stSentence->szWord[i], ".tag=", 5) == 0) lTag = atol(stSentence->szWord[i] + 5);
+   }
+
+   if ((lTag >= 0) && (stConn->iState != ASYNC_FAILED)) {
+      for (pstLink = &stConn->stBucket[lTag & (ASYNC_BUCKETS - 1)]; *pstLink; pstLink = &(*pstLink)->stNext) {
+         if ((*pstLink)->lTag == lTag) {
+            stRequest = *pstLink;
+            break;
+         }
+      }
+   }
+
+   if (stRequest == NULL) {
+      if (stSentence->iReturnValue == FATAL) failConnection(stConn, 1);
+      clearSentence(stSentence);
+      return;
+   }
+
+   if (stSentence->iReturnValue == TRAP) stRequest->iTrap = 1;
+   addSentenceToBlock(&stRequest->stReply, stSentence); // the Block owns the words now
+   if ((stSentence->iReturnValue != DONE) && (stSentence->iReturnValue != FATAL)) return;
+
+   *pstLink = stRequest->stNext;
+   stConn->lInFlight--;
+   if (stSentence->iReturnValue == FATAL) completeRequest(stRequest, FATAL);
+   else completeRequest(stRequest, stRequest->iTrap ? TRAP : DONE);
+}
+
+
+// ********************************************************************
+// asyncSubmit
+// ********************************************************************
+// QUEUE A COMMAND (NULL TERMINATED WORDS, NO .tag).
+//
+// onDone(stRequest, pData) gets the reply in stRequest->stReply and
+// stRequest->iResult set; it must not keep stRequest, which is freed
+// when it returns.  Commands submitted before the login is done are
+// sent right after it.  Nothing is written here: the next asyncStep
+// does.  Returns 1, or 0 if the connection has failed, in which case
+// onDone was called with FATAL already.
+
+int asyncSubmit(struct AsyncConnection *stConn, char **szWords,
+                void (*onDone)(struct AsyncRequest *, void *), void *pData) {
+   struct AsyncRequest *stRequest = newRequest(stConn, szWords, onDone, pData);
+
+   if (stConn->iState == ASYNC_FAILED) {
+      completeRequest(stRequest, FATAL);
+      return (0);
+   }
+
+   if (stConn->iState == ASYNC_READY) {
+      sendRequest(stConn, stRequest);
+      return (1);
+   }
+
+   if (stConn->stQueuedLast) stConn->stQueuedLast->stNext = stRequest;
+   else stConn->stQueued = stRequest;
+   stConn->stQueuedLast = stRequest;
+   return (1);
+}
+
+
+// ********************************************************************
+// clearAsyncConnection
+// ********************************************************************
+// CLOSE THE CONNECTION AND FREE ALL ITS MEMORY.
+//
+// Requests still pending complete with FATAL first; onState is not
+// called.
+
+void clearAsyncConnection(struct AsyncConnection *stConn) {
+   stConn->onState = NULL;
+   failConnection(stConn, 0);
+
+   if (stConn->fdSock >= 0) close(stConn->fdSock);
+   stConn->fdSock = -1;
+   clearDecoder(&stConn->stDecoder);
+   debug_ram -= stConn->iOutSize;
+   free(stConn->cOut);
+   stConn->cOut = NULL;
+   stConn->iOutSize = 0;
+}
@@ -0,0 +1,76 @@
+//
+// Mikrotik API 2.0 // Non-blocking connection.
+//
+
+#ifndef MK_ASYNC
+#define MK_ASYNC
+
+#include <netinet/in.h>
+
+#include "api.h"
+#include "decoder.h"
+
+#define ASYNC_BUCKETS  16          // in-flight lookup table (power of 2)
+#define ASYNC_OUT_SIZE 4096        // initial output buffer
+
+#define ASYNC_CONNECTING 0 // TCP connect in progress
+#define ASYNC_LOGIN      1 // connected, waiting for the /login reply
+#define ASYNC_READY      2 // logged in
+#define ASYNC_FAILED     3 // connect or login failed, or connection lost
+
+// struct AsyncRequest
+//
+// One command submitted to an AsyncConnection, and later its reply.
+// iResult is 0 until the reply is complete, then DONE, TRAP (a !trap
+// came before the !done) or FATAL (the connection failed).
+
+struct AsyncRequest {
+        struct AsyncRequest *stNext;       // queue or in-flight bucket chain
+        unsigned char *cCommand;           // encoded sentence incl .tag
+        int iCommandLen;                   // bytes in cCommand
+        long lTag;                         // .tag of the command
+        struct Block stReply;              // reply sentences
+        int iTrap;                         // a !trap was received
+        int iResult;                       // 0 while pending
+        void (*onDone)(struct AsyncRequest *stRequest, void *pData);
+        void *pData;
+};
+
+// struct AsyncConnection
+//
+// A connection to one router that never blocks and owns no thread.
+// The caller's event loop watches fdSock for asyncEvents and calls
+// asyncStep when it is ready; asyncStep connects, logs in, writes what
+// is queued and decodes what arrived, as far as it can without waiting.
+// Commands submitted before the login is done wait in stQueued.  Once
+// sent, they are pipelined, each with its own .tag, and matched to
+// their reply by tag.  Everything runs on the caller's thread.
+
+struct AsyncConnection {
+        int fdSock;                        // non-blocking socket, -1 if none
+        int iState;                        // ASYNC_CONNECTING .. ASYNC_FAILED
+        struct sockaddr_in stAddress;      // router, to finish the connect
+        struct Decoder stDecoder;          // decodes replies as they arrive
+        unsigned char *cOut;               // encoded sentences not yet written
+        int iOutLen;                       // bytes in cOut
+        int iOutSent;                      // bytes of cOut written already
+        int iOutSize;                      // bytes allocated
+        struct AsyncRequest *stQueued;     // waiting for the login, oldest first
+        struct AsyncRequest *stQueuedLast;
+        struct AsyncRequest *stBucket[ASYNC_BUCKETS]; // in flight by tag
+        long lInFlight;
+        long lNextTag;
+        void (*onState)(struct AsyncConnection *stConn, void *pData);
+        void *pData;                       // passed to onState
+};
+
+int asyncConnect(struct AsyncConnection *stConn, char *szIPaddr, int iPort, char *szUsername, char *szPassword,
+                 void (*onState)(struct AsyncConnection *, void *), void *pData);
+int asyncFd(struct AsyncConnection *stConn);
+int asyncEvents(struct AsyncConnection *stConn);
+int asyncStep(struct AsyncConnection *stConn);
+int asyncSubmit(struct AsyncConnection *stConn, char **szWords,
+                void (*onDone)(struct AsyncRequest *, void *), void *pData);
+void clearAsyncConnection(struct AsyncConnection *stConn);
+
+#endif // MK_ASYNC
@@ -0,0 +1,278 @@
+//
+// Mikrotik API 2.0 // Attribute sentences.
+//
+// A Sentence keeps every word as its own malloc'd string, so a 500k
+// row address list repeats "=address=", "=list=", "=comment=" ... in
+// every row and pays the allocator overhead for each of them.  An
+// AttrBlock keeps the names once in the pool of the connection and
+// each row as a single allocation of (name id, value) pairs.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "api.h"
+#include "pool.h"
+#include "attr.h"
+
+// scratch space for the sentence being read.
+struct AttrScratch {
+        struct Attribute *stAttr; // attributes read so far
+        int iLength;      // attributes in stAttr
+        int iSize;        // attributes allocated
+        char *cValue;     // values read so far
+        int iValueLen;    // bytes used in cValue
+        int iValueSize;   // bytes allocated for cValue
+};
+
+
+// ********************************************************************
+// initializeAttrBlock
+// ********************************************************************
+// INITIALIZE AN ATTRBLOCK.
+
+void initializeAttrBlock(struct AttrBlock *stAttrBlock) {
+   memset(stAttrBlock, 0, sizeof(struct AttrBlock));
+}
+
+
+// ********************************************************************
+// clearAttrBlock
+// ********************************************************************
+// CLEAR AN ATTRBLOCK BY FREEING MEMORY.
+//
+// The pool belongs to the connection; only the block's hold on it is
+// given back here.
+
+void clearAttrBlock(struct AttrBlock *stAttrBlock) {
+   int i;
+
+   for (i = 0; i < stAttrBlock->iLength; i++) {
+      debug_ram -= stAttrBlock->stSentence[i].iSize;
+      free(stAttrBlock->stSentence[i].stAttr);
+   }
+   debug_ram -= stAttrBlock->iSize * sizeof(struct AttrSentence);
+   free(stAttrBlock->stSentence);
+   releaseConnectionPool(stAttrBlock->stPool);
+
+   initializeAttrBlock(stAttrBlock);
+}
+
+
+// ********************************************************************
+// attrName
+// ********************************************************************
+// RETURN THE ID OF AN ATTRIBUTE NAME OR -1 IF NO SENTENCE HAS IT.
+//
+// szName is the bare attribute name, "address" and not "=address=".
+// The id is valid for every AttrBlock read from the same connection.
+// Safe while another thread reads a reply on that connection.
+
+int attrName(struct AttrBlock *stAttrBlock, char *szName) {
+   int iName;
+
+   if (stAttrBlock->stPool == NULL) return (-1);
+
+   lockConnectionPool(stAttrBlock->stPool);
+   iName = findStringInPool(stAttrBlock->stPool, szName, strlen(szName));
+   unlockConnectionPool(stAttrBlock->stPool);
+   return (iName);
+}
+
+
+// ********************************************************************
+// attrValue
+// ********************************************************************
+// RETURN THE VALUE OF AN ATTRIBUTE OF A SENTENCE OR NULL IF MISSING.
+//
+// iName comes from attrName.  The lookup is a scan of integer compares.
+// The value is valid until clearAttrBlock, also when it is pooled:
+// pooled strings never move, and other replies read on the same
+// connection (on any thread) only add to the pool.
+
+char *attrValue(struct AttrBlock *stAttrBlock, int iSentence, int iName) {
+   struct AttrSentence *stSentence;
+   char *szValue;
+   int i;
+
+   if ((iSentence < 0) || (iSentence >= stAttrBlock->iLength) || (iName < 0)) return (NULL);
+
+   stSentence = &stAttrBlock->stSentence[iSentence];
+   for (i = 0; i < stSentence->iLength; i++) {
+      if (stSentence->stAttr[i].iName != iName) continue;
+      if (stSentence->stAttr[i].iValue >= 0) return (stSentence->cValue + stSentence->stAttr[i].iValue);
+
+      lockConnectionPool(stAttrBlock->stPool);
+      szValue = poolString(stAttrBlock->stPool, -stSentence->stAttr[i].iValue - 1);
+      unlockConnectionPool(stAttrBlock->stPool);
+      return (szValue);
+   }
+   return (NULL);
+}
+
+
+// ********************************************************************
+// addAttrToScratch
+// ********************************************************************
+// ADD ONE ATTRIBUTE TO THE SENTENCE BEING READ.
+//
+// Takes the pool lock for the name and pooled value.
+
+static void addAttrToScratch(struct AttrScratch *stScratch, struct StringPool *stPool, char *szName, int iNameLen, char *szValue, char **szPooledNames) {
+   struct Attribute *stAttr;
+   int iValueLen;
+   int iNewSize;
+
+   if (stScratch->iLength == stScratch->iSize) {
+      iNewSize = stScratch->iSize ? stScratch->iSize * 2 : 32;
+      stScratch->stAttr = realloc(stScratch->stAttr, iNewSize * sizeof(struct Attribute));
+      debug_ram += (iNewSize - stScratch->iSize) * sizeof(struct Attribute);
+      stScratch->iSize = iNewSize;
+   }
+
+   stAttr = &stScratch->stAttr[stScratch->iLength++];
+   lockConnectionPool(stPool);
+   stAttr->iName = addStringToPool(stPool, szName, iNameLen);
+   if (isLowCardinalityName(poolString(stPool, stAttr->iName), szPooledNames)) {
+      stAttr->iValue = -addStringToPool(stPool, szValue, strlen(szValue)) - 1;
+      unlockConnectionPool(stPool);
+      return;
+   }
+   unlockConnectionPool(stPool);
+
+   iValueLen = strlen(szValue) + 1;
+   if (stScratch->iValueLen + iValueLen > stScratch->iValueSize) {
+      iNewSize = stScratch->iValueSize ? stScratch->iValueSize * 2 : 1024;
+      while (iNewSize < stScratch->iValueLen + iValueLen) iNewSize *= 2;
+      stScratch->cValue = realloc(stScratch->cValue, iNewSize);
+      debug_ram += (iNewSize - stScratch->iValueSize);
+      stScratch->iValueSize = iNewSize;
+   }
+   stAttr->iValue = stScratch->iValueLen;
+   memcpy(stScratch->cValue + stScratch->iValueLen, szValue, iValueLen);
+   stScratch->iValueLen += iValueLen;
+}
+
+
+// ********************************************************************
+// addScratchToAttrBlock
+// ********************************************************************
+// COPY THE SENTENCE READ INTO ONE ALLOCATION AND ADD IT TO THE BLOCK.
+
+static void addScratchToAttrBlock(struct AttrBlock *stAttrBlock, struct AttrScratch *stScratch, int iReturnValue) {
+   struct AttrSentence *stSentence;
+   int iAttrBytes = stScratch->iLength * sizeof(struct Attribute);
+   int iNewSize;
+
+   if (stAttrBlock->iLength == stAttrBlock->iSize) {
+      iNewSize = stAttrBlock->iSize ? stAttrBlock->iSize * 2 : 256;
+      stAttrBlock->stSentence = realloc(stAttrBlock->stSentence, iNewSize * sizeof(struct AttrSentence));
+      debug_ram += (iNewSize - stAttrBlock->iSize) * sizeof(struct AttrSentence);
+      stAttrBlock->iSize = iNewSize;
+   }
+
+   stSentence = &stAttrBlock->stSentence[stAttrBlock->iLength++];
+   stSentence->iLength = stScratch->iLength;
+   stSentence->iReturnValue = iReturnValue;
+   stSentence->iSize = iAttrBytes + stScratch->iValueLen;
+   stSentence->stAttr = malloc(stSentence->iSize ? stSentence->iSize : 1);
+   debug_ram += stSentence->iSize;
+   stSentence->cValue = (char *)stSentence->stAttr + iAttrBytes;
+   if (iAttrBytes) memcpy(stSentence->stAttr, stScratch->stAttr, iAttrBytes);
+   if (stScratch->iValueLen) memcpy(stSentence->cValue, stScratch->cValue, stScratch->iValueLen);
+
+   stScratch->iLength = 0;
+   stScratch->iValueLen = 0;
+}
+
+
+// ********************************************************************
+// readAttrBlock
+// ********************************************************************
+// READ A REPLY FROM THE SOCKET INTO AN ATTRBLOCK.
+//
+// Same termination rules as readBlock: keep reading sentences until
+// !done or !fatal.  Every sentence of the reply is kept, including
+// the final !done/!trap, with .tag and =message= as attributes and the
+// text of a !fatal under the name ATTR_MESSAGE.
+//
+// szPooledNames is a NULL terminated list of attributes whose values
+// are pooled too.  Pass NULL for the defaults (list, chain, ...).
+//
+// IMPORTANT:  Must free the AttrBlock with clearAttrBlock.
+
+void readAttrBlock(int fdSock, struct AttrBlock *stAttrBlock, char **szPooledNames) {
+   struct AttrScratch stScratch;
+   char *szWord = NULL;
+   int iSize = 0;
+   int iReturnValue;
+   char *szValue;
+
+   initializeAttrBlock(stAttrBlock);
+   stAttrBlock->stPool = connectionPool(fdSock);
+   memset(&stScratch, 0, sizeof(stScratch));
+
+   do {
+      iReturnValue = 0;
+
+      while (readWordBuffer(fdSock, &szWord, &iSize) > 0) {
+         if (szWord[0] == '!') {
+            if (strcmp(szWord, "!re") == 0) iReturnValue = DATA;
+            else if (strcmp(szWord, "!done") == 0) iReturnValue = DONE;
+            else if (strcmp(szWord, "!trap") == 0) iReturnValue = TRAP;
+            else if (strcmp(szWord, "!fatal") == 0) iReturnValue = FATAL;
+         } else if ((szWord[0] == '=') && ((szValue = strchr(szWord + 1, '=')) != NULL)) {
+            addAttrToScratch(&stScratch, stAttrBlock->stPool, szWord + 1, szValue - szWord - 1, szValue + 1, szPooledNames);
+         } else if ((szWord[0] == '.') && ((szValue = strchr(szWord, '=')) != NULL)) {
+            addAttrToScratch(&stScratch, stAttrBlock->stPool, szWord, szValue - szWord, szValue + 1, szPooledNames);
+         } else if (iReturnValue == FATAL) {
+            addAttrToScratch(&stScratch, stAttrBlock->stPool, ATTR_MESSAGE, strlen(ATTR_MESSAGE), szWord, szPooledNames);
+         }
+      }
+
+      if (iReturnValue) addScratchToAttrBlock(stAttrBlock, &stScratch, iReturnValue);
+   } while ((iReturnValue == DATA) || (iReturnValue == TRAP));
+
+   debug_ram -= iSize;
+   free(szWord);
+   debug_ram -= stScratch.iSize * sizeof(struct Attribute);
+   debug_ram -= stScratch.iValueSize;
+   free(stScratch.stAttr);
+   free(stScratch.cValue);
+}
+
+
+// ********************************************************************
+// printAttrBlock
+// ********************************************************************
+// PRINT AN ATTRBLOCK TO STDOUT.
+//
+// Same layout as printBlock: one line per sentence.  Holds the pool
+// lock while printing.
+
+void printAttrBlock(struct AttrBlock *stAttrBlock) {
+   struct AttrSentence *stSentence;
+   struct Attribute *stAttr;
+   char *szName;
+   int i, j;
+
+   if (stAttrBlock->stPool) lockConnectionPool(stAttrBlock->stPool);
+   for (i = 0; i < stAttrBlock->iLength; i++) {
+      stSentence = &stAttrBlock->stSentence[i];
+      if (stSentence->iReturnValue == DATA) printf("!re ");
+      else if (stSentence->iReturnValue == DONE) printf("!done ");
+      else if (stSentence->iReturnValue == TRAP) printf("!trap ");
+      else if (stSentence->iReturnValue == FATAL) printf("!fatal ");
+
+      for (j = 0; j < stSentence->iLength; j++) {
+         stAttr = &stSentence->stAttr[j];
+         szName = poolString(stAttrBlock->stPool, stAttr->iName);
+         printf(szName[0] == '.' ? "%s=" : "=%s=", szName);
+         if (stAttr->iValue < 0) printf("%s ", poolString(stAttrBlock->stPool, -stAttr->iValue - 1));
+         else printf("%s ", stSentence->cValue + stAttr->iValue);
+      }
+      printf("\n");
+   }
+   if (stAttrBlock->stPool) unlockConnectionPool(stAttrBlock->stPool);
+}
@@ -0,0 +1,62 @@
+//
+// Mikrotik API 2.0 // Attribute sentences.
+//
+
+#ifndef MK_ATTR
+#define MK_ATTR
+
+#include "api.h"
+#include "pool.h"
+
+#define ATTR_MESSAGE "message" // name given to the text of a !fatal
+
+// struct Attribute
+//
+// One =name=value word of a sentence.  iName is the id of the name in
+// the pool of the AttrBlock.  iValue is either the offset of the value
+// in the cValue buffer of the sentence (iValue >= 0) or, for pooled
+// low-cardinality values, -(id + 1) of the value in the pool.
+
+struct Attribute {
+        int iName;        // pool id of the attribute name
+        int iValue;       // offset into cValue or -(pool id + 1)
+};
+
+// struct AttrSentence
+//
+// The compact counterpart of a Sentence.  stAttr and cValue share one
+// allocation: the iLength Attribute entries come first and the packed
+// NULL terminated values follow them.  A sentence of twenty attributes
+// is one malloc instead of twenty-one.
+
+struct AttrSentence {
+        struct Attribute *stAttr; // attributes, followed by cValue
+        char *cValue;     // packed NULL terminated values
+        int iLength;      // number of attributes in stAttr
+        int iSize;        // bytes allocated for stAttr + cValue
+        int iReturnValue; // DONE, TRAP, FATAL or DATA
+};
+
+// struct AttrBlock
+//
+// An array of AttrSentences and the pool their ids refer to.  The pool
+// belongs to the connection (see connectionPool) so every reply read
+// from one router shares the same ids: look a name up once with
+// attrName and compare integers from then on.  The block keeps the
+// pool alive after apiDisconnect, until clearAttrBlock.
+
+struct AttrBlock {
+        struct AttrSentence *stSentence; // array of sentences
+        int iLength;      // number of sentences in stSentence
+        int iSize;        // number of sentences allocated
+        struct StringPool *stPool; // names and pooled values
+};
+
+void initializeAttrBlock(struct AttrBlock *stAttrBlock);
+void clearAttrBlock(struct AttrBlock *stAttrBlock);
+void printAttrBlock(struct AttrBlock *stAttrBlock);
+int attrName(struct AttrBlock *stAttrBlock, char *szName);
+char *attrValue(struct AttrBlock *stAttrBlock, int iSentence, int iName);
+void readAttrBlock(int fdSock, struct AttrBlock *stAttrBlock, char **szPooledNames);
+
+#endif // MK_ATTR
@@ -0,0 +1,366 @@
+//
+// Mikrotik API 2.0 // Bulk address-list load.
+//
+// Adding address-list entries one /add at a time costs one round trip
+// per entry.  Instead render the entries into a RouterOS script, upload
+// it through /file/add in BULK_CHUNK_SIZE pieces and run one /import.
+//
+// Every entry is wrapped in ":do { } on-error={ }" so one bad entry
+// doesn't abort the import.  A failed entry logs "mkbulk <pid> <index>"
+// which is read back from /log/print afterwards to build the per-entry
+// results.  NOTE: the router keeps only the last 1000 log lines by
+// default, so with more failures than that only the newest are listed;
+// iFailed is counted from what the log still holds.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "api.h"
+#include "bulk.h"
+
+
+// ********************************************************************
+// isReadOnlyWord
+// ********************************************************************
+// RETURN 1 FOR ATTRIBUTES THAT /print RETURNS BUT /add REJECTS.
+
+static int isReadOnlyWord(char *szWord) {
+   if (strncmp(szWord, "=.id=", 5) == 0) return (1);
+   if (strncmp(szWord, "=bytes=", 7) == 0) return (1);
+   if (strncmp(szWord, "=packets=", 9) == 0) return (1);
+   if (strncmp(szWord, "=invalid=", 9) == 0) return (1);
+   if (strncmp(szWord, "=dynamic=", 9) == 0) return (1);
+   if (strncmp(szWord, "=creation-time=", 15) == 0) return (1);
+   return (0);
+}
+
+
+// ********************************************************************
+// renderEntry
+// ********************************************************************
+// RENDER ONE ADDRESS-LIST SENTENCE AS A SCRIPT LINE.
+//
+// Writes at most iSize bytes to szLine and returns the line length,
+// or -1 if it doesn't fit.  Values are quoted and escaped so any
+// comment text survives the script parser.
+
+static int renderEntry(struct Sentence *stSentence, int iIndex, char *szLine, int iSize) {
+   char *ptr;
+   char *szEnd = szLine + iSize;
+   char *szOut = szLine;
+   int i;
+   int n;
+
+   n = snprintf(szOut, szEnd - szOut, ":do {/ip firewall address-list add");
+   if ((n < 0) || (n >= szEnd - szOut)) return (-1);
+   szOut += n;
+
+   for (i = 1; i < stSentence->iLength; i++) {
+      if ((stSentence->szWord[i][0] != '=') || isReadOnlyWord(stSentence->szWord[i])) continue;
+
+      if (szEnd - szOut < 2) return (-1);
+      *szOut++ = ' ';
+      for (ptr = stSentence->szWord[i] + 1; *ptr && (*ptr != '='); ptr++) { // name
+         if (szEnd - szOut < 2) return (-1);
+         *szOut++ = *ptr;
+      }
+      if (*ptr != '=') return (-1);
+      ptr++;
+
+      if (szEnd - szOut < 3) return (-1);
+      *szOut++ = '=';
+      *szOut++ = '"';
+      for (; *ptr; ptr++) { // value
+         if (szEnd - szOut < 5) return (-1);
+         if ((*ptr == '"') || (*ptr == '\\') || (*ptr == '$') || (*ptr == '?')) {
+            *szOut++ = '\\';
+            *szOut++ = *ptr;
+         } else if ((unsigned char)*ptr < 0x20) {
+            szOut += sprintf(szOut, "\\%02X", (unsigned char)*ptr);
+         } else {
+            *szOut++ = *ptr;
+         }
+      }
+      if (szEnd - szOut < 2) return (-1);
+      *szOut++ = '"';
+   }
+
+   n = snprintf(szOut, szEnd - szOut, "} on-error={:log error \"mkbulk %d %d\"}\n", (int)getpid(), iIndex);
+   if ((n < 0) || (n >= szEnd - szOut)) return (-1);
+   szOut += n;
+
+   return (szOut - szLine);
+}
+
+
+// ********************************************************************
+// setBulkMessage
+// ********************************************************************
+// REMEMBER THE FIRST =message= OF A FAILED REPLY.
+
+static void setBulkMessage(struct BulkResult *stResult, struct Block *stBlock) {
+   char *ptr;
+   int i, j;
+
+   if (stResult->szMessage) return;
+
+   for (i = 0; i < stBlock->iLength; i++) {
+      for (j = 0; j < stBlock->stSentence[i]->iLength; j++) {
+         ptr = stBlock->stSentence[i]->szWord[j];
+         if (strncmp(ptr, "=message=", 9) != 0) continue;
+         stResult->szMessage = malloc(strlen(ptr + 9) + 1);
+         debug_ram += (strlen(ptr + 9) + 1);
+         strcpy(stResult->szMessage, ptr + 9);
+         return;
+      }
+   }
+}
+
+
+// ********************************************************************
+// blockFailed
+// ********************************************************************
+// RETURN 1 IF A REPLY BLOCK CONTAINS A !trap OR !fatal.
+
+static int blockFailed(struct Block *stBlock) {
+   int i;
+
+   for (i = 0; i < stBlock->iLength; i++) {
+      if ((stBlock->stSentence[i]->iReturnValue == TRAP) || (stBlock->stSentence[i]->iReturnValue == FATAL)) return (1);
+   }
+   return (0);
+}
+
+
+// ********************************************************************
+// drainReplies
+// ********************************************************************
+// READ THE REPLIES TO iOutstanding PIPELINED COMMANDS.
+//
+// Returns 0 if any of them failed.
+
+static int drainReplies(int fdSock, int iOutstanding, struct BulkResult *stResult) {
+   struct Block stBlock;
+   int iOk = 1;
+
+   while (iOutstanding-- > 0) {
+      readBlock(fdSock, &stBlock);
+      if (blockFailed(&stBlock)) {
+         setBulkMessage(stResult, &stBlock);
+         iOk = 0;
+      }
+      clearBlock(&stBlock);
+   }
+   return (iOk);
+}
+
+
+// ********************************************************************
+// uploadFile
+// ********************************************************************
+// WRITE A /file/add FOR ONE SCRIPT FILE WITHOUT WAITING FOR THE REPLY.
+//
+// szContents must start with "=contents=" so it can be written as is.
+
+static void uploadFile(int fdSock, char *szName, char *szContents) {
+   char szWord[96];
+
+   snprintf(szWord, sizeof szWord, "=name=%s", szName);
+   writeWord(fdSock, "/file/add");
+   writeWord(fdSock, szWord);
+   writeWord(fdSock, szContents);
+   writeWord(fdSock, "");
+}
+
+
+// ********************************************************************
+// removeFiles
+// ********************************************************************
+// REMOVE THE UPLOADED SCRIPT FILES.  ERRORS ARE IGNORED.
+
+static void removeFiles(int fdSock, int iChunks) {
+   struct BulkResult stIgnore;
+   char szWord[96];
+   int i;
+   int iOutstanding = 0;
+
+   memset(&stIgnore, 0, sizeof stIgnore);
+
+   for (i = 0; i <= iChunks; i++) {
+      if (i < iChunks) snprintf(szWord, sizeof szWord, "=numbers=mkbulk%d-%d.rsc", (int)getpid(), i);
+      else snprintf(szWord, sizeof szWord, "=numbers=mkbulk%d.rsc", (int)getpid());
+      writeWord(fdSock, "/file/remove");
+      writeWord(fdSock, szWord);
+      writeWord(fdSock, "");
+      if (++iOutstanding == BULK_WINDOW) {
+         drainReplies(fdSock, iOutstanding, &stIgnore);
+         iOutstanding = 0;
+      }
+   }
+   drainReplies(fdSock, iOutstanding, &stIgnore);
+   clearBulkResult(&stIgnore);
+}
+
+
+// ********************************************************************
+// readImportErrors
+// ********************************************************************
+// MARK THE ENTRIES WHOSE on-error HANDLER LOGGED A FAILURE.
+
+static void readImportErrors(int fdSock, struct Block *stBlock, struct BulkResult *stResult) {
+   struct Block stLog;
+   char szPrefix[32];
+   char *ptr;
+   int iPrefixLen;
+   int iIndex;
+   int i;
+
+   iPrefixLen = snprintf(szPrefix, sizeof szPrefix, "mkbulk %d ", (int)getpid());
+
+   writeWord(fdSock, "/log/print");
+   writeWord(fdSock, "?topics=script,error");
+   writeWord(fdSock, "");
+   readBlock(fdSock, &stLog);
+
+   for (i = 0; i < stLog.iLength; i++) {
+      if ((ptr = findWord(stLog.stSentence[i], "=message=")) == NULL) continue;
+      if (strncmp(ptr + 9, szPrefix, iPrefixLen) != 0) continue;
+      iIndex = atoi(ptr + 9 + iPrefixLen);
+      if ((iIndex < 0) || (iIndex >= stBlock->iLength) || stResult->cFailed[iIndex]) continue;
+      stResult->cFailed[iIndex] = 1;
+      stResult->iFailed++;
+   }
+   clearBlock(&stLog);
+}
+
+
+// ********************************************************************
+// bulkLoadAddressList
+// ********************************************************************
+// LOAD A BLOCK OF ADDRESS-LIST ENTRIES WITH ONE /import.
+//
+// stBlock is typically the reply of /ip/firewall/address-list/print
+// from another router.  Every DATA sentence is loaded unless cSkip is
+// not NULL and cSkip[i] is set.  progress, if not NULL, is called as
+// entries are uploaded and once more after the import.
+//
+// The script is uploaded as files mkbulk<pid>-<n>.rsc plus a loader
+// mkbulk<pid>.rsc that imports them in order, so only one /import is
+// run over the API.  All files are removed afterwards.
+//
+// 1 is returned when the import ran; check stResult for the entries
+// that failed.  0 is returned when the upload or the import failed
+// as a whole; stResult->szMessage tells why.
+//
+// IMPORTANT:  Free stResult with clearBulkResult.
+
+int bulkLoadAddressList(int fdSock, struct Block *stBlock, char *cSkip, struct BulkResult *stResult, void (*progress)(int iDone, int iTotal)) {
+   struct Block stReply;
+   char *szChunk;       // "=contents=" followed by the script text
+   int iChunkLen;
+   int iChunks = 0;
+   int iOutstanding = 0;
+   int iTotal = 0;
+   int iLen;
+   int iOk = 1;
+   char szName[64];
+   char szWord[96];
+   int i;
+
+   memset(stResult, 0, sizeof(struct BulkResult));
+   stResult->cFailed = calloc(stBlock->iLength + 1, 1);
+   debug_ram += stBlock->iLength + 1;
+   stResult->iLength = stBlock->iLength;
+
+   for (i = 0; i < stBlock->iLength; i++) {
+      if ((stBlock->stSentence[i]->iReturnValue == DATA) && !(cSkip && cSkip[i])) iTotal++;
+   }
+
+   szChunk = malloc(BULK_CHUNK_SIZE + 11);
+   debug_ram += BULK_CHUNK_SIZE + 11;
+   strcpy(szChunk, "=contents=");
+   iChunkLen = 10;
+
+   for (i = 0; i <= stBlock->iLength; i++) {
+      iLen = 0;
+      if (i < stBlock->iLength) {
+         if ((stBlock->stSentence[i]->iReturnValue != DATA) || (cSkip && cSkip[i])) continue;
+         iLen = renderEntry(stBlock->stSentence[i], i, szChunk + iChunkLen, BULK_CHUNK_SIZE + 10 - iChunkLen);
+      }
+
+      if ((iLen < 0) || ((i == stBlock->iLength) && (iChunkLen > 10))) { // chunk full or last one
+         if (iChunkLen == 10) { // a single entry bigger than a chunk
+            stResult->cFailed[i] = 1;
+            stResult->iFailed++;
+            continue;
+         }
+         szChunk[iChunkLen] = 0;
+         snprintf(szName, sizeof szName, "mkbulk%d-%d.rsc", (int)getpid(), iChunks++);
+         uploadFile(fdSock, szName, szChunk);
+         iChunkLen = 10;
+         if (++iOutstanding == BULK_WINDOW) {
+            iOk &= drainReplies(fdSock, iOutstanding, stResult);
+            iOutstanding = 0;
+            if (progress) progress(stResult->iEntries, iTotal);
+         }
+         if (i < stBlock->iLength) i--; // render this entry again into the empty chunk.
+         continue;
+      }
+
+      iChunkLen += iLen;
+      if (i < stBlock->iLength) stResult->iEntries++;
+   }
+   iOk &= drainReplies(fdSock, iOutstanding, stResult);
+
+   if (iOk && iChunks) { // loader imports the chunks in order.
+      snprintf(szChunk, BULK_CHUNK_SIZE + 11, "=contents=:for i from=0 to=%d do={/import file-name=(\"mkbulk%d-\" . $i . \".rsc\")}\n", iChunks - 1, (int)getpid());
+      snprintf(szName, sizeof szName, "mkbulk%d.rsc", (int)getpid());
+      uploadFile(fdSock, szName, szChunk);
+      iOk &= drainReplies(fdSock, 1, stResult);
+   }
+
+   debug_ram -= BULK_CHUNK_SIZE + 11;
+   free(szChunk);
+
+   if (iOk && iChunks) {
+      snprintf(szWord, sizeof szWord, "=file-name=%s", szName);
+      writeWord(fdSock, "/import");
+      writeWord(fdSock, szWord);
+      writeWord(fdSock, "");
+      readBlock(fdSock, &stReply);
+      if (blockFailed(&stReply)) {
+         setBulkMessage(stResult, &stReply);
+         iOk = 0;
+      }
+      clearBlock(&stReply);
+      if (iOk) readImportErrors(fdSock, stBlock, stResult);
+   }
+
+   stResult->iReturnValue = iOk ? DONE : TRAP;
+   if (progress) progress(stResult->iEntries, iTotal);
+
+   if (iChunks) removeFiles(fdSock, iChunks);
+
+   return (iOk);
+}
+
+
+// ********************************************************************
+// clearBulkResult
+// ********************************************************************
+// FREE THE MEMORY HELD BY A BULKRESULT.
+
+void clearBulkResult(struct BulkResult *stResult) {
+   if (stResult->cFailed) {
+      debug_ram -= stResult->iLength + 1;
+      free(stResult->cFailed);
+   }
+   if (stResult->szMessage) {
+      debug_ram -= (strlen(stResult->szMessage) + 1);
+      free(stResult->szMessage);
+   }
+   memset(stResult, 0, sizeof(struct BulkResult));
+}
@@ -0,0 +1,33 @@
+//
+// Mikrotik API 2.0 // Bulk address-list load.
+//
+
+#ifndef MK_BULK
+#define MK_BULK
+
+#include "api.h"
+
+#define BULK_CHUNK_SIZE 4000 // max bytes per uploaded script file (v6 /file contents limit is 4095)
+#define BULK_WINDOW 32       // file uploads written before reading their replies
+
+// struct BulkResult
+//
+// Filled in by bulkLoadAddressList.  cFailed has one flag per sentence
+// of the Block that was loaded, so cFailed[i] tells whether the entry
+// in stSentence[i] was rejected by the router.  iReturnValue is the
+// result of the /import itself (DONE or TRAP) and szMessage its
+// =message= when it failed as a whole.
+
+struct BulkResult {
+        int iEntries;      // number of entries sent to the router
+        int iFailed;       // number of entries the router rejected
+        char *cFailed;     // one flag per sentence of the loaded Block
+        int iLength;       // number of flags in cFailed
+        int iReturnValue;  // DONE or TRAP from /import
+        char *szMessage;   // =message= of a failed upload or /import
+};
+
+int bulkLoadAddressList(int fdSock, struct Block *stBlock, char *cSkip, struct BulkResult *stResult, void (*progress)(int iDone, int iTotal));
+void clearBulkResult(struct BulkResult *stResult);
+
+#endif // MK_BULK
@@ -9,6 +9,16 @@
 //  /ip/firewall/address-list
 //
 //  It then disconnects and connects to the specified TARGET router.
+//  (The three tables download at once over one connection, each with
+//  its own tag, while three TARGET connections log in and read the
+//  TARGET tables.  Then each table is cloned on its own connection and
+//  thread, so the mangle and address-lists load while the filter rules
+//  do.  The phases wait for each other where the order below matters:
+//  nothing is removed before the DROP, REJECT and TARPIT rules are
+//  disabled, and those are not enabled before the mangle rules and
+//  address-lists are loaded.  The step numbers of the output follow
+//  the order below.)
+//
 //  Disables all firewall filter DROP, REJECT and TARPIT rules before
 //  proceeding to erase all firewall filter rules that do not have a
 //  comment beginning with an '@'.  By disabling all the DROP, REJECT
@@ -30,6 +40,40 @@
 //  begins with an '@' will be ignored.  Once this is complete, go back
 //  and turn on any "previously disabled" filter rules.
 //
+//  With -b the address-lists are not added one at a time.  Instead they
+//  are rendered into a script, uploaded in chunks and loaded with a
+//  single /import.  Use this for large block lists.
+//
+//  Address-list entries that are just an address on a list (no comment,
+//  no timeout, enabled) are loaded into an address trie first: duplicates
+//  and prefixes inside bigger ones are dropped, adjacent prefixes are
+//  merged, and whatever the TARGET's '@' entries already cover is left
+//  out.  Only the remaining prefixes are sent.  With -b nothing is
+//  merged (the import takes the MASTER's rows), the rest still applies.
+//
+//  If the TARGET already has exactly the MASTER's filter rules, only in
+//  another order, nothing is removed or added: the fewest move commands
+//  that restore the MASTER order are sent instead, after step 5 has
+//  disabled the DROP, REJECT and TARPIT rules, and step 12 enables them
+//  again.
+//
+//  Before each table is touched, its fingerprint on the TARGET router is
+//  compared with the MASTER's.  A table that already matches is left
+//  alone.  Matching filter rules still have their DROP, REJECT and
+//  TARPIT rules disabled while another table is reloaded, since they
+//  may refer to it; step 12 puts back the state they had.  The
+//  fingerprints are appended to szFingerprintFile, one line
+//  per router and table, so drift across many routers can be checked
+//  by comparing those lines instead of the rules.  Loading the
+//  address-lists merges and dedupes them, so the TARGET never ends up
+//  with the MASTER's exact rows; its fingerprint after the load is
+//  recorded too, and on the next run a TARGET that still has it
+//  matches as long as the MASTER did not change.
+//
+//  Built with -DAPI_TRACE, every connect, login, command and reply is
+//  timed and written to szTraceFile in the Chrome trace format when the
+//  program ends.  Open it in chrome://tracing or ui.perfetto.dev.
+//
 //  Lastly erase all firewall tracking connections.  Should someone try
 //  to sneak through the firewall while it was disabled and establish
 //  a connection, we want to make sure they get processed by the new
@@ -43,392 +87,993 @@ char *szIPaddr1  = "0.0.0.0";
 char *szPort     = "8728";
 char *szUsername = "admin";
 char *szPassword = "password";
+char *szFingerprintFile = "mkclone.fp"; // table fingerprints are appended here.
+char *szTraceFile = "mkclone.trace.json"; // spans when built with -DAPI_TRACE.
 
 // don't touch below here.
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "../api.h"
+#include "../bulk.h"
+#include "../fingerprint.h"
+#include "../prepared.h"
+#include "../reorder.h"
+#include "../shared.h"
+#include "../trace.h"
+#include "../trie.h"
 
 // ********************************************************************
+// markCommentRows
 // ********************************************************************
+// FLAG THE SENTENCES WITH A COMMENT BEGINNING WITH AN '@'.
+//
+// IMPORTANT: free the returned array when finished with it.
+
+char *markCommentRows(struct Block *stBlock) {
+   char *cSkip;
+   char *ptr;
+   int i;
+
+   cSkip = calloc(stBlock->iLength + 1, 1);
+   for (i = 0; i < stBlock->iLength; i++) {
+      if (((ptr=findWord(stBlock->stSentence[i],"=comment=")) != 0) && (*(ptr+9) == '@')) cSkip[i] = 1;
+   }
+   return (cSkip);
+}
+
+
 // ********************************************************************
+// markUnplainRows
 // ********************************************************************
+// FLAG THE ADDRESS-LIST ENTRIES THAT ARE NOT JUST AN ADDRESS ON A LIST.
+//
+// A plain entry is enabled, has no timeout and an address the trie can
+// take.  With iKept it must also have a comment beginning with an '@'
+// (the TARGET entries step 10 leaves alone), otherwise no comment at
+// all.  The flags are the cSkip of trieAddBlock.
+//
+// IMPORTANT: free the returned array when finished with it.
 
-
-int main(int argc, char *argv[]) {
-   int fdSock;
-   int iPort;
-   int iLoginResult;
-   char cWordInput[256]; // limit user word input to 256 chars
-   int i,j,k; // temporary loop and flag variables.
+char *markUnplainRows(struct Block *stBlock, int iKept) {
+   struct Sentence *stSentence;
+   unsigned char cKey[TRIE_KEY_SIZE];
+   char *cSkip;
    char *ptr;
-   struct Sentence stSentence;
-   struct Block stBlockFILTER; // MASTER router FILTER rules.
-   struct Block stBlockMANGLE; // MASTER router MANGLE rules.
-   struct Block stBlockADDRESS; // MASTER router ADDRESS lists.
-   struct Block stBlockTMP;
-   struct Block stBlockRESULT; // TARGET router command response.
+   int iFamily;
+   int iLength;
+   int i;
+
+   cSkip = calloc(stBlock->iLength + 1, 1);
+   for (i = 0; i < stBlock->iLength; i++) {
+      stSentence = stBlock->stSentence[i];
+      cSkip[i] = 1;
+      if (stSentence->iReturnValue != DATA) continue;
+
+      ptr = findWord(stSentence, "=comment=");
+      if (iKept ? ((ptr == 0) || (*(ptr+9) != '@')) : (ptr != 0)) continue;
+      if (((ptr = findWord(stSentence, "=timeout=")) != 0) && *(ptr+9)) continue;
+      if (findWord(stSentence, "=disabled=true")) continue;
+      if (((ptr = findWord(stSentence, "=address=")) == 0) || !trieParseAddress(ptr+9, &iFamily, cKey, &iLength)) continue;
+      cSkip[i] = 0;
+   }
+   return (cSkip);
+}
 
 
-// 0. Check command line arguments.
+// ********************************************************************
+// tableFingerprint
+// ********************************************************************
+// FINGERPRINT A TABLE, LEAVING OUT THE ROWS COMMENTED WITH AN '@'.
 
-   apiInitialize();
+unsigned long long tableFingerprint(struct Block *stBlock) {
+   unsigned long long lFingerprint;
+   char *cSkip;
 
-   stSentence.iLength=0;
-   stSentence.iReturnValue = 0;
+   cSkip = markCommentRows(stBlock);
+   lFingerprint = fingerprintBlock(stBlock, cSkip);
+   free(cSkip);
+   return (lFingerprint);
+}
 
-   if (argc!=2) {
-      fprintf(stderr,"USAGE: %s ip_address\n",argv[0]);
-      exit(1);
-   }
 
+// ********************************************************************
+// saveFingerprint
+// ********************************************************************
+// APPEND "router table fingerprint status" TO szFingerprintFile.
+//
+// status is "master", "match" (TARGET already matched, nothing done),
+// "cloned" (TARGET was loaded; the MASTER fingerprint is recorded) or
+// "loaded" (the TARGET's own fingerprint right after that load).
 
-// 1. Use apiConnect to connect to the MASTER router and login.
+void saveFingerprint(char *szRouter, char *szTable, unsigned long long lFingerprint, char *szStatus) {
+   FILE *fp;
 
-   printf("( 1/14): Connect to MASTER router: %s\n",szIPaddr1);
+   if ((fp = fopen(szFingerprintFile, "a")) == NULL) return;
+   fprintf(fp, "%s %s %016llx %s\n", szRouter, szTable, lFingerprint, szStatus);
+   fclose(fp);
+}
 
-   iPort = atoi(szPort);
-   fdSock = apiConnect(szIPaddr1, iPort);
-   if (!(iLoginResult = login(fdSock, szUsername, szPassword))) {
-       apiDisconnect(fdSock);
-       printf("Invalid username or password.\n");
-       exit(1);
+
+// ********************************************************************
+// replyFailed
+// ********************************************************************
+// RETURN 1 IF A REPLY HAS A !trap OR DOESN'T END WITH !done.
+
+int replyFailed(struct Block *stBlock) {
+   int i;
+
+   if ((stBlock->iLength == 0) || (stBlock->stSentence[stBlock->iLength - 1]->iReturnValue != DONE)) return (1);
+   for (i = 0; i < stBlock->iLength; i++) {
+      if (stBlock->stSentence[i]->iReturnValue == TRAP) return (1);
    }
+   return (0);
+}
 
 
-// 2. Read in all firewall settings from the MASTER router.
+// ********************************************************************
+// loadedFingerprint
+// ********************************************************************
+// RETURN THE FINGERPRINT THE TARGET TABLE HAD AFTER ITS LAST LOAD.
+//
+// Reads szFingerprintFile.  Only a load of the MASTER table with the
+// fingerprint lMaster counts: 0 is returned if the last "cloned" or
+// "match" line of the router and table has another MASTER fingerprint,
+// or if that load wasn't recorded as complete.
+
+unsigned long long loadedFingerprint(char *szRouter, char *szTable, unsigned long long lMaster) {
+   FILE *fp;
+   char szLine[256];
+   char szLineRouter[128];
+   char szLineTable[32];
+   char szStatus[16];
+   unsigned long long lFingerprint;
+   unsigned long long lCloned = 0; // MASTER fingerprint of the last load
+   unsigned long long lLoaded = 0; // TARGET fingerprint after it
+
+   if ((fp = fopen(szFingerprintFile, "r")) == NULL) return (0);
+   while (fgets(szLine, sizeof(szLine), fp) != NULL) {
+      if (sscanf(szLine, "%127s %31s %llx %15s", szLineRouter, szLineTable, &lFingerprint, szStatus) != 4) continue;
+      if ((strcmp(szLineRouter, szRouter) != 0) || (strcmp(szLineTable, szTable) != 0)) continue;
+
+      if (strcmp(szStatus, "cloned") == 0) { // a new load, its "loaded" line follows
+         lCloned = lFingerprint;
+         lLoaded = 0;
+      } else if (strcmp(szStatus, "match") == 0) { // unchanged, unless the MASTER was another one
+         if (lFingerprint != lCloned) lLoaded = 0;
+         lCloned = lFingerprint;
+      } else if (strcmp(szStatus, "loaded") == 0) {
+         lLoaded = lFingerprint;
+      }
+   }
+   fclose(fp);
 
-   printf("( 2/14): Download firewall configuration.\n");
+   return ((lCloned == lMaster) ? lLoaded : 0);
+}
 
-   writeWord(fdSock,"/ip/firewall/filter/print"); // load all FILTER rules.
-   writeWord(fdSock,"");
-   readBlock(fdSock,&stBlockFILTER);
 
-   writeWord(fdSock,"/ip/firewall/mangle/print"); // load all MANGLE rules.
-   writeWord(fdSock,"");
-   readBlock(fdSock,&stBlockMANGLE);
+// ********************************************************************
+// printProgress
+// ********************************************************************
+// PRINT PERCENT DONE.  Used as the bulk load progress callback.
 
-   writeWord(fdSock,"/ip/firewall/address-list/print"); // load all ADDRESS-LIST's.
-   writeWord(fdSock,"");
-   readBlock(fdSock,&stBlockADDRESS);
+void printProgress(int iDone, int iTotal) {
+   printf("%%%3.0f\r",100*(float)iDone/(float)(iTotal ? iTotal : 1)); fflush(stdout);
+}
 
 
-// 3. We have everything we need from the master router; time to disconnect.
- 
-   printf("( 3/14): Disconnect from MASTER router: %s\n",szIPaddr1);
-   apiDisconnect(fdSock); 
+// ********************************************************************
+// struct CloneState
+// ********************************************************************
+//
+// What main and the three TARGET phases share.  The flags only go up;
+// cloneSet raises one and cloneWait waits for one.  They make the
+// phases keep the order that matters for a live firewall: no table is
+// emptied before the DROP, REJECT and TARPIT filters are disabled, and
+// those are not enabled again before the mangle rules (which may set
+// the marks the filters match) and the address-lists are loaded.
+
+struct CloneState {
+        char *szTarget;            // TARGET router.
+        int iBulk;                 // load address-lists with one /import (-b).
+        struct Block stBlockFILTER;  // MASTER router FILTER rules.
+        struct Block stBlockMANGLE;  // MASTER router MANGLE rules.
+        struct Block stBlockADDRESS; // MASTER router ADDRESS lists.
+        unsigned long long lFpFILTER;  // MASTER table fingerprints.
+        unsigned long long lFpMANGLE;
+        unsigned long long lFpADDRESS;
+        unsigned long long lLastADDRESS; // TARGET address-lists after the last load of this MASTER, 0 if none.
+        unsigned long long lLoadedADDRESS; // TARGET address-lists after step 11, 0 if not loaded or it failed.
+        int iLoggedIn;             // phases done connecting to the TARGET.
+        int iFailed;               // a phase could not log in.
+        int iAbort;                // give up: the phases leave the TARGET alone.
+        int iMasterReady;          // the MASTER tables are downloaded.
+        int iFilterDisabled;       // step 5 is done (or skipped).
+        int iDecided;              // mangle and address phases that know if they reload.
+        int iReloading;            // ... and how many of those empty their table.
+        int iMangleDone;           // step 9 is done (or skipped).
+        int iAddressDone;          // step 11 is done (or skipped).
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+};
+
+// struct ClonePhase
+//
+// One TARGET table.  Each phase runs on its own thread over its own
+// TARGET connection, so the mangle and address-lists load while the
+// filter rules do.
 
+struct ClonePhase {
+        pthread_t thread;
+        int fdSock;                // TARGET connection.
+        char *szPrint;             // print command of the table.
+        struct Block stBlockTARGET; // the table, read right after login.
+        int iSkip;                 // TARGET table already matches the MASTER.
+        int iMoved;                // ... after moving some of its rules.
+        int iDisable;              // filter: DROP, REJECT and TARPIT rules are disabled.
+};
 
-// 4. Connect to the target router.
+struct CloneState stClone;
 
-   printf("( 4/14): Connect to TARGET router: %s\n",argv[1]);
 
-   iPort = atoi(szPort);
-   fdSock = apiConnect(argv[1], iPort);
-   if (!(iLoginResult = login(fdSock, szUsername, szPassword))) {
-      apiDisconnect(fdSock);
-      clearBlock(&stBlockADDRESS);
-      clearBlock(&stBlockMANGLE);
-      clearBlock(&stBlockFILTER);
-      printf("Invalid username or password.\n");
-      exit(1);
+// ********************************************************************
+// cloneSet
+// ********************************************************************
+// SET A FLAG OF stClone AND WAKE WHOEVER WAITS FOR IT.
+
+void cloneSet(int *piFlag, int iValue) {
+   pthread_mutex_lock(&stClone.mutex);
+   *piFlag = iValue;
+   pthread_cond_broadcast(&stClone.cond);
+   pthread_mutex_unlock(&stClone.mutex);
+}
+
+
+// ********************************************************************
+// cloneWait
+// ********************************************************************
+// WAIT UNTIL A FLAG OF stClone REACHES iValue.  0 IF THE CLONE ABORTED.
+
+int cloneWait(int *piFlag, int iValue) {
+   int iGo;
+
+   pthread_mutex_lock(&stClone.mutex);
+   while ((*piFlag < iValue) && !stClone.iAbort) pthread_cond_wait(&stClone.cond, &stClone.mutex);
+   iGo = !stClone.iAbort;
+   pthread_mutex_unlock(&stClone.mutex);
+   return (iGo);
+}
+
+
+// ********************************************************************
+// cloneDecided
+// ********************************************************************
+// THE MANGLE OR ADDRESS PHASE KNOWS WHETHER IT RELOADS ITS TABLE.
+//
+// The filter phase waits for both: even when the filter rules match,
+// the drops must be disabled while a table they refer to is reloaded.
+
+void cloneDecided(int iReload) {
+   pthread_mutex_lock(&stClone.mutex);
+   stClone.iDecided++;
+   stClone.iReloading += iReload;
+   pthread_cond_broadcast(&stClone.cond);
+   pthread_mutex_unlock(&stClone.mutex);
+}
+
+
+// ********************************************************************
+// connectPhase
+// ********************************************************************
+// CONNECT A PHASE TO THE TARGET, READ ITS TABLE AND WAIT FOR THE MASTER.
+//
+// Returns 1 once the MASTER tables are in, 0 if the phase must stop
+// (its connection is closed then).
+
+int connectPhase(struct ClonePhase *stPhase) {
+   int iLoggedIn = 0;
+
+   if ((stPhase->fdSock = apiConnect(stClone.szTarget, atoi(szPort))) != 0) {
+      iLoggedIn = login(stPhase->fdSock, szUsername, szPassword);
+   }
+   if (iLoggedIn) {
+      writeWord(stPhase->fdSock, stPhase->szPrint);
+      writeWord(stPhase->fdSock, "");
+      readBlock(stPhase->fdSock, &stPhase->stBlockTARGET);
    }
 
+   pthread_mutex_lock(&stClone.mutex);
+   stClone.iLoggedIn++;
+   if (!iLoggedIn) stClone.iFailed = 1;
+   pthread_cond_broadcast(&stClone.cond);
+   pthread_mutex_unlock(&stClone.mutex);
+
+   if (iLoggedIn && cloneWait(&stClone.iMasterReady, 1)) return (1);
+   if (stPhase->fdSock) apiDisconnect(stPhase->fdSock);
+   clearBlock(&stPhase->stBlockTARGET);
+   return (0);
+}
+
+
+// ********************************************************************
+// filterPhase
+// ********************************************************************
+// STEPS 5, 6, 7, 12 AND 13: THE FILTER RULES.
+
+void *filterPhase(void *pArg) {
+   struct ClonePhase *stPhase = pArg;
+   struct Block *stBlockFILTER = &stClone.stBlockFILTER;
+   int fdSock;
+   int i,j,k;
+   char *ptr;
+   char *cSkip;       // MASTER rows with a comment beginning with '@'.
+   char *cTargetSkip; // TARGET rows with a comment beginning with '@'.
+   struct ReorderPlan stPlan;
+   int iReorder;      // rules to move in step 5.
+   struct Sentence stSentence;
+   struct Block stBlockTMP;
+   struct Block stBlockDISABLED; // rules step 5 disabled, if the rules stay.
+   struct Block stBlockRESULT; // TARGET router command response.
+   char *szFilterDisable[] = { "/ip/firewall/filter/set", "=.id=%s", "=disabled=yes", NULL };
+   char *szFilterEnable[] = { "/ip/firewall/filter/set", "=.id=%s", "=disabled=no", NULL };
+   char *szFilterRemove[] = { "/ip/firewall/filter/remove", "=.id=%s", NULL };
+   char *szConnectionRemove[] = { "/ip/firewall/connection/remove", "=.id=%s", NULL };
+   struct PreparedCommand stFilterDisable; // per row commands, encoded once.
+   struct PreparedCommand stFilterEnable;
+   struct PreparedCommand stFilterRemove;
+   struct PreparedCommand stConnectionRemove;
+
+   if (!connectPhase(stPhase)) {
+      cloneSet(&stClone.iFilterDisabled, 1);
+      return (NULL);
+   }
+   fdSock = stPhase->fdSock;
+   stSentence.iLength = 0;
+   stSentence.iReturnValue = 0;
+
 
 // 5. Disable any DROP, REJECT or TARPIT rules in firewall. Does not
-//    matter if it has a comment beginning with '@'.
-
-   printf("( 5/14): Disable TARGET firewall DROP, REJECT and TARPIT filters.\n");
-
-   writeWord(fdSock,"/ip/firewall/filter/print");
-   writeWord(fdSock,"?=action=drop");
-   writeWord(fdSock,"?=action=reject");
-   writeWord(fdSock,"?#|");
-   writeWord(fdSock,"?=action=tarpit");
-   writeWord(fdSock,"?#|");
-   writeWord(fdSock,"");
-   readBlock(fdSock,&stBlockTMP);
-   if (stBlockTMP.iLength > 1) { // If two or more results.  Remember one is the !done.
-      for (i = 0; i < stBlockTMP.iLength - 1; i++) { // ignore !done at end of block.
-         printf("%%%3.0f\r",100*(float)i/(float)stBlockTMP.iLength); fflush(stdout);
-         addWordToSentence(&stSentence,"/ip/firewall/filter/set");
-         ptr=findWord(stBlockTMP.stSentence[i],"=.id=");
-         sprintf(cWordInput,"=.id=*%s",ptr+6);
-         addWordToSentence(&stSentence, cWordInput);
-         addWordToSentence(&stSentence,"=disabled=yes"); // disable drop rules.
-         writeSentence(fdSock, &stSentence);
-         clearSentence(&stSentence);
-         readBlock(fdSock,&stBlockRESULT);
-         clearBlock(&stBlockRESULT);
+//    matter if it has a comment beginning with '@'.  Skip steps 6 and 7
+//    if the TARGET filter rules already match the MASTER or only need
+//    moving, and steps 5, 12 and 13 too if no rule moves and no other
+//    table is reloaded either.
+
+   stPhase->iSkip = (tableFingerprint(&stPhase->stBlockTARGET) == stClone.lFpFILTER);
+
+   iReorder = 0;
+   memset(&stPlan, 0, sizeof(stPlan));
+   if (!stPhase->iSkip) { // same rules in another order: plan the moves.
+      cSkip = markCommentRows(stBlockFILTER);
+      cTargetSkip = markCommentRows(&stPhase->stBlockTARGET);
+      reorderPlan(stBlockFILTER, cSkip, &stPhase->stBlockTARGET, cTargetSkip, &stPlan);
+      if (!stPlan.iMissing && !stPlan.iExtra) {
+         printf("( 5/14): TARGET has the MASTER filter rules in another order, %d to move.\n", stPlan.iMoves);
+         if (stPlan.iMoves == 0) stPhase->iSkip = stPhase->iMoved = 1;
+         else iReorder = 1;
       }
+      free(cTargetSkip);
+      free(cSkip);
    }
-   clearBlock(&stBlockTMP); // clear either the filter list or the response block.
 
+   // the rules may stay, but not enabled while they are moved or while
+   // the tables they refer to are emptied.
+   stPhase->iDisable = !stPhase->iSkip || (cloneWait(&stClone.iDecided, 2) && stClone.iReloading);
+
+   if (stPhase->iMoved) printf("         TARGET filter rules match MASTER, skip steps 6 and 7.\n");
+   else if (stPhase->iSkip) printf("( 5/14): TARGET filter rules match MASTER, skip steps 6 and 7.\n");
+   if (stPhase->iDisable) printf("( 5/14): Disable TARGET firewall DROP, REJECT and TARPIT filters.\n");
+   else printf("         No table is reloaded, skip steps 5, 12 and 13.\n");
+
+   prepareCommand(&stFilterDisable, szFilterDisable);
+   prepareCommand(&stFilterEnable, szFilterEnable);
+   prepareCommand(&stFilterRemove, szFilterRemove);
+   prepareCommand(&stConnectionRemove, szConnectionRemove);
+
+   initializeBlock(&stBlockDISABLED);
+   if (stPhase->iDisable) {
+      writeWord(fdSock,"/ip/firewall/filter/print");
+      writeWord(fdSock,"?=action=drop");
+      writeWord(fdSock,"?=action=reject");
+      writeWord(fdSock,"?#|");
+      writeWord(fdSock,"?=action=tarpit");
+      writeWord(fdSock,"?#|");
+      writeWord(fdSock,"");
+      readBlock(fdSock,&stBlockTMP);
+      if (stBlockTMP.iLength > 1) { // If two or more results.  Remember one is the !done.
+         for (i = 0; i < stBlockTMP.iLength - 1; i++) { // ignore !done at end of block.
+            printf("%%%3.0f\r",100*(float)i/(float)stBlockTMP.iLength); fflush(stdout);
+            if (findWord(stBlockTMP.stSentence[i],"=disabled=true") != 0) continue; // off already.
+            ptr=findWord(stBlockTMP.stSentence[i],"=.id=");
+            preparedWrite(fdSock, &stFilterDisable, ptr+5);
+            readBlock(fdSock,&stBlockRESULT);
+            clearBlock(&stBlockRESULT);
+         }
+      }
+      if (stPhase->iSkip || iReorder) stBlockDISABLED = stBlockTMP; // step 12 enables just these again.
+      else clearBlock(&stBlockTMP); // clear either the filter list or the response block.
+   }
+   cloneSet(&stClone.iFilterDisabled, 1); // the other tables may be emptied now.
 
-// 6. next we need to erase all firewall rules that don't have a comment beginning with '@'.
+   if (iReorder) { // the drops are off: no rule can block while they move.
+      stPhase->iSkip = stPhase->iMoved = (reorderApply(fdSock, "/ip/firewall/filter/move", &stPhase->stBlockTARGET, &stPlan) == stPlan.iMoves);
+      if (stPhase->iMoved) {
+         printf("         TARGET filter rules match MASTER, skip steps 6 and 7.\n");
+      } else {
+         printf("         Move failed, load all filter rules.\n");
+         clearBlock(&stBlockDISABLED); // removed in step 6; step 12 enables what step 7 loads.
+      }
+   }
+   clearReorderPlan(&stPlan);
+   clearBlock(&stPhase->stBlockTARGET);
 
-   printf("( 6/14): Remove TARGET firewall filter rules.\n");
 
-   addWordToSentence(&stSentence,"/ip/firewall/filter/print");
-   writeSentence(fdSock, &stSentence);
-   clearSentence(&stSentence);
-   readBlock(fdSock,&stBlockTMP);
+// 6. next we need to erase all firewall rules that don't have a comment beginning with '@'.
 
-   if (stBlockTMP.iLength > 2) { // If two or more results.  Remember one is the !done
-      for (i = 0; i < stBlockTMP.iLength - 1; i++) { // ignore !done at end of block.
-         printf("%%%3.0f\r",100*(float)i/(float)stBlockTMP.iLength); fflush(stdout);
-         if (((ptr=findWord(stBlockTMP.stSentence[i],"=comment=")) == 0) || (*(ptr+9) != '@')) {
-            addWordToSentence(&stSentence,"/ip/firewall/filter/remove");
-            ptr=findWord(stBlockTMP.stSentence[i],"=.id=");
-            sprintf(cWordInput,"=.id=*%s",ptr+6);
-            addWordToSentence(&stSentence, cWordInput);
-            writeSentence(fdSock, &stSentence);
-            clearSentence(&stSentence);
-            readBlock(fdSock,&stBlockRESULT); // read response to our command.
-            clearBlock(&stBlockRESULT);
+   if (!stPhase->iSkip) {
+      printf("( 6/14): Remove TARGET firewall filter rules.\n");
+
+      addWordToSentence(&stSentence,"/ip/firewall/filter/print");
+      writeSentence(fdSock, &stSentence);
+      clearSentence(&stSentence);
+      readBlock(fdSock,&stBlockTMP);
+
+      if (stBlockTMP.iLength > 2) { // If two or more results.  Remember one is the !done
+         for (i = 0; i < stBlockTMP.iLength - 1; i++) { // ignore !done at end of block.
+            printf("%%%3.0f\r",100*(float)i/(float)stBlockTMP.iLength); fflush(stdout);
+            if (((ptr=findWord(stBlockTMP.stSentence[i],"=comment=")) == 0) || (*(ptr+9) != '@')) {
+               ptr=findWord(stBlockTMP.stSentence[i],"=.id=");
+               preparedWrite(fdSock, &stFilterRemove, ptr+5);
+               readBlock(fdSock,&stBlockRESULT); // read response to our command.
+               clearBlock(&stBlockRESULT);
+            }
          }
       }
+      clearBlock(&stBlockTMP); // don't need list of entries to disable anymore.
    }
-   clearBlock(&stBlockTMP); // don't need list of entries to disable anymore.
 
 
 // 7. Add the list of firewall filter rules from the master router.  Make sure
 // you load drops disabled. Skip entries with a comment beginning with '@'.
 
-   printf("( 7/14): Load new filter rules with DROP, REJECT and TARPIT disabled.\n");
+   if (!stPhase->iSkip) {
+      printf("( 7/14): Load new filter rules with DROP, REJECT and TARPIT disabled.\n");
+
+      for (i = 0; i < stBlockFILTER->iLength - 1; i++) { // ignore !done at end of block.
+         printf("%%%3.0f\r",100*(float)i/(float)stBlockFILTER->iLength); fflush(stdout);
+         if (((ptr=findWord(stBlockFILTER->stSentence[i],"=comment=")) == 0) || (*(ptr+9) != '@')) {
+            k=0;
+            addWordToSentence(&stSentence,"/ip/firewall/filter/add");
 
-   for (i = 0; i < stBlockFILTER.iLength - 1; i++) { // ignore !done at end of block.
-      printf("%%%3.0f\r",100*(float)i/(float)stBlockFILTER.iLength); fflush(stdout);
-      if (((ptr=findWord(stBlockFILTER.stSentence[i],"=comment=")) == 0) || (*(ptr+9) != '@')) {
-         k=0;
-         addWordToSentence(&stSentence,"/ip/firewall/filter/add");
+            if (findWord(stBlockFILTER->stSentence[i],"=action=drop") != 0) k=1; // flag drop
+            if (findWord(stBlockFILTER->stSentence[i],"=action=reject") != 0) k=1; // flag reject
+            if (findWord(stBlockFILTER->stSentence[i],"=action=tarpit") != 0) k=1; // flag tarpit
 
-         if (findWord(stBlockFILTER.stSentence[i],"=action=drop") != 0) k=1; // flag drop
-         if (findWord(stBlockFILTER.stSentence[i],"=action=reject") != 0) k=1; // flag reject
-         if (findWord(stBlockFILTER.stSentence[i],"=action=tarpit") != 0) k=1; // flag tarpit
+            for (j=1; j<stBlockFILTER->stSentence[i]->iLength; j++) {
+               // if this is a drop, reject or tarpit entry, strip off the disabled option and re-add later.
+               if (k && (strncmp(stBlockFILTER->stSentence[i]->szWord[j],"=disabled=",10) == 0)) continue;
 
-         for (j=1; j<stBlockFILTER.stSentence[i]->iLength; j++) {
-            // if this is a drop, reject or tarpit entry, strip off the disabled option and re-add later.
-            if (k && (strncmp(stBlockFILTER.stSentence[i]->szWord[j],"=disabled=",10) == 0)) continue;
+               if (strncmp(stBlockFILTER->stSentence[i]->szWord[j],"=.id=",5) == 0) continue;
+               if (strncmp(stBlockFILTER->stSentence[i]->szWord[j],"=bytes=",7) == 0) continue;
+               if (strncmp(stBlockFILTER->stSentence[i]->szWord[j],"=packets=",9) == 0) continue;
+               if (strncmp(stBlockFILTER->stSentence[i]->szWord[j],"=invalid=",9) == 0) continue;
+               if (strncmp(stBlockFILTER->stSentence[i]->szWord[j],"=dynamic=",9) == 0) continue;
+               if (strncmp(stBlockFILTER->stSentence[i]->szWord[j],"=creation-time=",15) == 0) continue;
+               if (strncmp(stBlockFILTER->stSentence[i]->szWord[j],".tag=",5) == 0) continue;
 
-            if (strncmp(stBlockFILTER.stSentence[i]->szWord[j],"=.id=",5) == 0) continue;
-            if (strncmp(stBlockFILTER.stSentence[i]->szWord[j],"=bytes=",7) == 0) continue;
-            if (strncmp(stBlockFILTER.stSentence[i]->szWord[j],"=packets=",9) == 0) continue;
-            if (strncmp(stBlockFILTER.stSentence[i]->szWord[j],"=invalid=",9) == 0) continue;
-            if (strncmp(stBlockFILTER.stSentence[i]->szWord[j],"=dynamic=",9) == 0) continue;
-            if (strncmp(stBlockFILTER.stSentence[i]->szWord[j],"=creation-time=",15) == 0) continue;
+               addWordToSentence(&stSentence,stBlockFILTER->stSentence[i]->szWord[j]);
+            }
+            if (k) { // if this was a drop then add disabled back in.
+               addWordToSentence(&stSentence,"=disabled=yes");
+            }
 
-            addWordToSentence(&stSentence,stBlockFILTER.stSentence[i]->szWord[j]);
+            writeSentence(fdSock,&stSentence);
+            clearSentence(&stSentence);
+
+            readBlock(fdSock,&stBlockTMP); // read response to our command.
+            clearBlock(&stBlockTMP);
          }
-         if (k) { // if this was a drop then add disabled back in.
-            addWordToSentence(&stSentence,"=disabled=yes");
+      }
+   }
+
+   clearBlock(stBlockFILTER);
+
+
+// 12. Re-enable any disabled firewall rules.  Does not matter if they have
+//     a comment beginning with an '@'.  Not before the mangle rules and
+//     address-lists the rules may refer to are loaded.  Rules that were
+//     kept get back the state they had before step 5.
+
+   if (stPhase->iDisable && cloneWait(&stClone.iMangleDone, 1) && cloneWait(&stClone.iAddressDone, 1)) {
+      printf("(12/14): Enable TARGET firewall DROP, REJECT and TARPIT filters.\n");
+
+      for (i = 0; i < stBlockDISABLED.iLength - 1; i++) { // ignore !done at end of block.
+         if (findWord(stBlockDISABLED.stSentence[i],"=disabled=true") != 0) continue; // was off before.
+         ptr=findWord(stBlockDISABLED.stSentence[i],"=.id=");
+         preparedWrite(fdSock, &stFilterEnable, ptr+5);
+         readBlock(fdSock,&stBlockRESULT);
+         clearBlock(&stBlockRESULT);
+      }
+
+      if (!stPhase->iSkip) { // the rules loaded in step 7.
+         writeWord(fdSock,"/ip/firewall/filter/print");
+         writeWord(fdSock,"?=action=drop");
+         writeWord(fdSock,"?=action=reject");
+         writeWord(fdSock,"?#|");
+         writeWord(fdSock,"?=action=tarpit");
+         writeWord(fdSock,"?#|");
+         writeWord(fdSock,"");
+         readBlock(fdSock,&stBlockTMP);
+         if (stBlockTMP.iLength > 1) { // If two or more results.  Remember one is the !done
+            for (i = 0; i < stBlockTMP.iLength - 1; i++) { // ignore !done at end of block.
+               printf("%%%3.0f\r",100*(float)i/(float)stBlockTMP.iLength); fflush(stdout);
+               ptr=findWord(stBlockTMP.stSentence[i],"=.id=");
+               preparedWrite(fdSock, &stFilterEnable, ptr+5);
+               readBlock(fdSock,&stBlockRESULT);
+               clearBlock(&stBlockRESULT);
+            }
          }
+         clearBlock(&stBlockTMP); // clear the filter list.
+      }
 
-         writeSentence(fdSock,&stSentence);
-         clearSentence(&stSentence);
 
-         readBlock(fdSock,&stBlockTMP); // read response to our command.
-         clearBlock(&stBlockTMP);
+// 13. clear old firewall connections
+
+      printf("(13/14): Reset TARGET firewall connection tracking.\n");
+
+      addWordToSentence(&stSentence,"/ip/firewall/connection/print");
+      writeSentence(fdSock, &stSentence);
+      clearSentence(&stSentence);
+      readBlock(fdSock,&stBlockTMP);
+
+      if (stBlockTMP.iLength > 1) { // If two or more results.  Remember one is the !done
+         for (i = 0; i < stBlockTMP.iLength - 1; i++) { // ignore !done at end of block.
+            printf("%%%3.0f\r",100*(float)i/(float)stBlockTMP.iLength); fflush(stdout);
+            ptr=findWord(stBlockTMP.stSentence[i],"=.id=");
+            preparedWrite(fdSock, &stConnectionRemove, ptr+5);
+            readBlock(fdSock,&stBlockRESULT);
+            if (stBlockRESULT.iLength >1) {
+               if  (strcmp(stBlockRESULT.stSentence[stBlockRESULT.iLength-2]->szWord[0], "!trap") == 0) {
+                  printSentence(stBlockRESULT.stSentence[stBlockRESULT.iLength-2]);
+               }
+            }
+            clearBlock(&stBlockRESULT);
+         }
       }
+      clearBlock(&stBlockTMP); // clear the connection list.
    }
+   clearBlock(&stBlockDISABLED);
+
+   clearPreparedCommand(&stFilterDisable);
+   clearPreparedCommand(&stFilterEnable);
+   clearPreparedCommand(&stFilterRemove);
+   clearPreparedCommand(&stConnectionRemove);
+   apiDisconnect(fdSock);
+   return (NULL);
+}
 
-   clearBlock(&stBlockFILTER);
 
+// ********************************************************************
+// manglePhase
+// ********************************************************************
+// STEPS 8 AND 9: THE MANGLE RULES.
 
-// 8. Erase all mangle rules that don't have a comment beginning with '@'.
+void *manglePhase(void *pArg) {
+   struct ClonePhase *stPhase = pArg;
+   struct Block *stBlockMANGLE = &stClone.stBlockMANGLE;
+   int fdSock;
+   int i,j;
+   char *ptr;
+   char cWordInput[256]; // limit user word input to 256 chars
+   struct Sentence stSentence;
+   struct Block stBlockTMP;
+   struct Block stBlockRESULT; // TARGET router command response.
+   char *szMangleRemove[] = { "/ip/firewall/mangle/remove", "=.id=%s", NULL };
+   struct PreparedCommand stMangleRemove;
 
-   printf("( 8/14): Remove TARGET firewall mangle rules.\n");
+   if (!connectPhase(stPhase)) {
+      cloneSet(&stClone.iMangleDone, 1);
+      return (NULL);
+   }
+   fdSock = stPhase->fdSock;
+   stSentence.iLength = 0;
+   stSentence.iReturnValue = 0;
+   prepareCommand(&stMangleRemove, szMangleRemove);
 
-   addWordToSentence(&stSentence,"/ip/firewall/mangle/print");
-   writeSentence(fdSock, &stSentence);
-   clearSentence(&stSentence);
-   readBlock(fdSock,&stBlockTMP);
 
-   if (stBlockTMP.iLength > 2) { // If two or more results.  Remember one is the !done
-      for (i = 0; i < stBlockTMP.iLength - 1; i++) { // ignore !done at end of block.
-         printf("%%%3.0f\r",100*(float)i/(float)stBlockTMP.iLength); fflush(stdout);
-         if (((ptr=findWord(stBlockTMP.stSentence[i],"=comment=")) == 0) || (*(ptr+9) != '@')) {
-            addWordToSentence(&stSentence,"/ip/firewall/mangle/remove");
-            ptr=findWord(stBlockTMP.stSentence[i],"=.id=");
-            sprintf(cWordInput,"=.id=*%s",ptr+6);
-            addWordToSentence(&stSentence, cWordInput);
-            writeSentence(fdSock, &stSentence);
-            clearSentence(&stSentence);
+// 8. Erase all mangle rules that don't have a comment beginning with '@'.
+
+   stPhase->iSkip = (tableFingerprint(&stPhase->stBlockTARGET) == stClone.lFpMANGLE);
+   cloneDecided(!stPhase->iSkip);
+   if (stPhase->iSkip) {
+      printf("( 8/14): TARGET mangle rules match MASTER, skip steps 8 and 9.\n");
+   } else if (cloneWait(&stClone.iFilterDisabled, 1)) {
+      printf("( 8/14): Remove TARGET firewall mangle rules.\n");
+   } else {
+      stPhase->iSkip = 1; // aborted.
+   }
+
+   if (!stPhase->iSkip && (stPhase->stBlockTARGET.iLength > 2)) { // If two or more results.  Remember one is the !done
+      for (i = 0; i < stPhase->stBlockTARGET.iLength - 1; i++) { // ignore !done at end of block.
+         printf("%%%3.0f\r",100*(float)i/(float)stPhase->stBlockTARGET.iLength); fflush(stdout);
+         if (((ptr=findWord(stPhase->stBlockTARGET.stSentence[i],"=comment=")) == 0) || (*(ptr+9) != '@')) {
+            ptr=findWord(stPhase->stBlockTARGET.stSentence[i],"=.id=");
+            preparedWrite(fdSock, &stMangleRemove, ptr+5);
             readBlock(fdSock,&stBlockRESULT); // read response to our command.
             clearBlock(&stBlockRESULT);
          }
       }
    }
-   clearBlock(&stBlockTMP); // don't need list of entries to disable anymore.
+   clearBlock(&stPhase->stBlockTARGET); // don't need list of entries to disable anymore.
 
 
 // 9. add the list of firewall mangle rules from the master router.
 
-   printf("( 9/14): Load new mangle rules.\n");
-
-   for (i = 0; i < stBlockMANGLE.iLength; i++) { // ignore !done at end of block.
-      printf("%%%3.0f\r",100*(float)i/(float)stBlockMANGLE.iLength); fflush(stdout);
+   if (!stPhase->iSkip) {
+      printf("( 9/14): Load new mangle rules.\n");
 
-      if (stBlockMANGLE.stSentence[i]->iReturnValue != DATA) {
-         continue; // skip response sentences.
-      }
+      for (i = 0; i < stBlockMANGLE->iLength; i++) { // ignore !done at end of block.
+         printf("%%%3.0f\r",100*(float)i/(float)stBlockMANGLE->iLength); fflush(stdout);
 
-      addWordToSentence(&stSentence,"/ip/firewall/mangle/add");
+         if (stBlockMANGLE->stSentence[i]->iReturnValue != DATA) {
+            continue; // skip response sentences.
+         }
 
-      for (j=1; j<stBlockMANGLE.stSentence[i]->iLength; j++) {
-         if (strncmp(stBlockMANGLE.stSentence[i]->szWord[j],"=.id=",5) == 0) continue;
-         if (strncmp(stBlockMANGLE.stSentence[i]->szWord[j],"=bytes=",7) == 0) continue;
-         if (strncmp(stBlockMANGLE.stSentence[i]->szWord[j],"=packets=",9) == 0) continue;
-         if (strncmp(stBlockMANGLE.stSentence[i]->szWord[j],"=invalid=",9) == 0) continue;
-         if (strncmp(stBlockMANGLE.stSentence[i]->szWord[j],"=dynamic=",9) == 0) continue;
-         if (strncmp(stBlockMANGLE.stSentence[i]->szWord[j],"=creation-time=",15) == 0) continue;
-         addWordToSentence(&stSentence,stBlockMANGLE.stSentence[i]->szWord[j]);
-      }
+         addWordToSentence(&stSentence,"/ip/firewall/mangle/add");
+
+         for (j=1; j<stBlockMANGLE->stSentence[i]->iLength; j++) {
+            if (strncmp(stBlockMANGLE->stSentence[i]->szWord[j],"=.id=",5) == 0) continue;
+            if (strncmp(stBlockMANGLE->stSentence[i]->szWord[j],"=bytes=",7) == 0) continue;
+            if (strncmp(stBlockMANGLE->stSentence[i]->szWord[j],"=packets=",9) == 0) continue;
+            if (strncmp(stBlockMANGLE->stSentence[i]->szWord[j],"=invalid=",9) == 0) continue;
+            if (strncmp(stBlockMANGLE->stSentence[i]->szWord[j],"=dynamic=",9) == 0) continue;
+            if (strncmp(stBlockMANGLE->stSentence[i]->szWord[j],"=creation-time=",15) == 0) continue;
+            if (strncmp(stBlockMANGLE->stSentence[i]->szWord[j],".tag=",5) == 0) continue;
+            addWordToSentence(&stSentence,stBlockMANGLE->stSentence[i]->szWord[j]);
+         }
 
-      if ((ptr = findWord(stBlockMANGLE.stSentence[i],"=comment=")) != 0) {
-         parse(ptr,cWordInput,cWordInput);
-         if (cWordInput[0] != '@') {
+         if ((ptr = findWord(stBlockMANGLE->stSentence[i],"=comment=")) != 0) {
+            parse(ptr,cWordInput,cWordInput);
+            if (cWordInput[0] != '@') {
+               writeSentence(fdSock,&stSentence);
+               clearSentence(&stSentence);
+               readBlock(fdSock,&stBlockTMP); // read response to our command.
+               clearBlock(&stBlockTMP);
+            } else {
+               clearSentence(&stSentence);
+            }
+         } else {
             writeSentence(fdSock,&stSentence);
             clearSentence(&stSentence);
             readBlock(fdSock,&stBlockTMP); // read response to our command.
             clearBlock(&stBlockTMP);
-         } else {
-            clearSentence(&stSentence);
          }
-      } else {
-         writeSentence(fdSock,&stSentence);
-         clearSentence(&stSentence);
-         readBlock(fdSock,&stBlockTMP); // read response to our command.
-         clearBlock(&stBlockTMP);
       }
    }
+   cloneSet(&stClone.iMangleDone, 1); // the filters may block again.
 
-   clearBlock(&stBlockMANGLE);
+   clearBlock(stBlockMANGLE);
+   clearPreparedCommand(&stMangleRemove);
+   apiDisconnect(fdSock);
+   return (NULL);
+}
 
 
-// 10. next we need to erase all address-list entries that don't have a comment beginning with '@'.
+// ********************************************************************
+// addressPhase
+// ********************************************************************
+// STEPS 10 AND 11: THE ADDRESS-LISTS.
 
-   printf("(10/14): Remove TARGET firewall address-lists.\n");
+void *addressPhase(void *pArg) {
+   struct ClonePhase *stPhase = pArg;
+   struct Block *stBlockADDRESS = &stClone.stBlockADDRESS;
+   int fdSock;
+   int i,j,k;
+   char *ptr;
+   char *cSkip;     // address-list entries not to load.
+   char *cUnplain;  // address-list entries not in stMaster.
+   struct AddressTrie stMaster; // plain MASTER address-list entries.
+   struct AddressTrie stTarget; // TARGET address-list entries step 10 keeps.
+   struct TrieSet stSet;        // what to send of stMaster.
+   char szPrefix[TRIE_STRING_SIZE];
+   struct BulkResult stBulkResult;
+   struct Sentence stSentence;
+   struct Block stBlockTMP;
+   struct Block stBlockRESULT; // TARGET router command response.
+   unsigned long long lFingerprint;
+   int iLoadFailed = 0; // an entry of step 11 was refused.
+   char *szAddressRemove[] = { "/ip/firewall/address-list/remove", "=.id=%s", NULL };
+   char *szAddressAdd[] = { "/ip/firewall/address-list/add", "=list=%s", "=address=%s", NULL };
+   struct PreparedCommand stAddressRemove;
+   struct PreparedCommand stAddressAdd;
+
+   if (!connectPhase(stPhase)) {
+      cloneSet(&stClone.iAddressDone, 1);
+      return (NULL);
+   }
+   fdSock = stPhase->fdSock;
+   stSentence.iLength = 0;
+   stSentence.iReturnValue = 0;
+   prepareCommand(&stAddressRemove, szAddressRemove);
+   prepareCommand(&stAddressAdd, szAddressAdd);
 
-   writeWord(fdSock,"/ip/firewall/address-list/print");
-   writeWord(fdSock,"");
-   readBlock(fdSock,&stBlockTMP);
 
-   if (stBlockTMP.iLength > 2) { // If two or more results.  Remember one is the !done
-      for (i = 0; i < stBlockTMP.iLength - 1; i++) { // ignore !done at end of block.
-         printf("%%%3.0f\r",100*(float)i/(float)stBlockTMP.iLength); fflush(stdout);
-         if (((ptr=findWord(stBlockTMP.stSentence[i],"=comment=")) == 0) || (*(ptr+9) != '@')) {
-            addWordToSentence(&stSentence,"/ip/firewall/address-list/remove");
-            ptr=findWord(stBlockTMP.stSentence[i],"=.id=");
-            sprintf(cWordInput,"=.id=*%s",ptr+6);
-            addWordToSentence(&stSentence, cWordInput);
-            writeSentence(fdSock, &stSentence);
-            clearSentence(&stSentence);
+// 10. next we need to erase all address-list entries that don't have a comment beginning with '@'.
+
+   lFingerprint = tableFingerprint(&stPhase->stBlockTARGET);
+   stPhase->iSkip = (lFingerprint == stClone.lFpADDRESS) || (lFingerprint && (lFingerprint == stClone.lLastADDRESS));
+   cloneDecided(!stPhase->iSkip);
+   if (stPhase->iSkip) {
+      printf("(10/14): TARGET address-lists match MASTER, skip steps 10 and 11.\n");
+   } else if (cloneWait(&stClone.iFilterDisabled, 1)) {
+      printf("(10/14): Remove TARGET firewall address-lists.\n");
+   } else {
+      stPhase->iSkip = 1; // aborted.
+   }
+
+   if (!stPhase->iSkip && (stPhase->stBlockTARGET.iLength > 2)) { // If two or more results.  Remember one is the !done
+      for (i = 0; i < stPhase->stBlockTARGET.iLength - 1; i++) { // ignore !done at end of block.
+         printf("%%%3.0f\r",100*(float)i/(float)stPhase->stBlockTARGET.iLength); fflush(stdout);
+         if (((ptr=findWord(stPhase->stBlockTARGET.stSentence[i],"=comment=")) == 0) || (*(ptr+9) != '@')) {
+            ptr=findWord(stPhase->stBlockTARGET.stSentence[i],"=.id=");
+            preparedWrite(fdSock, &stAddressRemove, ptr+5);
             readBlock(fdSock,&stBlockRESULT); // read response to our command.
             clearBlock(&stBlockRESULT);
          }
       }
    }
-   clearBlock(&stBlockTMP); // don't need list of entries to disable anymore.
+
+   initializeAddressTrie(&stTarget); // what stays on the TARGET need not be sent.
+   if (!stPhase->iSkip) {
+      cUnplain = markUnplainRows(&stPhase->stBlockTARGET, 1);
+      trieAddBlock(&stTarget, &stPhase->stBlockTARGET, cUnplain);
+      trieBuildIndex(&stTarget);
+      free(cUnplain);
+   }
+   clearBlock(&stPhase->stBlockTARGET); // don't need list of entries to disable anymore.
 
 
 // 11. add the list of firewall address-list entries from the master router.
 
-   printf("(11/14): Load new address-lists.\n");
-
-   for (i = 0; i < stBlockADDRESS.iLength - 1; i++) { // ignore !done at end of block.
-      printf("%%%3.0f\r",100*(float)i/(float)stBlockADDRESS.iLength); fflush(stdout);
-      if (((ptr=findWord(stBlockADDRESS.stSentence[i],"=comment=")) == 0) || (*(ptr+9) != '@')) {
-         addWordToSentence(&stSentence,"/ip/firewall/address-list/add");
-
-         for (j = 0; j < stBlockADDRESS.stSentence[i]->iLength; j++) {
-            if (strncmp(stBlockADDRESS.stSentence[i]->szWord[j],"=.id=",5) == 0) continue;
-            if (strncmp(stBlockADDRESS.stSentence[i]->szWord[j],"=bytes=",7) == 0) continue;
-            if (strncmp(stBlockADDRESS.stSentence[i]->szWord[j],"=packets=",9) == 0) continue;
-            if (strncmp(stBlockADDRESS.stSentence[i]->szWord[j],"=invalid=",9) == 0) continue;
-            if (strncmp(stBlockADDRESS.stSentence[i]->szWord[j],"=dynamic=",9) == 0) continue;
-            if (strncmp(stBlockADDRESS.stSentence[i]->szWord[j],"=creation-time=",15) == 0) continue;
-            addWordToSentence(&stSentence,stBlockADDRESS.stSentence[i]->szWord[j]);
+   if (stPhase->iSkip) {
+      // TARGET already matches.
+   } else if (stClone.iBulk) { // one /import for the whole list.
+      printf("(11/14): Load new address-lists with one /import.\n");
+      cSkip = markCommentRows(stBlockADDRESS);
+      cUnplain = markUnplainRows(stBlockADDRESS, 0);
+      initializeAddressTrie(&stMaster);
+      trieAddBlock(&stMaster, stBlockADDRESS, cUnplain);
+      triePrefixes(&stMaster, 0, &stSet); // no merging: only the MASTER rows can be imported.
+      trieSubtract(&stMaster, &stSet, &stTarget);
+      for (i = k = 0; i < stBlockADDRESS->iLength; i++) { // plain entries go by stSet.
+         if (cUnplain[i]) continue;
+         cSkip[i] = 1;
+         k++;
+      }
+      for (i = 0; i < stSet.iLength; i++) cSkip[stSet.stPrefix[i].iValue] = 0;
+      printf("         %d plain entries, %d left to load.\n", k, stSet.iLength);
+      clearTrieSet(&stSet);
+      clearAddressTrie(&stMaster);
+      free(cUnplain);
+      if (!bulkLoadAddressList(fdSock, stBlockADDRESS, cSkip, &stBulkResult, printProgress)) {
+         printf("Bulk load failed: %s\n", stBulkResult.szMessage ? stBulkResult.szMessage : "unknown error");
+         iLoadFailed = 1;
+      } else if (stBulkResult.iFailed) {
+         iLoadFailed = 1;
+         printf("%d of %d address-list entries failed:\n", stBulkResult.iFailed, stBulkResult.iEntries);
+         for (i = 0; i < stBlockADDRESS->iLength; i++) {
+            if (stBulkResult.cFailed[i]) printSentence(stBlockADDRESS->stSentence[i]);
          }
-
-         writeSentence(fdSock,&stSentence);
-         clearSentence(&stSentence);
-
+      }
+      clearBulkResult(&stBulkResult);
+      free(cSkip);
+   } else { // one /add per entry.
+      printf("(11/14): Load new address-lists.\n");
+      cUnplain = markUnplainRows(stBlockADDRESS, 0);
+      initializeAddressTrie(&stMaster);
+      trieAddBlock(&stMaster, stBlockADDRESS, cUnplain);
+      triePrefixes(&stMaster, 1, &stSet);
+      trieSubtract(&stMaster, &stSet, &stTarget);
+      for (i = k = 0; i < stBlockADDRESS->iLength; i++) k += !cUnplain[i];
+      printf("         %d plain entries, sent as %d prefixes.\n", k, stSet.iLength);
+
+      for (i = 0; i < stSet.iLength; i++) { // the plain entries, merged.
+         printf("%%%3.0f\r",100*(float)i/(float)(stSet.iLength + stBlockADDRESS->iLength)); fflush(stdout);
+         triePrefixString(&stSet.stPrefix[i], szPrefix);
+         preparedWrite(fdSock, &stAddressAdd, poolString(&stMaster.stLists, stSet.stPrefix[i].iList), szPrefix);
          readBlock(fdSock,&stBlockTMP); // read response to our command.
+         iLoadFailed |= replyFailed(&stBlockTMP);
          clearBlock(&stBlockTMP);
       }
-   }
 
-   clearBlock(&stBlockADDRESS);
+      for (i = 0; i < stBlockADDRESS->iLength - 1; i++) { // ignore !done at end of block.
+         printf("%%%3.0f\r",100*(float)(stSet.iLength + i)/(float)(stSet.iLength + stBlockADDRESS->iLength)); fflush(stdout);
+         if (!cUnplain[i]) continue; // sent above.
+         if (((ptr=findWord(stBlockADDRESS->stSentence[i],"=comment=")) == 0) || (*(ptr+9) != '@')) {
+            addWordToSentence(&stSentence,"/ip/firewall/address-list/add");
+
+            for (j = 0; j < stBlockADDRESS->stSentence[i]->iLength; j++) {
+               if (strncmp(stBlockADDRESS->stSentence[i]->szWord[j],"=.id=",5) == 0) continue;
+               if (strncmp(stBlockADDRESS->stSentence[i]->szWord[j],"=bytes=",7) == 0) continue;
+               if (strncmp(stBlockADDRESS->stSentence[i]->szWord[j],"=packets=",9) == 0) continue;
+               if (strncmp(stBlockADDRESS->stSentence[i]->szWord[j],"=invalid=",9) == 0) continue;
+               if (strncmp(stBlockADDRESS->stSentence[i]->szWord[j],"=dynamic=",9) == 0) continue;
+               if (strncmp(stBlockADDRESS->stSentence[i]->szWord[j],"=creation-time=",15) == 0) continue;
+               if (strncmp(stBlockADDRESS->stSentence[i]->szWord[j],".tag=",5) == 0) continue;
+               addWordToSentence(&stSentence,stBlockADDRESS->stSentence[i]->szWord[j]);
+            }
 
+            writeSentence(fdSock,&stSentence);
+            clearSentence(&stSentence);
 
-// 12. Re-enable any disabled firewall rules.  Does not matter if they have
-//     a comment beginning with an '@'.
-
-   printf("(12/14): Enable TARGET firewall DROP, REJECT and TARPIT filters.\n");
-
-   writeWord(fdSock,"/ip/firewall/filter/print");
-   writeWord(fdSock,"?=action=drop");
-   writeWord(fdSock,"?=action=reject");
-   writeWord(fdSock,"?#|");
-   writeWord(fdSock,"?=action=tarpit");
-   writeWord(fdSock,"?#|");
-   writeWord(fdSock,"");
-   readBlock(fdSock,&stBlockTMP);
-   if (stBlockTMP.iLength > 1) { // If two or more results.  Remember one is the !done
-      for (i = 0; i < stBlockTMP.iLength - 1; i++) { // ignore !done at end of block.
-         printf("%%%3.0f\r",100*(float)i/(float)stBlockTMP.iLength); fflush(stdout);
-         addWordToSentence(&stSentence,"/ip/firewall/filter/set");
-         ptr=findWord(stBlockTMP.stSentence[i],"=.id=");
-         sprintf(cWordInput,"=.id=*%s",ptr+6);
-         addWordToSentence(&stSentence, cWordInput);
-         addWordToSentence(&stSentence,"=disabled=no"); // enable drop rules.
-         writeSentence(fdSock, &stSentence);
-         clearSentence(&stSentence);
-         readBlock(fdSock,&stBlockRESULT);
-         clearBlock(&stBlockRESULT);
+            readBlock(fdSock,&stBlockTMP); // read response to our command.
+            iLoadFailed |= replyFailed(&stBlockTMP);
+            clearBlock(&stBlockTMP);
+         }
       }
+      clearTrieSet(&stSet);
+      clearAddressTrie(&stMaster);
+      free(cUnplain);
+   }
+   cloneSet(&stClone.iAddressDone, 1); // the filters may block again.
+
+   // the load merged and deduped the rows, so the TARGET won't match the
+   // MASTER's fingerprint next time.  Record what it looks like now.
+   if (!stPhase->iSkip && !iLoadFailed) {
+      writeWord(fdSock, stPhase->szPrint);
+      writeWord(fdSock, "");
+      readBlock(fdSock, &stBlockTMP);
+      if (!replyFailed(&stBlockTMP)) stClone.lLoadedADDRESS = tableFingerprint(&stBlockTMP);
+      clearBlock(&stBlockTMP);
    }
-   clearBlock(&stBlockTMP); // clear the filter list.
 
+   clearAddressTrie(&stTarget);
+   clearBlock(stBlockADDRESS);
+   clearPreparedCommand(&stAddressRemove);
+   clearPreparedCommand(&stAddressAdd);
+   apiDisconnect(fdSock);
+   return (NULL);
+}
 
-// 13. clear old firewall connections
 
-   printf("(13/14): Reset TARGET firewall connection tracking.\n");
-
-   addWordToSentence(&stSentence,"/ip/firewall/connection/print");
-   writeSentence(fdSock, &stSentence);
-   clearSentence(&stSentence);
-   readBlock(fdSock,&stBlockTMP);
-
-   if (stBlockTMP.iLength > 1) { // If two or more results.  Remember one is the !done
-      for (i = 0; i < stBlockTMP.iLength - 1; i++) { // ignore !done at end of block.
-         printf("%%%3.0f\r",100*(float)i/(float)stBlockTMP.iLength); fflush(stdout);
-         addWordToSentence(&stSentence,"/ip/firewall/connection/remove");
-         ptr=findWord(stBlockTMP.stSentence[i],"=.id=");
-         sprintf(cWordInput,"=.id=*%s",ptr+6);
-         addWordToSentence(&stSentence, cWordInput);
-         writeSentence(fdSock, &stSentence);
-         clearSentence(&stSentence);
-         readBlock(fdSock,&stBlockRESULT);
-         if (stBlockRESULT.iLength >1) {
-            if  (strcmp(stBlockRESULT.stSentence[stBlockRESULT.iLength-2]->szWord[0], "!trap") == 0) {
-               printSentence(stBlockRESULT.stSentence[stBlockRESULT.iLength-2]);
-            }
-         }
-         clearBlock(&stBlockRESULT);
+// ********************************************************************
+// ********************************************************************
+// ********************************************************************
+// ********************************************************************
+
+
+int main(int argc, char *argv[]) {
+   int fdSock;
+   int iPort;
+   int iLoginResult;
+   int iResult;
+   int i;
+   char *szPrint[3][2] = { { "/ip/firewall/filter/print", NULL },
+                           { "/ip/firewall/mangle/print", NULL },
+                           { "/ip/firewall/address-list/print", NULL } };
+   struct Block *stMasterTable[3] = { &stClone.stBlockFILTER, &stClone.stBlockMANGLE, &stClone.stBlockADDRESS };
+   struct SharedConnection stShared;  // the MASTER downloads, one tag each.
+   struct SharedRequest *stRequest[3];
+   struct ClonePhase stPhase[3];      // filter, mangle, address-list.
+   void *(*runPhase[3])(void *) = { filterPhase, manglePhase, addressPhase };
+
+
+// 0. Check command line arguments.
+
+   apiInitialize();
+#ifdef API_TRACE
+   traceStart(0);
+#endif
+
+   memset(&stClone, 0, sizeof(stClone));
+   pthread_mutex_init(&stClone.mutex, NULL);
+   pthread_cond_init(&stClone.cond, NULL);
+
+   if ((argc == 3) && (strcmp(argv[1],"-b") == 0)) stClone.iBulk = 1;
+   else if (argc!=2) {
+      fprintf(stderr,"USAGE: %s [-b] ip_address\n",argv[0]);
+      exit(1);
+   }
+   stClone.szTarget = argv[argc-1];
+
+
+// 4. Connect to the target router, once per table, while the MASTER
+//    tables download.  Each phase then reads its TARGET table.
+
+   printf("( 4/14): Connect to TARGET router: %s\n",stClone.szTarget);
+
+   memset(stPhase, 0, sizeof(stPhase));
+   for (i = 0; i < 3; i++) {
+      stPhase[i].szPrint = szPrint[i][0];
+      pthread_create(&stPhase[i].thread, NULL, runPhase[i], &stPhase[i]);
+   }
+
+
+// 1. Use apiConnect to connect to the MASTER router and login.
+
+   printf("( 1/14): Connect to MASTER router: %s\n",szIPaddr1);
+
+   iPort = atoi(szPort);
+   fdSock = apiConnect(szIPaddr1, iPort);
+   if (!fdSock || !(iLoginResult = login(fdSock, szUsername, szPassword))) {
+      if (fdSock) apiDisconnect(fdSock);
+      printf("Invalid username or password.\n");
+      cloneSet(&stClone.iAbort, 1);
+      for (i = 0; i < 3; i++) pthread_join(stPhase[i].thread, NULL);
+      exit(1);
+   }
+
+
+// 2. Read in all firewall settings from the MASTER router, the three
+//    tables at once.
+
+   printf("( 2/14): Download firewall configuration.\n");
+
+   iResult = DONE;
+   if (initializeSharedConnection(&stShared, fdSock)) {
+      for (i = 0; i < 3; i++) stRequest[i] = sharedSubmit(&stShared, szPrint[i], NULL, NULL);
+      for (i = 0; i < 3; i++) {
+         if (sharedWait(&stShared, stRequest[i]) == FATAL) iResult = FATAL;
+         *stMasterTable[i] = stRequest[i]->stReply; // hand the sentences over
+         initializeBlock(&stRequest[i]->stReply);
+         freeSharedRequest(stRequest[i]);
+      }
+      clearSharedConnection(&stShared);
+   } else { // no I/O thread: one table after the other.
+      printf("         Could not start the download thread, reading the tables one by one.\n");
+      for (i = 0; i < 3; i++) {
+         writeWord(fdSock, szPrint[i][0]);
+         writeWord(fdSock, "");
+         readBlock(fdSock, stMasterTable[i]);
+         if ((stMasterTable[i]->iLength == 0) ||
+             (stMasterTable[i]->stSentence[stMasterTable[i]->iLength - 1]->iReturnValue != DONE)) iResult = FATAL;
       }
    }
-   clearBlock(&stBlockTMP); // clear the connection list.
 
+   stClone.lFpFILTER = tableFingerprint(&stClone.stBlockFILTER);
+   stClone.lFpMANGLE = tableFingerprint(&stClone.stBlockMANGLE);
+   stClone.lFpADDRESS = tableFingerprint(&stClone.stBlockADDRESS);
+   stClone.lLastADDRESS = loadedFingerprint(stClone.szTarget, "address-list", stClone.lFpADDRESS);
+   if (iResult == DONE) {
+      saveFingerprint(szIPaddr1, "filter", stClone.lFpFILTER, "master");
+      saveFingerprint(szIPaddr1, "mangle", stClone.lFpMANGLE, "master");
+      saveFingerprint(szIPaddr1, "address-list", stClone.lFpADDRESS, "master");
+   }
 
-// 14. disconnect from target router.
 
-   printf("(14/14): Disconnect from TARGET router: %s\n",argv[1]);
+// 3. We have everything we need from the master router; time to disconnect.
+//    Let the phases go once they are all logged in to the TARGET.
+
+   printf("( 3/14): Disconnect from MASTER router: %s\n",szIPaddr1);
    apiDisconnect(fdSock);
+
+   cloneWait(&stClone.iLoggedIn, 3);
+   if (iResult != DONE) printf("MASTER download failed.\n");
+   else if (stClone.iFailed) printf("Invalid username or password.\n");
+   if ((iResult != DONE) || stClone.iFailed) cloneSet(&stClone.iAbort, 1);
+   else cloneSet(&stClone.iMasterReady, 1);
+
+   for (i = 0; i < 3; i++) pthread_join(stPhase[i].thread, NULL);
+   for (i = 0; i < 3; i++) clearBlock(stMasterTable[i]); // left over if a phase stopped early.
+   if (stClone.iAbort) exit(1);
+
+
+// 14. record the TARGET fingerprints and disconnect from target router.
+
+   saveFingerprint(stClone.szTarget, "filter", stClone.lFpFILTER, (stPhase[0].iSkip && !stPhase[0].iMoved) ? "match" : "cloned");
+   saveFingerprint(stClone.szTarget, "mangle", stClone.lFpMANGLE, stPhase[1].iSkip ? "match" : "cloned");
+   saveFingerprint(stClone.szTarget, "address-list", stClone.lFpADDRESS, stPhase[2].iSkip ? "match" : "cloned");
+   if (stClone.lLoadedADDRESS) saveFingerprint(stClone.szTarget, "address-list", stClone.lLoadedADDRESS, "loaded");
+
+   printf("(14/14): Disconnect from TARGET router: %s\n",stClone.szTarget);
+   pthread_mutex_destroy(&stClone.mutex);
+   pthread_cond_destroy(&stClone.cond);
+#ifdef API_TRACE
+   traceWrite(szTraceFile);
+   traceStop();
+#endif
    apiTerminate();
    return (0);
 }
@@ -0,0 +1,490 @@
+//
+// Mikrotik API 2.0 // Columnar blocks.
+//
+// A ColumnBlock stores a reply column by column instead of sentence by
+// sentence.  All values of one attribute live in one contiguous buffer,
+// so scanning 500k address-list entries for one field walks a single
+// array instead of chasing Block -> Sentence -> word pointers per row.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "api.h"
+#include "column.h"
+#include "pool.h"
+#include "value.h"
+
+// ********************************************************************
+// appendColumnData
+// ********************************************************************
+// APPEND A NULL TERMINATED VALUE TO THE COLUMN DATA BUFFER.
+//
+// The buffer at least doubles each time it grows.  The offset of the
+// new value is returned.  Use offsets, not pointers, since cData moves.
+
+static long appendColumnData(struct Column *stColumn, char *szValue) {
+   long lLen = strlen(szValue) + 1;
+   long lOffset;
+   long lNewSize;
+
+   if (stColumn->lDataLen + lLen > stColumn->lDataSize) {
+      lNewSize = stColumn->lDataSize ? stColumn->lDataSize * 2 : 1024;
+      while (lNewSize < stColumn->lDataLen + lLen) lNewSize *= 2;
+      stColumn->cData = realloc(stColumn->cData, lNewSize);
+      debug_ram += (lNewSize - stColumn->lDataSize);
+      stColumn->lDataSize = lNewSize;
+   }
+
+   lOffset = stColumn->lDataLen;
+   memcpy(stColumn->cData + lOffset, szValue, lLen);
+   stColumn->lDataLen += lLen;
+
+   return (lOffset);
+}
+
+
+// ********************************************************************
+// fillColumnRows
+// ********************************************************************
+// MAKE ROOM FOR ROWS 0..iRows-1 IN A COLUMN.
+//
+// Rows between the last stored row and iRows are marked COL_MISSING.
+
+static void fillColumnRows(struct Column *stColumn, int iRows) {
+   int iNewSize;
+
+   if (iRows > stColumn->iSize) {
+      iNewSize = stColumn->iSize ? stColumn->iSize * 2 : 256;
+      while (iNewSize < iRows) iNewSize *= 2;
+      if (stColumn->iType == COL_DICT) {
+         stColumn->iCode = realloc(stColumn->iCode, iNewSize * sizeof(int));
+         debug_ram += (iNewSize - stColumn->iSize) * sizeof(int);
+      } else {
+         stColumn->lOffset = realloc(stColumn->lOffset, iNewSize * sizeof(long));
+         debug_ram += (iNewSize - stColumn->iSize) * sizeof(long);
+      }
+      stColumn->iSize = iNewSize;
+   }
+
+   while (stColumn->iFilled < iRows) {
+      if (stColumn->iType == COL_DICT) stColumn->iCode[stColumn->iFilled] = COL_MISSING;
+      else stColumn->lOffset[stColumn->iFilled] = COL_MISSING;
+      stColumn->iFilled++;
+   }
+}
+
+
+// ********************************************************************
+// columnDictCode
+// ********************************************************************
+// LOOK UP THE DICTIONARY CODE OF A VALUE.
+//
+// Returns the code or COL_MISSING if the value does not occur in the
+// column.  Resolve the code once, then filter rows with columnCode.
+
+int columnDictCode(struct Column *stColumn, char *szValue) {
+   int iCode;
+
+   if (stColumn->iType != COL_DICT) return (COL_MISSING);
+   iCode = findStringInPool(&stColumn->stDict, szValue, strlen(szValue));
+   return (iCode < 0 ? COL_MISSING : iCode);
+}
+
+
+// ********************************************************************
+// addColumn
+// ********************************************************************
+// ADD AN EMPTY COLUMN TO A COLUMNBLOCK AND RETURN ITS INDEX.
+
+static int addColumn(struct ColumnBlock *stColumnBlock, char *szName, int iNameLen, char **szDictNames) {
+   struct Column *stColumn;
+
+   if (stColumnBlock->iColumns == stColumnBlock->iColumnSize) {
+      stColumnBlock->iColumnSize = stColumnBlock->iColumnSize ? stColumnBlock->iColumnSize * 2 : 16;
+      stColumnBlock->stColumn = realloc(stColumnBlock->stColumn, stColumnBlock->iColumnSize * sizeof(struct Column));
+      debug_ram += (stColumnBlock->iColumnSize - stColumnBlock->iColumns) * sizeof(struct Column);
+   }
+
+   stColumn = &stColumnBlock->stColumn[stColumnBlock->iColumns];
+   memset(stColumn, 0, sizeof(struct Column));
+   stColumn->szName = malloc(iNameLen + 1);
+   debug_ram += (iNameLen + 1);
+   memcpy(stColumn->szName, szName, iNameLen);
+   stColumn->szName[iNameLen] = 0;
+   stColumn->iType = isLowCardinalityName(stColumn->szName, szDictNames) ? COL_DICT : COL_PLAIN;
+
+   return (stColumnBlock->iColumns++);
+}
+
+
+// ********************************************************************
+// initializeColumnBlock
+// ********************************************************************
+// INITIALIZE A COLUMNBLOCK.
+
+void initializeColumnBlock(struct ColumnBlock *stColumnBlock) {
+   memset(stColumnBlock, 0, sizeof(struct ColumnBlock));
+}
+
+
+// ********************************************************************
+// clearColumnBlock
+// ********************************************************************
+// CLEAR A COLUMNBLOCK BY FREEING MEMORY.
+
+void clearColumnBlock(struct ColumnBlock *stColumnBlock) {
+   int i;
+   struct Column *stColumn;
+
+   for (i = 0; i < stColumnBlock->iColumns; i++) {
+      stColumn = &stColumnBlock->stColumn[i];
+      debug_ram -= (strlen(stColumn->szName) + 1);
+      debug_ram -= stColumn->lDataSize;
+      if (stColumn->iType == COL_DICT) {
+         debug_ram -= stColumn->iSize * sizeof(int);
+         clearStringPool(&stColumn->stDict);
+      } else {
+         debug_ram -= stColumn->iSize * sizeof(long);
+      }
+      if (stColumn->stValue) debug_ram -= stColumn->iValues * sizeof(struct Value) + 1;
+      free(stColumn->szName);
+      free(stColumn->cData);
+      free(stColumn->lOffset);
+      free(stColumn->iCode);
+      free(stColumn->stValue);
+   }
+   debug_ram -= stColumnBlock->iColumnSize * sizeof(struct Column);
+   free(stColumnBlock->stColumn);
+
+   if (stColumnBlock->szMessage) {
+      debug_ram -= (strlen(stColumnBlock->szMessage) + 1);
+      free(stColumnBlock->szMessage);
+   }
+
+   initializeColumnBlock(stColumnBlock);
+}
+
+
+// ********************************************************************
+// findColumn
+// ********************************************************************
+// RETURN THE INDEX OF THE NAMED COLUMN OR -1 IF NOT FOUND.
+//
+// szName is the bare attribute name, "address" and not "=address=".
+
+int findColumn(struct ColumnBlock *stColumnBlock, char *szName) {
+   int i;
+
+   for (i = 0; i < stColumnBlock->iColumns; i++) {
+      if (strcmp(stColumnBlock->stColumn[i].szName, szName) == 0) return (i);
+   }
+   return (-1);
+}
+
+
+// ********************************************************************
+// columnValue
+// ********************************************************************
+// RETURN A POINTER TO THE VALUE OF A ROW OR NULL IF THE ROW HAS NONE.
+//
+// The pointer is only valid until the column is added to or cleared.
+
+char *columnValue(struct Column *stColumn, int iRow) {
+   long lOffset;
+
+   if ((iRow < 0) || (iRow >= stColumn->iFilled)) return (NULL);
+
+   if (stColumn->iType == COL_DICT) return (poolString(&stColumn->stDict, stColumn->iCode[iRow]));
+
+   lOffset = stColumn->lOffset[iRow];
+   return (lOffset == COL_MISSING ? NULL : stColumn->cData + lOffset);
+}
+
+
+// ********************************************************************
+// columnCode
+// ********************************************************************
+// RETURN THE DICTIONARY CODE OF A ROW OR COL_MISSING.
+
+int columnCode(struct Column *stColumn, int iRow) {
+   if ((stColumn->iType != COL_DICT) || (iRow < 0) || (iRow >= stColumn->iFilled)) return (COL_MISSING);
+   return (stColumn->iCode[iRow]);
+}
+
+
+// ********************************************************************
+// dropColumnValues
+// ********************************************************************
+// FORGET THE TYPED VALUES OF A COLUMN.
+
+static void dropColumnValues(struct Column *stColumn) {
+   debug_ram -= stColumn->iValues * sizeof(struct Value) + 1;
+   free(stColumn->stValue);
+   stColumn->stValue = NULL;
+   stColumn->iValueType = VALUE_NONE;
+   stColumn->iValues = 0;
+}
+
+
+// ********************************************************************
+// convertColumn
+// ********************************************************************
+// PARSE EVERY VALUE OF THE NAMED COLUMN AS iType, ONCE.
+//
+// The result is kept in the column (see columnTyped) so numeric work
+// over a big block reads numbers instead of parsing text on every
+// pass.  A dictionary column parses each distinct value only once.
+// Rows that are missing or not of the type get VALUE_NONE.  Returns
+// the number of rows that parsed, -1 if the block has no such column.
+
+int convertColumn(struct ColumnBlock *stColumnBlock, char *szName, int iType) {
+   struct Column *stColumn;
+   struct Value *stDistinct = NULL;
+   int iConverted = 0;
+   int iColumn;
+   int i;
+
+   if ((iColumn = findColumn(stColumnBlock, szName)) < 0) return (-1);
+   stColumn = &stColumnBlock->stColumn[iColumn];
+   if (stColumn->stValue) dropColumnValues(stColumn);
+
+   stColumn->iValues = stColumn->iFilled;
+   stColumn->iValueType = iType;
+   stColumn->stValue = malloc(stColumn->iValues * sizeof(struct Value) + 1);
+   debug_ram += stColumn->iValues * sizeof(struct Value) + 1;
+
+   if (stColumn->iType == COL_DICT) {
+      stDistinct = malloc(stColumn->stDict.iLength * sizeof(struct Value) + 1);
+      debug_ram += stColumn->stDict.iLength * sizeof(struct Value) + 1;
+      for (i = 0; i < stColumn->stDict.iLength; i++) parseValue(poolString(&stColumn->stDict, i), iType, &stDistinct[i]);
+   }
+
+   for (i = 0; i < stColumn->iValues; i++) {
+      if (stDistinct == NULL) parseValue(columnValue(stColumn, i), iType, &stColumn->stValue[i]);
+      else if (stColumn->iCode[i] == COL_MISSING) parseValue(NULL, iType, &stColumn->stValue[i]);
+      else stColumn->stValue[i] = stDistinct[stColumn->iCode[i]];
+      iConverted += (stColumn->stValue[i].iType != VALUE_NONE);
+   }
+
+   if (stDistinct) {
+      debug_ram -= stColumn->stDict.iLength * sizeof(struct Value) + 1;
+      free(stDistinct);
+   }
+   return (iConverted);
+}
+
+
+// ********************************************************************
+// columnTyped
+// ********************************************************************
+// RETURN THE TYPED VALUE OF A ROW, NULL IF THE ROW HAS NONE.
+//
+// NULL too if the column wasn't converted with convertColumn.
+
+struct Value *columnTyped(struct Column *stColumn, int iRow) {
+   if ((iRow < 0) || (iRow >= stColumn->iValues)) return (NULL);
+   if (stColumn->stValue[iRow].iType == VALUE_NONE) return (NULL);
+   return (&stColumn->stValue[iRow]);
+}
+
+
+// ********************************************************************
+// addValueToColumnBlock
+// ********************************************************************
+// STORE ONE ATTRIBUTE VALUE OF A ROW.
+//
+// szName need not be NULL terminated; iNameLen gives its length.  The
+// column is created on first use.  Rows of one reply usually carry the
+// same attributes in the same order, so the column after the last one
+// used is tried before searching all columns.
+
+void addValueToColumnBlock(struct ColumnBlock *stColumnBlock, int iRow, char *szName, int iNameLen, char *szValue, char **szDictNames) {
+   struct Column *stColumn;
+   int iColumn = -1;
+   int i;
+
+   i = stColumnBlock->iLastColumn + 1;
+   if (i >= stColumnBlock->iColumns) i = 0;
+   if ((i < stColumnBlock->iColumns) &&
+       (strncmp(stColumnBlock->stColumn[i].szName, szName, iNameLen) == 0) &&
+       (stColumnBlock->stColumn[i].szName[iNameLen] == 0)) {
+      iColumn = i;
+   } else {
+      for (i = 0; i < stColumnBlock->iColumns; i++) {
+         if ((strncmp(stColumnBlock->stColumn[i].szName, szName, iNameLen) == 0) &&
+             (stColumnBlock->stColumn[i].szName[iNameLen] == 0)) {
+            iColumn = i;
+            break;
+         }
+      }
+   }
+   if (iColumn < 0) iColumn = addColumn(stColumnBlock, szName, iNameLen, szDictNames);
+   stColumnBlock->iLastColumn = iColumn;
+
+   if (iRow >= stColumnBlock->iRows) stColumnBlock->iRows = iRow + 1;
+
+   stColumn = &stColumnBlock->stColumn[iColumn];
+   if (stColumn->stValue) dropColumnValues(stColumn);
+   fillColumnRows(stColumn, iRow + 1);
+   if (stColumn->iType == COL_DICT) stColumn->iCode[iRow] = addStringToPool(&stColumn->stDict, szValue, strlen(szValue));
+   else stColumn->lOffset[iRow] = appendColumnData(stColumn, szValue);
+}
+
+
+// ********************************************************************
+// splitWord
+// ********************************************************************
+// SPLIT A =name=value WORD.
+//
+// Returns the length of the name and points *pszValue at the value.
+// Returns 0 if the word is not of the form =name=value.
+
+static int splitWord(char *szWord, char **pszValue) {
+   char *ptr;
+
+   if (szWord[0] != '=') return (0);
+   if ((ptr = strchr(szWord + 1, '=')) == NULL) return (0);
+   *pszValue = ptr + 1;
+   return (ptr - szWord - 1);
+}
+
+
+// ********************************************************************
+// setColumnBlockMessage
+// ********************************************************************
+// REMEMBER THE MESSAGE OF A !trap OR !fatal.
+
+static void setColumnBlockMessage(struct ColumnBlock *stColumnBlock, char *szMessage) {
+   if (stColumnBlock->szMessage) return; // keep the first one.
+   stColumnBlock->szMessage = malloc(strlen(szMessage) + 1);
+   debug_ram += (strlen(szMessage) + 1);
+   strcpy(stColumnBlock->szMessage, szMessage);
+}
+
+
+// ********************************************************************
+// addSentenceToColumnBlock
+// ********************************************************************
+// ADD A SENTENCE TO A COLUMNBLOCK.
+//
+// Converts a sentence of an existing Block.  A DATA sentence becomes a
+// new row, the others update iReturnValue and szMessage.
+
+void addSentenceToColumnBlock(struct ColumnBlock *stColumnBlock, struct Sentence *stSentence, char **szDictNames) {
+   int i;
+   int iRow;
+   int iNameLen;
+   char *szValue;
+
+   if (stSentence->iReturnValue != DATA) {
+      if (stSentence->iReturnValue > stColumnBlock->iReturnValue) stColumnBlock->iReturnValue = stSentence->iReturnValue;
+      for (i = 1; i < stSentence->iLength; i++) {
+         if (strncmp(stSentence->szWord[i], "=message=", 9) == 0) setColumnBlockMessage(stColumnBlock, stSentence->szWord[i] + 9);
+      }
+      return;
+   }
+
+   iRow = stColumnBlock->iRows++;
+   for (i = 1; i < stSentence->iLength; i++) {
+      if ((iNameLen = splitWord(stSentence->szWord[i], &szValue)) == 0) continue;
+      addValueToColumnBlock(stColumnBlock, iRow, stSentence->szWord[i] + 1, iNameLen, szValue, szDictNames);
+   }
+}
+
+
+// ********************************************************************
+// finishColumnBlock
+// ********************************************************************
+// PAD EVERY COLUMN TO THE FULL NUMBER OF ROWS.
+
+static void finishColumnBlock(struct ColumnBlock *stColumnBlock) {
+   int i;
+
+   for (i = 0; i < stColumnBlock->iColumns; i++) fillColumnRows(&stColumnBlock->stColumn[i], stColumnBlock->iRows);
+}
+
+
+// ********************************************************************
+// readColumnBlock
+// ********************************************************************
+// READ A REPLY FROM THE SOCKET STRAIGHT INTO A COLUMNBLOCK.
+//
+// Same termination rules as readBlock: keep reading sentences until
+// !done or !fatal.  Words are read into one reusable buffer and the
+// values copied once into their column; no Sentence is built.
+//
+// szDictNames is a NULL terminated list of attribute names to
+// dictionary encode.  Pass NULL for the defaults (list, chain,
+// action, ...).
+//
+// IMPORTANT:  Must free the ColumnBlock with clearColumnBlock.
+
+void readColumnBlock(int fdSock, struct ColumnBlock *stColumnBlock, char **szDictNames) {
+   char *szWord = NULL;
+   int iSize = 0;
+   int iReturnValue;
+   int iRow;
+   int iNameLen;
+   char *szValue;
+
+   initializeColumnBlock(stColumnBlock);
+
+   do {
+      iReturnValue = 0;
+      iRow = -1;
+
+      while (readWordBuffer(fdSock, &szWord, &iSize) > 0) {
+         if (szWord[0] == '!') {
+            if (strcmp(szWord, "!re") == 0) {
+               iReturnValue = DATA;
+               iRow = stColumnBlock->iRows++;
+            } else if (strcmp(szWord, "!done") == 0) iReturnValue = DONE;
+            else if (strcmp(szWord, "!trap") == 0) iReturnValue = TRAP;
+            else if (strcmp(szWord, "!fatal") == 0) iReturnValue = FATAL;
+         } else if (iReturnValue == DATA) {
+            if ((iNameLen = splitWord(szWord, &szValue)) == 0) continue; // .tag= etc.
+            addValueToColumnBlock(stColumnBlock, iRow, szWord + 1, iNameLen, szValue, szDictNames);
+         } else if ((iReturnValue == TRAP) && (strncmp(szWord, "=message=", 9) == 0)) {
+            setColumnBlockMessage(stColumnBlock, szWord + 9);
+         } else if (iReturnValue == FATAL) {
+            setColumnBlockMessage(stColumnBlock, szWord);
+         }
+      }
+
+      if (iReturnValue != DATA && iReturnValue > stColumnBlock->iReturnValue) stColumnBlock->iReturnValue = iReturnValue;
+   } while ((iReturnValue == DATA) || (iReturnValue == TRAP));
+
+   debug_ram -= iSize;
+   free(szWord);
+
+   finishColumnBlock(stColumnBlock);
+}
+
+
+// ********************************************************************
+// printColumnBlock
+// ********************************************************************
+// PRINT A COLUMNBLOCK TO STDOUT.
+//
+// Same layout as printBlock: one line per row, then the final reply.
+
+void printColumnBlock(struct ColumnBlock *stColumnBlock) {
+   int i, j;
+   char *szValue;
+
+   for (i = 0; i < stColumnBlock->iRows; i++) {
+      printf("!re ");
+      for (j = 0; j < stColumnBlock->iColumns; j++) {
+         if ((szValue = columnValue(&stColumnBlock->stColumn[j], i)) != NULL) {
+            printf("=%s=%s ", stColumnBlock->stColumn[j].szName, szValue);
+         }
+      }
+      printf("\n");
+   }
+
+   if (stColumnBlock->iReturnValue == FATAL) printf("!fatal %s\n", stColumnBlock->szMessage ? stColumnBlock->szMessage : "");
+   else if (stColumnBlock->iReturnValue == TRAP) printf("!trap =message=%s\n", stColumnBlock->szMessage ? stColumnBlock->szMessage : "");
+   else printf("!done\n");
+}
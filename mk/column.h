@@ -0,0 +1,83 @@
+//
+// Mikrotik API 2.0 // Columnar blocks.
+//
+
+#ifndef MK_COLUMN
+#define MK_COLUMN
+
+#include "api.h"
+#include "pool.h"
+#include "value.h"
+
+#define COL_PLAIN 0 // one value per row stored in cData
+#define COL_DICT  1 // one dictionary code per row, distinct values in cData
+
+#define COL_MISSING -1 // offset or code of a row that has no value
+
+// struct Column
+//
+// A Column holds every value of one attribute (the "name" of a
+// =name=value word) for all the rows of a ColumnBlock.  The value
+// strings are packed NULL terminated, one after the other, into the
+// single buffer cData.
+//
+// A COL_PLAIN column keeps one offset into cData per row in lOffset.
+// A COL_DICT column stores each distinct value only once in the
+// StringPool stDict and one small integer code (the pool id) per row
+// in iCode.  Comparing two rows of a dictionary column is then an
+// integer compare.
+//
+// Rows that don't carry this attribute have COL_MISSING as offset
+// (plain) or code (dictionary).
+//
+// convertColumn can parse the values once into stValue, one struct
+// Value per row; the text stays as it is.  Adding a value to the
+// column drops the conversion.
+
+struct Column {
+        char *szName;     // attribute name without the equal signs.
+        int iType;        // COL_PLAIN or COL_DICT
+        char *cData;      // plain: packed NULL terminated values
+        long lDataLen;    // plain: bytes used in cData
+        long lDataSize;   // plain: bytes allocated for cData
+        long *lOffset;    // plain: offset per row.  NULL for dict columns.
+        int *iCode;       // dict: code per row.  NULL for plain columns.
+        int iFilled;      // number of rows stored in lOffset/iCode
+        int iSize;        // number of rows allocated in lOffset/iCode
+        struct StringPool stDict; // dict: the distinct values
+        struct Value *stValue;    // typed value per row, NULL if not converted
+        int iValueType;           // VALUE_INT .. VALUE_MAC of stValue
+        int iValues;              // rows in stValue
+};
+
+// struct ColumnBlock
+//
+// A ColumnBlock is the columnar alternative to a Block.  Each !re
+// sentence of the reply becomes one row and each attribute becomes one
+// Column.  iReturnValue holds DONE, TRAP or FATAL from the sentences
+// that ended the reply and szMessage the =message= of a !trap/!fatal.
+
+struct ColumnBlock {
+        struct Column *stColumn; // array of columns.
+        int iColumns;      // number of columns in stColumn
+        int iColumnSize;   // number of columns allocated in stColumn
+        int iRows;         // number of !re sentences read
+        int iLastColumn;   // column of the last value added (lookup hint)
+        int iReturnValue;  // DONE, TRAP or FATAL
+        char *szMessage;   // =message= of !trap or !fatal.  NULL if none.
+};
+
+void initializeColumnBlock(struct ColumnBlock *stColumnBlock);
+void clearColumnBlock(struct ColumnBlock *stColumnBlock);
+void printColumnBlock(struct ColumnBlock *stColumnBlock);
+int findColumn(struct ColumnBlock *stColumnBlock, char *szName);
+char *columnValue(struct Column *stColumn, int iRow);
+int columnCode(struct Column *stColumn, int iRow);
+int columnDictCode(struct Column *stColumn, char *szValue);
+void addValueToColumnBlock(struct ColumnBlock *stColumnBlock, int iRow, char *szName, int iNameLen, char *szValue, char **szDictNames);
+void addSentenceToColumnBlock(struct ColumnBlock *stColumnBlock, struct Sentence *stSentence, char **szDictNames);
+void readColumnBlock(int fdSock, struct ColumnBlock *stColumnBlock, char **szDictNames);
+int convertColumn(struct ColumnBlock *stColumnBlock, char *szName, int iType);
+struct Value *columnTyped(struct Column *stColumn, int iRow);
+
+#endif // MK_COLUMN
@@ -0,0 +1,207 @@
+//
+// Mikrotik API 2.0 // Push decoder.
+//
+// readLen, readWord, readSentence and readBlock pull bytes from a
+// blocking socket.  The Decoder is the same protocol turned around:
+// bytes are pushed into it as they arrive, so one thread running
+// poll/epoll can serve any number of routers.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "api.h"
+#include "wire.h"
+#include "decoder.h"
+
+#define DECODER_READ_SIZE 16384 // bytes read per decoderRead call
+
+
+// ********************************************************************
+// sentenceReturnValue
+// ********************************************************************
+// RETURN DONE, DATA, TRAP OR FATAL FOR A REPLY WORD, 0 FOR OTHER WORDS.
+
+int sentenceReturnValue(char *szWord) {
+   if (szWord[0] != '!') return (0);
+   if (strcmp(szWord, "!re") == 0) return (DATA);
+   if (strcmp(szWord, "!done") == 0) return (DONE);
+   if (strcmp(szWord, "!trap") == 0) return (TRAP);
+   if (strcmp(szWord, "!fatal") == 0) return (FATAL);
+   return (0);
+}
+
+
+// ********************************************************************
+// initializeDecoder
+// ********************************************************************
+// INITIALIZE A DECODER.
+//
+// onSentence is called for every complete sentence.  pData is passed
+// through to it.  Set stDecoder->onWord afterwards to also see words.
+
+void initializeDecoder(struct Decoder *stDecoder, void (*onSentence)(struct Sentence *, void *), void *pData) {
+   memset(stDecoder, 0, sizeof(struct Decoder));
+   stDecoder->iState = DECODER_LENGTH;
+   initializeSentence(&stDecoder->stSentence);
+   stDecoder->onSentence = onSentence;
+   stDecoder->pData = pData;
+}
+
+
+// ********************************************************************
+// clearDecoder
+// ********************************************************************
+// FREE A PARTIAL WORD AND SENTENCE HELD BY A DECODER.
+
+void clearDecoder(struct Decoder *stDecoder) {
+   if (stDecoder->szWord) {
+      debug_ram -= (stDecoder->iWordLen + 1);
+      free(stDecoder->szWord);
+      stDecoder->szWord = NULL;
+   }
+   clearSentence(&stDecoder->stSentence);
+   stDecoder->iState = DECODER_LENGTH;
+   stDecoder->iLengthHave = 0;
+}
+
+
+// ********************************************************************
+// decoderWordDone
+// ********************************************************************
+// HAND A COMPLETE WORD OVER TO THE SENTENCE BEING ASSEMBLED.
+//
+// The word was allocated to its exact size while it was received, so
+// its pointer goes into the sentence as is; no copy is made.
+
+static void decoderWordDone(struct Decoder *stDecoder) {
+   struct Sentence *stSentence = &stDecoder->stSentence;
+   int iReturnValue;
+
+   stDecoder->szWord[stDecoder->iWordLen] = 0;
+   if (stDecoder->onWord) stDecoder->onWord(stDecoder->szWord, stDecoder->iWordLen, stDecoder->pData);
+
+   if (stSentence->iLength == 0) stSentence->szWord = malloc(sizeof(char *));
+   else stSentence->szWord = realloc(stSentence->szWord, (stSentence->iLength + 1) * sizeof(char *));
+   debug_ram += sizeof(char *);
+   stSentence->szWord[stSentence->iLength++] = stDecoder->szWord;
+
+   if ((iReturnValue = sentenceReturnValue(stDecoder->szWord)) != 0) stSentence->iReturnValue = iReturnValue;
+
+   stDecoder->szWord = NULL;
+   stDecoder->iState = DECODER_LENGTH;
+}
+
+
+// ********************************************************************
+// decoderSentenceDone
+// ********************************************************************
+// PASS THE ASSEMBLED SENTENCE TO onSENTENCE AND START A NEW ONE.
+
+static void decoderSentenceDone(struct Decoder *stDecoder) {
+   struct Sentence stSentence;
+
+   stSentence = stDecoder->stSentence;
+   initializeSentence(&stDecoder->stSentence);
+
+   if (stSentence.iLength == 0) return; // stray empty word.
+   if (stDecoder->onSentence) stDecoder->onSentence(&stSentence, stDecoder->pData);
+   else clearSentence(&stSentence);
+}
+
+
+// ********************************************************************
+// decoderFeed
+// ********************************************************************
+// PUSH iLen BYTES FROM THE API INTO THE DECODER.
+//
+// All bytes are consumed.  Callbacks run before decoderFeed returns.
+// Returns the number of sentences completed, or -1 if a reserved
+// first byte or a word longer than DECODER_MAX_WORD was received;
+// the decoder then stays in DECODER_ERROR and the connection should
+// be closed.
+
+int decoderFeed(struct Decoder *stDecoder, char *cData, int iLen) {
+   unsigned char *cIn = (unsigned char *)cData;
+   unsigned int iWordLen = 0;
+   int iSentences = 0;
+   int iUsed;
+   int n;
+
+   if (stDecoder->iState == DECODER_ERROR) return (-1);
+
+   while (iLen > 0) {
+      if (stDecoder->iState == DECODER_LENGTH) {
+         if ((stDecoder->iLengthHave == 0) && (cIn[0] < 0x80)) { // common case: 1 byte length in place
+            iWordLen = cIn[0];
+            cIn++;
+            iLen--;
+         } else {
+            if ((stDecoder->iLengthHave == 0) && (wirePrefixSize(cIn[0]) == 0)) {
+               stDecoder->iState = DECODER_ERROR;
+               return (-1);
+            }
+            n = wirePrefixSize(stDecoder->iLengthHave ? stDecoder->cLength[0] : cIn[0]) - stDecoder->iLengthHave;
+            if (n > iLen) n = iLen;
+            memcpy(stDecoder->cLength + stDecoder->iLengthHave, cIn, n);
+            stDecoder->iLengthHave += n;
+            cIn += n;
+            iLen -= n;
+            if ((iUsed = wireDecodeLen(stDecoder->cLength, stDecoder->iLengthHave, &iWordLen)) == 0) break; // need more
+            stDecoder->iLengthHave = 0;
+         }
+
+         if (iWordLen == 0) { // end of sentence
+            decoderSentenceDone(stDecoder);
+            iSentences++;
+            continue;
+         }
+
+         if ((iWordLen > DECODER_MAX_WORD) || ((stDecoder->szWord = malloc((size_t)iWordLen + 1)) == NULL)) {
+            stDecoder->iState = DECODER_ERROR;
+            return (-1);
+         }
+         debug_ram += (iWordLen + 1);
+         stDecoder->iWordLen = iWordLen;
+         stDecoder->iWordHave = 0;
+         stDecoder->iState = DECODER_WORD;
+      }
+
+      // DECODER_WORD: copy as much of the word as we have.
+      n = stDecoder->iWordLen - stDecoder->iWordHave;
+      if (n > iLen) n = iLen;
+      memcpy(stDecoder->szWord + stDecoder->iWordHave, cIn, n);
+      stDecoder->iWordHave += n;
+      cIn += n;
+      iLen -= n;
+      if (stDecoder->iWordHave == stDecoder->iWordLen) decoderWordDone(stDecoder);
+   }
+
+   return (iSentences);
+}
+
+
+// ********************************************************************
+// decoderRead
+// ********************************************************************
+// READ WHATEVER IS AVAILABLE ON fdSock AND FEED IT TO THE DECODER.
+//
+// Meant for non-blocking sockets that poll/epoll reported readable.
+// Returns the number of bytes read, 0 if the router closed the
+// connection or -1 on error (errno is EAGAIN if nothing was there, or
+// EPROTO if the router sent a reserved first byte).
+
+int decoderRead(struct Decoder *stDecoder, int fdSock) {
+   char cBuffer[DECODER_READ_SIZE];
+   int iRead;
+
+   if ((iRead = apiRead(fdSock, cBuffer, sizeof cBuffer)) <= 0) return (iRead);
+
+   if (decoderFeed(stDecoder, cBuffer, iRead) < 0) {
+      errno = EPROTO;
+      return (-1);
+   }
+   return (iRead);
+}
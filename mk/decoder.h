@@ -0,0 +1,47 @@
+//
+// Mikrotik API 2.0 // Push decoder.
+//
+
+#ifndef MK_DECODER
+#define MK_DECODER
+
+#include <limits.h>
+
+#include "api.h"
+#include "wire.h"
+
+#define DECODER_LENGTH 0 // waiting for (the rest of) a word length
+#define DECODER_WORD   1 // waiting for (the rest of) a word
+#define DECODER_ERROR  2 // a reserved first byte or bad length was received
+
+#define DECODER_MAX_WORD (INT_MAX - 1) // longest word accepted, so iWordLen + 1 fits an int
+
+// struct Decoder
+//
+// A Decoder turns a byte stream from the API into sentences without
+// ever blocking.  Feed it whatever bytes arrived, in chunks of any size,
+// with decoderFeed or decoderRead.  Partial lengths and words are kept
+// inside the Decoder between calls.  Each complete word is passed to
+// onWord (if set) and each complete sentence to onSentence, which takes
+// ownership of it and must free it with clearSentence.
+
+struct Decoder {
+        int iState;                  // DECODER_LENGTH, DECODER_WORD or DECODER_ERROR
+        unsigned char cLength[WIRE_MAX_LEN_SIZE]; // partial encoded length
+        int iLengthHave;             // bytes in cLength
+        char *szWord;                // word being received, allocated to its full size
+        int iWordLen;                // length of szWord
+        int iWordHave;               // bytes of szWord received so far
+        struct Sentence stSentence;  // sentence being assembled
+        void (*onWord)(char *szWord, int iLen, void *pData);
+        void (*onSentence)(struct Sentence *stSentence, void *pData);
+        void *pData;                 // passed to the callbacks
+};
+
+void initializeDecoder(struct Decoder *stDecoder, void (*onSentence)(struct Sentence *, void *), void *pData);
+void clearDecoder(struct Decoder *stDecoder);
+int decoderFeed(struct Decoder *stDecoder, char *cData, int iLen);
+int decoderRead(struct Decoder *stDecoder, int fdSock);
+int sentenceReturnValue(char *szWord);
+
+#endif // MK_DECODER
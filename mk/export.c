@@ -0,0 +1,985 @@
+//
+// Mikrotik API 2.0 // Exporters.
+//
+// Writes replies as JSON lines, CSV or an Arrow IPC file while they
+// are read (exportReply) or from a Block.  Output goes through one
+// large buffer, so a million row export costs a few hundred write
+// calls.
+//
+// All three are written as UTF-8.  RouterOS doesn't check what is
+// stored in a comment and older ones are often Windows-1252, so a byte
+// that doesn't start a valid UTF-8 sequence is taken as Latin-1: it is
+// written as the UTF-8 of U+0080 to U+00FF (\u00XX in JSON).
+//
+// The Arrow metadata are flatbuffers (Message.fbs, Schema.fbs and
+// File.fbs of the Arrow format).  They are small and fixed, so they
+// are laid out by hand here instead of pulling in the flatbuffers
+// library: tables are written front to back, each with its vtable
+// just before it, and every child after its parent so all offsets
+// point forward as the format requires.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "api.h"
+#include "export.h"
+
+#define ARROW_V5      4 // MetadataVersion.V5
+#define ARROW_SCHEMA  1 // MessageHeader.Schema
+#define ARROW_BATCH   3 // MessageHeader.RecordBatch
+#define ARROW_UTF8    5 // Type.Utf8
+
+// a flatbuffer being built.
+struct FlatBuilder {
+        unsigned char *cData;
+        int iLen;
+        int iSize;
+};
+
+
+// ********************************************************************
+// flushExporter
+// ********************************************************************
+// WRITE THE BUFFERED OUTPUT.
+//
+// On a write error the output is dropped and iError is set; the
+// exporter keeps going so the caller only has to check finishExporter.
+
+static void flushExporter(struct Exporter *stExporter) {
+   int iDone = 0;
+   int iWritten;
+
+   while (iDone < stExporter->iBufferLen) {
+      iWritten = write(stExporter->fdOut, stExporter->cBuffer + iDone, stExporter->iBufferLen - iDone);
+      if ((iWritten < 0) && (errno == EINTR)) continue;
+      if (iWritten <= 0) {
+         stExporter->iError = 1;
+         break;
+      }
+      iDone += iWritten;
+   }
+   stExporter->iBufferLen = 0;
+}
+
+
+// ********************************************************************
+// exportWrite
+// ********************************************************************
+// APPEND BYTES TO THE OUTPUT.
+
+static void exportWrite(struct Exporter *stExporter, const void *pData, long lLen) {
+   const unsigned char *cData = pData;
+   long lChunk;
+
+   stExporter->llOffset += lLen;
+   while (lLen > 0) {
+      if (stExporter->iBufferLen == EXPORT_BUFFER_SIZE) flushExporter(stExporter);
+      lChunk = EXPORT_BUFFER_SIZE - stExporter->iBufferLen;
+      if (lChunk > lLen) lChunk = lLen;
+      memcpy(stExporter->cBuffer + stExporter->iBufferLen, cData, lChunk);
+      stExporter->iBufferLen += lChunk;
+      cData += lChunk;
+      lLen -= lChunk;
+   }
+}
+
+
+// ********************************************************************
+// utf8SequenceLen
+// ********************************************************************
+// RETURN THE LENGTH OF THE VALID UTF-8 SEQUENCE AT c, OR 0.
+//
+// lAvail bytes are there.  Overlong forms, surrogates and code points
+// above U+10FFFF are not valid.
+
+static int utf8SequenceLen(const unsigned char *c, long lAvail) {
+   int iLen;
+   int i;
+
+   if (c[0] < 0x80) return (1);
+   if ((c[0] >= 0xc2) && (c[0] <= 0xdf)) iLen = 2;
+   else if ((c[0] >= 0xe0) && (c[0] <= 0xef)) iLen = 3;
+   else if ((c[0] >= 0xf0) && (c[0] <= 0xf4)) iLen = 4;
+   else return (0);
+
+   if (lAvail < iLen) return (0);
+   for (i = 1; i < iLen; i++) {
+      if ((c[i] & 0xc0) != 0x80) return (0);
+   }
+   if ((c[0] == 0xe0) && (c[1] < 0xa0)) return (0); // overlong
+   if ((c[0] == 0xed) && (c[1] > 0x9f)) return (0); // surrogate
+   if ((c[0] == 0xf0) && (c[1] < 0x90)) return (0); // overlong
+   if ((c[0] == 0xf4) && (c[1] > 0x8f)) return (0); // above U+10FFFF
+   return (iLen);
+}
+
+
+// ********************************************************************
+// repairUTF8
+// ********************************************************************
+// COPY lLen BYTES TO cOut, LATIN-1 FOR THOSE THAT AREN'T UTF-8.
+//
+// Returns the number of bytes written.  With cOut NULL nothing is
+// written, to find out how much room is needed (at most 2 * lLen).
+
+static long repairUTF8(const char *szIn, long lLen, char *cOut) {
+   const unsigned char *c = (const unsigned char *)szIn;
+   long lOut = 0;
+   long i = 0;
+   int iSeq;
+
+   while (i < lLen) {
+      if ((iSeq = utf8SequenceLen(c + i, lLen - i)) > 0) {
+         if (cOut) memcpy(cOut + lOut, c + i, iSeq);
+         lOut += iSeq;
+         i += iSeq;
+         continue;
+      }
+      if (cOut) {
+         cOut[lOut] = 0xc0 | (c[i] >> 6);
+         cOut[lOut + 1] = 0x80 | (c[i] & 0x3f);
+      }
+      lOut += 2;
+      i++;
+   }
+   return (lOut);
+}
+
+
+// ********************************************************************
+// exportWriteUTF8
+// ********************************************************************
+// APPEND lLen BYTES OF TEXT, REPAIRED AS BY repairUTF8.
+
+static void exportWriteUTF8(struct Exporter *stExporter, const char *szText, long lLen) {
+   const unsigned char *c = (const unsigned char *)szText;
+   unsigned char cLatin1[2];
+   long lStart = 0;
+   long i = 0;
+   int iSeq;
+
+   while (i < lLen) {
+      if ((iSeq = utf8SequenceLen(c + i, lLen - i)) > 0) {
+         i += iSeq;
+         continue;
+      }
+      exportWrite(stExporter, c + lStart, i - lStart);
+      cLatin1[0] = 0xc0 | (c[i] >> 6);
+      cLatin1[1] = 0x80 | (c[i] & 0x3f);
+      exportWrite(stExporter, cLatin1, 2);
+      lStart = ++i;
+   }
+   exportWrite(stExporter, c + lStart, lLen - lStart);
+}
+
+
+// ********************************************************************
+// exportPad
+// ********************************************************************
+// WRITE ZEROS UP TO THE NEXT MULTIPLE OF 8 BYTES.
+
+static void exportPad(struct Exporter *stExporter) {
+   static const unsigned char cZero[8] = { 0 };
+
+   if (stExporter->llOffset % 8) exportWrite(stExporter, cZero, 8 - stExporter->llOffset % 8);
+}
+
+
+// ********************************************************************
+// splitExportWord
+// ********************************************************************
+// SPLIT "=name=value" INTO NAME LENGTH AND VALUE.
+//
+// Returns the length of the name, 0 if the word isn't an attribute.
+
+static int splitExportWord(char *szWord, char **pszValue) {
+   char *ptr;
+
+   if (szWord[0] != '=') return (0);
+   if ((ptr = strchr(szWord + 1, '=')) == NULL) return (0);
+   *pszValue = ptr + 1;
+   return (ptr - szWord - 1);
+}
+
+
+// ********************************************************************
+// findExportColumn
+// ********************************************************************
+// RETURN THE COLUMN OF AN ATTRIBUTE NAME OR -1.
+//
+// Rows carry their attributes in the same order, so the column after
+// the last one found is tried first.
+
+static int findExportColumn(struct Exporter *stExporter, char *szName, int iNameLen) {
+   int iColumn;
+   int i;
+
+   for (i = 0; i < stExporter->iColumns; i++) {
+      iColumn = (stExporter->iLastColumn + 1 + i) % stExporter->iColumns;
+      if ((strncmp(stExporter->szColumn[iColumn], szName, iNameLen) == 0) && (stExporter->szColumn[iColumn][iNameLen] == 0)) {
+         stExporter->iLastColumn = iColumn;
+         return (iColumn);
+      }
+   }
+   return (-1);
+}
+
+
+// ********************************************************************
+// setExportColumns
+// ********************************************************************
+// SET THE COLUMN NAMES AND ALLOCATE THE PER COLUMN STATE.
+
+static void setExportColumns(struct Exporter *stExporter, char **szNames, int iNames) {
+   int i;
+
+   stExporter->iColumns = iNames;
+   stExporter->szColumn = malloc((iNames + 1) * sizeof(char *));
+   stExporter->szValue = malloc((iNames + 1) * sizeof(char *));
+   debug_ram += 2 * (iNames + 1) * sizeof(char *);
+   for (i = 0; i < iNames; i++) {
+      stExporter->szColumn[i] = malloc(strlen(szNames[i]) + 1);
+      debug_ram += strlen(szNames[i]) + 1;
+      strcpy(stExporter->szColumn[i], szNames[i]);
+   }
+   stExporter->iLastColumn = iNames - 1;
+
+   if (stExporter->iFormat == EXPORT_ARROW) {
+      stExporter->stColumn = calloc(iNames + 1, sizeof(struct ExportColumn));
+      debug_ram += (iNames + 1) * sizeof(struct ExportColumn);
+   }
+}
+
+
+// ********************************************************************
+// setColumnsFromSentence
+// ********************************************************************
+// TAKE THE COLUMN NAMES FROM THE ATTRIBUTES OF A ROW.
+
+static void setColumnsFromSentence(struct Exporter *stExporter, struct Sentence *stSentence) {
+   char **szNames;
+   char *szValue;
+   int iNameLen;
+   int iNames = 0;
+   int i;
+
+   szNames = malloc((stSentence->iLength + 1) * sizeof(char *));
+   debug_ram += (stSentence->iLength + 1) * sizeof(char *);
+   for (i = 1; i < stSentence->iLength; i++) {
+      if ((iNameLen = splitExportWord(stSentence->szWord[i], &szValue)) == 0) continue;
+      szNames[iNames] = malloc(iNameLen + 1);
+      debug_ram += iNameLen + 1;
+      memcpy(szNames[iNames], stSentence->szWord[i] + 1, iNameLen);
+      szNames[iNames++][iNameLen] = 0;
+   }
+
+   setExportColumns(stExporter, szNames, iNames);
+
+   for (i = 0; i < iNames; i++) {
+      debug_ram -= strlen(szNames[i]) + 1;
+      free(szNames[i]);
+   }
+   debug_ram -= (stSentence->iLength + 1) * sizeof(char *);
+   free(szNames);
+}
+
+
+// ********************************************************************
+// fbReserve
+// ********************************************************************
+// ADD iBytes ZEROED BYTES TO A FLATBUFFER AND RETURN THEIR POSITION.
+
+static int fbReserve(struct FlatBuilder *stFlat, int iBytes) {
+   int iPos = stFlat->iLen;
+   int iNewSize = stFlat->iSize;
+
+   if (stFlat->iLen + iBytes > stFlat->iSize) {
+      while (stFlat->iLen + iBytes > iNewSize) iNewSize = iNewSize ? iNewSize * 2 : 1024;
+      stFlat->cData = realloc(stFlat->cData, iNewSize);
+      debug_ram += iNewSize - stFlat->iSize;
+      stFlat->iSize = iNewSize;
+   }
+   memset(stFlat->cData + iPos, 0, iBytes);
+   stFlat->iLen += iBytes;
+
+   return (iPos);
+}
+
+
+// ********************************************************************
+// fbFree
+// ********************************************************************
+// FREE A FLATBUFFER.
+
+static void fbFree(struct FlatBuilder *stFlat) {
+   debug_ram -= stFlat->iSize;
+   free(stFlat->cData);
+}
+
+
+// ********************************************************************
+// fbAlign
+// ********************************************************************
+// PAD A FLATBUFFER UNTIL (LENGTH + iSkip) IS A MULTIPLE OF iAlign.
+
+static void fbAlign(struct FlatBuilder *stFlat, int iAlign, int iSkip) {
+   while ((stFlat->iLen + iSkip) % iAlign) fbReserve(stFlat, 1);
+}
+
+
+// ********************************************************************
+// fbPut
+// ********************************************************************
+// STORE A LITTLE ENDIAN SCALAR OF iBytes BYTES AT iPos.
+
+static void fbPut(struct FlatBuilder *stFlat, int iPos, long long llValue, int iBytes) {
+   int i;
+
+   for (i = 0; i < iBytes; i++) stFlat->cData[iPos + i] = (unsigned char)(llValue >> (8 * i));
+}
+
+
+// ********************************************************************
+// fbOffset
+// ********************************************************************
+// POINT THE OFFSET FIELD AT iField TO THE OBJECT AT iTarget.
+
+static void fbOffset(struct FlatBuilder *stFlat, int iField, int iTarget) {
+   fbPut(stFlat, iField, iTarget - iField, 4);
+}
+
+
+// ********************************************************************
+// fbTable
+// ********************************************************************
+// ADD A TABLE WITH ITS VTABLE AND RETURN THE TABLE POSITION.
+//
+// iFieldSize gives the size of each field (1, 2, 4 or 8, offsets are
+// 4), 0 for a field left out.  The position of every field is stored
+// in iFieldPos so the caller can fill it in.  Fields are laid out
+// biggest first so each is aligned to its size.
+
+static int fbTable(struct FlatBuilder *stFlat, int iFields, const int *iFieldSize, int *iFieldPos) {
+   int iOffset[16];
+   int iObject = 4; // the vtable offset comes first
+   int iVTable;
+   int iTable;
+   int iSize;
+   int i;
+
+   for (iSize = 8; iSize >= 1; iSize /= 2) {
+      for (i = 0; i < iFields; i++) {
+         if (iFieldSize[i] != iSize) continue;
+         iObject = (iObject + iSize - 1) / iSize * iSize;
+         iOffset[i] = iObject;
+         iObject += iSize;
+      }
+   }
+
+   fbAlign(stFlat, 2, 0);
+   iVTable = fbReserve(stFlat, 4 + 2 * iFields);
+   fbPut(stFlat, iVTable, 4 + 2 * iFields, 2);
+   fbPut(stFlat, iVTable + 2, iObject, 2);
+   for (i = 0; i < iFields; i++) fbPut(stFlat, iVTable + 4 + 2 * i, iFieldSize[i] ? iOffset[i] : 0, 2);
+
+   fbAlign(stFlat, 8, 0);
+   iTable = fbReserve(stFlat, iObject);
+   fbPut(stFlat, iTable, iTable - iVTable, 4);
+   for (i = 0; i < iFields; i++) iFieldPos[i] = iFieldSize[i] ? iTable + iOffset[i] : -1;
+
+   return (iTable);
+}
+
+
+// ********************************************************************
+// fbVector
+// ********************************************************************
+// ADD A VECTOR OF iCount ELEMENTS AND RETURN ITS POSITION.
+//
+// The elements start 4 bytes after the returned position, aligned to
+// iAlign.
+
+static int fbVector(struct FlatBuilder *stFlat, int iCount, int iElementSize, int iAlign) {
+   int iPos;
+
+   fbAlign(stFlat, iAlign < 4 ? 4 : iAlign, 4);
+   iPos = fbReserve(stFlat, 4 + iCount * iElementSize);
+   fbPut(stFlat, iPos, iCount, 4);
+
+   return (iPos);
+}
+
+
+// ********************************************************************
+// fbString
+// ********************************************************************
+// ADD A STRING AND RETURN ITS POSITION.
+//
+// Flatbuffer strings are UTF-8, so it is repaired as by repairUTF8.
+
+static int fbString(struct FlatBuilder *stFlat, char *szString) {
+   int iLen = repairUTF8(szString, strlen(szString), NULL);
+   int iPos;
+
+   fbAlign(stFlat, 4, 0);
+   iPos = fbReserve(stFlat, 4 + iLen + 1);
+   fbPut(stFlat, iPos, iLen, 4);
+   repairUTF8(szString, strlen(szString), (char *)stFlat->cData + iPos + 4);
+
+   return (iPos);
+}
+
+
+// ********************************************************************
+// fbSchema
+// ********************************************************************
+// ADD AN ARROW Schema TABLE WITH ONE NULLABLE utf8 FIELD PER COLUMN.
+
+static int fbSchema(struct FlatBuilder *stFlat, struct Exporter *stExporter) {
+   static const int iSchemaSize[2] = { 0, 4 };             // endianness (Little), fields
+   static const int iFieldSize[6] = { 4, 1, 1, 4, 0, 4 };  // name, nullable, type_type, type, dictionary, children
+   int iSchemaPos[2];
+   int iFieldPos[6];
+   int iEmpty[1];
+   int iSchema;
+   int iVector;
+   int iField;
+   int i;
+
+   iSchema = fbTable(stFlat, 2, iSchemaSize, iSchemaPos);
+   iVector = fbVector(stFlat, stExporter->iColumns, 4, 4);
+   fbOffset(stFlat, iSchemaPos[1], iVector);
+
+   for (i = 0; i < stExporter->iColumns; i++) {
+      iField = fbTable(stFlat, 6, iFieldSize, iFieldPos);
+      fbOffset(stFlat, iVector + 4 + 4 * i, iField);
+      fbPut(stFlat, iFieldPos[1], 1, 1);
+      fbPut(stFlat, iFieldPos[2], ARROW_UTF8, 1);
+      fbOffset(stFlat, iFieldPos[0], fbString(stFlat, stExporter->szColumn[i]));
+      fbOffset(stFlat, iFieldPos[3], fbTable(stFlat, 0, NULL, iEmpty)); // Utf8 has no fields
+      fbOffset(stFlat, iFieldPos[5], fbVector(stFlat, 0, 4, 4));
+   }
+
+   return (iSchema);
+}
+
+
+// ********************************************************************
+// writeArrowMessage
+// ********************************************************************
+// WRITE AN ENCAPSULATED ARROW MESSAGE HEADER.
+//
+// Continuation marker, metadata length, the flatbuffer padded to 8
+// bytes.  The body follows.  Returns the bytes written.
+
+static int writeArrowMessage(struct Exporter *stExporter, struct FlatBuilder *stFlat) {
+   unsigned char cPrefix[8];
+   int iMeta = (stFlat->iLen + 7) / 8 * 8;
+
+   memset(cPrefix, 0xff, 4);
+   cPrefix[4] = iMeta;
+   cPrefix[5] = iMeta >> 8;
+   cPrefix[6] = iMeta >> 16;
+   cPrefix[7] = iMeta >> 24;
+   exportWrite(stExporter, cPrefix, 8);
+   exportWrite(stExporter, stFlat->cData, stFlat->iLen);
+   exportPad(stExporter);
+
+   return (8 + iMeta);
+}
+
+
+// ********************************************************************
+// startExport
+// ********************************************************************
+// WRITE THE CSV HEADER OR THE ARROW FILE MAGIC AND SCHEMA.
+
+static void startExport(struct Exporter *stExporter) {
+   static const int iMessageSize[4] = { 2, 1, 4, 8 }; // version, header_type, header, bodyLength
+   struct FlatBuilder stFlat;
+   int iMessagePos[4];
+   int i;
+
+   stExporter->iStarted = 1;
+
+   if (stExporter->iFormat == EXPORT_CSV) {
+      for (i = 0; i < stExporter->iColumns; i++) {
+         if (i) exportWrite(stExporter, ",", 1);
+         exportWriteUTF8(stExporter, stExporter->szColumn[i], strlen(stExporter->szColumn[i]));
+      }
+      exportWrite(stExporter, "\n", 1);
+   } else if (stExporter->iFormat == EXPORT_ARROW) {
+      exportWrite(stExporter, "ARROW1\0\0", 8);
+
+      memset(&stFlat, 0, sizeof(struct FlatBuilder));
+      fbReserve(&stFlat, 4); // root offset
+      fbOffset(&stFlat, 0, fbTable(&stFlat, 4, iMessageSize, iMessagePos));
+      fbPut(&stFlat, iMessagePos[0], ARROW_V5, 2);
+      fbPut(&stFlat, iMessagePos[1], ARROW_SCHEMA, 1);
+      fbOffset(&stFlat, iMessagePos[2], fbSchema(&stFlat, stExporter));
+      writeArrowMessage(stExporter, &stFlat);
+      fbFree(&stFlat);
+   }
+}
+
+
+// ********************************************************************
+// writeArrowBatch
+// ********************************************************************
+// WRITE THE ROWS COLLECTED SO FAR AS ONE ARROW RECORD BATCH.
+//
+// Each column has three buffers in the body: validity bitmap, int32
+// offsets and the value bytes, each padded to 8 bytes.
+
+static void writeArrowBatch(struct Exporter *stExporter) {
+   static const int iMessageSize[4] = { 2, 1, 4, 8 }; // version, header_type, header, bodyLength
+   static const int iBatchSize[3] = { 8, 4, 4 };      // length, nodes, buffers
+   struct ExportColumn *stColumn;
+   struct FlatBuilder stFlat;
+   long long llMessage = stExporter->llOffset;
+   long long llBody = 0;
+   long long llLen[3];
+   int iMessagePos[4];
+   int iBatchPos[3];
+   int iRows = stExporter->iBatchRows;
+   int iNodes;
+   int iBuffers;
+   int iMeta;
+   int i, j;
+
+   memset(&stFlat, 0, sizeof(struct FlatBuilder));
+   fbReserve(&stFlat, 4);
+   fbOffset(&stFlat, 0, fbTable(&stFlat, 4, iMessageSize, iMessagePos));
+   fbPut(&stFlat, iMessagePos[0], ARROW_V5, 2);
+   fbPut(&stFlat, iMessagePos[1], ARROW_BATCH, 1);
+   fbOffset(&stFlat, iMessagePos[2], fbTable(&stFlat, 3, iBatchSize, iBatchPos));
+   fbPut(&stFlat, iBatchPos[0], iRows, 8);
+
+   iNodes = fbVector(&stFlat, stExporter->iColumns, 16, 8);
+   fbOffset(&stFlat, iBatchPos[1], iNodes);
+   iBuffers = fbVector(&stFlat, 3 * stExporter->iColumns, 16, 8);
+   fbOffset(&stFlat, iBatchPos[2], iBuffers);
+
+   for (i = 0; i < stExporter->iColumns; i++) {
+      stColumn = &stExporter->stColumn[i];
+      fbPut(&stFlat, iNodes + 4 + 16 * i, iRows, 8);
+      fbPut(&stFlat, iNodes + 4 + 16 * i + 8, stColumn->lNulls, 8);
+
+      llLen[0] = (iRows + 7) / 8;
+      llLen[1] = iRows ? (iRows + 1) * 4 : 0;
+      llLen[2] = stColumn->lDataLen;
+      for (j = 0; j < 3; j++) {
+         fbPut(&stFlat, iBuffers + 4 + 16 * (3 * i + j), llBody, 8);
+         fbPut(&stFlat, iBuffers + 4 + 16 * (3 * i + j) + 8, llLen[j], 8);
+         llBody += (llLen[j] + 7) / 8 * 8;
+      }
+   }
+   fbPut(&stFlat, iMessagePos[3], llBody, 8);
+
+   iMeta = writeArrowMessage(stExporter, &stFlat);
+   fbFree(&stFlat);
+
+   for (i = 0; i < stExporter->iColumns; i++) {
+      stColumn = &stExporter->stColumn[i];
+      if (iRows == 0) break;
+      exportWrite(stExporter, stColumn->cValid, (iRows + 7) / 8);
+      exportPad(stExporter);
+      exportWrite(stExporter, stColumn->iOffset, (iRows + 1) * 4);
+      exportPad(stExporter);
+      exportWrite(stExporter, stColumn->cData, stColumn->lDataLen);
+      exportPad(stExporter);
+
+      memset(stColumn->cValid, 0, (iRows + 7) / 8);
+      stColumn->lDataLen = 0;
+      stColumn->lNulls = 0;
+   }
+   stExporter->iBatchRows = 0;
+
+   // remember where the batch is for the footer
+   if (stExporter->iBlocks == stExporter->iBlockSize) {
+      stExporter->iBlockSize = stExporter->iBlockSize ? stExporter->iBlockSize * 2 : 16;
+      stExporter->llBlock = realloc(stExporter->llBlock, stExporter->iBlockSize * 3 * sizeof(long long));
+      debug_ram += (stExporter->iBlockSize - stExporter->iBlocks) * 3 * sizeof(long long);
+   }
+   stExporter->llBlock[3 * stExporter->iBlocks] = llMessage;
+   stExporter->llBlock[3 * stExporter->iBlocks + 1] = iMeta;
+   stExporter->llBlock[3 * stExporter->iBlocks + 2] = llBody;
+   stExporter->iBlocks++;
+}
+
+
+// ********************************************************************
+// writeArrowFooter
+// ********************************************************************
+// END THE STREAM AND WRITE THE FILE FOOTER AND TRAILING MAGIC.
+
+static void writeArrowFooter(struct Exporter *stExporter) {
+   static const int iFooterSize[4] = { 2, 4, 0, 4 }; // version, schema, dictionaries, recordBatches
+   static const unsigned char cEnd[8] = { 0xff, 0xff, 0xff, 0xff, 0, 0, 0, 0 };
+   struct FlatBuilder stFlat;
+   unsigned char cLen[4];
+   int iFooterPos[4];
+   int iVector;
+   int i;
+
+   exportWrite(stExporter, cEnd, 8);
+
+   memset(&stFlat, 0, sizeof(struct FlatBuilder));
+   fbReserve(&stFlat, 4);
+   fbOffset(&stFlat, 0, fbTable(&stFlat, 4, iFooterSize, iFooterPos));
+   fbPut(&stFlat, iFooterPos[0], ARROW_V5, 2);
+   fbOffset(&stFlat, iFooterPos[1], fbSchema(&stFlat, stExporter));
+   iVector = fbVector(&stFlat, stExporter->iBlocks, 24, 8);
+   fbOffset(&stFlat, iFooterPos[3], iVector);
+   for (i = 0; i < stExporter->iBlocks; i++) { // struct Block { long offset; int metaDataLength; long bodyLength; }
+      fbPut(&stFlat, iVector + 4 + 24 * i, stExporter->llBlock[3 * i], 8);
+      fbPut(&stFlat, iVector + 4 + 24 * i + 8, stExporter->llBlock[3 * i + 1], 4);
+      fbPut(&stFlat, iVector + 4 + 24 * i + 16, stExporter->llBlock[3 * i + 2], 8);
+   }
+
+   exportWrite(stExporter, stFlat.cData, stFlat.iLen);
+   for (i = 0; i < 4; i++) cLen[i] = stFlat.iLen >> (8 * i);
+   exportWrite(stExporter, cLen, 4);
+   exportWrite(stExporter, "ARROW1", 6);
+   fbFree(&stFlat);
+}
+
+
+// ********************************************************************
+// addArrowRow
+// ********************************************************************
+// APPEND THE VALUES OF THE CURRENT ROW TO THE ARROW COLUMNS.
+
+static void addArrowRow(struct Exporter *stExporter) {
+   struct ExportColumn *stColumn;
+   int iRow = stExporter->iBatchRows;
+   long lLen;
+   long lNewSize;
+   int iNewSize;
+   int i;
+
+   for (i = 0; i < stExporter->iColumns; i++) {
+      stColumn = &stExporter->stColumn[i];
+
+      if (iRow + 1 >= stColumn->iSize) {
+         iNewSize = stColumn->iSize ? stColumn->iSize * 2 : 1024;
+         stColumn->cValid = realloc(stColumn->cValid, iNewSize / 8);
+         memset(stColumn->cValid + stColumn->iSize / 8, 0, (iNewSize - stColumn->iSize) / 8);
+         stColumn->iOffset = realloc(stColumn->iOffset, iNewSize * sizeof(int));
+         debug_ram += (iNewSize - stColumn->iSize) / 8 + (iNewSize - stColumn->iSize) * sizeof(int);
+         stColumn->iSize = iNewSize;
+      }
+      if (iRow == 0) stColumn->iOffset[0] = 0;
+
+      if (stExporter->szValue[i] == NULL) {
+         stColumn->iOffset[iRow + 1] = stColumn->lDataLen;
+         stColumn->lNulls++;
+         continue;
+      }
+
+      lLen = repairUTF8(stExporter->szValue[i], strlen(stExporter->szValue[i]), NULL); // utf8 columns must be UTF-8
+      if (stColumn->lDataLen + lLen > stColumn->lDataSize) {
+         lNewSize = stColumn->lDataSize ? stColumn->lDataSize * 2 : 65536;
+         while (lNewSize < stColumn->lDataLen + lLen) lNewSize *= 2;
+         stColumn->cData = realloc(stColumn->cData, lNewSize);
+         debug_ram += lNewSize - stColumn->lDataSize;
+         stColumn->lDataSize = lNewSize;
+      }
+      repairUTF8(stExporter->szValue[i], strlen(stExporter->szValue[i]), stColumn->cData + stColumn->lDataLen);
+      stColumn->lDataLen += lLen;
+      stColumn->iOffset[iRow + 1] = stColumn->lDataLen;
+      stColumn->cValid[iRow / 8] |= 1 << (iRow % 8);
+   }
+
+   stExporter->iBatchRows++;
+   if (stExporter->iBatchRows == EXPORT_BATCH_ROWS) {
+      writeArrowBatch(stExporter);
+      return;
+   }
+   for (i = 0; i < stExporter->iColumns; i++) {
+      if (stExporter->stColumn[i].lDataLen >= EXPORT_BATCH_BYTES) {
+         writeArrowBatch(stExporter);
+         return;
+      }
+   }
+}
+
+
+// ********************************************************************
+// writeCSVRow
+// ********************************************************************
+// WRITE THE CURRENT ROW AS A CSV LINE.
+//
+// Values with a comma, quote or line break are quoted (RFC 4180).
+
+static void writeCSVRow(struct Exporter *stExporter) {
+   char *szValue;
+   char *ptr;
+   int i;
+
+   for (i = 0; i < stExporter->iColumns; i++) {
+      if (i) exportWrite(stExporter, ",", 1);
+      if ((szValue = stExporter->szValue[i]) == NULL) continue;
+
+      if (strpbrk(szValue, ",\"\r\n") == NULL) {
+         exportWriteUTF8(stExporter, szValue, strlen(szValue));
+         continue;
+      }
+      exportWrite(stExporter, "\"", 1);
+      while ((ptr = strchr(szValue, '"')) != NULL) {
+         exportWriteUTF8(stExporter, szValue, ptr - szValue + 1);
+         exportWrite(stExporter, "\"", 1);
+         szValue = ptr + 1;
+      }
+      exportWriteUTF8(stExporter, szValue, strlen(szValue));
+      exportWrite(stExporter, "\"", 1);
+   }
+   exportWrite(stExporter, "\n", 1);
+}
+
+
+// ********************************************************************
+// writeJSONString
+// ********************************************************************
+// WRITE A QUOTED JSON STRING OF iLen BYTES.
+//
+// Quotes, backslashes and control characters are escaped, and so are
+// bytes that aren't valid UTF-8 (as the Latin-1 \u00XX).  Valid UTF-8
+// is copied as it is.
+
+static void writeJSONString(struct Exporter *stExporter, char *szString, int iLen) {
+   char szEscape[8];
+   int iStart = 0;
+   int iSeq;
+   int i;
+
+   exportWrite(stExporter, "\"", 1);
+   for (i = 0; i < iLen; i++) {
+      if ((unsigned char)szString[i] >= 0x80) {
+         if ((iSeq = utf8SequenceLen((unsigned char *)szString + i, iLen - i)) > 0) {
+            i += iSeq - 1;
+            continue;
+         }
+      } else if (((unsigned char)szString[i] >= 0x20) && (szString[i] != '"') && (szString[i] != '\\')) {
+         continue;
+      }
+      exportWrite(stExporter, szString + iStart, i - iStart);
+      if ((szString[i] == '"') || (szString[i] == '\\')) sprintf(szEscape, "\\%c", szString[i]);
+      else sprintf(szEscape, "\\u%04x", (unsigned char)szString[i]);
+      exportWrite(stExporter, szEscape, strlen(szEscape));
+      iStart = i + 1;
+   }
+   exportWrite(stExporter, szString + iStart, iLen - iStart);
+   exportWrite(stExporter, "\"", 1);
+}
+
+
+// ********************************************************************
+// writeJSONRow
+// ********************************************************************
+// WRITE A ROW AS ONE JSON OBJECT ON ONE LINE.
+//
+// With columns: those that the row has, in column order.  Without:
+// every attribute of the sentence.
+
+static void writeJSONRow(struct Exporter *stExporter, struct Sentence *stSentence) {
+   char *szValue;
+   int iNameLen;
+   int iFirst = 1;
+   int i;
+
+   exportWrite(stExporter, "{", 1);
+   if (stExporter->szColumn) {
+      for (i = 0; i < stExporter->iColumns; i++) {
+         if (stExporter->szValue[i] == NULL) continue;
+         if (!iFirst) exportWrite(stExporter, ",", 1);
+         writeJSONString(stExporter, stExporter->szColumn[i], strlen(stExporter->szColumn[i]));
+         exportWrite(stExporter, ":", 1);
+         writeJSONString(stExporter, stExporter->szValue[i], strlen(stExporter->szValue[i]));
+         iFirst = 0;
+      }
+   } else {
+      for (i = 1; i < stSentence->iLength; i++) {
+         if ((iNameLen = splitExportWord(stSentence->szWord[i], &szValue)) == 0) continue;
+         if (!iFirst) exportWrite(stExporter, ",", 1);
+         writeJSONString(stExporter, stSentence->szWord[i] + 1, iNameLen);
+         exportWrite(stExporter, ":", 1);
+         writeJSONString(stExporter, szValue, strlen(szValue));
+         iFirst = 0;
+      }
+   }
+   exportWrite(stExporter, "}\n", 2);
+}
+
+
+// ********************************************************************
+// initializeExporter
+// ********************************************************************
+// START AN EXPORT TO fdOut.
+//
+// szColumns is a NULL terminated list of attribute names to export,
+// or NULL to use the attributes of the first row (CSV, Arrow) or of
+// every row (JSON).  Returns 1, or 0 for an unknown format.
+//
+// IMPORTANT: Use finishExporter to complete the output and free it.
+
+int initializeExporter(struct Exporter *stExporter, int fdOut, int iFormat, char **szColumns) {
+   int iNames = 0;
+
+   memset(stExporter, 0, sizeof(struct Exporter));
+   if ((iFormat != EXPORT_JSON) && (iFormat != EXPORT_CSV) && (iFormat != EXPORT_ARROW)) return (0);
+
+   stExporter->fdOut = fdOut;
+   stExporter->iFormat = iFormat;
+   stExporter->cBuffer = malloc(EXPORT_BUFFER_SIZE);
+   debug_ram += EXPORT_BUFFER_SIZE;
+
+   if (szColumns) {
+      while (szColumns[iNames]) iNames++;
+      setExportColumns(stExporter, szColumns, iNames);
+   }
+
+   return (1);
+}
+
+
+// ********************************************************************
+// exportSentence
+// ********************************************************************
+// EXPORT ONE SENTENCE.
+//
+// Only DATA sentences are rows; !done, !trap and !fatal are skipped.
+
+void exportSentence(struct Exporter *stExporter, struct Sentence *stSentence) {
+   char *szValue;
+   int iNameLen;
+   int iColumn;
+   int i;
+
+   if (stSentence->iReturnValue != DATA) return;
+
+   if ((stExporter->szColumn == NULL) && (stExporter->iFormat != EXPORT_JSON)) setColumnsFromSentence(stExporter, stSentence);
+   if (!stExporter->iStarted) startExport(stExporter);
+
+   if (stExporter->szColumn) {
+      for (i = 0; i < stExporter->iColumns; i++) stExporter->szValue[i] = NULL;
+      for (i = 1; i < stSentence->iLength; i++) {
+         if ((iNameLen = splitExportWord(stSentence->szWord[i], &szValue)) == 0) continue;
+         if ((iColumn = findExportColumn(stExporter, stSentence->szWord[i] + 1, iNameLen)) >= 0) stExporter->szValue[iColumn] = szValue;
+      }
+   }
+
+   if (stExporter->iFormat == EXPORT_JSON) writeJSONRow(stExporter, stSentence);
+   else if (stExporter->iFormat == EXPORT_CSV) writeCSVRow(stExporter);
+   else addArrowRow(stExporter);
+
+   stExporter->lRows++;
+}
+
+
+// ********************************************************************
+// exportBlock
+// ********************************************************************
+// EXPORT EVERY DATA SENTENCE OF A BLOCK.
+
+void exportBlock(struct Exporter *stExporter, struct Block *stBlock) {
+   int i;
+
+   for (i = 0; i < stBlock->iLength; i++) exportSentence(stExporter, stBlock->stSentence[i]);
+}
+
+
+// ********************************************************************
+// exportReply
+// ********************************************************************
+// READ A REPLY FROM THE SOCKET AND EXPORT IT AS IT ARRIVES.
+//
+// Same termination rules as readBlock.  Only one sentence is held in
+// memory at a time, so replies of any size can be exported.  Returns
+// DONE, TRAP (a !trap was received) or FATAL.
+//
+// The reply is complete only if it ends with !done.  If the connection
+// is lost or a !fatal arrives first, FATAL is returned, the exporter is
+// marked truncated and finishExporter returns -1 without completing
+// the output: the caller must discard what was written to fdOut.
+
+int exportReply(struct Exporter *stExporter, int fdSock) {
+   struct Sentence stSentence;
+   int iReturnValue = DONE;
+
+   initializeSentence(&stSentence);
+   do {
+      clearSentence(&stSentence);
+      readSentence(fdSock, &stSentence);
+      if (stSentence.iReturnValue == DATA) exportSentence(stExporter, &stSentence);
+      else if (stSentence.iReturnValue > iReturnValue) iReturnValue = stSentence.iReturnValue;
+   } while ((stSentence.iReturnValue == DATA) || (stSentence.iReturnValue == TRAP));
+   if (stSentence.iReturnValue != DONE) { // cut off before the !done
+      stExporter->iTruncated = 1;
+      iReturnValue = FATAL;
+   }
+   clearSentence(&stSentence);
+
+   return (iReturnValue);
+}
+
+
+// ********************************************************************
+// finishExporter
+// ********************************************************************
+// COMPLETE THE OUTPUT, FLUSH IT AND FREE THE EXPORTER.
+//
+// fdOut is left open.  Returns 0, or -1 if a write failed or the reply
+// was truncated (see exportReply).  A truncated output is not completed
+// (no Arrow footer) and what is still buffered is dropped; discard it.
+
+int finishExporter(struct Exporter *stExporter) {
+   struct ExportColumn *stColumn;
+   int iError;
+   int i;
+
+   if (stExporter->cBuffer == NULL) return (-1);
+
+   if (stExporter->iTruncated) {
+      iError = 1;
+   } else {
+      if (!stExporter->iStarted && (stExporter->iFormat != EXPORT_JSON)) startExport(stExporter);
+      if (stExporter->iFormat == EXPORT_ARROW) {
+         if (stExporter->iBatchRows > 0) writeArrowBatch(stExporter);
+         writeArrowFooter(stExporter);
+      }
+      flushExporter(stExporter);
+      iError = stExporter->iError;
+   }
+
+   for (i = 0; i < stExporter->iColumns; i++) {
+      debug_ram -= strlen(stExporter->szColumn[i]) + 1;
+      free(stExporter->szColumn[i]);
+      if (stExporter->stColumn == NULL) continue;
+      stColumn = &stExporter->stColumn[i];
+      debug_ram -= stColumn->iSize / 8 + stColumn->iSize * sizeof(int) + stColumn->lDataSize;
+      free(stColumn->cValid);
+      free(stColumn->iOffset);
+      free(stColumn->cData);
+   }
+   if (stExporter->szColumn) {
+      debug_ram -= 2 * (stExporter->iColumns + 1) * sizeof(char *);
+      free(stExporter->szColumn);
+      free(stExporter->szValue);
+   }
+   if (stExporter->stColumn) {
+      debug_ram -= (stExporter->iColumns + 1) * sizeof(struct ExportColumn);
+      free(stExporter->stColumn);
+   }
+   debug_ram -= stExporter->iBlockSize * 3 * sizeof(long long);
+   free(stExporter->llBlock);
+   debug_ram -= EXPORT_BUFFER_SIZE;
+   free(stExporter->cBuffer);
+   memset(stExporter, 0, sizeof(struct Exporter));
+
+   return (iError ? -1 : 0);
+}
@@ -0,0 +1,71 @@
+//
+// Mikrotik API 2.0 // Exporters.
+//
+
+#ifndef MK_EXPORT
+#define MK_EXPORT
+
+#include "api.h"
+
+#define EXPORT_JSON  0 // one JSON object per line
+#define EXPORT_CSV   1 // header line, then one line per row
+#define EXPORT_ARROW 2 // Arrow IPC file, every column utf8
+
+#define EXPORT_BUFFER_SIZE (256 * 1024)       // bytes buffered before a write
+#define EXPORT_BATCH_ROWS  65536              // rows per Arrow record batch
+#define EXPORT_BATCH_BYTES (64 * 1024 * 1024) // or fewer if a column gets this big
+
+// struct ExportColumn
+//
+// The rows of one column of the Arrow record batch being built: a
+// validity bitmap, iRows + 1 offsets and the packed value bytes.
+
+struct ExportColumn {
+        unsigned char *cValid;     // bit per row, 1 = has a value
+        int *iOffset;              // start of each value in cData
+        int iSize;                 // rows allocated in cValid/iOffset
+        char *cData;
+        long lDataLen;
+        long lDataSize;
+        long lNulls;               // rows without a value
+};
+
+// struct Exporter
+//
+// Writes rows to fdOut in one format through a write buffer.  CSV and
+// Arrow have a fixed set of columns: the names given to
+// initializeExporter, or else the attributes of the first row.
+// Attributes not in that set are dropped.  JSON lines keep all the
+// attributes of each row unless columns were given.
+//
+// The Arrow output is an IPC file ("Feather v2"): 8 byte aligned
+// buffers that readers can mmap and use without copying.
+
+struct Exporter {
+        int fdOut;                 // where the output goes
+        int iFormat;               // EXPORT_JSON, EXPORT_CSV or EXPORT_ARROW
+        unsigned char *cBuffer;    // write buffer
+        int iBufferLen;            // bytes in cBuffer
+        long long llOffset;        // bytes exported so far (buffered included)
+        int iError;                // a write failed
+        int iTruncated;            // exportReply lost the reply before its !done
+        char **szColumn;           // column names, NULL until known
+        int iColumns;
+        int iLastColumn;           // column of the last value (lookup hint)
+        char **szValue;            // values of the current row, by column
+        int iStarted;              // header or schema written
+        long lRows;                // rows exported
+        struct ExportColumn *stColumn; // arrow: the batch being built
+        int iBatchRows;            // arrow: rows in the batch
+        long long *llBlock;        // arrow: offset, metadata and body length per batch
+        int iBlocks;
+        int iBlockSize;
+};
+
+int initializeExporter(struct Exporter *stExporter, int fdOut, int iFormat, char **szColumns);
+void exportSentence(struct Exporter *stExporter, struct Sentence *stSentence);
+void exportBlock(struct Exporter *stExporter, struct Block *stBlock);
+int exportReply(struct Exporter *stExporter, int fdSock);
+int finishExporter(struct Exporter *stExporter);
+
+#endif // MK_EXPORT
@@ -0,0 +1,221 @@
+//
+// Mikrotik API 2.0 // Table fingerprints.
+//
+// A fingerprint is a 64 bit hash of a normalized table: the DATA
+// sentences of a Block in order, without the attributes that differ
+// between two routers holding the same configuration (.id, counters,
+// dynamic state).  Two tables with equal fingerprints can be treated as
+// identical, so a sync phase can be skipped without comparing rows, and
+// a fleet drift check only needs one stored number per router and table.
+//
+// The hash runs four independent 64 bit lanes over 32 byte stripes
+// (the xxHash64 construction), so the multiplies of the lanes overlap
+// and the compiler may put them in vector registers.  The input is read
+// byte by byte into the lanes, so the result is the same on little and
+// big endian hosts.
+//
+
+#include <string.h>
+
+#include "api.h"
+#include "fingerprint.h"
+
+#define FP_P1 0x9E3779B185EBCA87ULL
+#define FP_P2 0xC2B2AE3D27D4EB4FULL
+#define FP_P3 0x165667B19E3779F9ULL
+#define FP_P4 0x85EBCA77C2B2AE63ULL
+#define FP_P5 0x27D4EB2F165667C5ULL
+
+#define FP_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+struct FingerprintState {
+        unsigned long long lAcc[4];  // the four lanes
+        unsigned char cBuffer[32];   // partial stripe
+        int iBuffered;               // bytes in cBuffer
+        unsigned long long lTotal;   // bytes hashed
+};
+
+
+// ********************************************************************
+// fingerprintLoad
+// ********************************************************************
+// READ 8 BYTES AS A LITTLE ENDIAN 64 BIT VALUE.
+
+static unsigned long long fingerprintLoad(const unsigned char *p) {
+   return ((unsigned long long)p[0]) | ((unsigned long long)p[1] << 8) |
+          ((unsigned long long)p[2] << 16) | ((unsigned long long)p[3] << 24) |
+          ((unsigned long long)p[4] << 32) | ((unsigned long long)p[5] << 40) |
+          ((unsigned long long)p[6] << 48) | ((unsigned long long)p[7] << 56);
+}
+
+
+// ********************************************************************
+// fingerprintStripe
+// ********************************************************************
+// MIX ONE 32 BYTE STRIPE INTO THE FOUR LANES.
+
+static void fingerprintStripe(unsigned long long *lAcc, const unsigned char *p) {
+   int i;
+
+   for (i = 0; i < 4; i++) {
+      lAcc[i] += fingerprintLoad(p + 8 * i) * FP_P2;
+      lAcc[i] = FP_ROTL(lAcc[i], 31);
+      lAcc[i] *= FP_P1;
+   }
+}
+
+
+// ********************************************************************
+// fingerprintInit
+// ********************************************************************
+
+static void fingerprintInit(struct FingerprintState *stState) {
+   stState->lAcc[0] = FP_P1 + FP_P2;
+   stState->lAcc[1] = FP_P2;
+   stState->lAcc[2] = 0;
+   stState->lAcc[3] = 0 - FP_P1;
+   stState->iBuffered = 0;
+   stState->lTotal = 0;
+}
+
+
+// ********************************************************************
+// fingerprintUpdate
+// ********************************************************************
+// HASH iLen MORE BYTES.
+
+static void fingerprintUpdate(struct FingerprintState *stState, const unsigned char *p, int iLen) {
+   int n;
+
+   stState->lTotal += iLen;
+
+   if (stState->iBuffered) { // complete the partial stripe first.
+      n = 32 - stState->iBuffered;
+      if (n > iLen) n = iLen;
+      memcpy(stState->cBuffer + stState->iBuffered, p, n);
+      stState->iBuffered += n;
+      p += n;
+      iLen -= n;
+      if (stState->iBuffered < 32) return;
+      fingerprintStripe(stState->lAcc, stState->cBuffer);
+      stState->iBuffered = 0;
+   }
+
+   for (; iLen >= 32; p += 32, iLen -= 32) fingerprintStripe(stState->lAcc, p);
+
+   memcpy(stState->cBuffer, p, iLen);
+   stState->iBuffered = iLen;
+}
+
+
+// ********************************************************************
+// fingerprintFinal
+// ********************************************************************
+// MERGE THE LANES AND THE TAIL INTO THE FINAL 64 BIT VALUE.
+
+static unsigned long long fingerprintFinal(struct FingerprintState *stState) {
+   unsigned long long lHash;
+   unsigned long long lLane;
+   int i;
+
+   lHash = FP_ROTL(stState->lAcc[0], 1) + FP_ROTL(stState->lAcc[1], 7) +
+           FP_ROTL(stState->lAcc[2], 12) + FP_ROTL(stState->lAcc[3], 18);
+   for (i = 0; i < 4; i++) {
+      lLane = FP_ROTL(stState->lAcc[i] * FP_P2, 31) * FP_P1;
+      lHash = (lHash ^ lLane) * FP_P1 + FP_P4;
+   }
+   lHash += stState->lTotal;
+
+   for (i = 0; i < stState->iBuffered; i++) {
+      lHash ^= stState->cBuffer[i] * FP_P5;
+      lHash = FP_ROTL(lHash, 11) * FP_P1;
+   }
+
+   lHash ^= lHash >> 33;
+   lHash *= FP_P2;
+   lHash ^= lHash >> 29;
+   lHash *= FP_P3;
+   lHash ^= lHash >> 32;
+
+   return (lHash);
+}
+
+
+// ********************************************************************
+// isVolatileWord
+// ********************************************************************
+// RETURN 1 FOR ATTRIBUTES LEFT OUT OF THE NORMALIZED TABLE.
+//
+// Same list mkclone strips before adding a rule to the target.
+
+static int isVolatileWord(char *szWord) {
+   if (strncmp(szWord, "=.id=", 5) == 0) return (1);
+   if (strncmp(szWord, "=bytes=", 7) == 0) return (1);
+   if (strncmp(szWord, "=packets=", 9) == 0) return (1);
+   if (strncmp(szWord, "=invalid=", 9) == 0) return (1);
+   if (strncmp(szWord, "=dynamic=", 9) == 0) return (1);
+   if (strncmp(szWord, "=creation-time=", 15) == 0) return (1);
+   if (strncmp(szWord, ".tag=", 5) == 0) return (1);
+   return (0);
+}
+
+
+// ********************************************************************
+// fingerprintRow
+// ********************************************************************
+// HASH THE NORMALIZED WORDS OF A SENTENCE.
+//
+// Each word is followed by a NULL and the sentence by one more NULL, so
+// moving a word between sentences changes the result.
+
+static void fingerprintRow(struct FingerprintState *stState, struct Sentence *stSentence) {
+   int j;
+
+   for (j = 1; j < stSentence->iLength; j++) { // skip !re
+      if (isVolatileWord(stSentence->szWord[j])) continue;
+      fingerprintUpdate(stState, (unsigned char *)stSentence->szWord[j], strlen(stSentence->szWord[j]) + 1);
+   }
+   fingerprintUpdate(stState, (unsigned char *)"", 1);
+}
+
+
+// ********************************************************************
+// fingerprintBlock
+// ********************************************************************
+// RETURN THE ORDER SENSITIVE FINGERPRINT OF A TABLE.
+//
+// Hashes the DATA sentences of the block in order, leaving out the
+// volatile attributes and the sentences i where cSkip[i] is set (cSkip
+// may be NULL).
+
+unsigned long long fingerprintBlock(struct Block *stBlock, char *cSkip) {
+   struct FingerprintState stState;
+   int i;
+
+   fingerprintInit(&stState);
+
+   for (i = 0; i < stBlock->iLength; i++) {
+      if ((stBlock->stSentence[i]->iReturnValue != DATA) || (cSkip && cSkip[i])) continue;
+      fingerprintRow(&stState, stBlock->stSentence[i]);
+   }
+
+   return (fingerprintFinal(&stState));
+}
+
+
+// ********************************************************************
+// fingerprintSentence
+// ********************************************************************
+// RETURN THE FINGERPRINT OF ONE ROW.
+//
+// Normalized as by fingerprintBlock, so two rows holding the same rule
+// on different routers get the same value.  Use it to match rows by
+// content.
+
+unsigned long long fingerprintSentence(struct Sentence *stSentence) {
+   struct FingerprintState stState;
+
+   fingerprintInit(&stState);
+   fingerprintRow(&stState, stSentence);
+   return (fingerprintFinal(&stState));
+}
@@ -0,0 +1,13 @@
+//
+// Mikrotik API 2.0 // Table fingerprints.
+//
+
+#ifndef MK_FINGERPRINT
+#define MK_FINGERPRINT
+
+#include "api.h"
+
+unsigned long long fingerprintBlock(struct Block *stBlock, char *cSkip);
+unsigned long long fingerprintSentence(struct Sentence *stSentence);
+
+#endif // MK_FINGERPRINT
@@ -0,0 +1,478 @@
+//
+// Mikrotik API 2.0 // Fleet executor.
+//
+// Runs one command sequence against many routers at once.  Routers
+// that answer in milliseconds and routers that take half a minute to
+// print a big table share the same workers: jobs are broken into
+// tasks at every wait, and the waits themselves are parked on one
+// poll loop instead of blocking a thread each.
+//
+//    struct Fleet stFleet;
+//    char *szWords[] = { "/ip/route/print", NULL };
+//
+//    initializeFleet(&stFleet, NULL);
+//    for (...) fleetAddRouter(&stFleet, szIPaddr, 8728, "admin", "");
+//    fleetAddCommand(&stFleet, szWords);
+//    fleetRun(&stFleet, onRoutes, NULL);   // onRoutes runs on the workers
+//    clearFleet(&stFleet);
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "api.h"
+#include "wire.h"
+#include "decoder.h"
+#include "threadpool.h"
+#include "trace.h"
+#include "fleet.h"
+
+static void onFleetSentence(struct Sentence *stSentence, void *pData);
+
+
+// ********************************************************************
+// fleetNow
+// ********************************************************************
+// RETURN THE MONOTONIC CLOCK IN MILLISECONDS.
+
+static long long fleetNow(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ((long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+
+// ********************************************************************
+// initializeFleet
+// ********************************************************************
+// INITIALIZE AN EMPTY FLEET WHOSE JOBS RUN ON stPool.
+//
+// stPool NULL uses sharedThreadPool().
+//
+// IMPORTANT: Use clearFleet when finished with it.
+
+void initializeFleet(struct Fleet *stFleet, struct ThreadPool *stPool) {
+   memset(stFleet, 0, sizeof(struct Fleet));
+   stFleet->stPool = stPool;
+   atomic_init(&stFleet->stParking, NULL);
+   atomic_init(&stFleet->iRunning, 0);
+}
+
+
+// ********************************************************************
+// clearFleet
+// ********************************************************************
+// FREE ALL MEMORY OF A FLEET.
+
+void clearFleet(struct Fleet *stFleet) {
+   struct FleetJob *stJob;
+   int i;
+
+   for (i = 0; i < stFleet->iJobs; i++) {
+      stJob = &stFleet->stJob[i];
+      if (stJob->fdSock) apiDisconnect(stJob->fdSock);
+      clearDecoder(&stJob->stDecoder);
+      clearBlock(&stJob->stReply);
+      debug_ram -= strlen(stJob->szUsername) + strlen(stJob->szPassword) + 2;
+      free(stJob->szUsername);
+      free(stJob->szPassword);
+   }
+   debug_ram -= stFleet->iJobs * sizeof(struct FleetJob);
+   free(stFleet->stJob);
+
+   for (i = 0; i < stFleet->iCommands; i++) {
+      debug_ram -= stFleet->iCommandLen[i];
+      free(stFleet->cCommand[i]);
+   }
+   debug_ram -= stFleet->iCommands * (sizeof(unsigned char *) + sizeof(int));
+   free(stFleet->cCommand);
+   free(stFleet->iCommandLen);
+
+   initializeFleet(stFleet, stFleet->stPool);
+}
+
+
+// ********************************************************************
+// fleetAddRouter
+// ********************************************************************
+// ADD A ROUTER TO RUN THE COMMANDS ON.  RETURN ITS JOB INDEX.
+//
+// Nothing is connected until fleetRun.
+
+int fleetAddRouter(struct Fleet *stFleet, char *szIPaddr, int iPort, char *szUsername, char *szPassword) {
+   struct FleetJob *stJob;
+
+   stFleet->stJob = realloc(stFleet->stJob, (stFleet->iJobs + 1) * sizeof(struct FleetJob));
+   debug_ram += sizeof(struct FleetJob);
+   stJob = &stFleet->stJob[stFleet->iJobs];
+   memset(stJob, 0, sizeof(struct FleetJob));
+
+   snprintf(stJob->szIPaddr, sizeof(stJob->szIPaddr), "%s", szIPaddr);
+   stJob->iPort = iPort;
+   stJob->szUsername = strdup(szUsername);
+   stJob->szPassword = strdup(szPassword);
+   debug_ram += strlen(szUsername) + strlen(szPassword) + 2;
+   initializeDecoder(&stJob->stDecoder, onFleetSentence, stJob);
+   initializeBlock(&stJob->stReply);
+
+   return (stFleet->iJobs++);
+}
+
+
+// ********************************************************************
+// fleetAddCommand
+// ********************************************************************
+// APPEND A COMMAND (NULL TERMINATED WORDS) TO THE SEQUENCE.
+//
+// The sentence is encoded once here and sent as is to every router.
+
+void fleetAddCommand(struct Fleet *stFleet, char **szWords) {
+   unsigned char *cCommand;
+   int iLen = 1; // final empty word
+   int iCommandLen = 0;
+   int i;
+
+   for (i = 0; szWords[i] != NULL; i++) iLen += strlen(szWords[i]) + WIRE_MAX_LEN_SIZE;
+   cCommand = malloc(iLen);
+   for (i = 0; szWords[i] != NULL; i++) {
+      iCommandLen += wireEncodeWord(szWords[i], strlen(szWords[i]), cCommand + iCommandLen);
+   }
+   cCommand[iCommandLen++] = 0;
+   cCommand = realloc(cCommand, iCommandLen);
+   debug_ram += iCommandLen;
+
+   i = stFleet->iCommands++;
+   stFleet->cCommand = realloc(stFleet->cCommand, stFleet->iCommands * sizeof(unsigned char *));
+   stFleet->iCommandLen = realloc(stFleet->iCommandLen, stFleet->iCommands * sizeof(int));
+   debug_ram += sizeof(unsigned char *) + sizeof(int);
+   stFleet->cCommand[i] = cCommand;
+   stFleet->iCommandLen[i] = iCommandLen;
+}
+
+
+// ********************************************************************
+// wakeFleet
+// ********************************************************************
+// WAKE THE POLL LOOP OF fleetRun.
+
+static void wakeFleet(struct Fleet *stFleet) {
+   if (write(stFleet->fdWake[1], "", 1) < 0) {
+      // pipe full: the loop has wake-ups pending anyway
+   }
+}
+
+
+// ********************************************************************
+// endJob
+// ********************************************************************
+// FINISH A JOB WITH iResult AND CLOSE ITS CONNECTION.
+
+static void endJob(struct FleetJob *stJob, int iResult) {
+   struct Fleet *stFleet = stJob->stFleet;
+
+   if (stJob->fdSock) apiDisconnect(stJob->fdSock);
+   stJob->fdSock = 0;
+   clearBlock(&stJob->stReply);
+   initializeBlock(&stJob->stReply);
+   stJob->llEnd = fleetNow();
+   stJob->iResult = iResult;
+   TRACE_SPAN(stJob->llStart * 1000, "fleetJob", 0, stJob->szIPaddr); // same clock, in us
+
+   atomic_fetch_sub(&stFleet->iRunning, 1);
+   wakeFleet(stFleet);
+}
+
+
+// ********************************************************************
+// parkJob
+// ********************************************************************
+// HAND THE SOCKET OF A JOB WAITING FOR A REPLY TO THE POLL LOOP.
+//
+// Lock-free push; only a push onto an empty stack wakes the loop.
+
+static void parkJob(struct FleetJob *stJob) {
+   struct Fleet *stFleet = stJob->stFleet;
+   struct FleetJob *stOld = atomic_load(&stFleet->stParking);
+
+   do {
+      stJob->stNext = stOld;
+   } while (!atomic_compare_exchange_weak(&stFleet->stParking, &stOld, stJob));
+   if (stOld == NULL) wakeFleet(stFleet);
+}
+
+
+// ********************************************************************
+// sendCommand
+// ********************************************************************
+// SEND THE CURRENT COMMAND OF A JOB AND PARK IT UNTIL THE REPLY.
+
+static void sendCommand(struct FleetJob *stJob) {
+   struct Fleet *stFleet = stJob->stFleet;
+   unsigned char *cCommand = stFleet->cCommand[stJob->iCommand];
+   int iLen = stFleet->iCommandLen[stJob->iCommand];
+   int iSent = 0;
+   int iWritten;
+
+   while (iSent < iLen) {
+      iWritten = apiWrite(stJob->fdSock, cCommand + iSent, iLen - iSent);
+      if (iWritten <= 0) {
+         if ((iWritten < 0) && (errno == EINTR)) continue;
+         endJob(stJob, FATAL);
+         return;
+      }
+      iSent += iWritten;
+   }
+
+   stJob->iReplyDone = 0;
+   parkJob(stJob);
+}
+
+
+// ********************************************************************
+// loginJob
+// ********************************************************************
+// TASK: SEND /login ON A CONNECTED SOCKET AND PARK UNTIL THE REPLY.
+
+static void loginJob(void *pArg) {
+   struct FleetJob *stJob = pArg;
+   struct Sentence stLogin;
+
+   stJob->iStage = FLEET_LOGIN;
+   initializeSentence(&stLogin);
+   addWordToSentence(&stLogin, "/login");
+   addWordToSentence(&stLogin, "=name=");
+   addPartWordToSentence(&stLogin, stJob->szUsername);
+   addWordToSentence(&stLogin, "=password=");
+   addPartWordToSentence(&stLogin, stJob->szPassword);
+   writeSentence(stJob->fdSock, &stLogin); // a failed write shows up as a closed socket.
+   clearSentence(&stLogin);
+
+   stJob->iReplyDone = 0;
+   parkJob(stJob);
+}
+
+
+// ********************************************************************
+// connectJob
+// ********************************************************************
+// TASK: START A NON-BLOCKING CONNECT AND PARK UNTIL IT IS DONE.
+//
+// The poll loop of fleetRun finishes the connect, then queues
+// loginJob.  No worker waits for a slow or dead router.
+
+static void connectJob(void *pArg) {
+   struct FleetJob *stJob = pArg;
+   int fdSock;
+
+   stJob->llStart = fleetNow();
+   stJob->iStage = FLEET_CONNECTING;
+   stJob->stAddress.sin_family = AF_INET;
+   stJob->stAddress.sin_addr.s_addr = inet_addr(stJob->szIPaddr);
+   stJob->stAddress.sin_port = htons(stJob->iPort);
+
+   if ((fdSock = socket(AF_INET, SOCK_STREAM, 0)) <= 0) {
+      endJob(stJob, FATAL);
+      return;
+   }
+   stJob->fdSock = fdSock;
+   fcntl(fdSock, F_SETFL, fcntl(fdSock, F_GETFL) | O_NONBLOCK);
+
+   if (connect(fdSock, (struct sockaddr *)&stJob->stAddress, sizeof(stJob->stAddress)) == 0) {
+      fcntl(fdSock, F_SETFL, fcntl(fdSock, F_GETFL) & ~O_NONBLOCK);
+      loginJob(stJob);
+   } else if (errno == EINPROGRESS) {
+      parkJob(stJob);
+   } else {
+      endJob(stJob, FATAL);
+   }
+}
+
+
+// ********************************************************************
+// connectDone
+// ********************************************************************
+// FINISH THE CONNECT OF A PARKED JOB WHOSE SOCKET IS WRITABLE.
+//
+// Returns 1 when connected, 0 if the connect failed and -1 if it is
+// still in progress.  The socket is made blocking again: from here on
+// it is only read once poll says so, and the small commands are
+// written whole.
+
+static int connectDone(struct FleetJob *stJob) {
+   // a second connect tells how the first one went, without waiting.
+   if ((connect(stJob->fdSock, (struct sockaddr *)&stJob->stAddress, sizeof(stJob->stAddress)) != 0) && (errno != EISCONN)) {
+      if ((errno == EINPROGRESS) || (errno == EALREADY) || (errno == EINTR)) return (-1);
+      return (0);
+   }
+   fcntl(stJob->fdSock, F_SETFL, fcntl(stJob->fdSock, F_GETFL) & ~O_NONBLOCK);
+   return (1);
+}
+
+
+// ********************************************************************
+// replyJob
+// ********************************************************************
+// TASK: POST-PROCESS A COMPLETE REPLY, THEN SEND THE NEXT COMMAND.
+//
+// A reply is only complete if it ends with !done.  Anything else (an
+// empty or truncated reply, !fatal) means the connection failed, and
+// onReply never sees it.  A /login reply goes on to the first command.
+
+static void replyJob(void *pArg) {
+   struct FleetJob *stJob = pArg;
+   struct Fleet *stFleet = stJob->stFleet;
+   struct Block *stReply = &stJob->stReply;
+   int iContinue = 1;
+   int iLogin;
+
+   if ((stReply->iLength == 0) || (stReply->stSentence[stReply->iLength - 1]->iReturnValue != DONE)) {
+      endJob(stJob, FATAL);
+      return;
+   }
+
+   if (stJob->iStage == FLEET_LOGIN) { // a !trap before the !done: bad login.
+      iLogin = (stReply->stSentence[0]->iReturnValue == DONE);
+      clearBlock(stReply);
+      initializeBlock(stReply);
+      stJob->iStage = FLEET_COMMAND;
+      if (!iLogin) endJob(stJob, FATAL);
+      else if (stFleet->iCommands == 0) endJob(stJob, DONE);
+      else sendCommand(stJob);
+      return;
+   }
+
+   if (stFleet->onReply) iContinue = stFleet->onReply(stJob, stJob->iCommand, stReply, stFleet->pData);
+   clearBlock(stReply);
+   initializeBlock(stReply);
+
+   if (!iContinue) endJob(stJob, FLEET_STOPPED);
+   else if (++stJob->iCommand < stFleet->iCommands) sendCommand(stJob);
+   else endJob(stJob, DONE);
+}
+
+
+// ********************************************************************
+// onFleetSentence
+// ********************************************************************
+// DECODER CALLBACK: ADD A SENTENCE TO THE REPLY OF A PARKED JOB.
+
+static void onFleetSentence(struct Sentence *stSentence, void *pData) {
+   struct FleetJob *stJob = pData;
+
+   addSentenceToBlock(&stJob->stReply, stSentence); // the Block owns the words now
+   if ((stSentence->iReturnValue == DONE) || (stSentence->iReturnValue == FATAL)) stJob->iReplyDone = 1;
+}
+
+
+// ********************************************************************
+// fleetRun
+// ********************************************************************
+// RUN THE COMMAND SEQUENCE ON EVERY ROUTER AND WAIT UNTIL ALL ARE DONE.
+//
+// onReply(stJob, iCommand, stReply, pData) gets each complete reply on
+// a pool worker and may take its time; return 0 from it to skip the
+// rest of the sequence for that router.  It must not keep stReply.
+// The calling thread polls the parked sockets meanwhile.  Returns the
+// number of jobs that ran every command; see iResult of each job for
+// the rest.
+
+int fleetRun(struct Fleet *stFleet, int (*onReply)(struct FleetJob *, int, struct Block *, void *), void *pData) {
+   struct ThreadPool *stPool = stFleet->stPool ? stFleet->stPool : sharedThreadPool();
+   struct TaskGroup stGroup = { 0 };
+   struct FleetJob **stParked;
+   struct FleetJob *stJob;
+   struct FleetJob *stNext;
+   struct pollfd *stPoll;
+   char cDrain[64];
+   int iParked = 0;
+   int iDone = 0;
+   int iRead;
+   int i;
+
+   if (stFleet->iJobs == 0) return (0);
+   if (pipe(stFleet->fdWake) != 0) return (0);
+   for (i = 0; i < 2; i++) fcntl(stFleet->fdWake[i], F_SETFL, fcntl(stFleet->fdWake[i], F_GETFL) | O_NONBLOCK);
+
+   stFleet->onReply = onReply;
+   stFleet->pData = pData;
+   stParked = malloc(stFleet->iJobs * sizeof(struct FleetJob *));
+   stPoll = malloc((stFleet->iJobs + 1) * sizeof(struct pollfd));
+   debug_ram += stFleet->iJobs * sizeof(struct FleetJob *) + (stFleet->iJobs + 1) * sizeof(struct pollfd);
+
+   atomic_store(&stFleet->iRunning, stFleet->iJobs);
+   for (i = 0; i < stFleet->iJobs; i++) {
+      stJob = &stFleet->stJob[i];
+      clearDecoder(&stJob->stDecoder); // drop what a previous run left behind
+      initializeDecoder(&stJob->stDecoder, onFleetSentence, stJob);
+      stJob->stFleet = stFleet;
+      stJob->iCommand = 0;
+      stJob->iResult = FLEET_RUNNING;
+      stJob->llStart = stJob->llEnd = 0;
+      threadPoolSubmit(stPool, &stGroup, connectJob, stJob);
+   }
+
+   while (atomic_load(&stFleet->iRunning) > 0) {
+      stPoll[0].fd = stFleet->fdWake[0];
+      stPoll[0].events = POLLIN;
+      stPoll[0].revents = 0;
+      for (i = 0; i < iParked; i++) {
+         stPoll[i + 1].fd = stParked[i]->fdSock;
+         stPoll[i + 1].events = (stParked[i]->iStage == FLEET_CONNECTING) ? POLLOUT : POLLIN;
+         stPoll[i + 1].revents = 0;
+      }
+      if ((poll(stPoll, iParked + 1, -1) < 0) && (errno != EINTR)) break;
+
+      if (stPoll[0].revents) {
+         while (read(stFleet->fdWake[0], cDrain, sizeof(cDrain)) > 0);
+      }
+
+      // back to front, so the swap below only moves polled entries already seen.
+      for (i = iParked - 1; i >= 0; i--) {
+         if (stPoll[i + 1].revents == 0) continue;
+         stJob = stParked[i];
+
+         if (stJob->iStage == FLEET_CONNECTING) {
+            if ((iRead = connectDone(stJob)) < 0) continue;
+            stParked[i] = stParked[--iParked];
+            if (iRead) threadPoolSubmit(stPool, &stGroup, loginJob, stJob);
+            else endJob(stJob, FATAL);
+            continue;
+         }
+
+         iRead = decoderRead(&stJob->stDecoder, stJob->fdSock);
+         if ((iRead == 0) || ((iRead < 0) && (errno != EAGAIN) && (errno != EINTR))) stJob->iReplyDone = 1;
+         if (!stJob->iReplyDone) continue;
+
+         stParked[i] = stParked[--iParked];
+         threadPoolSubmit(stPool, &stGroup, replyJob, stJob);
+      }
+
+      for (stJob = atomic_exchange(&stFleet->stParking, NULL); stJob; stJob = stNext) {
+         stNext = stJob->stNext;
+         stParked[iParked++] = stJob;
+      }
+   }
+
+   threadPoolWait(stPool, &stGroup); // the last endJob may still be returning
+
+   debug_ram -= stFleet->iJobs * sizeof(struct FleetJob *) + (stFleet->iJobs + 1) * sizeof(struct pollfd);
+   free(stParked);
+   free(stPoll);
+   close(stFleet->fdWake[0]);
+   close(stFleet->fdWake[1]);
+
+   for (i = 0; i < stFleet->iJobs; i++) {
+      if (stFleet->stJob[i].iResult == DONE) iDone++;
+   }
+   return (iDone);
+}
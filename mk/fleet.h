@@ -0,0 +1,83 @@
+//
+// Mikrotik API 2.0 // Fleet executor.
+//
+
+#ifndef MK_FLEET
+#define MK_FLEET
+
+#include <netinet/in.h>
+
+#include "api.h"
+#include "decoder.h"
+#include "threadpool.h"
+
+#define FLEET_RUNNING 0    // job not finished yet
+#define FLEET_STOPPED TRAP // onReply asked to stop before the last command
+
+#define FLEET_CONNECTING 0 // non-blocking connect in progress
+#define FLEET_LOGIN      1 // waiting for the /login reply
+#define FLEET_COMMAND    2 // running the command sequence
+
+struct Fleet;
+
+// struct FleetJob
+//
+// One router of a Fleet and the state of its job: connect, login, run
+// the command sequence, post-process every reply.  iResult is
+// FLEET_RUNNING until the job ends, then DONE (every command ran),
+// FLEET_STOPPED or FATAL (connect, login or the connection failed; no
+// more onReply calls).  A reply only counts as complete when its last
+// sentence is !done; a connection that closes or fails before that
+// ends the job with FATAL.  llStart / llEnd time the job in ms.
+
+struct FleetJob {
+        char szIPaddr[64];
+        int iPort;
+        char *szUsername;
+        char *szPassword;
+        int fdSock;                // 0 while not connected
+        struct sockaddr_in stAddress; // router, to finish the connect
+        int iStage;                // FLEET_CONNECTING, FLEET_LOGIN or FLEET_COMMAND
+        int iCommand;              // command running or last run
+        int iResult;               // FLEET_RUNNING, DONE, FLEET_STOPPED or FATAL
+        struct Decoder stDecoder;  // decodes replies while the job is parked
+        struct Block stReply;      // reply being received
+        int iReplyDone;            // stReply ended (!done, !fatal or connection lost)
+        long long llStart;
+        long long llEnd;
+        struct FleetJob *stNext;   // parking stack
+        struct Fleet *stFleet;
+};
+
+// struct Fleet
+//
+// Runs the same command sequence against many routers.  The CPU side
+// of each job (starting the connect, sending, the onReply post-
+// processing) runs as tasks on a work-stealing ThreadPool, so a worker
+// that is done with fast routers steals the post-processing queued on
+// busy ones.  While a job waits for its connect, its login or a reply
+// it holds no worker: its socket is parked with the thread in
+// fleetRun, which polls all parked sockets and queues the job again
+// once the connect or the reply is complete.
+
+struct Fleet {
+        struct ThreadPool *stPool; // NULL = sharedThreadPool()
+        struct FleetJob *stJob;
+        int iJobs;
+        unsigned char **cCommand;  // encoded sentences
+        int *iCommandLen;
+        int iCommands;
+        int (*onReply)(struct FleetJob *stJob, int iCommand, struct Block *stReply, void *pData);
+        void *pData;
+        int fdWake[2];             // wakes fleetRun when a job parks or ends
+        struct FleetJob *_Atomic stParking; // jobs handing over their socket
+        _Atomic int iRunning;      // jobs not finished
+};
+
+void initializeFleet(struct Fleet *stFleet, struct ThreadPool *stPool);
+void clearFleet(struct Fleet *stFleet);
+int fleetAddRouter(struct Fleet *stFleet, char *szIPaddr, int iPort, char *szUsername, char *szPassword);
+void fleetAddCommand(struct Fleet *stFleet, char **szWords);
+int fleetRun(struct Fleet *stFleet, int (*onReply)(struct FleetJob *, int, struct Block *, void *), void *pData);
+
+#endif // MK_FLEET
@@ -0,0 +1,435 @@
+//
+// Mikrotik API 2.0 // Parallel Block algorithms.
+//
+// Map, filter and sort over the sentences of a Block on the shared
+// thread pool.  The rows are cut into contiguous ranges, a few per
+// worker so stealing can even out uneven rows, and each range is one
+// task.  Blocks smaller than PARALLEL_MIN_ROWS are done on the calling
+// thread without starting the pool.
+//
+// The callbacks run on several threads at once.  They may change the
+// sentence they are given but nothing shared without their own locks,
+// and they must not add words to spilled sentences (see struct Block).
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "api.h"
+#include "parallel.h"
+#include "threadpool.h"
+
+// one task: rows iFirst to iLast - 1 of the job pJob.
+struct RowRange {
+        int iFirst;
+        int iLast;
+        void *pJob;
+};
+
+struct MapJob {
+        struct Block *stBlock;
+        void (*map)(struct Sentence *, int, void *);
+        void *pData;
+};
+
+struct FilterJob {
+        struct Block *stBlock;
+        int (*keep)(struct Sentence *, void *);
+        void *pData;
+        char *cKeep;               // 1 per row that stays
+};
+
+// sort key of one row.  iIndex (the original row) breaks ties so the
+// sort is stable.
+struct SortKey {
+        char *szValue;             // value of the key, NULL if missing
+        double dValue;             // numeric sort: parsed value
+        int iIndex;                // row in the block before sorting
+};
+
+struct SortJob {
+        struct Block *stBlock;
+        char *szPrefix;            // "=key="
+        int iPrefixLen;
+        int iNumeric;
+        struct SortKey *stKey;
+        struct SortKey *stTemp;    // merge buffer
+        int (*compare)(const void *, const void *);
+};
+
+// one merge: rows iFirst..iMid-1 and iMid..iLast-1 of stFrom into stTo.
+struct MergeRange {
+        struct SortKey *stFrom;
+        struct SortKey *stTo;
+        int iFirst;
+        int iMid;
+        int iLast;
+        int (*compare)(const void *, const void *);
+};
+
+
+// ********************************************************************
+// rangeRows
+// ********************************************************************
+// RETURN THE NUMBER OF ROWS PER TASK FOR A BLOCK OF iRows ROWS.
+//
+// Aim for four ranges per worker, never less than PARALLEL_MIN_ROWS.
+
+static int rangeRows(struct ThreadPool *stPool, int iRows) {
+   int iTasks = stPool ? stPool->iQueues * 4 : 1;
+   int iPerTask = (iRows + iTasks - 1) / iTasks;
+
+   return (iPerTask < PARALLEL_MIN_ROWS ? PARALLEL_MIN_ROWS : iPerTask);
+}
+
+
+// ********************************************************************
+// runRanges
+// ********************************************************************
+// RUN run(RowRange) OVER ROWS 0 TO iRows - 1 AND WAIT FOR ALL RANGES.
+//
+// iPerTask is the range size, 0 to pick one with rangeRows.
+
+static void runRanges(int iRows, int iPerTask, void (*run)(void *), void *pJob) {
+   struct ThreadPool *stPool;
+   struct TaskGroup stGroup;
+   struct RowRange *stRange;
+   struct RowRange stAll;
+   int iRanges;
+   int i;
+
+   if (iRows <= 0) return;
+
+   if (iRows <= PARALLEL_MIN_ROWS) { // not worth a thread
+      stAll.iFirst = 0;
+      stAll.iLast = iRows;
+      stAll.pJob = pJob;
+      run(&stAll);
+      return;
+   }
+
+   stPool = sharedThreadPool();
+   if (iPerTask <= 0) iPerTask = rangeRows(stPool, iRows);
+   iRanges = (iRows + iPerTask - 1) / iPerTask;
+
+   stRange = malloc(iRanges * sizeof(struct RowRange));
+   debug_ram += iRanges * sizeof(struct RowRange);
+   stGroup.iPending = 0;
+   for (i = 0; i < iRanges; i++) {
+      stRange[i].iFirst = i * iPerTask;
+      stRange[i].iLast = (i == iRanges - 1) ? iRows : (i + 1) * iPerTask;
+      stRange[i].pJob = pJob;
+      threadPoolSubmit(stPool, &stGroup, run, &stRange[i]);
+   }
+   threadPoolWait(stPool, &stGroup);
+
+   debug_ram -= iRanges * sizeof(struct RowRange);
+   free(stRange);
+}
+
+
+// ********************************************************************
+// mapRange
+// ********************************************************************
+// CALL THE MAP FUNCTION ON EVERY ROW OF A RANGE.
+
+static void mapRange(void *pArg) {
+   struct RowRange *stRange = pArg;
+   struct MapJob *stJob = stRange->pJob;
+   int i;
+
+   for (i = stRange->iFirst; i < stRange->iLast; i++) {
+      stJob->map(stJob->stBlock->stSentence[i], i, stJob->pData);
+   }
+}
+
+
+// ********************************************************************
+// parallelMap
+// ********************************************************************
+// CALL map(SENTENCE, ROW, pData) FOR EVERY SENTENCE OF A BLOCK.
+//
+// The calls are spread over the shared thread pool, in no particular
+// order.  Returns when all of them have finished.
+
+void parallelMap(struct Block *stBlock, void (*map)(struct Sentence *stSentence, int iIndex, void *pData), void *pData) {
+   struct MapJob stJob;
+
+   stJob.stBlock = stBlock;
+   stJob.map = map;
+   stJob.pData = pData;
+   runRanges(stBlock->iLength, 0, mapRange, &stJob);
+}
+
+
+// ********************************************************************
+// filterRange
+// ********************************************************************
+// EVALUATE THE FILTER PREDICATE ON EVERY ROW OF A RANGE.
+
+static void filterRange(void *pArg) {
+   struct RowRange *stRange = pArg;
+   struct FilterJob *stJob = stRange->pJob;
+   int i;
+
+   for (i = stRange->iFirst; i < stRange->iLast; i++) {
+      stJob->cKeep[i] = stJob->keep(stJob->stBlock->stSentence[i], stJob->pData) ? 1 : 0;
+   }
+}
+
+
+// ********************************************************************
+// freeBlockSentence
+// ********************************************************************
+// FREE ONE SENTENCE OF A BLOCK, THE WAY clearBlock DOES.
+
+static void freeBlockSentence(struct Block *stBlock, struct Sentence *stSentence) {
+   if (stBlock->cMap && (stSentence->iLength > 0) &&
+       (stSentence->szWord[0] >= stBlock->cMap) && (stSentence->szWord[0] < stBlock->cMap + stBlock->lMapSize)) {
+      debug_ram -= (sizeof(char *) * stSentence->iLength);
+      free(stSentence->szWord); // words are in the spill mapping
+   } else {
+      clearSentence(stSentence);
+   }
+   debug_ram -= sizeof(struct Sentence);
+   free(stSentence);
+}
+
+
+// ********************************************************************
+// parallelFilter
+// ********************************************************************
+// KEEP ONLY THE SENTENCES FOR WHICH keep(SENTENCE, pData) IS NOT 0.
+//
+// The predicate is evaluated in parallel, then the block is compacted
+// in place keeping the order of the remaining sentences.  Dropped
+// sentences are freed.  Returns the new length of the block.
+//
+// The predicate sees every sentence, !done included; return 1 for
+// those to keep them.
+
+int parallelFilter(struct Block *stBlock, int (*keep)(struct Sentence *stSentence, void *pData), void *pData) {
+   struct FilterJob stJob;
+   int iKept = 0;
+   int i;
+
+   if (stBlock->iLength == 0) return (0);
+
+   stJob.stBlock = stBlock;
+   stJob.keep = keep;
+   stJob.pData = pData;
+   stJob.cKeep = malloc(stBlock->iLength);
+   debug_ram += stBlock->iLength;
+   runRanges(stBlock->iLength, 0, filterRange, &stJob);
+
+   for (i = 0; i < stBlock->iLength; i++) { // compacting is a memory walk, no gain from threads
+      if (stJob.cKeep[i]) stBlock->stSentence[iKept++] = stBlock->stSentence[i];
+      else freeBlockSentence(stBlock, stBlock->stSentence[i]);
+   }
+   debug_ram -= stBlock->iLength;
+   free(stJob.cKeep);
+
+   // clearBlock frees iLength pointers, so the array must match it.
+   debug_ram -= (stBlock->iLength - iKept) * sizeof(struct Sentence *);
+   if (iKept == 0) {
+      free(stBlock->stSentence);
+      stBlock->stSentence = NULL;
+      if (stBlock->cMap) munmap(stBlock->cMap, stBlock->lMapSize);
+      initializeBlock(stBlock);
+   } else if (iKept < stBlock->iLength) {
+      stBlock->stSentence = realloc(stBlock->stSentence, iKept * sizeof(struct Sentence *));
+   }
+   stBlock->iLength = iKept;
+
+   return (iKept);
+}
+
+
+// ********************************************************************
+// compareText
+// ********************************************************************
+// qsort COMPARE: VALUE AS STRING, MISSING LAST, THEN ORIGINAL ORDER.
+
+static int compareText(const void *pA, const void *pB) {
+   const struct SortKey *stA = pA;
+   const struct SortKey *stB = pB;
+   int iCmp;
+
+   if (stA->szValue && stB->szValue) {
+      if ((iCmp = strcmp(stA->szValue, stB->szValue)) != 0) return (iCmp);
+   } else if (stA->szValue || stB->szValue) {
+      return (stA->szValue ? -1 : 1);
+   }
+
+   return (stA->iIndex - stB->iIndex);
+}
+
+
+// ********************************************************************
+// compareNumeric
+// ********************************************************************
+// qsort COMPARE: VALUE AS NUMBER, MISSING LAST, THEN ORIGINAL ORDER.
+
+static int compareNumeric(const void *pA, const void *pB) {
+   const struct SortKey *stA = pA;
+   const struct SortKey *stB = pB;
+
+   if (stA->szValue && stB->szValue) {
+      if (stA->dValue < stB->dValue) return (-1);
+      if (stA->dValue > stB->dValue) return (1);
+   } else if (stA->szValue || stB->szValue) {
+      return (stA->szValue ? -1 : 1);
+   }
+
+   return (stA->iIndex - stB->iIndex);
+}
+
+
+// ********************************************************************
+// keyRange
+// ********************************************************************
+// EXTRACT THE SORT KEYS OF A RANGE AND SORT THE RANGE BY THEM.
+//
+// The value is looked up once per row, not once per comparison like
+// sortBlock does.  Only an exact "=key=" word counts.
+
+static void keyRange(void *pArg) {
+   struct RowRange *stRange = pArg;
+   struct SortJob *stJob = stRange->pJob;
+   struct Sentence *stSentence;
+   struct SortKey *stKey;
+   char *szEnd;
+   int i, j;
+
+   for (i = stRange->iFirst; i < stRange->iLast; i++) {
+      stSentence = stJob->stBlock->stSentence[i];
+      stKey = &stJob->stKey[i];
+      stKey->szValue = NULL;
+      stKey->dValue = 0;
+      stKey->iIndex = i;
+
+      if (stSentence->iReturnValue != DATA) continue;
+      for (j = 0; j < stSentence->iLength; j++) {
+         if (strncmp(stSentence->szWord[j], stJob->szPrefix, stJob->iPrefixLen) == 0) {
+            stKey->szValue = stSentence->szWord[j] + stJob->iPrefixLen;
+            break;
+         }
+      }
+      if (stKey->szValue && stJob->iNumeric) {
+         stKey->dValue = strtod(stKey->szValue, &szEnd);
+         if (szEnd == stKey->szValue) stKey->szValue = NULL; // not a number, sort with the missing
+      }
+   }
+
+   qsort(&stJob->stKey[stRange->iFirst], stRange->iLast - stRange->iFirst, sizeof(struct SortKey), stJob->compare);
+}
+
+
+// ********************************************************************
+// mergeRange
+// ********************************************************************
+// MERGE TWO SORTED RUNS OF KEYS INTO THE OTHER BUFFER.
+
+static void mergeRange(void *pArg) {
+   struct MergeRange *stMerge = pArg;
+   struct SortKey *stFrom = stMerge->stFrom;
+   struct SortKey *stTo = stMerge->stTo;
+   int i = stMerge->iFirst;
+   int j = stMerge->iMid;
+   int k = stMerge->iFirst;
+
+   while ((i < stMerge->iMid) && (j < stMerge->iLast)) {
+      if (stMerge->compare(&stFrom[j], &stFrom[i]) < 0) stTo[k++] = stFrom[j++];
+      else stTo[k++] = stFrom[i++];
+   }
+   if (i < stMerge->iMid) memcpy(&stTo[k], &stFrom[i], (stMerge->iMid - i) * sizeof(struct SortKey));
+   if (j < stMerge->iLast) memcpy(&stTo[k], &stFrom[j], (stMerge->iLast - j) * sizeof(struct SortKey));
+}
+
+
+// ********************************************************************
+// parallelSortBlock
+// ********************************************************************
+// SORT A BLOCK BY THE VALUE OF ONE ATTRIBUTE.
+//
+// szKey is the attribute name without the equal signs ("address").
+// Values compare as strings, or as numbers when iNumeric is set.
+// Sentences without the key (or, when numeric, without a number) go
+// after the others.  The sort is stable.  Sentences at the end of the
+// block that aren't DATA, normally the !done, stay at the end.
+//
+// Each range is sorted by its own task, then the sorted runs are
+// merged pairwise, all pairs of one round in parallel.
+
+void parallelSortBlock(struct Block *stBlock, char *szKey, int iNumeric) {
+   struct ThreadPool *stPool = NULL;
+   struct TaskGroup stGroup;
+   struct MergeRange *stMerge;
+   struct Sentence **stSorted;
+   struct SortKey *stSwap;
+   struct SortJob stJob;
+   int iRows = stBlock->iLength;
+   int iPerTask;
+   int iMerges;
+   int iMergeSize;
+   int iWidth;
+   int i;
+
+   while ((iRows > 0) && (stBlock->stSentence[iRows - 1]->iReturnValue != DATA)) iRows--;
+   if (iRows < 2) return;
+
+   stJob.stBlock = stBlock;
+   stJob.iPrefixLen = strlen(szKey) + 2;
+   stJob.szPrefix = malloc(stJob.iPrefixLen + 1);
+   debug_ram += stJob.iPrefixLen + 1;
+   sprintf(stJob.szPrefix, "=%s=", szKey);
+   stJob.iNumeric = iNumeric;
+   stJob.compare = iNumeric ? compareNumeric : compareText;
+   stJob.stKey = malloc(2 * iRows * sizeof(struct SortKey));
+   debug_ram += 2 * iRows * sizeof(struct SortKey);
+   stJob.stTemp = stJob.stKey + iRows;
+
+   if (iRows > PARALLEL_MIN_ROWS) stPool = sharedThreadPool();
+   iPerTask = rangeRows(stPool, iRows);
+   runRanges(iRows, iPerTask, keyRange, &stJob);
+
+   // merge runs of iWidth rows until one run is left
+   iMergeSize = (iRows + 2 * iPerTask - 1) / (2 * iPerTask);
+   stMerge = malloc(iMergeSize * sizeof(struct MergeRange));
+   debug_ram += iMergeSize * sizeof(struct MergeRange);
+   for (iWidth = iPerTask; iWidth < iRows; iWidth *= 2) {
+      stGroup.iPending = 0;
+      for (i = 0, iMerges = 0; i < iRows; i += 2 * iWidth, iMerges++) {
+         stMerge[iMerges].stFrom = stJob.stKey;
+         stMerge[iMerges].stTo = stJob.stTemp;
+         stMerge[iMerges].iFirst = i;
+         stMerge[iMerges].iMid = (i + iWidth < iRows) ? i + iWidth : iRows;
+         stMerge[iMerges].iLast = (i + 2 * iWidth < iRows) ? i + 2 * iWidth : iRows;
+         stMerge[iMerges].compare = stJob.compare;
+         if (iMerges > 0) threadPoolSubmit(stPool, &stGroup, mergeRange, &stMerge[iMerges]);
+      }
+      mergeRange(&stMerge[0]); // the caller takes the first (biggest) merge itself
+      if (iMerges > 1) threadPoolWait(stPool, &stGroup);
+      stSwap = stJob.stKey;
+      stJob.stKey = stJob.stTemp;
+      stJob.stTemp = stSwap;
+   }
+   debug_ram -= iMergeSize * sizeof(struct MergeRange);
+   free(stMerge);
+
+   // put the sentences in key order
+   stSorted = malloc(iRows * sizeof(struct Sentence *));
+   debug_ram += iRows * sizeof(struct Sentence *);
+   for (i = 0; i < iRows; i++) stSorted[i] = stBlock->stSentence[stJob.stKey[i].iIndex];
+   memcpy(stBlock->stSentence, stSorted, iRows * sizeof(struct Sentence *));
+   debug_ram -= iRows * sizeof(struct Sentence *);
+   free(stSorted);
+
+   if (stJob.stKey > stJob.stTemp) stJob.stKey = stJob.stTemp; // start of the allocation
+   debug_ram -= 2 * iRows * sizeof(struct SortKey);
+   free(stJob.stKey);
+   debug_ram -= stJob.iPrefixLen + 1;
+   free(stJob.szPrefix);
+}
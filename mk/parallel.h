@@ -0,0 +1,16 @@
+//
+// Mikrotik API 2.0 // Parallel Block algorithms.
+//
+
+#ifndef MK_PARALLEL
+#define MK_PARALLEL
+
+#include "api.h"
+
+#define PARALLEL_MIN_ROWS 2048 // smallest row range handed to one task
+
+void parallelMap(struct Block *stBlock, void (*map)(struct Sentence *stSentence, int iIndex, void *pData), void *pData);
+int parallelFilter(struct Block *stBlock, int (*keep)(struct Sentence *stSentence, void *pData), void *pData);
+void parallelSortBlock(struct Block *stBlock, char *szKey, int iNumeric);
+
+#endif // MK_PARALLEL
@@ -0,0 +1,718 @@
+//
+// Mikrotik API 2.0 // Polling scheduler.
+//
+// Runs many periodic queries against many routers from one thread.
+// Each router has a small pool of logged in connections; every query
+// is pipelined on one of them with its own .tag, replies are decoded
+// as they arrive, and a timer wheel decides what is due next.
+//
+//    struct Poller stPoller;
+//    char *szWords[] = { "/interface/print", "=stats=", NULL };
+//
+//    initializePoller(&stPoller);
+//    iRouter = pollAddRouter(&stPoller, "10.0.0.1", 8728, "admin", "", 2);
+//    pollAddQuery(&stPoller, iRouter, szWords, 10000, 500, onStats, NULL);
+//    while (1) pollRun(&stPoller, 60000);
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "api.h"
+#include "wire.h"
+#include "decoder.h"
+#include "poller.h"
+
+#define POLL_WHEEL_MASK (POLL_WHEEL_SIZE - 1)
+
+static void onPollSentence(struct Sentence *stSentence, void *pData);
+
+
+// ********************************************************************
+// monotonicMs
+// ********************************************************************
+// RETURN THE MONOTONIC CLOCK IN MILLISECONDS.
+
+static long long monotonicMs(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ((long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+
+// ********************************************************************
+// pollNow
+// ********************************************************************
+// RETURN THE SCHEDULER TIME: MILLISECONDS SINCE initializePoller.
+
+long long pollNow(struct Poller *stPoller) {
+   return (monotonicMs() - stPoller->llStart);
+}
+
+
+// ********************************************************************
+// initializePoller
+// ********************************************************************
+
+void initializePoller(struct Poller *stPoller) {
+   memset(stPoller, 0, sizeof(struct Poller));
+   memset(stPoller->iWheel, 0xff, sizeof(stPoller->iWheel)); // all -1
+   stPoller->llStart = monotonicMs();
+}
+
+
+// ********************************************************************
+// closePollConnection
+// ********************************************************************
+// CLOSE A CONNECTION AND FAIL EVERY QUERY RUNNING ON IT.
+
+static void closePollConnection(struct Poller *stPoller, struct PollConnection *stConnection) {
+   struct PollQuery *stQuery;
+   int iConnection = stConnection - stPoller->stRouter[stConnection->iRouter].stConnection;
+   int i;
+
+   if (stConnection->fdSock) apiDisconnect(stConnection->fdSock);
+   clearDecoder(&stConnection->stDecoder);
+   stConnection->fdSock = 0;
+   stConnection->iInFlight = 0;
+   stConnection->iFailed = 0;
+   stConnection->llRetry = pollNow(stPoller) + POLL_RETRY_MS;
+
+   for (i = 0; i < stPoller->iQueries; i++) {
+      stQuery = &stPoller->stQuery[i];
+      if ((stQuery->iState != POLL_RUNNING) || (stQuery->iRouter != stConnection->iRouter) ||
+          (stQuery->iConnection != iConnection)) continue;
+      stQuery->lFailed++;
+      stQuery->iState = POLL_IDLE;
+      clearBlock(&stQuery->stReply);
+      if (stQuery->onReply) stQuery->onReply(stPoller, i, NULL, stQuery->pData);
+   }
+}
+
+
+// ********************************************************************
+// clearPoller
+// ********************************************************************
+// CLOSE ALL CONNECTIONS AND FREE ALL MEMORY OF A POLLER.
+
+void clearPoller(struct Poller *stPoller) {
+   struct PollRouter *stRouter;
+   int i, j;
+
+   for (i = 0; i < stPoller->iRouters; i++) {
+      stRouter = &stPoller->stRouter[i];
+      for (j = 0; j < stRouter->iConnections; j++) {
+         if (stRouter->stConnection[j].fdSock) apiDisconnect(stRouter->stConnection[j].fdSock);
+         clearDecoder(&stRouter->stConnection[j].stDecoder);
+      }
+      debug_ram -= stRouter->iConnections * sizeof(struct PollConnection);
+      debug_ram -= strlen(stRouter->szUsername) + strlen(stRouter->szPassword) + 2;
+      free(stRouter->stConnection);
+      free(stRouter->szUsername);
+      free(stRouter->szPassword);
+   }
+   debug_ram -= stPoller->iRouters * sizeof(struct PollRouter);
+   free(stPoller->stRouter);
+
+   for (i = 0; i < stPoller->iQueries; i++) {
+      clearBlock(&stPoller->stQuery[i].stReply);
+      debug_ram -= stPoller->stQuery[i].iCommandLen;
+      free(stPoller->stQuery[i].cCommand);
+   }
+   debug_ram -= stPoller->iQueries * sizeof(struct PollQuery);
+   free(stPoller->stQuery);
+
+   debug_ram -= stPoller->iReadySize * sizeof(int);
+   free(stPoller->iReady);
+
+   initializePoller(stPoller);
+}
+
+
+// ********************************************************************
+// pollAddRouter
+// ********************************************************************
+// ADD A ROUTER WITH A POOL OF iConnections CONNECTIONS.
+//
+// Nothing is connected yet; connections open when queries need them.
+// Returns the router index to pass to pollAddQuery.
+
+int pollAddRouter(struct Poller *stPoller, char *szIPaddr, int iPort, char *szUsername, char *szPassword, int iConnections) {
+   struct PollRouter *stRouter;
+   int i;
+
+   if (iConnections < 1) iConnections = 1;
+
+   stPoller->stRouter = realloc(stPoller->stRouter, (stPoller->iRouters + 1) * sizeof(struct PollRouter));
+   debug_ram += sizeof(struct PollRouter);
+   stRouter = &stPoller->stRouter[stPoller->iRouters];
+
+   snprintf(stRouter->szIPaddr, sizeof(stRouter->szIPaddr), "%s", szIPaddr);
+   stRouter->iPort = iPort;
+   stRouter->szUsername = strdup(szUsername);
+   stRouter->szPassword = strdup(szPassword);
+   debug_ram += strlen(szUsername) + strlen(szPassword) + 2;
+
+   stRouter->iConnections = iConnections;
+   stRouter->stConnection = calloc(iConnections, sizeof(struct PollConnection));
+   debug_ram += iConnections * sizeof(struct PollConnection);
+   for (i = 0; i < iConnections; i++) {
+      stRouter->stConnection[i].iRouter = stPoller->iRouters;
+      stRouter->stConnection[i].stPoller = stPoller;
+      initializeDecoder(&stRouter->stConnection[i].stDecoder, onPollSentence, &stRouter->stConnection[i]);
+   }
+
+   return (stPoller->iRouters++);
+}
+
+
+// ********************************************************************
+// wheelInsert
+// ********************************************************************
+// PUT A QUERY ON THE TIMER WHEEL TO EXPIRE AT TICK llTimer.
+//
+// The level is the lowest one whose span covers the distance from now;
+// the slot is taken from the absolute tick so a slot is cascaded to the
+// level below exactly when time reaches it.  advanceWheel cascades
+// before it expires level 0, so a cascaded timer due on the current
+// tick still fires on it.  Other callers must ask for a later tick.
+
+static void wheelInsert(struct Poller *stPoller, int iQuery) {
+   struct PollQuery *stQuery = &stPoller->stQuery[iQuery];
+   unsigned long long llDelta;
+   int iLevel;
+   int iSlot;
+
+   if (stQuery->llTimer < stPoller->llTick) stQuery->llTimer = stPoller->llTick;
+   llDelta = stQuery->llTimer - stPoller->llTick;
+
+   for (iLevel = 0; iLevel < POLL_WHEEL_LEVELS - 1; iLevel++) {
+      if (llDelta < (1ULL << (POLL_WHEEL_BITS * (iLevel + 1)))) break;
+   }
+   if (llDelta >= (1ULL << (POLL_WHEEL_BITS * POLL_WHEEL_LEVELS))) { // beyond the wheel: park in the top level
+      stQuery->llTimer = stPoller->llTick + (1ULL << (POLL_WHEEL_BITS * POLL_WHEEL_LEVELS)) - 1;
+   }
+
+   iSlot = (stQuery->llTimer >> (POLL_WHEEL_BITS * iLevel)) & POLL_WHEEL_MASK;
+   stQuery->iNext = stPoller->iWheel[iLevel][iSlot];
+   stPoller->iWheel[iLevel][iSlot] = iQuery;
+}
+
+
+// ********************************************************************
+// readyPush / readyPop
+// ********************************************************************
+// BINARY MIN-HEAP OF DUE QUERIES ORDERED BY llDue.
+
+static void readyPush(struct Poller *stPoller, int iQuery) {
+   int i, iParent;
+   int iNewSize;
+
+   if (stPoller->iReadyLen == stPoller->iReadySize) {
+      iNewSize = stPoller->iReadySize ? stPoller->iReadySize * 2 : 256;
+      stPoller->iReady = realloc(stPoller->iReady, iNewSize * sizeof(int));
+      debug_ram += (iNewSize - stPoller->iReadySize) * sizeof(int);
+      stPoller->iReadySize = iNewSize;
+   }
+
+   i = stPoller->iReadyLen++;
+   while (i > 0) {
+      iParent = (i - 1) / 2;
+      if (stPoller->stQuery[stPoller->iReady[iParent]].llDue <= stPoller->stQuery[iQuery].llDue) break;
+      stPoller->iReady[i] = stPoller->iReady[iParent];
+      i = iParent;
+   }
+   stPoller->iReady[i] = iQuery;
+   stPoller->stQuery[iQuery].iState = POLL_READY;
+}
+
+static int readyPop(struct Poller *stPoller) {
+   int iTop = stPoller->iReady[0];
+   int iLast = stPoller->iReady[--stPoller->iReadyLen];
+   int i = 0, iChild;
+
+   while ((iChild = 2 * i + 1) < stPoller->iReadyLen) {
+      if ((iChild + 1 < stPoller->iReadyLen) &&
+          (stPoller->stQuery[stPoller->iReady[iChild + 1]].llDue < stPoller->stQuery[stPoller->iReady[iChild]].llDue)) iChild++;
+      if (stPoller->stQuery[iLast].llDue <= stPoller->stQuery[stPoller->iReady[iChild]].llDue) break;
+      stPoller->iReady[i] = stPoller->iReady[iChild];
+      i = iChild;
+   }
+   if (stPoller->iReadyLen > 0) stPoller->iReady[i] = iLast;
+
+   return (iTop);
+}
+
+
+// ********************************************************************
+// scheduleQuery
+// ********************************************************************
+// PUT A QUERY ON THE WHEEL FOR ITS RUN IN THE INTERVAL AT llGrid.
+
+static void scheduleQuery(struct Poller *stPoller, int iQuery) {
+   struct PollQuery *stQuery = &stPoller->stQuery[iQuery];
+
+   stQuery->llNext = stQuery->llGrid;
+   if (stQuery->lJitter > 0) stQuery->llNext += rand() % (stQuery->lJitter + 1);
+   stQuery->llTimer = stQuery->llNext / POLL_TICK_MS;
+   if (stQuery->llTimer <= stPoller->llTick) stQuery->llTimer = stPoller->llTick + 1; // this tick's slot is done.
+   wheelInsert(stPoller, iQuery);
+}
+
+
+// ********************************************************************
+// pollAddQuery
+// ********************************************************************
+// ADD A QUERY THAT RUNS szWords ON A ROUTER EVERY lInterval MS.
+//
+// szWords is a NULL terminated list of words, without .tag.  The first
+// run is in 0..lJitter ms.  Returns the query index passed to onReply.
+
+int pollAddQuery(struct Poller *stPoller, int iRouter, char **szWords, long lInterval, long lJitter,
+                 void (*onReply)(struct Poller *, int, struct Block *, void *), void *pData) {
+   struct PollQuery *stQuery;
+   char szTag[32];
+   int iLen = 1; // final empty word
+   int iQuery = stPoller->iQueries;
+   int i;
+
+   snprintf(szTag, sizeof(szTag), ".tag=%d", iQuery);
+   for (i = 0; szWords[i] != NULL; i++) iLen += strlen(szWords[i]) + WIRE_MAX_LEN_SIZE;
+   iLen += strlen(szTag) + WIRE_MAX_LEN_SIZE;
+
+   stPoller->stQuery = realloc(stPoller->stQuery, (iQuery + 1) * sizeof(struct PollQuery));
+   debug_ram += sizeof(struct PollQuery);
+   stQuery = &stPoller->stQuery[iQuery];
+   memset(stQuery, 0, sizeof(struct PollQuery));
+
+   // encode the whole sentence once.
+   stQuery->cCommand = malloc(iLen);
+   for (i = 0; szWords[i] != NULL; i++) {
+      stQuery->iCommandLen += wireEncodeWord(szWords[i], strlen(szWords[i]), stQuery->cCommand + stQuery->iCommandLen);
+   }
+   stQuery->iCommandLen += wireEncodeWord(szTag, strlen(szTag), stQuery->cCommand + stQuery->iCommandLen);
+   stQuery->cCommand[stQuery->iCommandLen++] = 0;
+   stQuery->cCommand = realloc(stQuery->cCommand, stQuery->iCommandLen);
+   debug_ram += stQuery->iCommandLen;
+
+   stQuery->iRouter = iRouter;
+   stQuery->iConnection = -1;
+   stQuery->lInterval = lInterval > 0 ? lInterval : 1;
+   stQuery->lJitter = lJitter;
+   stQuery->lTimeout = POLL_TIMEOUT_MS;
+   stQuery->onReply = onReply;
+   stQuery->pData = pData;
+   initializeBlock(&stQuery->stReply);
+   stPoller->iQueries++;
+
+   // align the grid to the tick the scheduler has already reached.
+   stQuery->llGrid = (long long)(stPoller->llTick + 1) * POLL_TICK_MS;
+   scheduleQuery(stPoller, iQuery);
+
+   return (iQuery);
+}
+
+
+// ********************************************************************
+// pollSetTimeout
+// ********************************************************************
+// LET A RUN OF iQuery TAKE UP TO lTimeout MS (POLL_TIMEOUT_MS BY DEFAULT).
+//
+// A run still without !done when the query next comes due after that
+// is failed, and its connection closed.
+
+void pollSetTimeout(struct Poller *stPoller, int iQuery, long lTimeout) {
+   stPoller->stQuery[iQuery].lTimeout = lTimeout > 0 ? lTimeout : 1;
+}
+
+
+// ********************************************************************
+// expireQuery
+// ********************************************************************
+// HANDLE A QUERY WHOSE TIMER RAN OUT.
+//
+// Intervals that passed entirely while the scheduler wasn't running
+// are counted as skipped and the grid moves past them.  A previous run
+// that is past its lTimeout fails, together with its connection.  If
+// it is still waiting or busy otherwise this run is skipped too; if not
+// the query becomes ready.  Either way the next run is scheduled.
+
+static void expireQuery(struct Poller *stPoller, int iQuery, long long llNow) {
+   struct PollQuery *stQuery = &stPoller->stQuery[iQuery];
+   long long llMissed;
+
+   if ((stQuery->iState == POLL_RUNNING) && (llNow - stQuery->llSent >= stQuery->lTimeout)) {
+      closePollConnection(stPoller, &stPoller->stRouter[stQuery->iRouter].stConnection[stQuery->iConnection]);
+   }
+
+   if (llNow - stQuery->llGrid >= stQuery->lInterval) {
+      llMissed = (llNow - stQuery->llGrid) / stQuery->lInterval;
+      stQuery->lSkipped += llMissed;
+      stQuery->llGrid += llMissed * stQuery->lInterval;
+      stQuery->llNext = stQuery->llGrid;
+   }
+
+   if (stQuery->iState == POLL_IDLE) {
+      stQuery->llDue = stQuery->llNext;
+      readyPush(stPoller, iQuery);
+   } else {
+      stQuery->lSkipped++;
+   }
+
+   stQuery->llGrid += stQuery->lInterval;
+   scheduleQuery(stPoller, iQuery);
+}
+
+
+// ********************************************************************
+// advanceWheel
+// ********************************************************************
+// PROCESS EVERY TICK UP TO llNow.
+
+static void advanceWheel(struct Poller *stPoller, long long llNow) {
+   unsigned long long llTarget = llNow / POLL_TICK_MS;
+   int iQuery, iNext;
+   int iLevel, iSlot;
+
+   while (stPoller->llTick < llTarget) {
+      stPoller->llTick++;
+
+      // cascade the coarser levels whose slot time has come.
+      for (iLevel = 1; iLevel < POLL_WHEEL_LEVELS; iLevel++) {
+         if ((stPoller->llTick & ((1ULL << (POLL_WHEEL_BITS * iLevel)) - 1)) != 0) break;
+         iSlot = (stPoller->llTick >> (POLL_WHEEL_BITS * iLevel)) & POLL_WHEEL_MASK;
+         iQuery = stPoller->iWheel[iLevel][iSlot];
+         stPoller->iWheel[iLevel][iSlot] = -1;
+         for (; iQuery >= 0; iQuery = iNext) {
+            iNext = stPoller->stQuery[iQuery].iNext;
+            wheelInsert(stPoller, iQuery);
+         }
+      }
+
+      iSlot = stPoller->llTick & POLL_WHEEL_MASK;
+      iQuery = stPoller->iWheel[0][iSlot];
+      stPoller->iWheel[0][iSlot] = -1;
+      for (; iQuery >= 0; iQuery = iNext) {
+         iNext = stPoller->stQuery[iQuery].iNext;
+         expireQuery(stPoller, iQuery, llNow);
+      }
+   }
+}
+
+
+// ********************************************************************
+// onPollSentence
+// ********************************************************************
+// DECODER CALLBACK: ADD A REPLY SENTENCE TO THE QUERY OF ITS .tag.
+//
+// The query completes on !done.  An untagged !fatal means the router is
+// closing the connection; it is closed once the decoder returns.  So is
+// a connection whose login was refused.
+
+static void onPollSentence(struct Sentence *stSentence, void *pData) {
+   struct PollConnection *stConnection = pData;
+   struct Poller *stPoller = stConnection->stPoller;
+   struct PollQuery *stQuery;
+   int iQuery = -1;
+   int i;
+
+   if (stConnection->iState == POLL_LOGIN) { // a !trap comes before the !done of a bad login.
+      if (stSentence->iReturnValue == DONE) stConnection->iState = POLL_OPEN;
+      else stConnection->iFailed = 1;
+      clearSentence(stSentence);
+      return;
+   }
+
+   for (i = 1; i < stSentence->iLength; i++) {
+      if (strncmp(stSentence->szWord[i], ".tag=", 5) == 0) iQuery = atoi(stSentence->szWord[i] + 5);
+   }
+
+   if ((iQuery < 0) || (iQuery >= stPoller->iQueries)) {
+      if (stSentence->iReturnValue == FATAL) stConnection->iFailed = 1;
+      clearSentence(stSentence);
+      return;
+   }
+
+   stQuery = &stPoller->stQuery[iQuery];
+   if ((stQuery->iState != POLL_RUNNING) || (stQuery->iRouter != stConnection->iRouter) ||
+       (&stPoller->stRouter[stQuery->iRouter].stConnection[stQuery->iConnection] != stConnection)) {
+      clearSentence(stSentence); // stale reply
+      return;
+   }
+
+   addSentenceToBlock(&stQuery->stReply, stSentence); // the Block owns the words now
+   if ((stSentence->iReturnValue != DONE) && (stSentence->iReturnValue != FATAL)) return;
+
+   stQuery->llLatency = pollNow(stPoller) - stQuery->llSent;
+   stQuery->lRuns++;
+   stQuery->iState = POLL_IDLE;
+   stConnection->iInFlight--;
+   stPoller->lReplies++;
+
+   if (stQuery->onReply) stQuery->onReply(stPoller, iQuery, &stQuery->stReply, stQuery->pData);
+   clearBlock(&stQuery->stReply);
+   initializeBlock(&stQuery->stReply);
+}
+
+
+// ********************************************************************
+// openPollConnection
+// ********************************************************************
+// START A NON-BLOCKING CONNECT.  RETURN 1 ON SUCCESS, 0 ON FAILURE.
+//
+// pollRun finishes the connect and the login as the socket gets ready;
+// the connection takes queries once it is POLL_OPEN.  A router that
+// fails is not tried again for POLL_RETRY_MS.
+
+static int openPollConnection(struct Poller *stPoller, struct PollRouter *stRouter, struct PollConnection *stConnection) {
+   int fdSock;
+
+   stConnection->llRetry = pollNow(stPoller) + POLL_RETRY_MS;
+   stConnection->llDeadline = pollNow(stPoller) + POLL_CONNECT_MS;
+   stConnection->stAddress.sin_family = AF_INET;
+   stConnection->stAddress.sin_addr.s_addr = inet_addr(stRouter->szIPaddr);
+   stConnection->stAddress.sin_port = htons(stRouter->iPort);
+
+   if ((fdSock = socket(AF_INET, SOCK_STREAM, 0)) <= 0) return (0);
+   fcntl(fdSock, F_SETFL, fcntl(fdSock, F_GETFL) | O_NONBLOCK);
+   if ((connect(fdSock, (struct sockaddr *)&stConnection->stAddress, sizeof(stConnection->stAddress)) != 0) &&
+       (errno != EINPROGRESS)) {
+      close(fdSock);
+      return (0);
+   }
+
+   stConnection->fdSock = fdSock;
+   stConnection->iState = POLL_CONNECTING;
+   stConnection->iInFlight = 0;
+   stConnection->iFailed = 0;
+   return (1);
+}
+
+
+// ********************************************************************
+// loginPollConnection
+// ********************************************************************
+// FINISH THE CONNECT OF A WRITABLE SOCKET AND SEND /login.
+//
+// Returns 0 if the connect failed.  The socket is made blocking again
+// once connected: it is only read when poll says so, and the short
+// commands are written whole.  The reply is handled by onPollSentence.
+
+static int loginPollConnection(struct PollRouter *stRouter, struct PollConnection *stConnection) {
+   struct Sentence stLogin;
+
+   // a second connect tells how the first one went, without waiting.
+   if ((connect(stConnection->fdSock, (struct sockaddr *)&stConnection->stAddress, sizeof(stConnection->stAddress)) != 0) &&
+       (errno != EISCONN)) {
+      return ((errno == EINPROGRESS) || (errno == EALREADY) || (errno == EINTR));
+   }
+   fcntl(stConnection->fdSock, F_SETFL, fcntl(stConnection->fdSock, F_GETFL) & ~O_NONBLOCK);
+
+   initializeSentence(&stLogin);
+   addWordToSentence(&stLogin, "/login");
+   addWordToSentence(&stLogin, "=name=");
+   addPartWordToSentence(&stLogin, stRouter->szUsername);
+   addWordToSentence(&stLogin, "=password=");
+   addPartWordToSentence(&stLogin, stRouter->szPassword);
+   writeSentence(stConnection->fdSock, &stLogin); // a failed write shows up as a closed socket.
+   clearSentence(&stLogin);
+
+   stConnection->iState = POLL_LOGIN;
+   return (1);
+}
+
+
+// ********************************************************************
+// pickConnection
+// ********************************************************************
+// RETURN THE CONNECTION TO SEND A QUERY ON, OR NULL IF NONE IS FREE.
+//
+// The least busy open connection is used.  A closed connection whose
+// retry time has passed is opened if every open one is busy and none
+// is opening already; until it is logged in the query waits, or goes
+// to a busy connection if there is one.
+
+static struct PollConnection *pickConnection(struct Poller *stPoller, struct PollRouter *stRouter, long long llNow) {
+   struct PollConnection *stBest = NULL;
+   struct PollConnection *stClosed = NULL;
+   int iOpening = 0;
+   int i;
+
+   for (i = 0; i < stRouter->iConnections; i++) {
+      if (stRouter->stConnection[i].fdSock == 0) {
+         if ((stClosed == NULL) && (stRouter->stConnection[i].llRetry <= llNow)) stClosed = &stRouter->stConnection[i];
+      } else if (stRouter->stConnection[i].iState != POLL_OPEN) {
+         iOpening = 1;
+      } else if ((stRouter->stConnection[i].iInFlight < POLL_MAX_INFLIGHT) &&
+                 ((stBest == NULL) || (stRouter->stConnection[i].iInFlight < stBest->iInFlight))) {
+         stBest = &stRouter->stConnection[i];
+      }
+   }
+
+   if (stClosed && !iOpening && ((stBest == NULL) || (stBest->iInFlight > 0))) {
+      openPollConnection(stPoller, stRouter, stClosed);
+   }
+   return (stBest);
+}
+
+
+// ********************************************************************
+// sendQuery
+// ********************************************************************
+// WRITE THE ENCODED COMMAND OF A QUERY.  RETURN 1 ON SUCCESS.
+
+static int sendQuery(struct PollConnection *stConnection, struct PollQuery *stQuery) {
+   int iSent = 0;
+   int iWritten;
+
+   while (iSent < stQuery->iCommandLen) {
+      iWritten = apiWrite(stConnection->fdSock, stQuery->cCommand + iSent, stQuery->iCommandLen - iSent);
+      if (iWritten <= 0) {
+         if ((iWritten < 0) && (errno == EINTR)) continue;
+         return (0);
+      }
+      iSent += iWritten;
+   }
+   return (1);
+}
+
+
+// ********************************************************************
+// dispatchReady
+// ********************************************************************
+// SEND DUE QUERIES, EARLIEST DEADLINE FIRST.
+//
+// Queries whose router has no free connection stay in the heap.
+
+static void dispatchReady(struct Poller *stPoller, long long llNow) {
+   struct PollConnection *stConnection;
+   struct PollQuery *stQuery;
+   int *iDeferred = NULL;
+   int iDeferredLen = 0;
+   int iDeferredSize = 0;
+   int iQuery;
+   long long llLate;
+
+   while (stPoller->iReadyLen > 0) {
+      iQuery = readyPop(stPoller);
+      stQuery = &stPoller->stQuery[iQuery];
+
+      if ((stConnection = pickConnection(stPoller, &stPoller->stRouter[stQuery->iRouter], llNow)) == NULL) {
+         if (iDeferredLen == iDeferredSize) {
+            iDeferredSize = iDeferredSize ? iDeferredSize * 2 : 64;
+            iDeferred = realloc(iDeferred, iDeferredSize * sizeof(int));
+            debug_ram += (iDeferredSize - iDeferredLen) * sizeof(int);
+         }
+         iDeferred[iDeferredLen++] = iQuery;
+         continue;
+      }
+
+      if (!sendQuery(stConnection, stQuery)) {
+         stQuery->lFailed++;
+         stQuery->iState = POLL_IDLE;
+         closePollConnection(stPoller, stConnection);
+         continue;
+      }
+
+      llLate = llNow - stQuery->llDue;
+      if (llLate < 0) llLate = 0;
+      stQuery->llLateTotal += llLate;
+      if (llLate > stQuery->llLateMax) stQuery->llLateMax = llLate;
+
+      stQuery->iState = POLL_RUNNING;
+      stQuery->iConnection = stConnection - stPoller->stRouter[stQuery->iRouter].stConnection;
+      stQuery->llSent = llNow;
+      stConnection->iInFlight++;
+   }
+
+   debug_ram -= iDeferredSize * sizeof(int);
+   while (iDeferredLen > 0) readyPush(stPoller, iDeferred[--iDeferredLen]);
+   free(iDeferred);
+}
+
+
+// ********************************************************************
+// pollRun
+// ********************************************************************
+// RUN THE SCHEDULER FOR lMilliseconds.
+//
+// Expires timers, sends due queries and reads replies until the time is
+// up, waking at least every POLL_TICK_MS.  onReply is called from here.
+// Returns the number of replies received.
+
+int pollRun(struct Poller *stPoller, long lMilliseconds) {
+   struct pollfd *stPollFd;
+   struct PollConnection **stPollConnection;
+   struct PollConnection *stConnection;
+   struct PollRouter *stRouter;
+   long lReplies = stPoller->lReplies;
+   long long llEnd = pollNow(stPoller) + lMilliseconds;
+   long long llNow;
+   int iConnections = 0;
+   int iTimeout;
+   int iRead;
+   int n, i, j;
+
+   for (i = 0; i < stPoller->iRouters; i++) iConnections += stPoller->stRouter[i].iConnections;
+   stPollFd = malloc((iConnections + 1) * sizeof(struct pollfd));
+   stPollConnection = malloc((iConnections + 1) * sizeof(struct PollConnection *));
+   debug_ram += (iConnections + 1) * (sizeof(struct pollfd) + sizeof(struct PollConnection *));
+
+   while ((llNow = pollNow(stPoller)) < llEnd) {
+      advanceWheel(stPoller, llNow);
+      dispatchReady(stPoller, llNow);
+
+      n = 0;
+      for (i = 0; i < stPoller->iRouters; i++) {
+         stRouter = &stPoller->stRouter[i];
+         for (j = 0; j < stRouter->iConnections; j++) {
+            if (stRouter->stConnection[j].fdSock == 0) continue;
+            if ((stRouter->stConnection[j].iState != POLL_OPEN) && (stRouter->stConnection[j].llDeadline <= llNow)) {
+               closePollConnection(stPoller, &stRouter->stConnection[j]); // connect or login too slow.
+               continue;
+            }
+            stPollFd[n].fd = stRouter->stConnection[j].fdSock;
+            stPollFd[n].events = (stRouter->stConnection[j].iState == POLL_CONNECTING) ? POLLOUT : POLLIN;
+            stPollFd[n].revents = 0;
+            stPollConnection[n++] = &stRouter->stConnection[j];
+         }
+      }
+
+      iTimeout = POLL_TICK_MS - (int)(llNow % POLL_TICK_MS);
+      if (iTimeout > llEnd - llNow) iTimeout = llEnd - llNow;
+
+      if (n == 0) {
+         usleep(iTimeout * 1000);
+         continue;
+      }
+      if (poll(stPollFd, n, iTimeout) <= 0) continue;
+
+      for (i = 0; i < n; i++) {
+         if (stPollFd[i].revents == 0) continue;
+         stConnection = stPollConnection[i];
+         if (stConnection->iState == POLL_CONNECTING) {
+            if (!loginPollConnection(&stPoller->stRouter[stConnection->iRouter], stConnection)) closePollConnection(stPoller, stConnection);
+            continue;
+         }
+         iRead = decoderRead(&stConnection->stDecoder, stConnection->fdSock);
+         if ((iRead == 0) || ((iRead < 0) && (errno != EAGAIN) && (errno != EINTR)) || stConnection->iFailed) {
+            closePollConnection(stPoller, stConnection);
+         }
+      }
+   }
+
+   debug_ram -= (iConnections + 1) * (sizeof(struct pollfd) + sizeof(struct PollConnection *));
+   free(stPollFd);
+   free(stPollConnection);
+
+   return (stPoller->lReplies - lReplies);
+}
@@ -0,0 +1,141 @@
+//
+// Mikrotik API 2.0 // Polling scheduler.
+//
+
+#ifndef MK_POLLER
+#define MK_POLLER
+
+#include <netinet/in.h>
+
+#include "api.h"
+#include "decoder.h"
+
+#define POLL_TICK_MS      10   // timer wheel resolution
+#define POLL_WHEEL_BITS   8
+#define POLL_WHEEL_SIZE   (1 << POLL_WHEEL_BITS)
+#define POLL_WHEEL_LEVELS 4    // 10ms * 256^4 is more than a year
+#define POLL_MAX_INFLIGHT 64   // tagged queries outstanding per connection
+#define POLL_RETRY_MS     5000 // wait before reconnecting to a failed router
+#define POLL_CONNECT_MS   10000 // connect and login must be done by then
+#define POLL_TIMEOUT_MS   30000 // default time a query may run (pollSetTimeout)
+
+#define POLL_IDLE    0 // waiting on the timer wheel
+#define POLL_READY   1 // due, waiting for a free connection
+#define POLL_RUNNING 2 // sent, waiting for !done
+
+#define POLL_CONNECTING 0 // non-blocking connect in progress
+#define POLL_LOGIN      1 // connected, waiting for the /login reply
+#define POLL_OPEN       2 // logged in, queries can be sent
+
+struct Poller;
+
+// struct PollConnection
+//
+// One pooled API connection to a router.  Replies are decoded without
+// blocking and matched to their query by .tag.  fdSock is 0 while the
+// connection is down; it is reopened when a query needs it and
+// llRetry has passed.  Connecting and the login don't block either:
+// the socket sits in the poll set until it is POLL_OPEN, or is closed
+// at llDeadline.
+
+struct PollConnection {
+        int fdSock;                // socket, 0 if not connected
+        int iState;                // POLL_CONNECTING, POLL_LOGIN or POLL_OPEN
+        struct sockaddr_in stAddress; // router, to finish the connect
+        long long llDeadline;      // connect and login must be done by then (ms)
+        struct Decoder stDecoder;  // decodes replies as they arrive
+        int iInFlight;             // queries sent and not yet done
+        int iFailed;               // router sent !fatal, close after decoding
+        long long llRetry;         // don't reconnect before this time (ms)
+        int iRouter;               // router this connection belongs to
+        struct Poller *stPoller;   // for the decoder callback
+};
+
+// struct PollRouter
+//
+// A router and its pool of connections.  Queries to a router go to its
+// least busy connection.
+
+struct PollRouter {
+        char szIPaddr[64];
+        int iPort;
+        char *szUsername;
+        char *szPassword;
+        struct PollConnection *stConnection; // iConnections entries
+        int iConnections;
+};
+
+// struct PollQuery
+//
+// A command sent to one router every lInterval ms.  Runs are aligned to
+// a fixed grid (llGrid) so they never drift; each run is moved by a
+// random 0..lJitter ms to spread the load.  A run that is still busy
+// or waiting when the next one comes due, or that was missed because
+// the process stalled, is counted in lSkipped instead of piling up.
+//
+// The command is encoded once, .tag included, and sent with a single
+// write per run.  onReply gets the whole reply Block (NULL if the
+// connection failed) and must not keep it; it is cleared on return.
+// A run without !done after lTimeout ms is failed at its next due time,
+// and its connection is closed: there is no telling what it still
+// sends.
+
+struct PollQuery {
+        int iRouter;               // router to query
+        int iConnection;           // connection of the running query
+        int iState;                // POLL_IDLE, POLL_READY or POLL_RUNNING
+        unsigned char *cCommand;   // encoded sentence incl .tag
+        int iCommandLen;           // bytes in cCommand
+        long lInterval;            // ms between runs
+        long lJitter;              // max random delay of a run (ms)
+        long lTimeout;             // max time a run may take (ms)
+        long long llGrid;          // start of the current interval (ms)
+        long long llNext;          // deadline of the run on the wheel (ms)
+        long long llDue;           // deadline of the ready or running run (ms)
+        long long llSent;          // time the current run was sent (ms)
+        unsigned long long llTimer; // wheel tick the query waits for
+        int iNext;                 // next query in the same wheel slot
+        struct Block stReply;      // reply being received
+        long lRuns;                // replies received
+        long lSkipped;             // intervals that didn't run
+        long lFailed;              // runs lost with their connection
+        long long llLateMax;       // worst delay between deadline and send
+        long long llLateTotal;     // sum of delays (average = total / runs)
+        long long llLatency;       // send to !done of the last run
+        void (*onReply)(struct Poller *stPoller, int iQuery, struct Block *stReply, void *pData);
+        void *pData;
+};
+
+// struct Poller
+//
+// The scheduler.  Queries wait on a hierarchical timer wheel of
+// POLL_WHEEL_LEVELS levels of POLL_WHEEL_SIZE slots; each level is
+// POLL_WHEEL_SIZE times coarser than the one below and its slots are
+// cascaded down as time reaches them, so adding and expiring a timer
+// is O(1) for any number of queries.  Expired queries go into a heap
+// ordered by deadline and are sent earliest deadline first.
+
+struct Poller {
+        struct PollRouter *stRouter;
+        int iRouters;
+        struct PollQuery *stQuery;
+        int iQueries;
+        int iWheel[POLL_WHEEL_LEVELS][POLL_WHEEL_SIZE]; // first query of each slot, -1 if empty
+        unsigned long long llTick; // last tick processed
+        long long llStart;         // monotonic clock at initializePoller (ms)
+        int *iReady;               // heap of due queries by llDue
+        int iReadyLen;
+        int iReadySize;
+        long lReplies;             // replies received in total
+};
+
+void initializePoller(struct Poller *stPoller);
+void clearPoller(struct Poller *stPoller);
+int pollAddRouter(struct Poller *stPoller, char *szIPaddr, int iPort, char *szUsername, char *szPassword, int iConnections);
+int pollAddQuery(struct Poller *stPoller, int iRouter, char **szWords, long lInterval, long lJitter,
+                 void (*onReply)(struct Poller *, int, struct Block *, void *), void *pData);
+void pollSetTimeout(struct Poller *stPoller, int iQuery, long lTimeout);
+long long pollNow(struct Poller *stPoller);
+int pollRun(struct Poller *stPoller, long lMilliseconds);
+
+#endif // MK_POLLER
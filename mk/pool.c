@@ -0,0 +1,360 @@
+//
+// Mikrotik API 2.0 // String pools.
+//
+// Replies repeat the same attribute names in every sentence and the
+// same few values (chain, action, list, ...) in most of them.  A pool
+// keeps one copy of each and lets callers work with integer ids.
+//
+// Each connection (fd) has its own pool, created on first use by
+// connectionPool.  apiDisconnect takes it off the fd, so a connection
+// that later gets the same fd number starts with an empty pool.  The
+// AttrBlocks read with it keep it alive until they are cleared.  A
+// connection pool is shared by every AttrBlock of the fd, which may be
+// read and used on different threads, so it has its own lock: take it
+// with lockConnectionPool around every add and lookup.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "api.h"
+#include "pool.h"
+
+// struct ConnectionPool
+//
+// The pool of a connection and how many hold it: the fd while it is
+// open, and every AttrBlock read from it.
+
+struct ConnectionPool {
+        struct StringPool stPool;    // first, so a StringPool * is a ConnectionPool *
+        int iRefs;                   // holders, under stConnectionPoolLock
+        pthread_mutex_t stLock;      // guards stPool
+};
+
+static pthread_mutex_t stConnectionPoolLock = PTHREAD_MUTEX_INITIALIZER; // guards the fd table and iRefs
+static struct ConnectionPool **stConnectionPool = NULL; // pool of each fd, NULL if none yet
+static int iConnectionPoolSize = 0;                     // entries in stConnectionPool
+
+// attributes with only a handful of distinct values per table.  Used
+// when the caller doesn't supply its own list.
+static char *szDefaultLowCardinality[] = {
+   "list", "chain", "action", "disabled", "dynamic", "invalid",
+   "protocol", "connection-state", NULL
+};
+
+
+// ********************************************************************
+// poolHash
+// ********************************************************************
+// FNV-1a HASH OF iLen BYTES.
+
+static unsigned int poolHash(char *szString, int iLen) {
+   unsigned int iHash = 2166136261u;
+
+   while (iLen-- > 0) {
+      iHash ^= (unsigned char)*szString++;
+      iHash *= 16777619u;
+   }
+   return (iHash);
+}
+
+
+// ********************************************************************
+// initializeStringPool
+// ********************************************************************
+
+void initializeStringPool(struct StringPool *stPool) {
+   memset(stPool, 0, sizeof(struct StringPool));
+}
+
+
+// ********************************************************************
+// clearStringPool
+// ********************************************************************
+// FREE ALL STRINGS OF A POOL.  IDS HANDED OUT BECOME INVALID.
+
+void clearStringPool(struct StringPool *stPool) {
+   int i;
+
+   for (i = 0; i < stPool->iChunks; i++) free(stPool->cChunk[i]);
+   debug_ram -= stPool->lDataSize;
+   debug_ram -= stPool->iChunks * sizeof(char *);
+   debug_ram -= stPool->iSize * sizeof(char *);
+   debug_ram -= stPool->iHashSize * sizeof(int);
+   free(stPool->cChunk);
+   free(stPool->szString);
+   free(stPool->iHash);
+   initializeStringPool(stPool);
+}
+
+
+// ********************************************************************
+// findStringInPool
+// ********************************************************************
+// RETURN THE ID OF A STRING OR -1 IF IT IS NOT IN THE POOL.
+//
+// szString need not be NULL terminated; iLen gives its length.
+
+int findStringInPool(struct StringPool *stPool, char *szString, int iLen) {
+   char *szPooled;
+   int iSlot;
+   int iId;
+
+   if (stPool->iHashSize == 0) return (-1);
+
+   iSlot = poolHash(szString, iLen) & (stPool->iHashSize - 1);
+   while ((iId = stPool->iHash[iSlot]) != 0) {
+      szPooled = stPool->szString[iId - 1];
+      if ((strncmp(szPooled, szString, iLen) == 0) && (szPooled[iLen] == 0)) return (iId - 1);
+      iSlot = (iSlot + 1) & (stPool->iHashSize - 1);
+   }
+   return (-1);
+}
+
+
+// ********************************************************************
+// growPoolHash
+// ********************************************************************
+// DOUBLE THE HASH TABLE AND RE-INSERT ALL IDS.
+
+static void growPoolHash(struct StringPool *stPool) {
+   int iNewSize = stPool->iHashSize ? stPool->iHashSize * 2 : 64;
+   char *szString;
+   int i, iSlot;
+
+   debug_ram -= stPool->iHashSize * sizeof(int);
+   free(stPool->iHash);
+   stPool->iHash = calloc(iNewSize, sizeof(int));
+   debug_ram += iNewSize * sizeof(int);
+   stPool->iHashSize = iNewSize;
+
+   for (i = 0; i < stPool->iLength; i++) {
+      szString = stPool->szString[i];
+      iSlot = poolHash(szString, strlen(szString)) & (iNewSize - 1);
+      while (stPool->iHash[iSlot]) iSlot = (iSlot + 1) & (iNewSize - 1);
+      stPool->iHash[iSlot] = i + 1;
+   }
+}
+
+
+// ********************************************************************
+// addPoolChunk
+// ********************************************************************
+// START A NEW CHUNK WITH ROOM FOR AT LEAST lNeed BYTES.
+//
+// The chunks before it stay as they are: strings never move.
+
+static void addPoolChunk(struct StringPool *stPool, long lNeed) {
+   long lNewSize = stPool->lChunkSize ? stPool->lChunkSize * 2 : 1024;
+
+   while (lNewSize < lNeed) lNewSize *= 2;
+
+   stPool->cChunk = realloc(stPool->cChunk, (stPool->iChunks + 1) * sizeof(char *));
+   stPool->cChunk[stPool->iChunks++] = malloc(lNewSize);
+   debug_ram += sizeof(char *) + lNewSize;
+   stPool->lDataSize += lNewSize;
+   stPool->lChunkSize = lNewSize;
+   stPool->lChunkLen = 0;
+}
+
+
+// ********************************************************************
+// addStringToPool
+// ********************************************************************
+// RETURN THE ID OF A STRING, ADDING IT TO THE POOL IF NEW.
+//
+// szString need not be NULL terminated; iLen gives its length.
+
+int addStringToPool(struct StringPool *stPool, char *szString, int iLen) {
+   char *szPooled;
+   int iSlot;
+   int iId;
+
+   if ((iId = findStringInPool(stPool, szString, iLen)) >= 0) return (iId);
+
+   if (2 * (stPool->iLength + 1) > stPool->iHashSize) growPoolHash(stPool);
+
+   if (stPool->iLength == stPool->iSize) {
+      iId = stPool->iSize ? stPool->iSize * 2 : 16; // new size
+      stPool->szString = realloc(stPool->szString, iId * sizeof(char *));
+      debug_ram += (iId - stPool->iSize) * sizeof(char *);
+      stPool->iSize = iId;
+   }
+
+   if (stPool->lChunkLen + iLen + 1 > stPool->lChunkSize) addPoolChunk(stPool, iLen + 1);
+
+   iId = stPool->iLength++;
+   szPooled = stPool->szString[iId] = stPool->cChunk[stPool->iChunks - 1] + stPool->lChunkLen;
+   memcpy(szPooled, szString, iLen);
+   szPooled[iLen] = 0;
+   stPool->lChunkLen += iLen + 1;
+
+   iSlot = poolHash(szString, iLen) & (stPool->iHashSize - 1);
+   while (stPool->iHash[iSlot]) iSlot = (iSlot + 1) & (stPool->iHashSize - 1);
+   stPool->iHash[iSlot] = iId + 1;
+
+   return (iId);
+}
+
+
+// ********************************************************************
+// poolString
+// ********************************************************************
+// RETURN THE STRING OF AN ID.
+//
+// The pointer stays valid until the pool is cleared.
+
+char *poolString(struct StringPool *stPool, int iId) {
+   if ((iId < 0) || (iId >= stPool->iLength)) return (NULL);
+   return (stPool->szString[iId]);
+}
+
+
+// ********************************************************************
+// isLowCardinalityName
+// ********************************************************************
+// RETURN 1 IF AN ATTRIBUTE NAME IS IN THE NULL TERMINATED LIST szNames.
+//
+// szNames NULL means the default list: list, chain, action, ...
+
+int isLowCardinalityName(char *szName, char **szNames) {
+   int i;
+
+   if (szNames == NULL) szNames = szDefaultLowCardinality;
+   for (i = 0; szNames[i] != NULL; i++) {
+      if (strcmp(szNames[i], szName) == 0) return (1);
+   }
+   return (0);
+}
+
+
+// ********************************************************************
+// connectionPool
+// ********************************************************************
+// RETURN THE STRING POOL OF A CONNECTION, CREATING IT ON FIRST USE.
+//
+// The caller holds a reference to it from now on.
+//
+// IMPORTANT: Use releaseConnectionPool when finished with it.
+
+struct StringPool *connectionPool(int fdSock) {
+   struct ConnectionPool *stConnection;
+
+   if (fdSock < 0) return (NULL);
+
+   pthread_mutex_lock(&stConnectionPoolLock);
+   if (fdSock >= iConnectionPoolSize) { // grow the fd table.
+      stConnectionPool = realloc(stConnectionPool, (fdSock + 1) * sizeof(struct ConnectionPool *));
+      memset(stConnectionPool + iConnectionPoolSize, 0, (fdSock + 1 - iConnectionPoolSize) * sizeof(struct ConnectionPool *));
+      iConnectionPoolSize = fdSock + 1;
+   }
+
+   if ((stConnection = stConnectionPool[fdSock]) == NULL) {
+      stConnection = stConnectionPool[fdSock] = malloc(sizeof(struct ConnectionPool));
+      debug_ram += sizeof(struct ConnectionPool);
+      initializeStringPool(&stConnection->stPool);
+      pthread_mutex_init(&stConnection->stLock, NULL);
+      stConnection->iRefs = 1; // the fd's own
+   }
+   stConnection->iRefs++;
+   pthread_mutex_unlock(&stConnectionPoolLock);
+
+   return (&stConnection->stPool);
+}
+
+
+// ********************************************************************
+// dropConnectionPool
+// ********************************************************************
+// DROP A REFERENCE, FREEING THE POOL WITH THE LAST ONE.
+//
+// Call with stConnectionPoolLock held.
+
+static void dropConnectionPool(struct ConnectionPool *stConnection) {
+   if (--stConnection->iRefs > 0) return;
+
+   clearStringPool(&stConnection->stPool);
+   pthread_mutex_destroy(&stConnection->stLock);
+   debug_ram -= sizeof(struct ConnectionPool);
+   free(stConnection);
+}
+
+
+// ********************************************************************
+// releaseConnectionPool
+// ********************************************************************
+// GIVE BACK A POOL RETURNED BY connectionPool.
+
+void releaseConnectionPool(struct StringPool *stPool) {
+   if (stPool == NULL) return;
+
+   pthread_mutex_lock(&stConnectionPoolLock);
+   dropConnectionPool((struct ConnectionPool *)stPool);
+   pthread_mutex_unlock(&stConnectionPoolLock);
+}
+
+
+// ********************************************************************
+// lockConnectionPool
+// ********************************************************************
+// TAKE THE LOCK OF A POOL RETURNED BY connectionPool.
+//
+// Other threads may add to the pool of the same fd at any time; hold
+// the lock while adding to it or looking anything up in it.  Strings
+// don't move, so a pointer from poolString may be kept after
+// unlockConnectionPool, for as long as the reference is held.
+
+void lockConnectionPool(struct StringPool *stPool) {
+   pthread_mutex_lock(&((struct ConnectionPool *)stPool)->stLock);
+}
+
+
+// ********************************************************************
+// unlockConnectionPool
+// ********************************************************************
+// GIVE BACK THE LOCK TAKEN BY lockConnectionPool.
+
+void unlockConnectionPool(struct StringPool *stPool) {
+   pthread_mutex_unlock(&((struct ConnectionPool *)stPool)->stLock);
+}
+
+
+// ********************************************************************
+// closeConnectionPool
+// ********************************************************************
+// TAKE THE POOL OFF A CLOSED fd.
+//
+// apiDisconnect calls this.  The next connection with the same fd gets
+// a new pool; the old one goes once its last AttrBlock is cleared.
+
+void closeConnectionPool(int fdSock) {
+   pthread_mutex_lock(&stConnectionPoolLock);
+   if ((fdSock >= 0) && (fdSock < iConnectionPoolSize) && stConnectionPool[fdSock]) {
+      dropConnectionPool(stConnectionPool[fdSock]);
+      stConnectionPool[fdSock] = NULL;
+   }
+   pthread_mutex_unlock(&stConnectionPoolLock);
+}
+
+
+// ********************************************************************
+// clearConnectionPools
+// ********************************************************************
+// TAKE THE POOLS OFF ALL fds AND FREE THE FD TABLE.
+//
+// Pools still held by AttrBlocks go when those are cleared.
+
+void clearConnectionPools(void) {
+   int i;
+
+   pthread_mutex_lock(&stConnectionPoolLock);
+   for (i = 0; i < iConnectionPoolSize; i++) {
+      if (stConnectionPool[i]) dropConnectionPool(stConnectionPool[i]);
+   }
+   free(stConnectionPool);
+   stConnectionPool = NULL;
+   iConnectionPoolSize = 0;
+   pthread_mutex_unlock(&stConnectionPoolLock);
+}
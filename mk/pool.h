@@ -0,0 +1,44 @@
+//
+// Mikrotik API 2.0 // String pools.
+//
+
+#ifndef MK_POOL
+#define MK_POOL
+
+// struct StringPool
+//
+// A StringPool stores each distinct string once and hands out small
+// integer ids for them, 0, 1, 2, ... in order of first use.  The
+// strings are packed NULL terminated into chunks that are never moved
+// or resized, a new and bigger one is started when the last is full,
+// so a string stays where it is until the pool is cleared.  They are
+// found again through an open addressing hash table of id + 1.
+// Two strings of one pool are equal exactly when their ids are.
+
+struct StringPool {
+        char **cChunk;    // chunks of packed NULL terminated strings
+        int iChunks;      // chunks in cChunk
+        long lChunkLen;   // bytes used in the last chunk
+        long lChunkSize;  // bytes allocated for the last chunk
+        long lDataSize;   // bytes allocated for all chunks
+        char **szString;  // each string, by id
+        int iLength;      // number of strings (next id)
+        int iSize;        // ids allocated in szString
+        int *iHash;       // open addressing table of id + 1
+        int iHashSize;    // slots in iHash (power of 2)
+};
+
+void initializeStringPool(struct StringPool *stPool);
+void clearStringPool(struct StringPool *stPool);
+int addStringToPool(struct StringPool *stPool, char *szString, int iLen);
+int findStringInPool(struct StringPool *stPool, char *szString, int iLen);
+char *poolString(struct StringPool *stPool, int iId);
+int isLowCardinalityName(char *szName, char **szNames);
+struct StringPool *connectionPool(int fdSock);
+void releaseConnectionPool(struct StringPool *stPool);
+void lockConnectionPool(struct StringPool *stPool);
+void unlockConnectionPool(struct StringPool *stPool);
+void closeConnectionPool(int fdSock);
+void clearConnectionPools(void);
+
+#endif // MK_POOL
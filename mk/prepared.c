@@ -0,0 +1,282 @@
+//
+// Mikrotik API 2.0 // Prepared commands.
+//
+// Commands sent over and over with only a value or two changing, such
+// as setting or removing rules by .id, are prepared once and then
+// encoded straight into the send buffer: no words are allocated or
+// copied and the constant lengths are not encoded again.
+//
+//    struct PreparedCommand stRemove;
+//    char *szWords[] = { "/ip/firewall/filter/remove", "=.id=%s", NULL };
+//
+//    prepareCommand(&stRemove, szWords);
+//    for (...) {
+//       preparedWrite(fdSock, &stRemove, szId);
+//       readBlock(fdSock, &stReply);
+//       ...
+//    }
+//    clearPreparedCommand(&stRemove);
+//
+// A word ending in %s, %d or %ld is a slot; everything before the % is
+// kept as its constant start.  As with printf, %d takes an int and %ld
+// a long.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+
+#include "api.h"
+#include "wire.h"
+#include "trace.h"
+#include "prepared.h"
+
+#define PREPARED_NUMBER_SIZE 24 // a long in decimal
+
+
+// ********************************************************************
+// slotType
+// ********************************************************************
+// RETURN THE SLOT TYPE OF A WORD OF iLen BYTES, OR 0 IF IT IS CONSTANT.
+//
+// The length of the % conversion is stored in *piSuffix.
+
+static int slotType(char *szWord, int iLen, int *piSuffix) {
+   if ((iLen >= 2) && (szWord[iLen - 2] == '%')) {
+      *piSuffix = 2;
+      if (szWord[iLen - 1] == 's') return (PREPARED_STRING);
+      if (szWord[iLen - 1] == 'd') return (PREPARED_INT);
+   }
+   if ((iLen >= 3) && (strcmp(szWord + iLen - 3, "%ld") == 0)) {
+      *piSuffix = 3;
+      return (PREPARED_LONG);
+   }
+   return (0);
+}
+
+
+// ********************************************************************
+// prepareCommand
+// ********************************************************************
+// PREPARE THE SENTENCE szWords (NULL TERMINATED) FOR SENDING.
+//
+// Returns 1, or 0 if it has more than PREPARED_MAX_SLOTS slots.
+//
+// IMPORTANT: Use clearPreparedCommand when finished with it.
+
+int prepareCommand(struct PreparedCommand *stPrepared, char **szWords) {
+   struct PreparedSlot *stSlot;
+   int iRun = 0; // bytes of cConst since the last slot
+   int iSize = 1; // final empty word
+   int iType;
+   int iSuffix;
+   int iLen;
+   int i;
+
+   memset(stPrepared, 0, sizeof(struct PreparedCommand));
+   for (i = 0; szWords[i] != NULL; i++) iSize += strlen(szWords[i]) + WIRE_MAX_LEN_SIZE;
+   stPrepared->cConst = malloc(iSize);
+   debug_ram += iSize;
+
+   for (i = 0; szWords[i] != NULL; i++) {
+      iLen = strlen(szWords[i]);
+      if ((iType = slotType(szWords[i], iLen, &iSuffix)) == 0) {
+         iLen = wireEncodeWord(szWords[i], iLen, stPrepared->cConst + stPrepared->iConstLen);
+         stPrepared->iConstLen += iLen;
+         iRun += iLen;
+         continue;
+      }
+
+      if (stPrepared->iSlots == PREPARED_MAX_SLOTS) {
+         stPrepared->iConstLen = iSize; // what clearPreparedCommand takes off debug_ram
+         clearPreparedCommand(stPrepared);
+         return (0);
+      }
+      stSlot = &stPrepared->stSlot[stPrepared->iSlots++];
+      stSlot->iConstLen = iRun;
+      stSlot->iType = iType;
+      stSlot->iPrefixLen = iLen - iSuffix;
+      stSlot->szPrefix = malloc(stSlot->iPrefixLen + 1);
+      memcpy(stSlot->szPrefix, szWords[i], stSlot->iPrefixLen);
+      stSlot->szPrefix[stSlot->iPrefixLen] = 0;
+      debug_ram += stSlot->iPrefixLen + 1;
+      iRun = 0;
+   }
+   stPrepared->cConst[stPrepared->iConstLen++] = 0;
+   stPrepared->cConst = realloc(stPrepared->cConst, stPrepared->iConstLen);
+   debug_ram -= iSize - stPrepared->iConstLen;
+
+   return (1);
+}
+
+
+// ********************************************************************
+// clearPreparedCommand
+// ********************************************************************
+// FREE ALL MEMORY OF A PREPARED COMMAND.
+
+void clearPreparedCommand(struct PreparedCommand *stPrepared) {
+   int i;
+
+   for (i = 0; i < stPrepared->iSlots; i++) {
+      debug_ram -= stPrepared->stSlot[i].iPrefixLen + 1;
+      free(stPrepared->stSlot[i].szPrefix);
+   }
+   debug_ram -= stPrepared->iConstLen + stPrepared->iBufferSize;
+   free(stPrepared->cConst);
+   free(stPrepared->cBuffer);
+   memset(stPrepared, 0, sizeof(struct PreparedCommand));
+}
+
+
+// ********************************************************************
+// formatNumber
+// ********************************************************************
+// WRITE lValue IN DECIMAL TO szOut (NOT TERMINATED).  RETURN ITS LENGTH.
+
+static int formatNumber(long lValue, char *szOut) {
+   char cDigits[PREPARED_NUMBER_SIZE];
+   unsigned long lAbs = (lValue < 0) ? -(unsigned long)lValue : (unsigned long)lValue;
+   int iDigits = 0;
+   int iLen = 0;
+
+   do {
+      cDigits[iDigits++] = '0' + lAbs % 10;
+      lAbs /= 10;
+   } while (lAbs);
+
+   if (lValue < 0) szOut[iLen++] = '-';
+   while (iDigits) szOut[iLen++] = cDigits[--iDigits];
+   return (iLen);
+}
+
+
+// ********************************************************************
+// collectValues
+// ********************************************************************
+// TAKE THE SLOT VALUES OFF vaValues.  RETURN THE ENCODED SIZE.
+//
+// Numbers are formatted into cNumbers, PREPARED_NUMBER_SIZE bytes each.
+
+static int collectValues(struct PreparedCommand *stPrepared, va_list vaValues,
+                         char **szValue, int *iValueLen, char *cNumbers) {
+   int iSize = stPrepared->iConstLen;
+   int i;
+
+   for (i = 0; i < stPrepared->iSlots; i++) {
+      if (stPrepared->stSlot[i].iType == PREPARED_STRING) {
+         szValue[i] = va_arg(vaValues, char *);
+         iValueLen[i] = strlen(szValue[i]);
+      } else {
+         szValue[i] = cNumbers + i * PREPARED_NUMBER_SIZE;
+         if (stPrepared->stSlot[i].iType == PREPARED_INT) iValueLen[i] = formatNumber(va_arg(vaValues, int), szValue[i]);
+         else iValueLen[i] = formatNumber(va_arg(vaValues, long), szValue[i]);
+      }
+      iSize += WIRE_MAX_LEN_SIZE + stPrepared->stSlot[i].iPrefixLen + iValueLen[i];
+   }
+   return (iSize);
+}
+
+
+// ********************************************************************
+// encodeValues
+// ********************************************************************
+// COPY THE CONSTANT RUNS AND ENCODE THE SLOTS INTO cOut.
+//
+// cOut must have room for what collectValues returned.  Returns the
+// number of bytes written.
+
+static int encodeValues(struct PreparedCommand *stPrepared, char **szValue, int *iValueLen, unsigned char *cOut) {
+   struct PreparedSlot *stSlot;
+   int iConst = 0;
+   int iLen = 0;
+   int i;
+
+   for (i = 0; i < stPrepared->iSlots; i++) {
+      stSlot = &stPrepared->stSlot[i];
+      memcpy(cOut + iLen, stPrepared->cConst + iConst, stSlot->iConstLen);
+      iLen += stSlot->iConstLen;
+      iConst += stSlot->iConstLen;
+
+      iLen += wireEncodeLen(stSlot->iPrefixLen + iValueLen[i], cOut + iLen);
+      memcpy(cOut + iLen, stSlot->szPrefix, stSlot->iPrefixLen);
+      iLen += stSlot->iPrefixLen;
+      memcpy(cOut + iLen, szValue[i], iValueLen[i]);
+      iLen += iValueLen[i];
+   }
+   memcpy(cOut + iLen, stPrepared->cConst + iConst, stPrepared->iConstLen - iConst);
+
+   return (iLen + stPrepared->iConstLen - iConst);
+}
+
+
+// ********************************************************************
+// preparedEncode
+// ********************************************************************
+// ENCODE THE COMMAND WITH THE SLOT VALUES INTO cOut.
+//
+// Pass one value per slot, in order: a char * for %s, an int for %d
+// and a long for %ld.
+// Returns the number of bytes written, or -1 if iSize may be too small
+// (nothing is written then).  Use this to gather several commands into
+// one write.
+
+int preparedEncode(struct PreparedCommand *stPrepared, unsigned char *cOut, int iSize, ...) {
+   char *szValue[PREPARED_MAX_SLOTS];
+   int iValueLen[PREPARED_MAX_SLOTS];
+   char cNumbers[PREPARED_MAX_SLOTS * PREPARED_NUMBER_SIZE];
+   va_list vaValues;
+   int iNeed;
+
+   va_start(vaValues, iSize);
+   iNeed = collectValues(stPrepared, vaValues, szValue, iValueLen, cNumbers);
+   va_end(vaValues);
+
+   if (iNeed > iSize) return (-1);
+   return (encodeValues(stPrepared, szValue, iValueLen, cOut));
+}
+
+
+// ********************************************************************
+// preparedWrite
+// ********************************************************************
+// SEND THE COMMAND WITH THE SLOT VALUES.  RETURN 1 ON SUCCESS.
+//
+// Values as for preparedEncode.  The sentence is encoded into the
+// command's own buffer and sent with a single write.
+
+int preparedWrite(int fdSock, struct PreparedCommand *stPrepared, ...) {
+   char *szValue[PREPARED_MAX_SLOTS];
+   int iValueLen[PREPARED_MAX_SLOTS];
+   char cNumbers[PREPARED_MAX_SLOTS * PREPARED_NUMBER_SIZE];
+   va_list vaValues;
+   int iNeed;
+   int iLen;
+   int iSent = 0;
+   int iWritten;
+   TRACE_START(llTrace);
+
+   va_start(vaValues, stPrepared);
+   iNeed = collectValues(stPrepared, vaValues, szValue, iValueLen, cNumbers);
+   va_end(vaValues);
+
+   if (iNeed > stPrepared->iBufferSize) {
+      stPrepared->cBuffer = realloc(stPrepared->cBuffer, iNeed);
+      debug_ram += iNeed - stPrepared->iBufferSize;
+      stPrepared->iBufferSize = iNeed;
+   }
+   iLen = encodeValues(stPrepared, szValue, iValueLen, stPrepared->cBuffer);
+
+   while (iSent < iLen) {
+      iWritten = apiWrite(fdSock, stPrepared->cBuffer + iSent, iLen - iSent);
+      if (iWritten <= 0) {
+         if ((iWritten < 0) && (errno == EINTR)) continue;
+         return (0);
+      }
+      iSent += iWritten;
+   }
+   TRACE_SPAN(llTrace, "preparedWrite", fdSock, NULL);
+   return (1);
+}
@@ -0,0 +1,47 @@
+//
+// Mikrotik API 2.0 // Prepared commands.
+//
+
+#ifndef MK_PREPARED
+#define MK_PREPARED
+
+#define PREPARED_MAX_SLOTS 16 // variable words per command
+
+#define PREPARED_STRING 1     // word ends in %s: char * value
+#define PREPARED_INT    2     // word ends in %d: int value, written in decimal
+#define PREPARED_LONG   3     // word ends in %ld: long value, written in decimal
+
+// struct PreparedSlot
+//
+// A variable word of a PreparedCommand: a constant start (e.g. "=.id=")
+// followed by the value passed when the command is sent.
+
+struct PreparedSlot {
+        int iConstLen;             // bytes of cConst sent before this word
+        int iType;                 // PREPARED_STRING, PREPARED_INT or PREPARED_LONG
+        char *szPrefix;            // constant start of the word
+        int iPrefixLen;
+};
+
+// struct PreparedCommand
+//
+// A sentence template.  Its constant words are encoded to wire bytes
+// once, when it is prepared, and kept in cConst in runs between the
+// variable words; the final empty word is part of the last run.
+// Sending it copies the runs and encodes only the variable words.
+
+struct PreparedCommand {
+        unsigned char *cConst;     // encoded constant words
+        int iConstLen;             // bytes in cConst
+        struct PreparedSlot stSlot[PREPARED_MAX_SLOTS];
+        int iSlots;
+        unsigned char *cBuffer;    // send buffer of preparedWrite
+        int iBufferSize;
+};
+
+int prepareCommand(struct PreparedCommand *stPrepared, char **szWords);
+void clearPreparedCommand(struct PreparedCommand *stPrepared);
+int preparedEncode(struct PreparedCommand *stPrepared, unsigned char *cOut, int iSize, ...);
+int preparedWrite(int fdSock, struct PreparedCommand *stPrepared, ...);
+
+#endif // MK_PREPARED
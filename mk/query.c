@@ -0,0 +1,618 @@
+//
+// Mikrotik API 2.0 // Local queries.
+//
+// Filters and counts over a ColumnBlock, evaluated a column at a time.
+// A predicate first decodes the values it needs into a plain array
+// (numbers, addresses) and then runs one branch free loop over that
+// array and the match bytes.  Those loops are simple enough for the
+// compiler to vectorize at -O2/-O3, so the per row cost is a few
+// instructions.
+//
+// Dictionary columns are cheaper still: the test runs once per
+// distinct value into a table indexed by code, and the row loop only
+// looks the code up.  Equality on a dictionary column is an integer
+// compare per row.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "api.h"
+#include "column.h"
+#include "pool.h"
+#include "query.h"
+#include "value.h"
+
+#define TEST_EQUALS 0
+#define TEST_PREFIX 1
+#define TEST_CIDR   2
+#define TEST_RANGE  3
+
+// a predicate on one value.
+struct QueryTest {
+        int iType;                 // TEST_...
+        char *szValue;             // equals / prefix
+        int iValueLen;
+        unsigned int iNet;         // cidr: network, masked
+        unsigned int iMask;        // cidr: netmask
+        int iPrefix;               // cidr: prefix length
+        long long llMin;           // range: inclusive bounds
+        long long llMax;
+};
+
+
+// ********************************************************************
+// queryParseNumber
+// ********************************************************************
+// PARSE A RouterOS NUMBER OR DURATION.
+//
+// Accepts plain integers ("1500", "-3") and anything valueParseDuration
+// accepts ("1w2d3h4m5s", "1.5s", "500ms", "01:02:03"), optionally
+// negative.  Durations are returned in whole seconds, the fraction
+// dropped, so a column converted to VALUE_DURATION compares the same.
+// Returns 1 on success, 0 if the value isn't a number.
+
+int queryParseNumber(char *szValue, long long *pllValue) {
+   long long llMs;
+   int iNegative = (*szValue == '-');
+
+   if (valueParseInt(szValue, pllValue)) return (1);
+   if (!valueParseDuration(szValue + iNegative, &llMs)) return (0);
+
+   *pllValue = iNegative ? -(llMs / 1000) : llMs / 1000;
+   return (1);
+}
+
+
+// ********************************************************************
+// queryParseIPv4
+// ********************************************************************
+// PARSE "a.b.c.d" OR "a.b.c.d/n".
+//
+// Stores the address in host byte order and the prefix length (32
+// without /n).  Returns 1 on success, 0 if not an IPv4 address.
+
+int queryParseIPv4(char *szValue, unsigned int *piAddr, int *piPrefix) {
+   unsigned int iAddr = 0;
+   unsigned int iByte;
+   int iDigits;
+   int i;
+   char *ptr = szValue;
+
+   for (i = 0; i < 4; i++) {
+      iByte = 0;
+      iDigits = 0;
+      while ((*ptr >= '0') && (*ptr <= '9') && (iDigits < 4)) {
+         iByte = iByte * 10 + (*ptr++ - '0');
+         iDigits++;
+      }
+      if ((iDigits == 0) || (iByte > 255)) return (0);
+      iAddr = (iAddr << 8) | iByte;
+      if (i < 3 && *ptr++ != '.') return (0);
+   }
+
+   *piPrefix = 32;
+   if (*ptr == '/') {
+      ptr++;
+      iByte = 0;
+      iDigits = 0;
+      while ((*ptr >= '0') && (*ptr <= '9') && (iDigits < 3)) {
+         iByte = iByte * 10 + (*ptr++ - '0');
+         iDigits++;
+      }
+      if ((iDigits == 0) || (iByte > 32)) return (0);
+      *piPrefix = iByte;
+   }
+   if (*ptr) return (0);
+
+   *piAddr = iAddr;
+   return (1);
+}
+
+
+// ********************************************************************
+// prefixMask
+// ********************************************************************
+// RETURN THE NETMASK OF A PREFIX LENGTH.
+
+static unsigned int prefixMask(int iPrefix) {
+   return (iPrefix == 0 ? 0 : 0xffffffffu << (32 - iPrefix));
+}
+
+
+// ********************************************************************
+// testValue
+// ********************************************************************
+// RETURN 1 IF ONE VALUE PASSES THE TEST.
+//
+// Used once per distinct value of a dictionary column.
+
+static int testValue(struct QueryTest *stTest, char *szValue) {
+   unsigned int iAddr;
+   long long llValue;
+   int iPrefix;
+
+   if (szValue == NULL) return (0);
+
+   switch (stTest->iType) {
+      case TEST_EQUALS: return (strcmp(szValue, stTest->szValue) == 0);
+      case TEST_PREFIX: return (strncmp(szValue, stTest->szValue, stTest->iValueLen) == 0);
+      case TEST_CIDR:
+         if (!queryParseIPv4(szValue, &iAddr, &iPrefix)) return (0);
+         return ((iPrefix >= stTest->iPrefix) && ((iAddr & stTest->iMask) == stTest->iNet));
+      case TEST_RANGE:
+         if (!queryParseNumber(szValue, &llValue)) return (0);
+         return ((llValue >= stTest->llMin) && (llValue <= stTest->llMax));
+   }
+   return (0);
+}
+
+
+// ********************************************************************
+// andDictColumn
+// ********************************************************************
+// APPLY A TEST TO A DICTIONARY COLUMN.
+//
+// The test runs once per distinct value into cCodeMatch, indexed by
+// code + 1 so COL_MISSING (-1) lands on slot 0 which never matches.
+
+static void andDictColumn(struct Query *stQuery, int iRows, struct Column *stColumn, struct QueryTest *stTest) {
+   unsigned char *cMatch = stQuery->cMatch;
+   unsigned char *cCodeMatch;
+   int *iCode = stColumn->iCode;
+   int iCodes = stColumn->stDict.iLength;
+   int i;
+
+   cCodeMatch = malloc(iCodes + 1);
+   debug_ram += iCodes + 1;
+   cCodeMatch[0] = 0;
+   for (i = 0; i < iCodes; i++) cCodeMatch[i + 1] = testValue(stTest, poolString(&stColumn->stDict, i));
+
+   for (i = 0; i < iRows; i++) cMatch[i] &= cCodeMatch[iCode[i] + 1];
+
+   debug_ram -= iCodes + 1;
+   free(cCodeMatch);
+}
+
+
+// ********************************************************************
+// andPlainStrings
+// ********************************************************************
+// APPLY AN EQUALS OR PREFIX TEST TO A PLAIN COLUMN.
+//
+// String compares don't vectorize; rows already dropped are skipped.
+
+static void andPlainStrings(struct Query *stQuery, int iRows, struct Column *stColumn, struct QueryTest *stTest) {
+   unsigned char *cMatch = stQuery->cMatch;
+   long *lOffset = stColumn->lOffset;
+   int i;
+
+   for (i = 0; i < iRows; i++) {
+      if (!cMatch[i]) continue;
+      if (lOffset[i] == COL_MISSING) cMatch[i] = 0;
+      else if (stTest->iType == TEST_EQUALS) cMatch[i] = (strcmp(stColumn->cData + lOffset[i], stTest->szValue) == 0);
+      else cMatch[i] = (strncmp(stColumn->cData + lOffset[i], stTest->szValue, stTest->iValueLen) == 0);
+   }
+}
+
+
+// ********************************************************************
+// andPlainRange
+// ********************************************************************
+// APPLY A NUMERIC RANGE TO A PLAIN COLUMN.
+//
+// Decode the selected rows into llValue (unparsable or missing rows
+// get a value outside any range via cValid = 0), then compare the
+// whole array in one branch free loop.
+
+static void andPlainRange(struct Query *stQuery, int iRows, struct Column *stColumn, struct QueryTest *stTest) {
+   unsigned char *cMatch = stQuery->cMatch;
+   unsigned char *cValid;
+   long long *llValue;
+   long long llMin = stTest->llMin;
+   long long llMax = stTest->llMax;
+   int i;
+
+   llValue = malloc(iRows * sizeof(long long));
+   cValid = malloc(iRows);
+   debug_ram += iRows * (sizeof(long long) + 1);
+
+   for (i = 0; i < iRows; i++) {
+      llValue[i] = 0;
+      cValid[i] = cMatch[i] && (stColumn->lOffset[i] != COL_MISSING) &&
+                  queryParseNumber(stColumn->cData + stColumn->lOffset[i], &llValue[i]);
+   }
+
+   for (i = 0; i < iRows; i++) cMatch[i] = cValid[i] & (llValue[i] >= llMin) & (llValue[i] <= llMax);
+
+   debug_ram -= iRows * (sizeof(long long) + 1);
+   free(llValue);
+   free(cValid);
+}
+
+
+// ********************************************************************
+// andPlainCIDR
+// ********************************************************************
+// APPLY A CIDR CONTAINMENT TEST TO A PLAIN COLUMN.
+//
+// Same shape as andPlainRange: decode addresses, then one masked
+// compare per row.  A value with its own prefix ("10.1.0.0/16") is
+// contained if it is no wider than the query network.
+
+static void andPlainCIDR(struct Query *stQuery, int iRows, struct Column *stColumn, struct QueryTest *stTest) {
+   unsigned char *cMatch = stQuery->cMatch;
+   unsigned int *iAddr;
+   unsigned char *cPrefix;
+   unsigned int iNet = stTest->iNet;
+   unsigned int iMask = stTest->iMask;
+   int iWant = stTest->iPrefix;
+   int iPrefix;
+   int i;
+
+   iAddr = malloc(iRows * sizeof(unsigned int));
+   cPrefix = malloc(iRows);
+   debug_ram += iRows * (sizeof(unsigned int) + 1);
+
+   for (i = 0; i < iRows; i++) {
+      iAddr[i] = 0;
+      cPrefix[i] = 0;
+      if (cMatch[i] && (stColumn->lOffset[i] != COL_MISSING) &&
+          queryParseIPv4(stColumn->cData + stColumn->lOffset[i], &iAddr[i], &iPrefix)) {
+         cPrefix[i] = iPrefix + 1; // 0 = not an address
+      }
+   }
+
+   for (i = 0; i < iRows; i++) {
+      cMatch[i] = (cPrefix[i] > iWant) & ((iAddr[i] & iMask) == iNet);
+   }
+
+   debug_ram -= iRows * (sizeof(unsigned int) + 1);
+   free(iAddr);
+   free(cPrefix);
+}
+
+
+// ********************************************************************
+// andTypedRange
+// ********************************************************************
+// APPLY A NUMERIC RANGE TO A COLUMN CONVERTED BY convertColumn.
+//
+// Nothing to parse: the numbers are there already.  Durations are kept
+// in ms and compared in seconds, like queryParseNumber returns them.
+// Rows that didn't convert to the column's type ("1h" in a VALUE_INT
+// column, "-3" in a VALUE_DURATION one) are parsed with
+// queryParseNumber, so the result is the same as for a plain column.
+
+static void andTypedRange(struct Query *stQuery, int iRows, struct Column *stColumn, struct QueryTest *stTest) {
+   unsigned char *cMatch = stQuery->cMatch;
+   struct Value *stValue = stColumn->stValue;
+   long long llScale = (stColumn->iValueType == VALUE_DURATION) ? 1000 : 1;
+   long long llValue;
+   char *szValue;
+   int i;
+
+   for (i = 0; i < iRows; i++) {
+      if (stValue[i].iType == VALUE_NONE) {
+         if (!cMatch[i]) continue;
+         szValue = columnValue(stColumn, i);
+         cMatch[i] = (szValue != NULL) && queryParseNumber(szValue, &llValue) &&
+                     (llValue >= stTest->llMin) && (llValue <= stTest->llMax);
+         continue;
+      }
+      llValue = stValue[i].llNumber / llScale;
+      cMatch[i] &= (llValue >= stTest->llMin) & (llValue <= stTest->llMax);
+   }
+}
+
+
+// ********************************************************************
+// andTypedCIDR
+// ********************************************************************
+// APPLY A CIDR CONTAINMENT TEST TO A COLUMN CONVERTED BY convertColumn.
+
+static void andTypedCIDR(struct Query *stQuery, int iRows, struct Column *stColumn, struct QueryTest *stTest) {
+   unsigned char *cMatch = stQuery->cMatch;
+   struct Value *stValue = stColumn->stValue;
+   unsigned char *cBytes;
+   unsigned int iAddr;
+   int i;
+
+   for (i = 0; i < iRows; i++) {
+      if (!cMatch[i]) continue;
+      cBytes = stValue[i].cBytes;
+      iAddr = ((unsigned int)cBytes[0] << 24) | (cBytes[1] << 16) | (cBytes[2] << 8) | cBytes[3];
+      cMatch[i] = (stValue[i].iType != VALUE_NONE) && (stValue[i].iFamily == VALUE_IPV4) &&
+                  (stValue[i].iLength >= stTest->iPrefix) && ((iAddr & stTest->iMask) == stTest->iNet);
+   }
+}
+
+
+// ********************************************************************
+// applyTest
+// ********************************************************************
+// AND A TEST ON THE NAMED COLUMN INTO THE SELECTION.
+//
+// Returns the number of rows still selected.
+
+static int applyTest(struct Query *stQuery, char *szName, struct QueryTest *stTest) {
+   struct Column *stColumn;
+   int iColumn;
+   int iRows;
+   int iCode;
+   int i;
+
+   if ((iColumn = findColumn(stQuery->stColumnBlock, szName)) < 0) {
+      memset(stQuery->cMatch, 0, stQuery->iRows);
+      return (0);
+   }
+   stColumn = &stQuery->stColumnBlock->stColumn[iColumn];
+
+   // rows past the last one stored in the column don't have the value
+   iRows = stColumn->iFilled < stQuery->iRows ? stColumn->iFilled : stQuery->iRows;
+   memset(stQuery->cMatch + iRows, 0, stQuery->iRows - iRows);
+
+   if ((stTest->iType == TEST_RANGE) && stColumn->stValue &&
+       ((stColumn->iValueType == VALUE_INT) || (stColumn->iValueType == VALUE_DURATION))) {
+      andTypedRange(stQuery, iRows, stColumn, stTest);
+   } else if ((stTest->iType == TEST_CIDR) && stColumn->stValue && (stColumn->iValueType == VALUE_ADDRESS)) {
+      andTypedCIDR(stQuery, iRows, stColumn, stTest);
+   } else if ((stColumn->iType == COL_DICT) && (stTest->iType == TEST_EQUALS)) {
+      iCode = columnDictCode(stColumn, stTest->szValue);
+      for (i = 0; i < iRows; i++) stQuery->cMatch[i] &= (stColumn->iCode[i] == iCode) & (iCode != COL_MISSING);
+   } else if (stColumn->iType == COL_DICT) {
+      andDictColumn(stQuery, iRows, stColumn, stTest);
+   } else if (stTest->iType == TEST_RANGE) {
+      andPlainRange(stQuery, iRows, stColumn, stTest);
+   } else if (stTest->iType == TEST_CIDR) {
+      andPlainCIDR(stQuery, iRows, stColumn, stTest);
+   } else {
+      andPlainStrings(stQuery, iRows, stColumn, stTest);
+   }
+
+   return (queryCount(stQuery));
+}
+
+
+// ********************************************************************
+// initializeQuery
+// ********************************************************************
+// START A QUERY WITH EVERY ROW OF A COLUMNBLOCK SELECTED.
+//
+// IMPORTANT: Use clearQuery when finished with it.
+
+void initializeQuery(struct Query *stQuery, struct ColumnBlock *stColumnBlock) {
+   stQuery->stColumnBlock = stColumnBlock;
+   stQuery->iRows = stColumnBlock->iRows;
+   stQuery->cMatch = malloc(stQuery->iRows + 1);
+   debug_ram += stQuery->iRows + 1;
+   memset(stQuery->cMatch, 1, stQuery->iRows);
+}
+
+
+// ********************************************************************
+// clearQuery
+// ********************************************************************
+// FREE THE SELECTION OF A QUERY.
+
+void clearQuery(struct Query *stQuery) {
+   debug_ram -= stQuery->iRows + 1;
+   free(stQuery->cMatch);
+   stQuery->cMatch = NULL;
+   stQuery->iRows = 0;
+}
+
+
+// ********************************************************************
+// queryEquals
+// ********************************************************************
+// KEEP THE ROWS WHOSE szName IS EXACTLY szValue.
+
+int queryEquals(struct Query *stQuery, char *szName, char *szValue) {
+   struct QueryTest stTest;
+
+   stTest.iType = TEST_EQUALS;
+   stTest.szValue = szValue;
+   stTest.iValueLen = strlen(szValue);
+   return (applyTest(stQuery, szName, &stTest));
+}
+
+
+// ********************************************************************
+// queryPrefix
+// ********************************************************************
+// KEEP THE ROWS WHOSE szName STARTS WITH szPrefix.
+
+int queryPrefix(struct Query *stQuery, char *szName, char *szPrefix) {
+   struct QueryTest stTest;
+
+   stTest.iType = TEST_PREFIX;
+   stTest.szValue = szPrefix;
+   stTest.iValueLen = strlen(szPrefix);
+   return (applyTest(stQuery, szName, &stTest));
+}
+
+
+// ********************************************************************
+// queryCIDR
+// ********************************************************************
+// KEEP THE ROWS WHOSE IPv4 ADDRESS (OR NETWORK) LIES IN szCIDR.
+//
+// szCIDR is "a.b.c.d/n".  Rows whose value isn't an IPv4 address or
+// prefix are dropped.  Returns -1 if szCIDR can't be parsed.
+
+int queryCIDR(struct Query *stQuery, char *szName, char *szCIDR) {
+   struct QueryTest stTest;
+   unsigned int iAddr;
+
+   if (!queryParseIPv4(szCIDR, &iAddr, &stTest.iPrefix)) return (-1);
+   stTest.iType = TEST_CIDR;
+   stTest.iMask = prefixMask(stTest.iPrefix);
+   stTest.iNet = iAddr & stTest.iMask;
+   return (applyTest(stQuery, szName, &stTest));
+}
+
+
+// ********************************************************************
+// queryRange
+// ********************************************************************
+// KEEP THE ROWS WHOSE szName IS A NUMBER FROM llMin TO llMax.
+//
+// Values are parsed with queryParseNumber, so durations compare in
+// seconds: timeout < 1h is queryRange(q, "timeout", 0, 3599).
+
+int queryRange(struct Query *stQuery, char *szName, long long llMin, long long llMax) {
+   struct QueryTest stTest;
+
+   stTest.iType = TEST_RANGE;
+   stTest.llMin = llMin;
+   stTest.llMax = llMax;
+   return (applyTest(stQuery, szName, &stTest));
+}
+
+
+// ********************************************************************
+// queryCount
+// ********************************************************************
+// RETURN THE NUMBER OF SELECTED ROWS.
+
+int queryCount(struct Query *stQuery) {
+   int iCount = 0;
+   int i;
+
+   for (i = 0; i < stQuery->iRows; i++) iCount += stQuery->cMatch[i];
+   return (iCount);
+}
+
+
+// ********************************************************************
+// queryNext
+// ********************************************************************
+// RETURN THE FIRST SELECTED ROW AT OR AFTER iRow, OR -1.
+//
+//   for (i = queryNext(&q, 0); i >= 0; i = queryNext(&q, i + 1)) ...
+
+int queryNext(struct Query *stQuery, int iRow) {
+   unsigned char *ptr;
+
+   if ((iRow < 0) || (iRow >= stQuery->iRows)) return (-1);
+   ptr = memchr(stQuery->cMatch + iRow, 1, stQuery->iRows - iRow);
+   return (ptr ? (int)(ptr - stQuery->cMatch) : -1);
+}
+
+
+// ********************************************************************
+// compareGroups
+// ********************************************************************
+// qsort COMPARE: BIGGEST GROUP FIRST, THEN BY VALUE.
+
+static int compareGroups(const void *pA, const void *pB) {
+   const struct QueryGroup *stA = pA;
+   const struct QueryGroup *stB = pB;
+
+   if (stA->lCount != stB->lCount) return (stA->lCount > stB->lCount ? -1 : 1);
+   return (strcmp(stA->szValue, stB->szValue));
+}
+
+
+// ********************************************************************
+// queryGroupCount
+// ********************************************************************
+// COUNT THE SELECTED ROWS PER VALUE OF szName.
+//
+// Returns an array of *piGroups groups, biggest first, to free with
+// freeQueryGroups.  Rows without the attribute aren't counted.  A
+// dictionary column is counted straight into an array by code; a
+// plain column is interned into a temporary StringPool first.
+
+struct QueryGroup *queryGroupCount(struct Query *stQuery, char *szName, int *piGroups) {
+   struct QueryGroup *stGroup;
+   struct StringPool stValues;
+   struct Column *stColumn;
+   long *lCount;
+   int *iFirstRow = NULL;
+   int iCodes;
+   int iSize;
+   int iRows;
+   int iColumn;
+   int iGroups = 0;
+   int iId;
+   int i;
+
+   *piGroups = 0;
+   if ((iColumn = findColumn(stQuery->stColumnBlock, szName)) < 0) return (NULL);
+   stColumn = &stQuery->stColumnBlock->stColumn[iColumn];
+   iRows = stColumn->iFilled < stQuery->iRows ? stColumn->iFilled : stQuery->iRows;
+
+   // lCount is indexed by code + 1, slot 0 collects the missing values
+   if (stColumn->iType == COL_DICT) {
+      iCodes = iSize = stColumn->stDict.iLength;
+      lCount = calloc(iSize + 1, sizeof(long));
+      debug_ram += (iSize + 1) * sizeof(long);
+      for (i = 0; i < iRows; i++) lCount[stColumn->iCode[i] + 1] += stQuery->cMatch[i];
+   } else {
+      initializeStringPool(&stValues);
+      iCodes = 0;
+      iSize = 64;
+      lCount = calloc(iSize + 1, sizeof(long));
+      iFirstRow = malloc(iSize * sizeof(int));
+      debug_ram += (iSize + 1) * sizeof(long) + iSize * sizeof(int);
+      for (i = 0; i < iRows; i++) {
+         if (!stQuery->cMatch[i] || (stColumn->lOffset[i] == COL_MISSING)) continue;
+         iId = addStringToPool(&stValues, stColumn->cData + stColumn->lOffset[i], strlen(stColumn->cData + stColumn->lOffset[i]));
+         if (iId == iSize) {
+            lCount = realloc(lCount, (iSize * 2 + 1) * sizeof(long));
+            iFirstRow = realloc(iFirstRow, iSize * 2 * sizeof(int));
+            debug_ram += iSize * (sizeof(long) + sizeof(int));
+            iSize *= 2;
+         }
+         if (iId == iCodes) { // first row with this value
+            lCount[iId + 1] = 0;
+            iFirstRow[iId] = i;
+            iCodes++;
+         }
+         lCount[iId + 1]++;
+      }
+      clearStringPool(&stValues);
+   }
+
+   for (i = 0; i < iCodes; i++) iGroups += (lCount[i + 1] > 0);
+   stGroup = malloc((iGroups + 1) * sizeof(struct QueryGroup));
+   debug_ram += (iGroups + 1) * sizeof(struct QueryGroup);
+   stGroup[iGroups].szValue = NULL; // end marker, freeQueryGroups counts on it
+   stGroup[iGroups].lCount = 0;
+
+   for (i = 0, iGroups = 0; i < iCodes; i++) {
+      if (lCount[i + 1] == 0) continue;
+      stGroup[iGroups].szValue = (stColumn->iType == COL_DICT) ? poolString(&stColumn->stDict, i) : columnValue(stColumn, iFirstRow[i]);
+      stGroup[iGroups].lCount = lCount[i + 1];
+      iGroups++;
+   }
+   qsort(stGroup, iGroups, sizeof(struct QueryGroup), compareGroups);
+
+   debug_ram -= (iSize + 1) * sizeof(long);
+   free(lCount);
+   if (iFirstRow) {
+      debug_ram -= iSize * sizeof(int);
+      free(iFirstRow);
+   }
+
+   *piGroups = iGroups;
+   return (stGroup);
+}
+
+
+// ********************************************************************
+// freeQueryGroups
+// ********************************************************************
+// FREE THE RESULT OF queryGroupCount.
+
+void freeQueryGroups(struct QueryGroup *stGroup) {
+   int i;
+
+   if (stGroup == NULL) return;
+   for (i = 0; stGroup[i].szValue; i++);
+   debug_ram -= (i + 1) * sizeof(struct QueryGroup);
+   free(stGroup);
+}
@@ -0,0 +1,46 @@
+//
+// Mikrotik API 2.0 // Local queries.
+//
+
+#ifndef MK_QUERY
+#define MK_QUERY
+
+#include "column.h"
+
+// struct Query
+//
+// A selection over the rows of a ColumnBlock.  cMatch holds one byte
+// per row, 1 while the row still matches.  Every predicate narrows the
+// selection (they AND together) and returns the number of rows left.
+// A predicate on a column the block doesn't have matches nothing.
+
+struct Query {
+        struct ColumnBlock *stColumnBlock;
+        unsigned char *cMatch;     // 1 per selected row
+        int iRows;                 // rows in cMatch
+};
+
+// struct QueryGroup
+//
+// One group of queryGroupCount.  szValue points into the ColumnBlock
+// and is valid as long as it is.
+
+struct QueryGroup {
+        char *szValue;
+        long lCount;
+};
+
+void initializeQuery(struct Query *stQuery, struct ColumnBlock *stColumnBlock);
+void clearQuery(struct Query *stQuery);
+int queryEquals(struct Query *stQuery, char *szName, char *szValue);
+int queryPrefix(struct Query *stQuery, char *szName, char *szPrefix);
+int queryCIDR(struct Query *stQuery, char *szName, char *szCIDR);
+int queryRange(struct Query *stQuery, char *szName, long long llMin, long long llMax);
+int queryCount(struct Query *stQuery);
+int queryNext(struct Query *stQuery, int iRow);
+struct QueryGroup *queryGroupCount(struct Query *stQuery, char *szName, int *piGroups);
+void freeQueryGroups(struct QueryGroup *stGroup);
+int queryParseNumber(char *szValue, long long *pllValue);
+int queryParseIPv4(char *szValue, unsigned int *piAddr, int *piPrefix);
+
+#endif // MK_QUERY
@@ -0,0 +1,362 @@
+//
+// Mikrotik API 2.0 // Rule reordering.
+//
+// Firewall rules are evaluated in order, so a TARGET holding the same
+// rules as the MASTER in another order still has to be fixed.  Instead
+// of removing and adding every rule, plan the fewest move commands that
+// restore the MASTER order and send those:
+//
+//    reorderPlan(&stBlockMASTER, cMasterSkip, &stBlockTARGET, cTargetSkip, &stPlan);
+//    if (!stPlan.iMissing && !stPlan.iExtra) {
+//       reorderApply(fdSock, "/ip/firewall/filter/move", &stBlockTARGET, &stPlan);
+//    }
+//    clearReorderPlan(&stPlan);
+//
+// Rows are compared by fingerprintSentence.  The longest common
+// subsequence of the two tables is the largest set of rows that are
+// already in the right order, and each of the others takes exactly one
+// move, so no plan can do with fewer.  It is found by Hunt-Szymanski
+// in O(p log n) for p pairs of equal rows, which is O(n log n) when the
+// rows are distinct: a 5000 rule table with three rules out of place
+// costs three moves.  A table with so many equal rows that p passes
+// REORDER_MAX_PAIRS matches equal rows in order instead; the plan is
+// still correct, just not always the shortest.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "api.h"
+#include "fingerprint.h"
+#include "prepared.h"
+#include "reorder.h"
+
+
+// ********************************************************************
+// classifyRows
+// ********************************************************************
+// GIVE EVERY ROW THE ID OF ITS CONTENT.
+//
+// TARGET rows with the same fingerprint share a class id, 0..n-1, and
+// a MASTER row gets the id of the TARGET rows equal to it.  Rows that
+// don't take part get -1; so do MASTER rows the TARGET doesn't have,
+// which are counted in iMissing.  Returns the number of classes.
+
+static int classifyRows(struct Block *stMaster, char *cMasterSkip, struct Block *stTarget, char *cTargetSkip,
+                        int *iMasterClass, int *iTargetClass, struct ReorderPlan *stPlan) {
+   unsigned long long *lHash; // per class
+   unsigned long long lRow;
+   int *iKey;                 // per slot: class with that hash, -1 if empty
+   int iSlots = 16;
+   int iMask;
+   int iClasses = 0;
+   int i, j;
+
+   while (iSlots < 2 * stTarget->iLength) iSlots *= 2;
+   iMask = iSlots - 1;
+   lHash = malloc(stTarget->iLength * sizeof(unsigned long long) + 1);
+   iKey = malloc(iSlots * sizeof(int));
+   debug_ram += stTarget->iLength * sizeof(unsigned long long) + 1 + iSlots * sizeof(int);
+   memset(iKey, 0xff, iSlots * sizeof(int)); // -1
+
+   for (i = 0; i < stTarget->iLength; i++) {
+      iTargetClass[i] = -1;
+      if ((stTarget->stSentence[i]->iReturnValue != DATA) || (cTargetSkip && cTargetSkip[i])) continue;
+      lRow = fingerprintSentence(stTarget->stSentence[i]);
+      for (j = lRow & iMask; (iKey[j] >= 0) && (lHash[iKey[j]] != lRow); j = (j + 1) & iMask);
+      if (iKey[j] < 0) {
+         lHash[iClasses] = lRow;
+         iKey[j] = iClasses++;
+      }
+      iTargetClass[i] = iKey[j];
+   }
+
+   for (i = 0; i < stMaster->iLength; i++) {
+      iMasterClass[i] = -1;
+      if ((stMaster->stSentence[i]->iReturnValue != DATA) || (cMasterSkip && cMasterSkip[i])) continue;
+      lRow = fingerprintSentence(stMaster->stSentence[i]);
+      for (j = lRow & iMask; (iKey[j] >= 0) && (lHash[iKey[j]] != lRow); j = (j + 1) & iMask);
+      if (iKey[j] < 0) stPlan->iMissing++;
+      else iMasterClass[i] = iKey[j];
+   }
+
+   debug_ram -= stTarget->iLength * sizeof(unsigned long long) + 1 + iSlots * sizeof(int);
+   free(lHash);
+   free(iKey);
+   return (iClasses);
+}
+
+
+// ********************************************************************
+// markInOrder
+// ********************************************************************
+// FLAG THE MASTER ROWS OF THE LONGEST RUN ALREADY IN TARGET ORDER.
+//
+// The longest increasing subsequence of the matched TARGET rows, by
+// patience sorting: iTail[k] is the MASTER row ending the best run of
+// length k + 1 found so far, iPrev links each row to the one before it.
+// cStay must come in cleared.  Returns the length of the run.
+
+static int markInOrder(struct ReorderPlan *stPlan, char *cStay) {
+   int *iTail;
+   int *iPrev;
+   int *iMatch = stPlan->iMatch;
+   int iRun = 0;
+   int iLow, iHigh, iMid;
+   int i;
+
+   iTail = malloc(stPlan->iRows * sizeof(int) + 1);
+   iPrev = malloc(stPlan->iRows * sizeof(int) + 1);
+   debug_ram += 2 * (stPlan->iRows * sizeof(int) + 1);
+
+   for (i = 0; i < stPlan->iRows; i++) {
+      if (iMatch[i] < 0) continue;
+
+      iLow = 0; // first run whose tail is past this row
+      iHigh = iRun;
+      while (iLow < iHigh) {
+         iMid = (iLow + iHigh) / 2;
+         if (iMatch[iTail[iMid]] < iMatch[i]) iLow = iMid + 1;
+         else iHigh = iMid;
+      }
+      iPrev[i] = iLow ? iTail[iLow - 1] : -1;
+      iTail[iLow] = i;
+      if (iLow == iRun) iRun++;
+   }
+
+   for (i = iRun ? iTail[iRun - 1] : -1; i >= 0; i = iPrev[i]) cStay[i] = 1;
+
+   debug_ram -= 2 * (stPlan->iRows * sizeof(int) + 1);
+   free(iTail);
+   free(iPrev);
+   return (iRun);
+}
+
+
+// ********************************************************************
+// markCommon
+// ********************************************************************
+// FLAG THE MASTER ROWS OF THE LONGEST COMMON SUBSEQUENCE AND MATCH THEM.
+//
+// Hunt-Szymanski: every MASTER row is paired with each TARGET row of
+// its class, those taken last to first so one MASTER row never extends
+// its own run; the longest increasing run of TARGET rows over all
+// pairs is the longest common subsequence.  One node per pair records
+// the run it ended.  Sets iMatch and cStay of the rows in it, cUsed of
+// their TARGET rows.  Returns the length of the run.
+
+static int markCommon(struct ReorderPlan *stPlan, int *iMasterClass, int *iStart, int *iPos, long lPairs,
+                      char *cStay, char *cUsed) {
+   int *iNodeRow;    // per pair: MASTER row
+   int *iNodeTarget; // per pair: TARGET row
+   int *iNodePrev;   // per pair: node before it in its run, -1 if none
+   int *iTail;       // per run length: node ending the best run
+   int iNodes = 0;
+   int iRun = 0;
+   int iLow, iHigh, iMid;
+   int i, j, c;
+
+   iNodeRow = malloc(lPairs * sizeof(int) + 1);
+   iNodeTarget = malloc(lPairs * sizeof(int) + 1);
+   iNodePrev = malloc(lPairs * sizeof(int) + 1);
+   iTail = malloc(stPlan->iRows * sizeof(int) + 1);
+   debug_ram += 3 * (lPairs * sizeof(int) + 1) + stPlan->iRows * sizeof(int) + 1;
+
+   for (i = 0; i < stPlan->iRows; i++) {
+      if ((c = iMasterClass[i]) < 0) continue;
+      for (j = iStart[c + 1] - 1; j >= iStart[c]; j--) {
+         iLow = 0; // first run whose tail is at or past this TARGET row
+         iHigh = iRun;
+         while (iLow < iHigh) {
+            iMid = (iLow + iHigh) / 2;
+            if (iNodeTarget[iTail[iMid]] < iPos[j]) iLow = iMid + 1;
+            else iHigh = iMid;
+         }
+         iNodeRow[iNodes] = i;
+         iNodeTarget[iNodes] = iPos[j];
+         iNodePrev[iNodes] = iLow ? iTail[iLow - 1] : -1;
+         iTail[iLow] = iNodes++;
+         if (iLow == iRun) iRun++;
+      }
+   }
+
+   for (j = iRun ? iTail[iRun - 1] : -1; j >= 0; j = iNodePrev[j]) {
+      stPlan->iMatch[iNodeRow[j]] = iNodeTarget[j];
+      cStay[iNodeRow[j]] = 1;
+      cUsed[iNodeTarget[j]] = 1;
+   }
+
+   debug_ram -= 3 * (lPairs * sizeof(int) + 1) + stPlan->iRows * sizeof(int) + 1;
+   free(iNodeRow);
+   free(iNodeTarget);
+   free(iNodePrev);
+   free(iTail);
+   return (iRun);
+}
+
+
+// ********************************************************************
+// reorderPlan
+// ********************************************************************
+// PLAN THE MOVES THAT PUT THE TARGET ROWS IN MASTER ORDER.
+//
+// Only DATA sentences take part, and not those flagged in cMasterSkip
+// or cTargetSkip (either may be NULL).  Returns the number of moves.
+//
+// IMPORTANT: Use clearReorderPlan when finished with it.
+
+int reorderPlan(struct Block *stMaster, char *cMasterSkip, struct Block *stTarget, char *cTargetSkip, struct ReorderPlan *stPlan) {
+   int *iMasterClass;
+   int *iTargetClass;
+   int *iCount;       // per class: MASTER rows, later the next TARGET row to hand out
+   int *iStart;       // per class: first of its TARGET rows in iPos
+   int *iPos;         // TARGET rows by class, in order within each
+   char *cStay;       // per MASTER row: stays where it is
+   char *cUsed;       // per TARGET row: kept by markCommon
+   long lPairs = 0;
+   int iClasses;
+   int iMatched = 0;
+   int iRun;
+   int iBefore = -1; // TARGET row of the next MASTER row, placed already
+   int i, c;
+
+   memset(stPlan, 0, sizeof(struct ReorderPlan));
+   stPlan->iRows = stMaster->iLength;
+   stPlan->iMatch = malloc(stPlan->iRows * sizeof(int) + 1);
+   debug_ram += stPlan->iRows * sizeof(int) + 1;
+   for (i = 0; i < stPlan->iRows; i++) stPlan->iMatch[i] = -1;
+
+   iMasterClass = malloc(stMaster->iLength * sizeof(int) + 1);
+   iTargetClass = malloc(stTarget->iLength * sizeof(int) + 1);
+   debug_ram += (stMaster->iLength + stTarget->iLength) * sizeof(int) + 2;
+   iClasses = classifyRows(stMaster, cMasterSkip, stTarget, cTargetSkip, iMasterClass, iTargetClass, stPlan);
+
+   // sort the TARGET rows by class, counting the rows of each.
+   iCount = calloc(iClasses + 1, sizeof(int));
+   iStart = calloc(iClasses + 2, sizeof(int));
+   iPos = malloc(stTarget->iLength * sizeof(int) + 1);
+   debug_ram += (2 * iClasses + 3) * sizeof(int) + stTarget->iLength * sizeof(int) + 1;
+   for (i = 0; i < stMaster->iLength; i++) if (iMasterClass[i] >= 0) iCount[iMasterClass[i]]++;
+   for (i = 0; i < stTarget->iLength; i++) if (iTargetClass[i] >= 0) iStart[iTargetClass[i] + 2]++;
+   for (c = 0; c < iClasses; c++) {
+      if (iCount[c] > iStart[c + 2]) stPlan->iMissing += iCount[c] - iStart[c + 2];
+      else stPlan->iExtra += iStart[c + 2] - iCount[c];
+      lPairs += (long)iCount[c] * iStart[c + 2];
+      iStart[c + 2] += iStart[c + 1];
+   }
+   for (i = 0; i < stTarget->iLength; i++) if (iTargetClass[i] >= 0) iPos[iStart[iTargetClass[i] + 1]++] = i;
+   // now iStart[c] is the first row of class c and iStart[c + 1] the end.
+
+   cStay = calloc(stPlan->iRows + 1, 1);
+   cUsed = calloc(stTarget->iLength + 1, 1);
+   debug_ram += stPlan->iRows + stTarget->iLength + 2;
+
+   if (lPairs <= REORDER_MAX_PAIRS) {
+      iRun = markCommon(stPlan, iMasterClass, iStart, iPos, lPairs, cStay, cUsed);
+   } else {
+      iRun = -1; // too many equal rows: match them in order below.
+   }
+
+   // every other MASTER row gets the first unused TARGET row of its class.
+   for (c = 0; c < iClasses; c++) iCount[c] = iStart[c];
+   for (i = 0; i < stPlan->iRows; i++) {
+      if (((c = iMasterClass[i]) < 0) || cStay[i]) continue;
+      while ((iCount[c] < iStart[c + 1]) && cUsed[iPos[iCount[c]]]) iCount[c]++;
+      if (iCount[c] == iStart[c + 1]) continue; // missing
+      stPlan->iMatch[i] = iPos[iCount[c]++];
+   }
+   for (i = 0; i < stPlan->iRows; i++) iMatched += (stPlan->iMatch[i] >= 0);
+   if (iRun < 0) iRun = markInOrder(stPlan, cStay);
+
+   stPlan->iMoves = iMatched - iRun;
+   stPlan->stMove = malloc(stPlan->iMoves * sizeof(struct ReorderMove) + 1);
+   debug_ram += stPlan->iMoves * sizeof(struct ReorderMove) + 1;
+
+   // last to first: each row out of place goes right before its MASTER
+   // successor, which is in place already (it stayed or was moved).
+   stPlan->iMoves = 0;
+   for (i = stPlan->iRows - 1; i >= 0; i--) {
+      if (stPlan->iMatch[i] < 0) continue;
+      if (!cStay[i]) {
+         stPlan->stMove[stPlan->iMoves].iRow = stPlan->iMatch[i];
+         stPlan->stMove[stPlan->iMoves].iBefore = iBefore;
+         stPlan->iMoves++;
+      }
+      iBefore = stPlan->iMatch[i];
+   }
+
+   debug_ram -= (stMaster->iLength + stTarget->iLength) * sizeof(int) + 2;
+   debug_ram -= (2 * iClasses + 3) * sizeof(int) + stTarget->iLength * sizeof(int) + 1;
+   debug_ram -= stPlan->iRows + stTarget->iLength + 2;
+   free(iMasterClass);
+   free(iTargetClass);
+   free(iCount);
+   free(iStart);
+   free(iPos);
+   free(cStay);
+   free(cUsed);
+   return (stPlan->iMoves);
+}
+
+
+// ********************************************************************
+// clearReorderPlan
+// ********************************************************************
+// FREE ALL MEMORY OF A PLAN.
+
+void clearReorderPlan(struct ReorderPlan *stPlan) {
+   if (stPlan->iMatch == NULL) return;
+   debug_ram -= stPlan->iRows * sizeof(int) + 1 + stPlan->iMoves * sizeof(struct ReorderMove) + 1;
+   free(stPlan->iMatch);
+   free(stPlan->stMove);
+   memset(stPlan, 0, sizeof(struct ReorderPlan));
+}
+
+
+// ********************************************************************
+// reorderApply
+// ********************************************************************
+// SEND THE MOVES OF A PLAN.  RETURN HOW MANY WERE DONE.
+//
+// szMove is the move command of the table, e.g. "/ip/firewall/filter/move".
+// Rows are named by the =.id= of their stTarget sentence.  Stops at the
+// first move the router refuses, printing its reply.
+
+int reorderApply(int fdSock, char *szMove, struct Block *stTarget, struct ReorderPlan *stPlan) {
+   char *szBefore[] = { szMove, "=numbers=%s", "=destination=%s", NULL };
+   char *szLast[] = { szMove, "=numbers=%s", NULL };
+   struct PreparedCommand stBefore;
+   struct PreparedCommand stLast;
+   struct ReorderMove *stMove;
+   struct Block stResult;
+   char *szId;
+   int iDone;
+   int iSent;
+   int i;
+
+   prepareCommand(&stBefore, szBefore);
+   prepareCommand(&stLast, szLast);
+
+   for (iDone = 0; iDone < stPlan->iMoves; iDone++) {
+      stMove = &stPlan->stMove[iDone];
+      szId = findWord(stTarget->stSentence[stMove->iRow], "=.id=") + 5;
+      if (stMove->iBefore < 0) iSent = preparedWrite(fdSock, &stLast, szId);
+      else iSent = preparedWrite(fdSock, &stBefore, szId, findWord(stTarget->stSentence[stMove->iBefore], "=.id=") + 5);
+      if (!iSent) break;
+
+      readBlock(fdSock, &stResult);
+      for (i = 0; i < stResult.iLength; i++) {
+         if ((stResult.stSentence[i]->iReturnValue == TRAP) || (stResult.stSentence[i]->iReturnValue == FATAL)) {
+            printSentence(stResult.stSentence[i]);
+            iSent = 0;
+         }
+      }
+      clearBlock(&stResult);
+      if (!iSent) break;
+   }
+
+   clearPreparedCommand(&stBefore);
+   clearPreparedCommand(&stLast);
+   return (iDone);
+}
@@ -0,0 +1,45 @@
+//
+// Mikrotik API 2.0 // Rule reordering.
+//
+
+#ifndef MK_REORDER
+#define MK_REORDER
+
+#include "api.h"
+
+#define REORDER_MAX_PAIRS (1L << 20) // pairs of equal rows for an exact plan
+
+// struct ReorderMove
+//
+// One move command: put target row iRow right before target row
+// iBefore, or at the end of the table if iBefore is -1.
+
+struct ReorderMove {
+        int iRow;
+        int iBefore;
+};
+
+// struct ReorderPlan
+//
+// How to bring the rows of a TARGET table into the order of a MASTER
+// table.  Rows are matched by content; the longest run of rows already
+// in MASTER order (where rows repeat, the matching that makes it
+// longest) stays where it is and every other matched row is moved
+// once.  The moves are only complete if the two tables
+// hold the same rows (iMissing and iExtra both 0); otherwise they put
+// the matched rows in order around the others.
+
+struct ReorderPlan {
+        int *iMatch;               // per MASTER row: TARGET row, -1 if none
+        int iRows;                 // rows in iMatch
+        struct ReorderMove *stMove;
+        int iMoves;
+        int iMissing;              // MASTER rows the TARGET doesn't have
+        int iExtra;                // TARGET rows the MASTER doesn't have
+};
+
+int reorderPlan(struct Block *stMaster, char *cMasterSkip, struct Block *stTarget, char *cTargetSkip, struct ReorderPlan *stPlan);
+void clearReorderPlan(struct ReorderPlan *stPlan);
+int reorderApply(int fdSock, char *szMove, struct Block *stTarget, struct ReorderPlan *stPlan);
+
+#endif // MK_REORDER
@@ -0,0 +1,315 @@
+//
+// Mikrotik API 2.0 // Sentence ring.
+//
+// Hands sentences from the thread reading a socket to the thread
+// processing them, for feeds that never end (torch, /listen, log
+// follow).  The reader decodes the next sentence while the consumer
+// works on the previous ones, and since slots keep their buffers no
+// memory is allocated once the ring has warmed up.
+//
+// Typical use, one ring per consumer thread:
+//
+//    reader:   while (ringReadSentence(fdSock, &stRing) != FATAL) ...
+//              ringClose(&stRing);
+//    consumer: while ((stSentence = ringPop(&stRing)) != NULL) {
+//                 ... use stSentence ...
+//                 ringRelease(&stRing);
+//              }
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "api.h"
+#include "ring.h"
+
+
+// ********************************************************************
+// ringWait
+// ********************************************************************
+// BACK OFF WHILE WAITING FOR THE OTHER SIDE OF THE RING.
+//
+// Spin first (the other thread is usually just about to move its
+// index), then give up the CPU, then sleep so an idle feed doesn't
+// burn a core.
+
+static void ringWait(int *piRound) {
+   struct timespec stSleep;
+
+   if (*piRound < 64) {
+      atomic_signal_fence(memory_order_seq_cst); // keep the compiler from collapsing the spin
+   } else if (*piRound < 256) {
+      sched_yield();
+   } else {
+      stSleep.tv_sec = 0;
+      stSleep.tv_nsec = 50000; // 50 us
+      nanosleep(&stSleep, NULL);
+   }
+   (*piRound)++;
+}
+
+
+// ********************************************************************
+// initializeRing
+// ********************************************************************
+// CREATE AN EMPTY RING OF iSize SLOTS (ROUNDED UP TO A POWER OF 2).
+//
+// Returns 1, or 0 if iSize is not positive.
+//
+// IMPORTANT: Use clearRing when finished with it.
+
+int initializeRing(struct SentenceRing *stRing, unsigned int iSize) {
+   unsigned int iSlots = 1;
+
+   memset(stRing, 0, sizeof(struct SentenceRing));
+   if (iSize == 0) return (0);
+   while (iSlots < iSize) iSlots *= 2;
+
+   stRing->stSlot = calloc(iSlots, sizeof(struct RingSlot));
+   debug_ram += iSlots * sizeof(struct RingSlot);
+   stRing->iSize = iSlots;
+   stRing->iMask = iSlots - 1;
+   atomic_init(&stRing->iHead, 0);
+   atomic_init(&stRing->iTail, 0);
+   atomic_init(&stRing->iClosed, 0);
+
+   return (1);
+}
+
+
+// ********************************************************************
+// clearRing
+// ********************************************************************
+// FREE A RING AND THE BUFFERS OF ALL ITS SLOTS.
+//
+// Both threads must be done with it.
+
+void clearRing(struct SentenceRing *stRing) {
+   struct RingSlot *stSlot;
+   unsigned int i;
+
+   for (i = 0; i < stRing->iSize; i++) {
+      stSlot = &stRing->stSlot[i];
+      debug_ram -= stSlot->lDataSize + stSlot->iWordSize * sizeof(char *);
+      free(stSlot->cData);
+      free(stSlot->stSentence.szWord);
+   }
+   debug_ram -= stRing->iSize * sizeof(struct RingSlot);
+   free(stRing->stSlot);
+   memset(stRing, 0, sizeof(struct SentenceRing));
+}
+
+
+// ********************************************************************
+// reserveSlot
+// ********************************************************************
+// PRODUCER: WAIT FOR A FREE SLOT AND RETURN IT EMPTIED.
+
+static struct RingSlot *reserveSlot(struct SentenceRing *stRing) {
+   unsigned int iTail = atomic_load_explicit(&stRing->iTail, memory_order_relaxed);
+   struct RingSlot *stSlot;
+   int iRound = 0;
+
+   // the slot is free once the consumer has moved iHead past it
+   while (iTail - atomic_load_explicit(&stRing->iHead, memory_order_acquire) >= stRing->iSize) {
+      if (iRound == 0) stRing->lFullWaits++;
+      ringWait(&iRound);
+   }
+
+   stSlot = &stRing->stSlot[iTail & stRing->iMask];
+   stSlot->stSentence.iLength = 0;
+   stSlot->stSentence.iReturnValue = 0;
+
+   return (stSlot);
+}
+
+
+// ********************************************************************
+// commitSlot
+// ********************************************************************
+// PRODUCER: PUBLISH THE SLOT FILLED AFTER reserveSlot.
+
+static void commitSlot(struct SentenceRing *stRing) {
+   unsigned int iTail = atomic_load_explicit(&stRing->iTail, memory_order_relaxed);
+
+   atomic_store_explicit(&stRing->iTail, iTail + 1, memory_order_release);
+}
+
+
+// ********************************************************************
+// addSlotWord
+// ********************************************************************
+// MAKE ROOM FOR A WORD OF iLen BYTES AT lOffset AND RECORD IT.
+//
+// The word pointer is stored as an offset for now; cData may still
+// move.  finishSlot turns the offsets into pointers.  Returns the
+// address to copy the word to.
+
+static char *addSlotWord(struct RingSlot *stSlot, long lOffset, int iLen) {
+   struct Sentence *stSentence = &stSlot->stSentence;
+   long lNewSize;
+   int iNewSize;
+
+   if (lOffset + iLen + 1 > stSlot->lDataSize) {
+      lNewSize = stSlot->lDataSize ? stSlot->lDataSize : 256;
+      while (lNewSize < lOffset + iLen + 1) lNewSize *= 2;
+      stSlot->cData = realloc(stSlot->cData, lNewSize);
+      debug_ram += lNewSize - stSlot->lDataSize;
+      stSlot->lDataSize = lNewSize;
+   }
+   if (stSentence->iLength == stSlot->iWordSize) {
+      iNewSize = stSlot->iWordSize ? stSlot->iWordSize * 2 : 16;
+      stSentence->szWord = realloc(stSentence->szWord, iNewSize * sizeof(char *));
+      debug_ram += (iNewSize - stSlot->iWordSize) * sizeof(char *);
+      stSlot->iWordSize = iNewSize;
+   }
+   stSentence->szWord[stSentence->iLength++] = (char *)lOffset;
+
+   return (stSlot->cData + lOffset);
+}
+
+
+// ********************************************************************
+// finishSlot
+// ********************************************************************
+// TURN THE WORD OFFSETS OF A FILLED SLOT INTO POINTERS.
+
+static void finishSlot(struct RingSlot *stSlot) {
+   int i;
+
+   for (i = 0; i < stSlot->stSentence.iLength; i++) {
+      stSlot->stSentence.szWord[i] = stSlot->cData + (long)stSlot->stSentence.szWord[i];
+   }
+}
+
+
+// ********************************************************************
+// setRingReturnValue
+// ********************************************************************
+// SET iReturnValue FROM THE FIRST WORD OF A REPLY.
+
+static void setRingReturnValue(struct Sentence *stSentence, char *szWord) {
+   if (strcmp(szWord, "!re") == 0) stSentence->iReturnValue = DATA;
+   else if (strcmp(szWord, "!done") == 0) stSentence->iReturnValue = DONE;
+   else if (strcmp(szWord, "!trap") == 0) stSentence->iReturnValue = TRAP;
+   else if (strcmp(szWord, "!fatal") == 0) stSentence->iReturnValue = FATAL;
+}
+
+
+// ********************************************************************
+// ringReadSentence
+// ********************************************************************
+// PRODUCER: READ THE NEXT SENTENCE FROM THE SOCKET INTO THE RING.
+//
+// Waits for a free slot first, then reads the words straight into the
+// slot's buffer.  Returns the iReturnValue of the sentence (DATA,
+// DONE, TRAP, FATAL), or FATAL without queuing anything if the
+// connection was closed or failed, even part way through a sentence:
+// the slot is only committed once the empty word ending the sentence
+// has been read, so the consumer never sees a truncated sentence.
+
+int ringReadSentence(int fdSock, struct SentenceRing *stRing) {
+   struct RingSlot *stSlot = reserveSlot(stRing);
+   long lOffset = 0;
+   char *szWord;
+   int iRead;
+   int iBytes;
+   int iLen;
+
+   while ((iLen = readLen(fdSock)) != 0 || stSlot->stSentence.iLength == 0) {
+      if (iLen < 0) return (FATAL); // connection closed, the slot stays uncommitted
+      if (iLen == 0) continue;      // empty sentence, nothing to queue
+      szWord = addSlotWord(stSlot, lOffset, iLen);
+      for (iRead = 0; iRead < iLen; iRead += iBytes) {
+         if ((iBytes = apiRead(fdSock, szWord + iRead, iLen - iRead)) <= 0) return (FATAL); // connection closed
+      }
+      szWord[iLen] = 0;
+      lOffset += iLen + 1;
+   }
+
+   finishSlot(stSlot);
+   setRingReturnValue(&stSlot->stSentence, stSlot->stSentence.szWord[0]);
+   commitSlot(stRing);
+
+   return (stSlot->stSentence.iReturnValue);
+}
+
+
+// ********************************************************************
+// ringPushSentence
+// ********************************************************************
+// PRODUCER: COPY A SENTENCE INTO THE RING.
+//
+// For producers that don't read a socket.  Waits while the ring is
+// full.  stSentence is left as it is.
+
+void ringPushSentence(struct SentenceRing *stRing, struct Sentence *stSentence) {
+   struct RingSlot *stSlot = reserveSlot(stRing);
+   long lOffset = 0;
+   int iLen;
+   int i;
+
+   for (i = 0; i < stSentence->iLength; i++) {
+      iLen = strlen(stSentence->szWord[i]);
+      memcpy(addSlotWord(stSlot, lOffset, iLen), stSentence->szWord[i], iLen + 1);
+      lOffset += iLen + 1;
+   }
+   finishSlot(stSlot);
+   stSlot->stSentence.iReturnValue = stSentence->iReturnValue;
+   commitSlot(stRing);
+}
+
+
+// ********************************************************************
+// ringClose
+// ********************************************************************
+// PRODUCER: NO MORE SENTENCES WILL BE ADDED.
+//
+// ringPop returns NULL once the consumer has read what is left.
+
+void ringClose(struct SentenceRing *stRing) {
+   atomic_store_explicit(&stRing->iClosed, 1, memory_order_release);
+}
+
+
+// ********************************************************************
+// ringPop
+// ********************************************************************
+// CONSUMER: WAIT FOR THE NEXT SENTENCE AND RETURN IT.
+//
+// Returns NULL when the ring is closed and empty.  The sentence
+// belongs to the ring: don't clear or keep it, and call ringRelease
+// when done with it so the slot can be refilled.
+
+struct Sentence *ringPop(struct SentenceRing *stRing) {
+   unsigned int iHead = atomic_load_explicit(&stRing->iHead, memory_order_relaxed);
+   int iRound = 0;
+
+   while (atomic_load_explicit(&stRing->iTail, memory_order_acquire) == iHead) {
+      if (atomic_load_explicit(&stRing->iClosed, memory_order_acquire)) {
+         // the producer may have committed one more before closing
+         if (atomic_load_explicit(&stRing->iTail, memory_order_acquire) == iHead) return (NULL);
+         break;
+      }
+      if (iRound == 0) stRing->lEmptyWaits++;
+      ringWait(&iRound);
+   }
+
+   return (&stRing->stSlot[iHead & stRing->iMask].stSentence);
+}
+
+
+// ********************************************************************
+// ringRelease
+// ********************************************************************
+// CONSUMER: HAND THE SENTENCE FROM ringPop BACK TO THE PRODUCER.
+
+void ringRelease(struct SentenceRing *stRing) {
+   unsigned int iHead = atomic_load_explicit(&stRing->iHead, memory_order_relaxed);
+
+   atomic_store_explicit(&stRing->iHead, iHead + 1, memory_order_release);
+}
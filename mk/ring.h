@@ -0,0 +1,58 @@
+//
+// Mikrotik API 2.0 // Sentence ring.
+//
+
+#ifndef MK_RING
+#define MK_RING
+
+#include "api.h"
+
+#define RING_CACHE_LINE 64
+
+// struct RingSlot
+//
+// One slot of a SentenceRing.  The words of stSentence point into
+// cData, which, like the szWord array, stays allocated when the slot
+// is released and is reused by the next sentence written into it.
+
+struct RingSlot {
+        struct Sentence stSentence;
+        char *cData;               // packed NULL terminated words
+        long lDataSize;            // bytes allocated in cData
+        int iWordSize;             // pointers allocated in stSentence.szWord
+};
+
+// struct SentenceRing
+//
+// A bounded single producer / single consumer queue of sentences.  The
+// producer (the thread reading the socket) fills the slot at iTail and
+// publishes it by moving iTail; the consumer reads the slot at iHead
+// and hands it back by moving iHead.  Each index is written by one
+// thread only, so no locks are needed, and they sit on separate cache
+// lines so the two threads don't slow each other down.
+//
+// When the ring is full the producer waits for the consumer
+// (backpressure: a slow consumer slows the reader down instead of
+// growing memory).  When it is empty the consumer waits.  Waiting
+// spins briefly, then yields, then sleeps.
+
+struct SentenceRing {
+        struct RingSlot *stSlot;   // iSize slots
+        unsigned int iSize;        // power of 2
+        unsigned int iMask;        // iSize - 1
+        _Alignas(RING_CACHE_LINE) _Atomic unsigned int iTail; // next slot to fill (producer)
+        long lFullWaits;           // times the producer found the ring full
+        _Alignas(RING_CACHE_LINE) _Atomic unsigned int iHead; // next slot to read (consumer)
+        long lEmptyWaits;          // times the consumer found the ring empty
+        _Alignas(RING_CACHE_LINE) _Atomic int iClosed;        // producer is done
+};
+
+int initializeRing(struct SentenceRing *stRing, unsigned int iSize);
+void clearRing(struct SentenceRing *stRing);
+int ringReadSentence(int fdSock, struct SentenceRing *stRing);
+void ringPushSentence(struct SentenceRing *stRing, struct Sentence *stSentence);
+void ringClose(struct SentenceRing *stRing);
+struct Sentence *ringPop(struct SentenceRing *stRing);
+void ringRelease(struct SentenceRing *stRing);
+
+#endif // MK_RING
@@ -0,0 +1,463 @@
+//
+// Mikrotik API 2.0 // Shared connection.
+//
+// Lets any number of threads send commands over one logged in
+// connection instead of each opening and logging in its own.  A
+// background I/O thread owns the socket: it writes the submitted
+// sentences whole, one after the other, each with a unique .tag, and
+// hands every reply back to the thread that asked for it.
+//
+//    struct SharedConnection stShared;
+//    char *szWords[] = { "/system/resource/print", NULL };
+//    struct Block stReply;
+//
+//    fdSock = apiConnect("10.0.0.1", 8728);
+//    login_643(fdSock, "admin", "");
+//    initializeSharedConnection(&stShared, fdSock);
+//
+//    // from any thread:
+//    if (sharedCommand(&stShared, szWords, &stReply) == DONE) ...
+//    clearBlock(&stReply);
+//
+//    clearSharedConnection(&stShared);
+//    apiDisconnect(fdSock);
+//
+// Nothing else may read or write fdSock while it is shared.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include "api.h"
+#include "wire.h"
+#include "decoder.h"
+#include "shared.h"
+
+static void *sharedMain(void *pArg);
+static void onSharedSentence(struct Sentence *stSentence, void *pData);
+
+
+// ********************************************************************
+// initializeSharedConnection
+// ********************************************************************
+// SHARE THE LOGGED IN CONNECTION fdSock AND START ITS I/O THREAD.
+//
+// Returns 1 on success, 0 if the thread or its wake-up pipe could not
+// be created.  fdSock still belongs to the caller: close it after
+// clearSharedConnection.
+
+int initializeSharedConnection(struct SharedConnection *stShared, int fdSock) {
+   int i;
+
+   memset(stShared, 0, sizeof(struct SharedConnection));
+   stShared->fdSock = fdSock;
+   atomic_init(&stShared->stSubmitted, NULL);
+   atomic_init(&stShared->lNextTag, 1);
+   atomic_init(&stShared->iStop, 0);
+   atomic_init(&stShared->iFailed, 0);
+
+   if (pipe(stShared->fdWake) != 0) return (0);
+   for (i = 0; i < 2; i++) {
+      fcntl(stShared->fdWake[i], F_SETFL, fcntl(stShared->fdWake[i], F_GETFL) | O_NONBLOCK);
+      fcntl(stShared->fdWake[i], F_SETFD, FD_CLOEXEC);
+   }
+
+   initializeDecoder(&stShared->stDecoder, onSharedSentence, stShared);
+   stShared->iOutSize = SHARED_WRITE_SIZE;
+   stShared->cOut = malloc(SHARED_WRITE_SIZE);
+   debug_ram += SHARED_WRITE_SIZE;
+   pthread_mutex_init(&stShared->mutex, NULL);
+   pthread_cond_init(&stShared->cond, NULL);
+
+   stShared->iSockFlags = fcntl(fdSock, F_GETFL);
+   fcntl(fdSock, F_SETFL, stShared->iSockFlags | O_NONBLOCK);
+
+   if (pthread_create(&stShared->thread, NULL, sharedMain, stShared) != 0) {
+      fcntl(fdSock, F_SETFL, stShared->iSockFlags);
+      clearDecoder(&stShared->stDecoder);
+      debug_ram -= stShared->iOutSize;
+      free(stShared->cOut);
+      pthread_mutex_destroy(&stShared->mutex);
+      pthread_cond_destroy(&stShared->cond);
+      close(stShared->fdWake[0]);
+      close(stShared->fdWake[1]);
+      return (0);
+   }
+
+   return (1);
+}
+
+
+// ********************************************************************
+// freeSharedRequest
+// ********************************************************************
+// FREE A REQUEST AND ITS REPLY.
+//
+// Only for requests without a callback, once sharedWait has returned.
+
+void freeSharedRequest(struct SharedRequest *stRequest) {
+   clearBlock(&stRequest->stReply);
+   debug_ram -= sizeof(struct SharedRequest) + stRequest->iCommandLen;
+   free(stRequest->cCommand);
+   free(stRequest);
+}
+
+
+// ********************************************************************
+// completeRequest
+// ********************************************************************
+// SET THE RESULT OF A REQUEST AND TELL WHOEVER WAITS FOR IT.
+//
+// A request with a callback is freed once the callback returns.
+
+static void completeRequest(struct SharedConnection *stShared, struct SharedRequest *stRequest, int iResult) {
+   if (stRequest->onDone) {
+      atomic_store(&stRequest->iResult, iResult);
+      stRequest->onDone(stRequest, stRequest->pData);
+      freeSharedRequest(stRequest);
+      return;
+   }
+
+   pthread_mutex_lock(&stShared->mutex);
+   atomic_store(&stRequest->iResult, iResult);
+   pthread_cond_broadcast(&stShared->cond);
+   pthread_mutex_unlock(&stShared->mutex);
+}
+
+
+// ********************************************************************
+// failInFlight
+// ********************************************************************
+// THE CONNECTION IS GONE: COMPLETE EVERY REQUEST IN FLIGHT WITH FATAL.
+//
+// Requests submitted from now on fail straight away.
+
+static void failInFlight(struct SharedConnection *stShared) {
+   struct SharedRequest *stRequest;
+   int i;
+
+   atomic_store(&stShared->iFailed, 1);
+   for (i = 0; i < SHARED_BUCKETS; i++) {
+      while ((stRequest = stShared->stBucket[i]) != NULL) {
+         stShared->stBucket[i] = stRequest->stInFlight;
+         completeRequest(stShared, stRequest, FATAL);
+      }
+   }
+   stShared->lInFlight = 0;
+}
+
+
+// ********************************************************************
+// takeSubmitted
+// ********************************************************************
+// TAKE EVERY SUBMITTED REQUEST OFF THE STACK, OLDEST FIRST.
+
+static struct SharedRequest *takeSubmitted(struct SharedConnection *stShared) {
+   struct SharedRequest *stRequest = atomic_exchange(&stShared->stSubmitted, NULL);
+   struct SharedRequest *stOldest = NULL;
+   struct SharedRequest *stNext;
+
+   while (stRequest) { // the stack is newest first; reverse it
+      stNext = stRequest->stNext;
+      stRequest->stNext = stOldest;
+      stOldest = stRequest;
+      stRequest = stNext;
+   }
+   return (stOldest);
+}
+
+
+// ********************************************************************
+// flushOutput
+// ********************************************************************
+// WRITE AS MUCH OF THE OUTPUT BUFFER AS THE SOCKET TAKES.
+
+static void flushOutput(struct SharedConnection *stShared) {
+   int iWritten;
+
+   while (stShared->iOutSent < stShared->iOutLen) {
+      iWritten = apiWrite(stShared->fdSock, stShared->cOut + stShared->iOutSent, stShared->iOutLen - stShared->iOutSent);
+      if (iWritten < 0) {
+         if (errno == EINTR) continue;
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+      }
+      if (iWritten <= 0) {
+         failInFlight(stShared);
+         stShared->iOutLen = stShared->iOutSent = 0;
+         return;
+      }
+      stShared->iOutSent += iWritten;
+   }
+   stShared->iOutLen = stShared->iOutSent = 0;
+}
+
+
+// ********************************************************************
+// sendSubmitted
+// ********************************************************************
+// PUT THE SUBMITTED REQUESTS IN FLIGHT AND WRITE WHAT THE SOCKET TAKES.
+//
+// The commands are gathered in the output buffer so a burst of
+// requests costs a single write.  Every sentence goes in whole, so
+// commands from different threads never interleave on the wire.
+// Nothing is taken while the buffer holds SHARED_WRITE_SIZE bytes.
+
+static void sendSubmitted(struct SharedConnection *stShared) {
+   struct SharedRequest *stRequest;
+   struct SharedRequest *stNext;
+   int iBucket;
+
+   flushOutput(stShared); // make room first, or a full buffer would never take the rest.
+   if (stShared->iOutLen - stShared->iOutSent < SHARED_WRITE_SIZE) {
+      if (stShared->iOutSent > 0) { // move the rest to the front to make room.
+         memmove(stShared->cOut, stShared->cOut + stShared->iOutSent, stShared->iOutLen - stShared->iOutSent);
+         stShared->iOutLen -= stShared->iOutSent;
+         stShared->iOutSent = 0;
+      }
+
+      for (stRequest = takeSubmitted(stShared); stRequest; stRequest = stNext) {
+         stNext = stRequest->stNext;
+         if (atomic_load(&stShared->iFailed)) {
+            completeRequest(stShared, stRequest, FATAL);
+            continue;
+         }
+
+         iBucket = stRequest->lTag & (SHARED_BUCKETS - 1);
+         stRequest->stInFlight = stShared->stBucket[iBucket];
+         stShared->stBucket[iBucket] = stRequest;
+         stShared->lInFlight++;
+
+         if (stShared->iOutLen + stRequest->iCommandLen > stShared->iOutSize) {
+            debug_ram -= stShared->iOutSize;
+            while (stShared->iOutLen + stRequest->iCommandLen > stShared->iOutSize) stShared->iOutSize *= 2;
+            stShared->cOut = realloc(stShared->cOut, stShared->iOutSize);
+            debug_ram += stShared->iOutSize;
+         }
+         memcpy(stShared->cOut + stShared->iOutLen, stRequest->cCommand, stRequest->iCommandLen);
+         stShared->iOutLen += stRequest->iCommandLen;
+      }
+   }
+   flushOutput(stShared);
+}
+
+
+// ********************************************************************
+// onSharedSentence
+// ********************************************************************
+// DECODER CALLBACK: ADD A REPLY SENTENCE TO ITS REQUEST.
+//
+// The request completes with its !done.  An untagged !fatal means the
+// router is closing the session.
+
+static void onSharedSentence(struct Sentence *stSentence, void *pData) {
+   struct SharedConnection *stShared = pData;
+   struct SharedRequest **pstLink;
+   struct SharedRequest *stRequest = NULL;
+   long lTag = -1;
+   int i;
+
+   for (i = 1; i < stSentence->iLength; i++) {
+      if (strncmp(stSentence->szWord[i], ".tag=", 5) == 0) lTag = atol(stSentence->szWord[i] + 5);
+   }
+
+   if (lTag >= 0) {
+      for (pstLink = &stShared->stBucket[lTag & (SHARED_BUCKETS - 1)]; *pstLink; pstLink = &(*pstLink)->stInFlight) {
+         if ((*pstLink)->lTag == lTag) {
+            stRequest = *pstLink;
+            break;
+         }
+      }
+   }
+
+   if (stRequest == NULL) {
+      if (stSentence->iReturnValue == FATAL) failInFlight(stShared);
+      clearSentence(stSentence);
+      return;
+   }
+
+   if (stSentence->iReturnValue == TRAP) stRequest->iTrap = 1;
+   addSentenceToBlock(&stRequest->stReply, stSentence); // the Block owns the words now
+   if ((stSentence->iReturnValue != DONE) && (stSentence->iReturnValue != FATAL)) return;
+
+   *pstLink = stRequest->stInFlight;
+   stShared->lInFlight--;
+   if (stSentence->iReturnValue == FATAL) completeRequest(stShared, stRequest, FATAL);
+   else completeRequest(stShared, stRequest, stRequest->iTrap ? TRAP : DONE);
+}
+
+
+// ********************************************************************
+// sharedMain
+// ********************************************************************
+// I/O THREAD: SEND WHAT IS SUBMITTED, DECODE WHAT ARRIVES.
+//
+// Reading never waits for writing: the socket is polled for POLLOUT
+// only while output is pending.  After the connection fails the thread
+// stays up, failing whatever is still submitted, until
+// clearSharedConnection stops it.
+
+static void *sharedMain(void *pArg) {
+   struct SharedConnection *stShared = pArg;
+   struct pollfd stPoll[2];
+   char cDrain[64];
+   int iRead;
+
+   while (!atomic_load(&stShared->iStop)) {
+      stPoll[0].fd = stShared->fdWake[0];
+      stPoll[0].events = POLLIN;
+      stPoll[1].fd = atomic_load(&stShared->iFailed) ? -1 : stShared->fdSock;
+      stPoll[1].events = POLLIN | ((stShared->iOutSent < stShared->iOutLen) ? POLLOUT : 0);
+      stPoll[0].revents = stPoll[1].revents = 0;
+
+      if ((poll(stPoll, 2, -1) < 0) && (errno != EINTR)) break;
+
+      if (stPoll[0].revents) {
+         while (read(stShared->fdWake[0], cDrain, sizeof(cDrain)) > 0);
+      }
+      sendSubmitted(stShared);
+
+      if (stPoll[1].revents & ~POLLOUT) {
+         while ((iRead = decoderRead(&stShared->stDecoder, stShared->fdSock)) > 0); // until EAGAIN
+         if ((iRead == 0) || ((iRead < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))) failInFlight(stShared);
+      }
+   }
+
+   return (NULL);
+}
+
+
+// ********************************************************************
+// sharedSubmit
+// ********************************************************************
+// QUEUE A COMMAND (NULL TERMINATED WORDS, NO .tag) FROM ANY THREAD.
+//
+// With onDone the reply is delivered to onDone(stRequest, pData) on the
+// I/O thread, which must not keep stRequest or block for long; NULL is
+// returned.  Without it the request is returned: wait for it with
+// sharedWait, read stRequest->stReply, then freeSharedRequest.  If the
+// connection has failed the request completes at once with FATAL.
+
+struct SharedRequest *sharedSubmit(struct SharedConnection *stShared, char **szWords,
+                                   void (*onDone)(struct SharedRequest *, void *), void *pData) {
+   struct SharedRequest *stRequest;
+   struct SharedRequest *stOld;
+   char szTag[32];
+   int iLen = 1; // final empty word
+   int i;
+
+   stRequest = calloc(1, sizeof(struct SharedRequest));
+   stRequest->lTag = atomic_fetch_add(&stShared->lNextTag, 1);
+   stRequest->onDone = onDone;
+   stRequest->pData = pData;
+   initializeBlock(&stRequest->stReply);
+   atomic_init(&stRequest->iResult, 0);
+
+   // encode the whole sentence here, outside the I/O thread.
+   snprintf(szTag, sizeof(szTag), ".tag=%ld", stRequest->lTag);
+   for (i = 0; szWords[i] != NULL; i++) iLen += strlen(szWords[i]) + WIRE_MAX_LEN_SIZE;
+   iLen += strlen(szTag) + WIRE_MAX_LEN_SIZE;
+   stRequest->cCommand = malloc(iLen);
+   for (i = 0; szWords[i] != NULL; i++) {
+      stRequest->iCommandLen += wireEncodeWord(szWords[i], strlen(szWords[i]), stRequest->cCommand + stRequest->iCommandLen);
+   }
+   stRequest->iCommandLen += wireEncodeWord(szTag, strlen(szTag), stRequest->cCommand + stRequest->iCommandLen);
+   stRequest->cCommand[stRequest->iCommandLen++] = 0;
+   debug_ram += sizeof(struct SharedRequest) + stRequest->iCommandLen;
+
+   if (atomic_load(&stShared->iFailed)) {
+      completeRequest(stShared, stRequest, FATAL);
+      return (onDone ? NULL : stRequest);
+   }
+
+   // push on the lock-free stack; only the push onto an empty stack
+   // needs to wake the I/O thread.
+   stOld = atomic_load(&stShared->stSubmitted);
+   do {
+      stRequest->stNext = stOld;
+   } while (!atomic_compare_exchange_weak(&stShared->stSubmitted, &stOld, stRequest));
+   if (stOld == NULL) {
+      if (write(stShared->fdWake[1], "", 1) < 0) {
+         // pipe full: the I/O thread has wake-ups pending anyway
+      }
+   }
+
+   return (onDone ? NULL : stRequest);
+}
+
+
+// ********************************************************************
+// sharedWait
+// ********************************************************************
+// WAIT FOR A REQUEST WITHOUT CALLBACK TO COMPLETE.
+//
+// Returns DONE, TRAP or FATAL.  The reply is in stRequest->stReply.
+
+int sharedWait(struct SharedConnection *stShared, struct SharedRequest *stRequest) {
+   pthread_mutex_lock(&stShared->mutex);
+   while (atomic_load(&stRequest->iResult) == 0) pthread_cond_wait(&stShared->cond, &stShared->mutex);
+   pthread_mutex_unlock(&stShared->mutex);
+
+   return (atomic_load(&stRequest->iResult));
+}
+
+
+// ********************************************************************
+// sharedCommand
+// ********************************************************************
+// RUN A COMMAND AND WAIT FOR ITS REPLY.
+//
+// The reply goes into stReply (use clearBlock when finished with it).
+// Returns DONE, TRAP or FATAL.
+
+int sharedCommand(struct SharedConnection *stShared, char **szWords, struct Block *stReply) {
+   struct SharedRequest *stRequest = sharedSubmit(stShared, szWords, NULL, NULL);
+   int iResult = sharedWait(stShared, stRequest);
+
+   *stReply = stRequest->stReply; // hand the sentences over
+   initializeBlock(&stRequest->stReply);
+   freeSharedRequest(stRequest);
+
+   return (iResult);
+}
+
+
+// ********************************************************************
+// clearSharedConnection
+// ********************************************************************
+// STOP THE I/O THREAD AND FAIL WHAT IS STILL PENDING.
+//
+// No thread may submit once this has been called.  Requests still in
+// flight complete with FATAL.  fdSock is left open, blocking again if
+// it was before.
+
+void clearSharedConnection(struct SharedConnection *stShared) {
+   struct SharedRequest *stRequest;
+   struct SharedRequest *stNext;
+
+   atomic_store(&stShared->iStop, 1);
+   if (write(stShared->fdWake[1], "", 1) < 0) {
+      // pipe full: the I/O thread will wake up anyway
+   }
+   pthread_join(stShared->thread, NULL);
+
+   for (stRequest = takeSubmitted(stShared); stRequest; stRequest = stNext) {
+      stNext = stRequest->stNext;
+      completeRequest(stShared, stRequest, FATAL);
+   }
+   failInFlight(stShared);
+   fcntl(stShared->fdSock, F_SETFL, stShared->iSockFlags);
+
+   clearDecoder(&stShared->stDecoder);
+   debug_ram -= stShared->iOutSize;
+   free(stShared->cOut);
+   close(stShared->fdWake[0]);
+   close(stShared->fdWake[1]);
+   pthread_mutex_destroy(&stShared->mutex);
+   pthread_cond_destroy(&stShared->cond);
+}
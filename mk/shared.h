@@ -0,0 +1,85 @@
+//
+// Mikrotik API 2.0 // Shared connection.
+//
+
+#ifndef MK_SHARED
+#define MK_SHARED
+
+#include <pthread.h>
+
+#include "api.h"
+#include "decoder.h"
+
+#define SHARED_BUCKETS    256       // in-flight lookup table (power of 2)
+#define SHARED_WRITE_SIZE (64 * 1024) // pending output before submissions wait
+
+// struct SharedRequest
+//
+// One command submitted to a SharedConnection, and later its reply.
+// stNext links the lock-free submission stack; stInFlight links the
+// in-flight table and is only touched by the I/O thread.  iResult is
+// 0 until the reply is complete, then DONE, TRAP (a !trap came before
+// the !done) or FATAL (the connection failed).
+
+struct SharedRequest {
+        struct SharedRequest *stNext;      // submission stack
+        struct SharedRequest *stInFlight;  // in-flight bucket chain
+        unsigned char *cCommand;           // encoded sentence incl .tag
+        int iCommandLen;                   // bytes in cCommand
+        long lTag;                         // .tag of the command
+        struct Block stReply;              // reply sentences
+        int iTrap;                         // a !trap was received
+        _Atomic int iResult;               // 0 while pending
+        void (*onDone)(struct SharedRequest *stRequest, void *pData);
+        void *pData;
+};
+
+// struct SharedConnection
+//
+// One logged in connection used by many threads at once.  Any thread
+// can submit commands: they are pushed on a lock-free stack and the
+// I/O thread picks them all up at once, gives them back their order,
+// and writes each sentence whole with its own .tag.  Replies are
+// decoded as they arrive and matched to their request by tag.  A
+// request completes with its !done: its callback runs on the I/O
+// thread, or the thread waiting in sharedWait wakes up.
+//
+// fdWake is a pipe the I/O thread polls with the socket.  Submitters
+// only write to it when they find the stack empty; otherwise a wake-up
+// is already on its way.
+//
+// The socket is non-blocking while shared.  What the router does not
+// take yet waits in cOut and goes out when poll reports POLLOUT, so the
+// I/O thread keeps reading replies while a big write is pending.  With
+// more than SHARED_WRITE_SIZE bytes pending, new submissions stay on
+// the stack until the router catches up.
+
+struct SharedConnection {
+        int fdSock;                        // logged in API socket
+        int iSockFlags;                    // fdSock file flags to restore
+        int fdWake[2];                     // wakes the I/O thread
+        pthread_t thread;                  // the I/O thread
+        struct SharedRequest *_Atomic stSubmitted; // newest first
+        _Atomic long lNextTag;
+        _Atomic int iStop;                 // clearSharedConnection was called
+        _Atomic int iFailed;               // connection lost, new requests fail
+        struct Decoder stDecoder;          // I/O thread only
+        struct SharedRequest *stBucket[SHARED_BUCKETS]; // in flight by tag, I/O thread only
+        long lInFlight;                    // I/O thread only
+        unsigned char *cOut;               // sentences not yet written, I/O thread only
+        int iOutLen;                       // bytes in cOut
+        int iOutSent;                      // bytes of cOut written already
+        int iOutSize;                      // bytes allocated
+        pthread_mutex_t mutex;             // for sharedWait
+        pthread_cond_t cond;               // broadcast when a request completes
+};
+
+int initializeSharedConnection(struct SharedConnection *stShared, int fdSock);
+void clearSharedConnection(struct SharedConnection *stShared);
+struct SharedRequest *sharedSubmit(struct SharedConnection *stShared, char **szWords,
+                                   void (*onDone)(struct SharedRequest *, void *), void *pData);
+int sharedWait(struct SharedConnection *stShared, struct SharedRequest *stRequest);
+void freeSharedRequest(struct SharedRequest *stRequest);
+int sharedCommand(struct SharedConnection *stShared, char **szWords, struct Block *stReply);
+
+#endif // MK_SHARED
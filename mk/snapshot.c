@@ -0,0 +1,552 @@
+//
+// Mikrotik API 2.0 // Block snapshots.
+//
+// A Block keeps every word in its own malloc'd string, which is fine
+// for one reply but not for the firewall of thousands of routers held
+// in memory at once.  snapshotBlock freezes a Block into a single
+// compact allocation that can be queried row by row without expanding
+// it again.  See struct Snapshot in snapshot.h for the layout.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "api.h"
+#include "pool.h"
+#include "snapshot.h"
+
+// growable buffer the snapshot is built in.
+struct SnapBuffer {
+        unsigned char *cData;
+        unsigned int iLength;
+        unsigned int iSize;
+};
+
+// a pool value with its id, so qsort needs no context.
+struct SnapSortValue {
+        char *szValue;
+        int iId;
+};
+
+
+// ********************************************************************
+// reserveSnapBuffer
+// ********************************************************************
+// MAKE ROOM FOR iLen MORE BYTES AND RETURN THE OFFSET WHERE THEY GO.
+
+static unsigned int reserveSnapBuffer(struct SnapBuffer *stBuffer, unsigned int iLen) {
+   unsigned int iOffset = stBuffer->iLength;
+   unsigned int iNewSize;
+
+   if (stBuffer->iLength + iLen > stBuffer->iSize) {
+      iNewSize = stBuffer->iSize ? stBuffer->iSize * 2 : 4096;
+      while (iNewSize < stBuffer->iLength + iLen) iNewSize *= 2;
+      stBuffer->cData = realloc(stBuffer->cData, iNewSize);
+      debug_ram += (iNewSize - stBuffer->iSize);
+      stBuffer->iSize = iNewSize;
+   }
+   stBuffer->iLength += iLen;
+   return (iOffset);
+}
+
+
+// ********************************************************************
+// putVarint
+// ********************************************************************
+// APPEND AN UNSIGNED LEB128 VARINT.
+
+static void putVarint(struct SnapBuffer *stBuffer, unsigned int iValue) {
+   unsigned int iOffset;
+
+   do {
+      iOffset = reserveSnapBuffer(stBuffer, 1);
+      stBuffer->cData[iOffset] = (iValue & 0x7f) | (iValue >= 0x80 ? 0x80 : 0);
+      iValue >>= 7;
+   } while (iValue);
+}
+
+
+// ********************************************************************
+// putBytes
+// ********************************************************************
+// APPEND iLen BYTES.
+
+static void putBytes(struct SnapBuffer *stBuffer, char *cData, unsigned int iLen) {
+   unsigned int iOffset = reserveSnapBuffer(stBuffer, iLen);
+
+   if (iLen) memcpy(stBuffer->cData + iOffset, cData, iLen);
+}
+
+
+// ********************************************************************
+// alignSnapBuffer
+// ********************************************************************
+// PAD THE BUFFER TO A MULTIPLE OF 4 BYTES.
+
+static void alignSnapBuffer(struct SnapBuffer *stBuffer) {
+   unsigned int iPad = (4 - (stBuffer->iLength & 3)) & 3;
+   unsigned int iOffset = reserveSnapBuffer(stBuffer, iPad);
+
+   memset(stBuffer->cData + iOffset, 0, iPad);
+}
+
+
+// ********************************************************************
+// getVarint
+// ********************************************************************
+// READ AN UNSIGNED LEB128 VARINT AND ADVANCE *pcData PAST IT.
+
+static unsigned int getVarint(unsigned char **pcData) {
+   unsigned int iValue = 0;
+   int iShift = 0;
+   unsigned char c;
+
+   do {
+      c = *(*pcData)++;
+      iValue |= (unsigned int)(c & 0x7f) << iShift;
+      iShift += 7;
+   } while (c & 0x80);
+   return (iValue);
+}
+
+
+// ********************************************************************
+// splitSnapWord
+// ********************************************************************
+// RETURN THE LENGTH OF THE ATTRIBUTE PREFIX OF A WORD.
+//
+// "=name=value" and ".tag=value" have the prefix up to and including
+// the last equal sign of the name.  Other words have an empty prefix.
+
+static int splitSnapWord(char *szWord) {
+   char *ptr;
+
+   if ((szWord[0] == '=') && ((ptr = strchr(szWord + 1, '=')) != NULL)) return (ptr - szWord + 1);
+   if ((szWord[0] == '.') && ((ptr = strchr(szWord, '=')) != NULL)) return (ptr - szWord + 1);
+   return (0);
+}
+
+
+// ********************************************************************
+// compareSnapValue
+// ********************************************************************
+// QSORT COMPARE OF TWO SnapSortValues.
+//
+// Each element carries its own string, so sorting is safe from any
+// number of threads at once.
+
+static int compareSnapValue(const void *p1, const void *p2) {
+   return (strcmp(((struct SnapSortValue *)p1)->szValue, ((struct SnapSortValue *)p2)->szValue));
+}
+
+
+// ********************************************************************
+// putSnapValues
+// ********************************************************************
+// APPEND THE SORTED, FRONT CODED VALUES OF ONE ATTRIBUTE.
+//
+// Fills iRank with the code (sort position) of every pool id and
+// returns the offset of the restart table.
+
+static unsigned int putSnapValues(struct SnapBuffer *stBuffer, struct StringPool *stValues, int *iRank) {
+   struct SnapSortValue *stOrder;
+   unsigned int iRestarts;
+   unsigned int *lRestart;
+   char *szPrevious = "";
+   char *szValue;
+   int iShared;
+   int i;
+
+   stOrder = malloc(stValues->iLength * sizeof(struct SnapSortValue) + 1);
+   debug_ram += stValues->iLength * sizeof(struct SnapSortValue) + 1;
+   for (i = 0; i < stValues->iLength; i++) {
+      stOrder[i].szValue = poolString(stValues, i);
+      stOrder[i].iId = i;
+   }
+   qsort(stOrder, stValues->iLength, sizeof(struct SnapSortValue), compareSnapValue);
+
+   alignSnapBuffer(stBuffer);
+   iRestarts = reserveSnapBuffer(stBuffer, ((stValues->iLength + SNAP_RESTART - 1) / SNAP_RESTART) * sizeof(unsigned int));
+
+   for (i = 0; i < stValues->iLength; i++) {
+      iRank[stOrder[i].iId] = i;
+      szValue = stOrder[i].szValue;
+
+      if (i % SNAP_RESTART == 0) {
+         lRestart = (unsigned int *)(stBuffer->cData + iRestarts); // cData may have moved
+         lRestart[i / SNAP_RESTART] = stBuffer->iLength;
+         iShared = 0;
+      } else {
+         for (iShared = 0; szValue[iShared] && (szValue[iShared] == szPrevious[iShared]); iShared++);
+      }
+
+      putVarint(stBuffer, iShared);
+      putVarint(stBuffer, strlen(szValue + iShared));
+      putBytes(stBuffer, szValue + iShared, strlen(szValue + iShared));
+      szPrevious = szValue; // pool doesn't move while sorting
+   }
+
+   debug_ram -= stValues->iLength * sizeof(struct SnapSortValue) + 1;
+   free(stOrder);
+
+   return (iRestarts);
+}
+
+
+// ********************************************************************
+// snapshotBlock
+// ********************************************************************
+// FREEZE A BLOCK INTO A SNAPSHOT.
+//
+// Every sentence of the Block, including the final !done, becomes one
+// row, and every word is kept: snapshotSentence gives back exactly the
+// Sentence that went in.  The Block is not changed.
+//
+// IMPORTANT:  Must free the Snapshot with freeSnapshot.
+
+struct Snapshot *snapshotBlock(struct Block *stBlock) {
+   struct SnapBuffer stBuffer;
+   struct StringPool stPrefix;           // attribute prefixes
+   struct StringPool *stValues = NULL;   // distinct values of each attribute
+   int iValuesSize = 0;                  // pools allocated in stValues
+   int **iRank;                          // code of each value id, by attribute
+   int *iWord;                           // attribute, value id of every word
+   long lWords = 0;
+   struct Snapshot *stSnapshot;
+   struct SnapshotAttr *stAttr;
+   unsigned int *lRow;
+   unsigned int iOffset;
+   struct Sentence *stSentence;
+   int iPrefixLen;
+   int iAttr;
+   int i, j;
+   long k;
+
+   memset(&stBuffer, 0, sizeof(stBuffer));
+   initializeStringPool(&stPrefix);
+
+   for (i = 0; i < stBlock->iLength; i++) lWords += stBlock->stSentence[i]->iLength;
+   iWord = malloc(2 * lWords * sizeof(int) + 1);
+   debug_ram += 2 * lWords * sizeof(int) + 1;
+
+   // pass 1: pool the prefixes and the values of each attribute.
+   k = 0;
+   for (i = 0; i < stBlock->iLength; i++) {
+      stSentence = stBlock->stSentence[i];
+      for (j = 0; j < stSentence->iLength; j++) {
+         iPrefixLen = splitSnapWord(stSentence->szWord[j]);
+         iAttr = addStringToPool(&stPrefix, stSentence->szWord[j], iPrefixLen);
+         if (iAttr >= iValuesSize) {
+            stValues = realloc(stValues, (iAttr + 1) * sizeof(struct StringPool));
+            debug_ram += (iAttr + 1 - iValuesSize) * sizeof(struct StringPool);
+            for (; iValuesSize <= iAttr; iValuesSize++) initializeStringPool(&stValues[iValuesSize]);
+         }
+         iWord[k++] = iAttr;
+         iWord[k++] = addStringToPool(&stValues[iAttr], stSentence->szWord[j] + iPrefixLen, strlen(stSentence->szWord[j] + iPrefixLen));
+      }
+   }
+
+   // header, attribute table and row table have fixed sizes.
+   reserveSnapBuffer(&stBuffer, sizeof(struct Snapshot));
+   reserveSnapBuffer(&stBuffer, stPrefix.iLength * sizeof(struct SnapshotAttr));
+   reserveSnapBuffer(&stBuffer, (stBlock->iLength + 1) * sizeof(unsigned int));
+
+   // pass 2: values and prefix of each attribute.
+   iRank = malloc(stPrefix.iLength * sizeof(int *) + 1);
+   debug_ram += stPrefix.iLength * sizeof(int *) + 1;
+   for (i = 0; i < stPrefix.iLength; i++) {
+      iRank[i] = malloc(stValues[i].iLength * sizeof(int) + 1);
+      debug_ram += stValues[i].iLength * sizeof(int) + 1;
+
+      iOffset = putSnapValues(&stBuffer, &stValues[i], iRank[i]);
+      stAttr = (struct SnapshotAttr *)(stBuffer.cData + sizeof(struct Snapshot)) + i;
+      stAttr->iRestarts = iOffset;
+      stAttr->iValues = stValues[i].iLength;
+      stAttr->iPrefix = stBuffer.iLength;
+      putBytes(&stBuffer, poolString(&stPrefix, i), strlen(poolString(&stPrefix, i)) + 1);
+   }
+
+   // pass 3: rows.
+   k = 0;
+   for (i = 0; i < stBlock->iLength; i++) {
+      stSentence = stBlock->stSentence[i];
+      iOffset = stBuffer.iLength;
+      lRow = (unsigned int *)(stBuffer.cData + sizeof(struct Snapshot) + stPrefix.iLength * sizeof(struct SnapshotAttr));
+      lRow[i] = iOffset;
+      iOffset = reserveSnapBuffer(&stBuffer, 1);
+      stBuffer.cData[iOffset] = (unsigned char)stSentence->iReturnValue;
+      putVarint(&stBuffer, stSentence->iLength);
+      for (j = 0; j < stSentence->iLength; j++, k += 2) {
+         putVarint(&stBuffer, iWord[k]);
+         putVarint(&stBuffer, iRank[iWord[k]][iWord[k + 1]]);
+      }
+   }
+   lRow = (unsigned int *)(stBuffer.cData + sizeof(struct Snapshot) + stPrefix.iLength * sizeof(struct SnapshotAttr));
+   lRow[stBlock->iLength] = stBuffer.iLength;
+
+   // shrink to the exact size and fill in the header.
+   stSnapshot = realloc(stBuffer.cData, stBuffer.iLength);
+   debug_ram -= (stBuffer.iSize - stBuffer.iLength);
+   stSnapshot->iSize = stBuffer.iLength;
+   stSnapshot->iRows = stBlock->iLength;
+   stSnapshot->iAttrs = stPrefix.iLength;
+   stSnapshot->iAttrTable = sizeof(struct Snapshot);
+   stSnapshot->iRowTable = sizeof(struct Snapshot) + stPrefix.iLength * sizeof(struct SnapshotAttr);
+
+   for (i = 0; i < stPrefix.iLength; i++) {
+      debug_ram -= stValues[i].iLength * sizeof(int) + 1;
+      free(iRank[i]);
+      clearStringPool(&stValues[i]);
+   }
+   debug_ram -= stPrefix.iLength * sizeof(int *) + 1;
+   free(iRank);
+   debug_ram -= iValuesSize * sizeof(struct StringPool);
+   free(stValues);
+   clearStringPool(&stPrefix);
+   debug_ram -= 2 * lWords * sizeof(int) + 1;
+   free(iWord);
+
+   return (stSnapshot);
+}
+
+
+// ********************************************************************
+// freeSnapshot
+// ********************************************************************
+
+void freeSnapshot(struct Snapshot *stSnapshot) {
+   if (stSnapshot == NULL) return;
+   debug_ram -= stSnapshot->iSize;
+   free(stSnapshot);
+}
+
+
+// ********************************************************************
+// snapshotAttrEntry
+// ********************************************************************
+// RETURN THE TABLE ENTRY OF AN ATTRIBUTE.
+
+static struct SnapshotAttr *snapshotAttrEntry(struct Snapshot *stSnapshot, int iAttr) {
+   return ((struct SnapshotAttr *)((char *)stSnapshot + stSnapshot->iAttrTable) + iAttr);
+}
+
+
+// ********************************************************************
+// snapshotRowData
+// ********************************************************************
+// RETURN A POINTER TO THE ENCODED ROW OR NULL IF OUT OF RANGE.
+
+static unsigned char *snapshotRowData(struct Snapshot *stSnapshot, int iRow) {
+   unsigned int *lRow = (unsigned int *)((char *)stSnapshot + stSnapshot->iRowTable);
+
+   if ((iRow < 0) || (iRow >= (int)stSnapshot->iRows)) return (NULL);
+   return ((unsigned char *)stSnapshot + lRow[iRow]);
+}
+
+
+// ********************************************************************
+// snapshotAttr
+// ********************************************************************
+// RETURN THE INDEX OF AN ATTRIBUTE OR -1 IF NO ROW HAS IT.
+//
+// szName is the bare attribute name ("address") or a full prefix
+// (".tag=", or "" for the reply words).
+
+int snapshotAttr(struct Snapshot *stSnapshot, char *szName) {
+   int iLen = strlen(szName);
+   char *szPrefix;
+   int i;
+
+   for (i = 0; i < (int)stSnapshot->iAttrs; i++) {
+      szPrefix = (char *)stSnapshot + snapshotAttrEntry(stSnapshot, i)->iPrefix;
+      if (strcmp(szPrefix, szName) == 0) return (i);
+      if ((szPrefix[0] == '=') && (strncmp(szPrefix + 1, szName, iLen) == 0) &&
+          (szPrefix[iLen + 1] == '=') && (szPrefix[iLen + 2] == 0)) return (i);
+   }
+   return (-1);
+}
+
+
+// ********************************************************************
+// snapshotCode
+// ********************************************************************
+// RETURN THE VALUE CODE OF AN ATTRIBUTE IN A ROW OR -1 IF MISSING.
+
+int snapshotCode(struct Snapshot *stSnapshot, int iRow, int iAttr) {
+   unsigned char *cData;
+   unsigned int iWords;
+
+   if ((cData = snapshotRowData(stSnapshot, iRow)) == NULL) return (-1);
+   cData++; // return value
+   iWords = getVarint(&cData);
+   while (iWords--) {
+      if ((int)getVarint(&cData) == iAttr) return (getVarint(&cData));
+      getVarint(&cData); // code of another attribute
+   }
+   return (-1);
+}
+
+
+// ********************************************************************
+// snapshotString
+// ********************************************************************
+// DECODE VALUE iCode OF AN ATTRIBUTE INTO szBuffer.
+//
+// Works like snprintf: at most iBufferSize - 1 bytes and a NULL are
+// stored and the full length of the value is returned, so a NULL
+// buffer of size 0 just measures it.  Returns -1 for a bad code.
+
+int snapshotString(struct Snapshot *stSnapshot, int iAttr, int iCode, char *szBuffer, int iBufferSize) {
+   struct SnapshotAttr *stAttr;
+   unsigned int *lRestart;
+   unsigned char *cData;
+   int iLength = 0;
+   int iShared, iSuffix;
+   int iCopy;
+   int i;
+
+   if ((iAttr < 0) || (iAttr >= (int)stSnapshot->iAttrs)) return (-1);
+   stAttr = snapshotAttrEntry(stSnapshot, iAttr);
+   if ((iCode < 0) || (iCode >= (int)stAttr->iValues)) return (-1);
+
+   lRestart = (unsigned int *)((char *)stSnapshot + stAttr->iRestarts);
+   cData = (unsigned char *)stSnapshot + lRestart[iCode / SNAP_RESTART];
+
+   // the visible part of each value only depends on the visible part of
+   // the previous one, so a short buffer still decodes correctly.
+   for (i = 0; i <= iCode % SNAP_RESTART; i++) {
+      iShared = getVarint(&cData);
+      iSuffix = getVarint(&cData);
+      iCopy = iBufferSize - 1 - iShared;
+      if (iCopy > iSuffix) iCopy = iSuffix;
+      if (iCopy > 0) memcpy(szBuffer + iShared, cData, iCopy);
+      cData += iSuffix;
+      iLength = iShared + iSuffix;
+   }
+
+   if (iBufferSize > 0) szBuffer[iLength < iBufferSize ? iLength : iBufferSize - 1] = 0;
+   return (iLength);
+}
+
+
+// ********************************************************************
+// snapshotFindCode
+// ********************************************************************
+// RETURN THE CODE OF A VALUE OF AN ATTRIBUTE OR -1 IF IT DOESN'T OCCUR.
+//
+// Binary search over the restart entries, then a scan of at most
+// SNAP_RESTART front coded entries without decoding them.
+
+int snapshotFindCode(struct Snapshot *stSnapshot, int iAttr, char *szValue) {
+   struct SnapshotAttr *stAttr;
+   unsigned int *lRestart;
+   unsigned char *cData;
+   int iValueLen = strlen(szValue);
+   int iLow, iHigh, iMiddle;
+   int iMatched;  // bytes of szValue matched by the current entry
+   int iShared, iSuffix;
+   int iCmp;
+   int i;
+
+   if ((iAttr < 0) || (iAttr >= (int)stSnapshot->iAttrs)) return (-1);
+   stAttr = snapshotAttrEntry(stSnapshot, iAttr);
+   if (stAttr->iValues == 0) return (-1);
+   lRestart = (unsigned int *)((char *)stSnapshot + stAttr->iRestarts);
+
+   // last restart entry <= szValue.
+   iLow = 0;
+   iHigh = (stAttr->iValues - 1) / SNAP_RESTART;
+   while (iLow < iHigh) {
+      iMiddle = (iLow + iHigh + 1) / 2;
+      cData = (unsigned char *)stSnapshot + lRestart[iMiddle];
+      getVarint(&cData); // shared, always 0
+      iSuffix = getVarint(&cData);
+      iCmp = memcmp(cData, szValue, iSuffix < iValueLen ? iSuffix : iValueLen);
+      if ((iCmp < 0) || ((iCmp == 0) && (iSuffix <= iValueLen))) iLow = iMiddle;
+      else iHigh = iMiddle - 1;
+   }
+
+   cData = (unsigned char *)stSnapshot + lRestart[iLow];
+   iMatched = 0;
+   for (i = iLow * SNAP_RESTART; (i < (int)stAttr->iValues) && (i < (iLow + 1) * SNAP_RESTART); i++) {
+      iShared = getVarint(&cData);
+      iSuffix = getVarint(&cData);
+      if (iShared <= iMatched) { // entry agrees with szValue up to iShared
+         iMatched = iShared;
+         while ((iMatched < iValueLen) && (iMatched - iShared < iSuffix) &&
+                (cData[iMatched - iShared] == (unsigned char)szValue[iMatched])) iMatched++;
+         if ((iMatched == iValueLen) && (iShared + iSuffix == iValueLen)) return (i);
+      }
+      cData += iSuffix;
+   }
+   return (-1);
+}
+
+
+// ********************************************************************
+// snapshotValue
+// ********************************************************************
+// DECODE THE VALUE OF A NAMED ATTRIBUTE OF A ROW INTO szBuffer.
+//
+// Same return as snapshotString; -1 if the row doesn't have it.
+
+int snapshotValue(struct Snapshot *stSnapshot, int iRow, char *szName, char *szBuffer, int iBufferSize) {
+   int iAttr;
+   int iCode;
+
+   if ((iAttr = snapshotAttr(stSnapshot, szName)) < 0) return (-1);
+   if ((iCode = snapshotCode(stSnapshot, iRow, iAttr)) < 0) return (-1);
+   return (snapshotString(stSnapshot, iAttr, iCode, szBuffer, iBufferSize));
+}
+
+
+// ********************************************************************
+// snapshotReturnValue
+// ********************************************************************
+// RETURN THE iReturnValue OF A ROW (DATA, DONE, TRAP, FATAL) OR 0.
+
+int snapshotReturnValue(struct Snapshot *stSnapshot, int iRow) {
+   unsigned char *cData;
+
+   if ((cData = snapshotRowData(stSnapshot, iRow)) == NULL) return (0);
+   return (cData[0]);
+}
+
+
+// ********************************************************************
+// snapshotSentence
+// ********************************************************************
+// EXPAND ONE ROW BACK INTO A SENTENCE.
+//
+// IMPORTANT:  Must free the Sentence with clearSentence.
+
+void snapshotSentence(struct Snapshot *stSnapshot, int iRow, struct Sentence *stSentence) {
+   unsigned char *cData;
+   unsigned int iWords;
+   char *szPrefix;
+   char *szWord;
+   int iPrefixLen;
+   int iLen;
+   int iAttr;
+   int iCode;
+
+   initializeSentence(stSentence);
+   if ((cData = snapshotRowData(stSnapshot, iRow)) == NULL) return;
+
+   stSentence->iReturnValue = *cData++;
+   iWords = getVarint(&cData);
+   while (iWords--) {
+      iAttr = getVarint(&cData);
+      iCode = getVarint(&cData);
+      szPrefix = (char *)stSnapshot + snapshotAttrEntry(stSnapshot, iAttr)->iPrefix;
+      iPrefixLen = strlen(szPrefix);
+      iLen = snapshotString(stSnapshot, iAttr, iCode, NULL, 0);
+
+      szWord = malloc(iPrefixLen + iLen + 1);
+      memcpy(szWord, szPrefix, iPrefixLen);
+      snapshotString(stSnapshot, iAttr, iCode, szWord + iPrefixLen, iLen + 1);
+      addWordToSentence(stSentence, szWord);
+      free(szWord);
+   }
+}
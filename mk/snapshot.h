@@ -0,0 +1,59 @@
+//
+// Mikrotik API 2.0 // Block snapshots.
+//
+
+#ifndef MK_SNAPSHOT
+#define MK_SNAPSHOT
+
+#include "api.h"
+
+#define SNAP_RESTART 16 // values between full (not prefix compressed) entries
+
+// struct Snapshot
+//
+// A frozen, compressed copy of a Block in one allocation that starts
+// with this header.  Everything after it is addressed by offsets from
+// the start of the snapshot, so a snapshot can be written to a file and
+// read back (or mmapped) as is on the same kind of host.
+//
+// Each word is split into an attribute prefix ("=address=", ".tag=",
+// or "" for words like "!re") and a value.  Per attribute the distinct
+// values are sorted and front coded: every entry stores the length it
+// shares with the previous value and the rest, with a full entry every
+// SNAP_RESTART values.  A row is its return value and a list of
+// (attribute, value code) varints.  The row table gives random access
+// to rows and the restart tables to values, so reading one value never
+// decodes more than SNAP_RESTART entries.
+//
+// Codes follow the sort order of the values, so within one snapshot
+// equal values have equal codes and codes compare like strcmp.
+
+struct Snapshot {
+        unsigned int iSize;       // bytes of the whole snapshot
+        unsigned int iRows;       // number of sentences
+        unsigned int iAttrs;      // number of attributes
+        unsigned int iRowTable;   // offset of iRows + 1 row offsets
+        unsigned int iAttrTable;  // offset of iAttrs SnapshotAttr entries
+};
+
+// struct SnapshotAttr
+//
+// One attribute of a Snapshot.  All members are offsets or counts.
+
+struct SnapshotAttr {
+        unsigned int iPrefix;     // offset of the NULL terminated prefix
+        unsigned int iValues;     // number of distinct values
+        unsigned int iRestarts;   // offset of the restart table (entry offsets)
+};
+
+struct Snapshot *snapshotBlock(struct Block *stBlock);
+void freeSnapshot(struct Snapshot *stSnapshot);
+int snapshotAttr(struct Snapshot *stSnapshot, char *szName);
+int snapshotCode(struct Snapshot *stSnapshot, int iRow, int iAttr);
+int snapshotFindCode(struct Snapshot *stSnapshot, int iAttr, char *szValue);
+int snapshotString(struct Snapshot *stSnapshot, int iAttr, int iCode, char *szBuffer, int iBufferSize);
+int snapshotValue(struct Snapshot *stSnapshot, int iRow, char *szName, char *szBuffer, int iBufferSize);
+int snapshotReturnValue(struct Snapshot *stSnapshot, int iRow);
+void snapshotSentence(struct Snapshot *stSnapshot, int iRow, struct Sentence *stSentence);
+
+#endif // MK_SNAPSHOT
@@ -6,14 +6,184 @@
 // Enter {BLANK LINK} to send the Sentence
 // Enter quit to end session.
 //
+// Batch mode (-b file, - for stdin) reads the sentences from a file in
+// the same format, one word per line and a blank line after each
+// sentence.  Lines starting with # are comments.  Up to iWindow
+// sentences are kept in flight, each with its own .tag, and replies
+// are printed as they arrive.  When a sentence is done its latency is
+// printed as a "# tag" line; totals and percentiles follow at the end.
+// Point it at a router or a mock server to measure it under load:
+//
+//    mktest -b commands.txt -w 32 -p 8728 10.0.0.1 admin password
+//
 
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include "../api.h"
 
 int iPort = 8728;
+int iWindow = 16;          // batch mode: sentences in flight
+
+// a batch mode sentence that was sent.
+struct BatchCommand {
+        long long llSent;  // send time (us)
+        long long llDone;  // time of !done (us), 0 while in flight
+        int iReplies;      // sentences received for it
+        int iTrap;         // a !trap was received
+        char szCommand[64]; // first word, for the report
+};
+
+
+/********************************************************************
+ ********************************************************************/
+
+static long long nowMicroseconds(void) {
+   struct timespec stNow;
+
+   clock_gettime(CLOCK_MONOTONIC, &stNow);
+   return ((long long)stNow.tv_sec * 1000000 + stNow.tv_nsec / 1000);
+}
+
+
+/********************************************************************
+ * Read the next sentence of a command file.  Returns 0 at the end.
+ ********************************************************************/
+
+static int readBatchSentence(FILE *fInput, struct Sentence *stSentence) {
+   char *szLine = NULL;
+   size_t lSize = 0;
+   ssize_t lLen;
+
+   initializeSentence(stSentence);
+   while ((lLen = getline(&szLine, &lSize, fInput)) >= 0) {
+      while ((lLen > 0) && ((szLine[lLen - 1] == '\n') || (szLine[lLen - 1] == '\r'))) szLine[--lLen] = 0;
+      if (szLine[0] == '#') continue;
+      if (strcmp(szLine, "quit") == 0) break;
+      if (lLen == 0) {
+         if (stSentence->iLength > 0) break;
+         continue;
+      }
+      addWordToSentence(stSentence, szLine);
+   }
+   free(szLine);
+
+   return (stSentence->iLength > 0);
+}
+
+
+/********************************************************************
+ ********************************************************************/
+
+static int compareLatency(const void *pA, const void *pB) {
+   long long llA = *(const long long *)pA;
+   long long llB = *(const long long *)pB;
+
+   return ((llA > llB) - (llA < llB));
+}
+
+
+/********************************************************************
+ * Pipeline the sentences of fInput over fdSock and report latencies.
+ ********************************************************************/
+
+static int runBatch(int fdSock, FILE *fInput) {
+   struct BatchCommand *stCommand = NULL;
+   struct Sentence stSentence;
+   long long *llLatency;
+   long long llStart = nowMicroseconds();
+   long long llTotal = 0;
+   long long llWall;
+   long lReplies = 0;
+   int iCommands = 0;  // sentences sent
+   int iSize = 0;
+   int iDone = 0;      // sentences finished
+   int iInFlight = 0;
+   int iTraps = 0;
+   int iEnd = 0;       // no more input
+   int iFatal = 0;
+   int iTag;
+   char szTag[32];
+   char *ptr;
+   int i;
+
+   while (!iFatal && (!iEnd || (iInFlight > 0))) {
+      // fill the window
+      while (!iEnd && (iInFlight < iWindow)) {
+         if (!readBatchSentence(fInput, &stSentence)) {
+            iEnd = 1;
+            break;
+         }
+         if (iCommands == iSize) {
+            iSize = iSize ? iSize * 2 : 256;
+            stCommand = realloc(stCommand, iSize * sizeof(struct BatchCommand));
+         }
+         memset(&stCommand[iCommands], 0, sizeof(struct BatchCommand));
+         snprintf(stCommand[iCommands].szCommand, sizeof(stCommand[iCommands].szCommand), "%s", stSentence.szWord[0]);
+         sprintf(szTag, ".tag=%d", iCommands);
+         addWordToSentence(&stSentence, szTag);
+         stCommand[iCommands].llSent = nowMicroseconds();
+         writeSentence(fdSock, &stSentence);
+         clearSentence(&stSentence);
+         iCommands++;
+         iInFlight++;
+      }
+      if (iInFlight == 0) break;
+
+      // print the next reply and match it to its sentence by tag
+      readSentence(fdSock, &stSentence);
+      if (stSentence.iLength == 0) { // connection lost
+         iFatal = 1;
+         break;
+      }
+      printSentence(&stSentence);
+      lReplies++;
+
+      iTag = -1;
+      for (i = 1; i < stSentence.iLength; i++) {
+         if (strncmp(stSentence.szWord[i], ".tag=", 5) == 0) iTag = strtol(stSentence.szWord[i] + 5, &ptr, 10);
+      }
+      if (stSentence.iReturnValue == FATAL) iFatal = 1;
+      if ((iTag >= 0) && (iTag < iCommands) && (stCommand[iTag].llDone == 0)) {
+         stCommand[iTag].iReplies++;
+         if (stSentence.iReturnValue == TRAP) stCommand[iTag].iTrap = 1;
+         if (stSentence.iReturnValue == DONE) {
+            stCommand[iTag].llDone = nowMicroseconds();
+            printf("# tag %d %s: %.3f ms, %d replies%s\n", iTag, stCommand[iTag].szCommand,
+                   (stCommand[iTag].llDone - stCommand[iTag].llSent) / 1000.0, stCommand[iTag].iReplies,
+                   stCommand[iTag].iTrap ? ", trap" : "");
+            iTraps += stCommand[iTag].iTrap;
+            iInFlight--;
+            iDone++;
+         }
+      }
+      clearSentence(&stSentence);
+   }
+   llWall = nowMicroseconds() - llStart;
+
+   // totals
+   llLatency = malloc((iDone + 1) * sizeof(long long));
+   for (i = 0, iDone = 0; i < iCommands; i++) {
+      if (stCommand[i].llDone == 0) continue;
+      llLatency[iDone] = stCommand[i].llDone - stCommand[i].llSent;
+      llTotal += llLatency[iDone++];
+   }
+   qsort(llLatency, iDone, sizeof(long long), compareLatency);
+
+   printf("# %d sent, %d done, %d trap, %d lost, %ld replies in %.3f s (%.1f sentences/s)\n",
+          iCommands, iDone, iTraps, iCommands - iDone, lReplies, llWall / 1e6, llWall ? iDone * 1e6 / llWall : 0.0);
+   if (iDone > 0) {
+      printf("# latency ms: min %.3f avg %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+             llLatency[0] / 1000.0, llTotal / 1000.0 / iDone, llLatency[iDone / 2] / 1000.0,
+             llLatency[iDone * 9 / 10] / 1000.0, llLatency[iDone * 99 / 100] / 1000.0, llLatency[iDone - 1] / 1000.0);
+   }
+
+   free(llLatency);
+   free(stCommand);
+   return (iCommands - iDone);
+}
 
 /********************************************************************
  ********************************************************************/
@@ -25,13 +195,25 @@ int main(int argc, char *argv[])
    char *szNewline;             // used for word input from the user
    struct Sentence stSentence;
    struct Block stBlock;
+   char *szBatchFile = NULL;    // -b: run the sentences of this file
+   FILE *fInput;
+   int iLost;
+   int iArg = 1;
 
    apiInitialize();
 
-   if (argc != 4) {
-      fprintf(stderr,"USAGE: %s ip user pass\n",argv[0]);
+   while ((iArg + 1 < argc) && (argv[iArg][0] == '-')) {
+      if (strcmp(argv[iArg], "-b") == 0) szBatchFile = argv[iArg + 1];
+      else if (strcmp(argv[iArg], "-w") == 0) iWindow = atoi(argv[iArg + 1]);
+      else if (strcmp(argv[iArg], "-p") == 0) iPort = atoi(argv[iArg + 1]);
+      else break;
+      iArg += 2;
+   }
+   if ((argc - iArg != 3) || (iWindow < 1)) {
+      fprintf(stderr,"USAGE: %s [-b cmdfile|-] [-w window] [-p port] ip user pass\n",argv[0]);
       exit(1);
    }
+   argv += iArg - 1;
 
    printf("Connecting to API: %s:%d\n", argv[1], iPort);
    fdSock = apiConnect(argv[1], iPort);
@@ -40,6 +222,21 @@ int main(int argc, char *argv[])
       printf("Invalid username or password.\n");
       exit(1);
    }
+
+   if (szBatchFile) {
+      if (strcmp(szBatchFile, "-") == 0) fInput = stdin;
+      else if ((fInput = fopen(szBatchFile, "r")) == NULL) {
+         perror(szBatchFile);
+         apiDisconnect(fdSock);
+         exit(1);
+      }
+      iLost = runBatch(fdSock, fInput);
+      if (fInput != stdin) fclose(fInput);
+      apiDisconnect(fdSock);
+      apiTerminate();
+      exit(iLost ? 1 : 0);
+   }
+
    initializeSentence(&stSentence);
 
    while (1) {
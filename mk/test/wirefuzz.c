@@ -0,0 +1,142 @@
+//
+// wirefuzz.c // Round trip and fuzz check of the wire length codec.
+//
+// Encodes the edges of every length class and random lengths, decodes
+// them again and checks the value and the size both ways.  Then feeds
+// random byte strings to wireDecodeLen and checks that it never claims
+// more bytes than it was given, that it asks for more only when the
+// encoded size does not fit, and that the reserved first bytes 0xF1 to
+// 0xFF are always rejected.  Prints the failures and exits non-zero if
+// there were any:
+//
+//    make wirefuzz && ./wirefuzz [rounds] [seed]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../wire.h"
+
+int iFailures = 0;
+
+
+// ********************************************************************
+// checkLength
+// ********************************************************************
+// ENCODE iLen, DECODE IT FROM EVERY PREFIX AND COMPARE.
+
+void checkLength(unsigned int iLen) {
+   unsigned char cBuf[WIRE_MAX_LEN_SIZE];
+   unsigned int iDecoded;
+   int iSize;
+   int iUsed;
+   int i;
+
+   iSize = wireEncodeLen(iLen, cBuf);
+   if (iSize != wireLenSize(iLen) || iSize != wirePrefixSize(cBuf[0])) {
+      printf("length %u: encoded %d bytes, wireLenSize %d, wirePrefixSize %d\n",
+             iLen, iSize, wireLenSize(iLen), wirePrefixSize(cBuf[0]));
+      iFailures++;
+      return;
+   }
+
+   // a shorter prefix must ask for more
+   for (i = 0; i < iSize; i++) {
+      if (wireDecodeLen(cBuf, i, &iDecoded) != 0) {
+         printf("length %u: decoded from %d of %d bytes\n", iLen, i, iSize);
+         iFailures++;
+      }
+   }
+
+   iDecoded = 0;
+   iUsed = wireDecodeLen(cBuf, iSize, &iDecoded);
+   if (iUsed != iSize || iDecoded != iLen) {
+      printf("length %u: decoded %u from %d of %d bytes\n", iLen, iDecoded, iUsed, iSize);
+      iFailures++;
+   }
+}
+
+
+// ********************************************************************
+// checkBytes
+// ********************************************************************
+// DECODE iAvail RANDOM BYTES AND CHECK THE RESULT IS CONSISTENT.
+
+void checkBytes(unsigned char *cBuf, int iAvail) {
+   unsigned char cOut[WIRE_MAX_LEN_SIZE];
+   unsigned int iLen;
+   int iSize = wirePrefixSize(cBuf[0]);
+   int iUsed = wireDecodeLen(cBuf, iAvail, &iLen);
+
+   if (cBuf[0] > 0xf0) {
+      if (iUsed != -1) {
+         printf("first byte 0x%02X: not rejected (%d)\n", cBuf[0], iUsed);
+         iFailures++;
+      }
+      return;
+   }
+
+   if (iSize < 1 || iSize > WIRE_MAX_LEN_SIZE) {
+      printf("first byte 0x%02X: size %d\n", cBuf[0], iSize);
+      iFailures++;
+      return;
+   }
+
+   if (iAvail < iSize) {
+      if (iUsed != 0) {
+         printf("first byte 0x%02X: used %d of %d bytes, needs %d\n", cBuf[0], iUsed, iAvail, iSize);
+         iFailures++;
+      }
+      return;
+   }
+
+   if (iUsed != iSize) {
+      printf("first byte 0x%02X: used %d bytes, size %d\n", cBuf[0], iUsed, iSize);
+      iFailures++;
+      return;
+   }
+
+   // a decoded length re-encodes to the same bytes unless it was not
+   // in its shortest form, which the decoder accepts
+   if (wireLenSize(iLen) == iSize && (wireEncodeLen(iLen, cOut) != iSize || memcmp(cOut, cBuf, iSize) != 0)) {
+      printf("first byte 0x%02X: %u does not re-encode to the same bytes\n", cBuf[0], iLen);
+      iFailures++;
+   }
+}
+
+
+int main(int argc, char *argv[]) {
+   static const unsigned int iEdges[] = {
+      0, 1, 0x7f, 0x80, 0x3fff, 0x4000, 0x1fffff, 0x200000,
+      0xfffffff, 0x10000000, 0x7fffffff, 0x80000000, 0xfffffffe, 0xffffffff
+   };
+   unsigned char cBuf[WIRE_MAX_LEN_SIZE + 1];
+   long lRounds = 1000000;
+   long l;
+   int i;
+
+   if (argc > 1) lRounds = atol(argv[1]);
+   srand(argc > 2 ? atoi(argv[2]) : 1);
+
+   for (i = 0; i < (int)(sizeof(iEdges) / sizeof(iEdges[0])); i++) checkLength(iEdges[i]);
+
+   // every first byte, with and without enough bytes behind it
+   for (i = 0; i < 256; i++) {
+      memset(cBuf, 0xff, sizeof(cBuf));
+      cBuf[0] = (unsigned char)i;
+      for (l = 1; l <= WIRE_MAX_LEN_SIZE; l++) checkBytes(cBuf, (int)l);
+   }
+
+   for (l = 0; l < lRounds; l++) {
+      unsigned int iLen = ((unsigned int)rand() << 16) ^ (unsigned int)rand();
+
+      // spread the lengths over the classes
+      checkLength(iLen >> (rand() % 32));
+
+      for (i = 0; i < WIRE_MAX_LEN_SIZE; i++) cBuf[i] = (unsigned char)rand();
+      checkBytes(cBuf, 1 + rand() % WIRE_MAX_LEN_SIZE);
+   }
+
+   printf("%ld rounds, %d failures\n", lRounds, iFailures);
+   return (iFailures != 0);
+}
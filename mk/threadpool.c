@@ -0,0 +1,321 @@
+//
+// Mikrotik API 2.0 // Thread pool.
+//
+// A small work-stealing pool for CPU work on replies (see parallel.c).
+// Every worker owns a deque; a mutex per deque is enough here since
+// tasks are coarse (thousands of rows each), so the locks are rarely
+// contended and much simpler to get right than a lock-free deque.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "api.h"
+#include "threadpool.h"
+
+static __thread struct ThreadPool *stWorkerPool = NULL; // pool of the worker running on this thread
+static __thread int iWorker = -1;                       // its index in that pool
+
+static struct ThreadPool *stSharedPool = NULL;          // created by sharedThreadPool
+static pthread_mutex_t sharedPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// argument of workerMain.
+struct WorkerStart {
+        struct ThreadPool *stPool;
+        int iWorker;
+};
+
+
+// ********************************************************************
+// queuePush
+// ********************************************************************
+// ADD A TASK AT THE TAIL OF A QUEUE, GROWING THE RING IF FULL.
+
+static void queuePush(struct TaskQueue *stQueue, struct ThreadTask *stTask) {
+   struct ThreadTask *stNew;
+   int iNewSize;
+   int i;
+
+   pthread_mutex_lock(&stQueue->mutex);
+   if (stQueue->iLength == stQueue->iSize) {
+      iNewSize = stQueue->iSize ? stQueue->iSize * 2 : 64;
+      stNew = malloc(iNewSize * sizeof(struct ThreadTask));
+      debug_ram += iNewSize * sizeof(struct ThreadTask);
+      for (i = 0; i < stQueue->iLength; i++) stNew[i] = stQueue->stTask[(stQueue->iHead + i) % stQueue->iSize];
+      debug_ram -= stQueue->iSize * sizeof(struct ThreadTask);
+      free(stQueue->stTask);
+      stQueue->stTask = stNew;
+      stQueue->iSize = iNewSize;
+      stQueue->iHead = 0;
+   }
+   stQueue->stTask[(stQueue->iHead + stQueue->iLength) % stQueue->iSize] = *stTask;
+   stQueue->iLength++;
+   pthread_mutex_unlock(&stQueue->mutex);
+}
+
+
+// ********************************************************************
+// queuePop
+// ********************************************************************
+// TAKE THE NEWEST (iSteal 0) OR OLDEST (iSteal 1) TASK OF A QUEUE.
+//
+// Returns 1 and fills *stTask, or 0 if the queue is empty.
+
+static int queuePop(struct TaskQueue *stQueue, struct ThreadTask *stTask, int iSteal) {
+   int iFound = 0;
+
+   pthread_mutex_lock(&stQueue->mutex);
+   if (stQueue->iLength > 0) {
+      if (iSteal) {
+         *stTask = stQueue->stTask[stQueue->iHead];
+         stQueue->iHead = (stQueue->iHead + 1) % stQueue->iSize;
+      } else {
+         *stTask = stQueue->stTask[(stQueue->iHead + stQueue->iLength - 1) % stQueue->iSize];
+      }
+      stQueue->iLength--;
+      iFound = 1;
+   }
+   pthread_mutex_unlock(&stQueue->mutex);
+
+   return (iFound);
+}
+
+
+// ********************************************************************
+// findTask
+// ********************************************************************
+// TAKE A TASK FROM OUR OWN QUEUE, OR STEAL ONE FROM ANOTHER WORKER.
+
+static int findTask(struct ThreadPool *stPool, struct ThreadTask *stTask) {
+   int iSelf = (stWorkerPool == stPool) ? iWorker : -1;
+   int iStart;
+   int i;
+
+   if (__atomic_load_n(&stPool->iQueued, __ATOMIC_ACQUIRE) == 0) return (0);
+
+   if ((iSelf >= 0) && queuePop(&stPool->stQueue[iSelf], stTask, 0)) goto found;
+
+   iStart = iSelf >= 0 ? iSelf + 1 : 0;
+   for (i = 0; i < stPool->iQueues; i++) {
+      if (queuePop(&stPool->stQueue[(iStart + i) % stPool->iQueues], stTask, 1)) goto found;
+   }
+   return (0);
+
+found:
+   __atomic_sub_fetch(&stPool->iQueued, 1, __ATOMIC_ACQ_REL);
+   return (1);
+}
+
+
+// ********************************************************************
+// runTask
+// ********************************************************************
+// RUN A TASK AND WAKE THE WAITERS WHEN IT WAS THE LAST OF ITS GROUP.
+
+static void runTask(struct ThreadPool *stPool, struct ThreadTask *stTask) {
+   stTask->run(stTask->pArg);
+
+   if (stTask->stGroup && (__atomic_sub_fetch(&stTask->stGroup->iPending, 1, __ATOMIC_ACQ_REL) == 0)) {
+      pthread_mutex_lock(&stPool->mutex);
+      pthread_cond_broadcast(&stPool->cond);
+      pthread_mutex_unlock(&stPool->mutex);
+   }
+}
+
+
+// ********************************************************************
+// workerMain
+// ********************************************************************
+// WORKER THREAD: RUN TASKS UNTIL THE POOL IS STOPPED.
+
+static void *workerMain(void *pArg) {
+   struct WorkerStart *stStart = pArg;
+   struct ThreadPool *stPool = stStart->stPool;
+   struct ThreadTask stTask;
+
+   stWorkerPool = stPool;
+   iWorker = stStart->iWorker;
+   debug_ram -= sizeof(struct WorkerStart);
+   free(stStart);
+
+   while (1) {
+      if (findTask(stPool, &stTask)) {
+         runTask(stPool, &stTask);
+         continue;
+      }
+
+      pthread_mutex_lock(&stPool->mutex);
+      while (!stPool->iStop && (__atomic_load_n(&stPool->iQueued, __ATOMIC_ACQUIRE) == 0)) {
+         pthread_cond_wait(&stPool->cond, &stPool->mutex);
+      }
+      if (stPool->iStop && (__atomic_load_n(&stPool->iQueued, __ATOMIC_ACQUIRE) == 0)) {
+         pthread_mutex_unlock(&stPool->mutex);
+         break;
+      }
+      pthread_mutex_unlock(&stPool->mutex);
+   }
+
+   return (NULL);
+}
+
+
+// ********************************************************************
+// initializeThreadPool
+// ********************************************************************
+// START A POOL OF iThreads WORKERS (0 = ONE PER ONLINE CPU).
+//
+// Returns 1 on success, 0 if no thread could be started.
+
+int initializeThreadPool(struct ThreadPool *stPool, int iThreads) {
+   struct WorkerStart *stStart;
+   int i;
+
+   memset(stPool, 0, sizeof(struct ThreadPool));
+   if (iThreads <= 0) iThreads = sysconf(_SC_NPROCESSORS_ONLN);
+   if (iThreads <= 0) iThreads = 1;
+
+   pthread_mutex_init(&stPool->mutex, NULL);
+   pthread_cond_init(&stPool->cond, NULL);
+
+   stPool->stQueue = calloc(iThreads, sizeof(struct TaskQueue));
+   stPool->thread = calloc(iThreads, sizeof(pthread_t));
+   debug_ram += iThreads * (sizeof(struct TaskQueue) + sizeof(pthread_t));
+   for (i = 0; i < iThreads; i++) pthread_mutex_init(&stPool->stQueue[i].mutex, NULL);
+   stPool->iQueues = iThreads; // set before the workers start looking
+
+   for (i = 0; i < iThreads; i++) {
+      stStart = malloc(sizeof(struct WorkerStart));
+      debug_ram += sizeof(struct WorkerStart);
+      stStart->stPool = stPool;
+      stStart->iWorker = i;
+      if (pthread_create(&stPool->thread[i], NULL, workerMain, stStart) != 0) {
+         debug_ram -= sizeof(struct WorkerStart);
+         free(stStart);
+         break;
+      }
+   }
+   stPool->iThreads = i; // workers that actually started
+
+   return (stPool->iThreads > 0);
+}
+
+
+// ********************************************************************
+// clearThreadPool
+// ********************************************************************
+// FINISH THE QUEUED TASKS, STOP THE WORKERS AND FREE THE POOL.
+
+void clearThreadPool(struct ThreadPool *stPool) {
+   int i;
+
+   pthread_mutex_lock(&stPool->mutex);
+   stPool->iStop = 1;
+   pthread_cond_broadcast(&stPool->cond);
+   pthread_mutex_unlock(&stPool->mutex);
+
+   for (i = 0; i < stPool->iThreads; i++) pthread_join(stPool->thread[i], NULL);
+
+   for (i = 0; i < stPool->iQueues; i++) {
+      debug_ram -= stPool->stQueue[i].iSize * sizeof(struct ThreadTask);
+      free(stPool->stQueue[i].stTask);
+      pthread_mutex_destroy(&stPool->stQueue[i].mutex);
+   }
+   debug_ram -= stPool->iQueues * (sizeof(struct TaskQueue) + sizeof(pthread_t));
+   free(stPool->stQueue);
+   free(stPool->thread);
+   pthread_mutex_destroy(&stPool->mutex);
+   pthread_cond_destroy(&stPool->cond);
+   memset(stPool, 0, sizeof(struct ThreadPool));
+}
+
+
+// ********************************************************************
+// threadPoolSubmit
+// ********************************************************************
+// QUEUE run(pArg) AS PART OF stGroup (MAY BE NULL).
+
+void threadPoolSubmit(struct ThreadPool *stPool, struct TaskGroup *stGroup, void (*run)(void *), void *pArg) {
+   struct ThreadTask stTask;
+   int iQueue;
+
+   stTask.run = run;
+   stTask.pArg = pArg;
+   stTask.stGroup = stGroup;
+   if (stGroup) __atomic_add_fetch(&stGroup->iPending, 1, __ATOMIC_ACQ_REL);
+
+   if (stWorkerPool == stPool) iQueue = iWorker;
+   else iQueue = (unsigned int)__atomic_fetch_add(&stPool->iNextQueue, 1, __ATOMIC_RELAXED) % stPool->iThreads;
+
+   queuePush(&stPool->stQueue[iQueue], &stTask);
+   __atomic_add_fetch(&stPool->iQueued, 1, __ATOMIC_ACQ_REL);
+
+   pthread_mutex_lock(&stPool->mutex);
+   pthread_cond_signal(&stPool->cond);
+   pthread_mutex_unlock(&stPool->mutex);
+}
+
+
+// ********************************************************************
+// threadPoolWait
+// ********************************************************************
+// WAIT UNTIL EVERY TASK OF stGroup HAS FINISHED.
+//
+// The calling thread runs queued tasks (of any group) while it waits.
+
+void threadPoolWait(struct ThreadPool *stPool, struct TaskGroup *stGroup) {
+   struct ThreadTask stTask;
+
+   while (__atomic_load_n(&stGroup->iPending, __ATOMIC_ACQUIRE) > 0) {
+      if (findTask(stPool, &stTask)) {
+         runTask(stPool, &stTask);
+         continue;
+      }
+
+      pthread_mutex_lock(&stPool->mutex);
+      while ((__atomic_load_n(&stGroup->iPending, __ATOMIC_ACQUIRE) > 0) &&
+             (__atomic_load_n(&stPool->iQueued, __ATOMIC_ACQUIRE) == 0)) {
+         pthread_cond_wait(&stPool->cond, &stPool->mutex);
+      }
+      pthread_mutex_unlock(&stPool->mutex);
+   }
+}
+
+
+// ********************************************************************
+// sharedThreadPool
+// ********************************************************************
+// RETURN THE PROCESS WIDE POOL, STARTING IT ON FIRST USE.
+//
+// One worker per online CPU.  apiTerminate stops it.
+
+struct ThreadPool *sharedThreadPool(void) {
+   pthread_mutex_lock(&sharedPoolMutex);
+   if (stSharedPool == NULL) {
+      stSharedPool = malloc(sizeof(struct ThreadPool));
+      debug_ram += sizeof(struct ThreadPool);
+      initializeThreadPool(stSharedPool, 0);
+   }
+   pthread_mutex_unlock(&sharedPoolMutex);
+
+   return (stSharedPool);
+}
+
+
+// ********************************************************************
+// clearSharedThreadPool
+// ********************************************************************
+// STOP THE PROCESS WIDE POOL IF IT WAS STARTED.
+
+void clearSharedThreadPool(void) {
+   pthread_mutex_lock(&sharedPoolMutex);
+   if (stSharedPool) {
+      clearThreadPool(stSharedPool);
+      debug_ram -= sizeof(struct ThreadPool);
+      free(stSharedPool);
+      stSharedPool = NULL;
+   }
+   pthread_mutex_unlock(&sharedPoolMutex);
+}
@@ -0,0 +1,73 @@
+//
+// Mikrotik API 2.0 // Thread pool.
+//
+
+#ifndef MK_THREADPOOL
+#define MK_THREADPOOL
+
+#include <pthread.h>
+
+// struct ThreadTask
+//
+// One unit of work: run(pArg).  stGroup is the TaskGroup to tell when
+// it is done, NULL if nobody waits for it.
+
+struct TaskGroup;
+
+struct ThreadTask {
+        void (*run)(void *pArg);
+        void *pArg;
+        struct TaskGroup *stGroup;
+};
+
+// struct TaskGroup
+//
+// Counts the tasks of one parallel operation that are still pending so
+// threadPoolWait knows when they are all done.
+
+struct TaskGroup {
+        int iPending;              // tasks submitted and not yet finished
+};
+
+// struct TaskQueue
+//
+// The deque of one worker.  The owner pushes and pops at the tail
+// (newest first, which keeps its caches warm); idle workers steal from
+// the head (oldest, usually the biggest piece of work).
+
+struct TaskQueue {
+        struct ThreadTask *stTask; // ring of iSize tasks
+        int iHead;                 // index of the oldest task
+        int iLength;               // tasks in the ring
+        int iSize;                 // slots allocated
+        pthread_mutex_t mutex;
+};
+
+// struct ThreadPool
+//
+// iThreads workers, each with its own TaskQueue.  Tasks submitted by a
+// worker go to its own queue, tasks from other threads are spread over
+// the queues round robin.  A worker with nothing to do steals from the
+// others before it sleeps.  Threads waiting for a TaskGroup run tasks
+// too, so parallel operations can nest without deadlocking the pool.
+
+struct ThreadPool {
+        pthread_t *thread;         // the workers
+        int iThreads;              // number of workers running
+        struct TaskQueue *stQueue; // one per worker
+        int iQueues;               // number of queues (workers requested)
+        int iQueued;               // tasks in all queues (atomic)
+        int iNextQueue;            // round robin for outside submitters (atomic)
+        int iStop;                 // set by clearThreadPool
+        pthread_mutex_t mutex;     // protects the sleep/wake condition
+        pthread_cond_t cond;       // signalled when tasks arrive
+};
+
+int initializeThreadPool(struct ThreadPool *stPool, int iThreads);
+void clearThreadPool(struct ThreadPool *stPool);
+void threadPoolSubmit(struct ThreadPool *stPool, struct TaskGroup *stGroup, void (*run)(void *), void *pArg);
+void threadPoolWait(struct ThreadPool *stPool, struct TaskGroup *stGroup);
+struct ThreadPool *sharedThreadPool(void);
+void clearSharedThreadPool(void);
+
+#endif // MK_THREADPOOL
@@ -0,0 +1,179 @@
+//
+// Mikrotik API 2.0 // Span tracing.
+//
+// Spans go into one array allocated by traceStart.  A slot is claimed
+// with an atomic increment, so recording is a clock read and a few
+// stores, safe from any thread and without a lock.  When the array is
+// full further spans are counted and dropped.  traceWrite dumps the
+// array in the Chrome trace event format ("X" complete events), with
+// one lane (tid) per connection and the .tag of each sentence in args.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "api.h"
+#include "trace.h"
+
+static struct TraceEvent *stTraceEvent = NULL; // recorded spans, NULL when not tracing
+static int iTraceSize = 0;                     // slots in stTraceEvent
+static int iTraceLength = 0;                   // slots claimed (may pass iTraceSize)
+
+
+// ********************************************************************
+// traceNow
+// ********************************************************************
+// RETURN THE MONOTONIC CLOCK IN MICROSECONDS.
+
+long long traceNow(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ((long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+
+// ********************************************************************
+// traceStart
+// ********************************************************************
+// START RECORDING, KEEPING AT MOST iMaxEvents SPANS.
+//
+// 0 means TRACE_DEFAULT_EVENTS.  Spans recorded before are discarded.
+// Returns 1 on success, 0 if the memory could not be allocated.
+
+int traceStart(int iMaxEvents) {
+   traceStop();
+   if (iMaxEvents <= 0) iMaxEvents = TRACE_DEFAULT_EVENTS;
+
+   if ((stTraceEvent = malloc(iMaxEvents * sizeof(struct TraceEvent))) == NULL) return (0);
+   debug_ram += iMaxEvents * sizeof(struct TraceEvent);
+   iTraceSize = iMaxEvents;
+   iTraceLength = 0;
+   return (1);
+}
+
+
+// ********************************************************************
+// traceStop
+// ********************************************************************
+// STOP RECORDING AND FREE THE SPANS.
+
+void traceStop(void) {
+   if (stTraceEvent == NULL) return;
+   debug_ram -= iTraceSize * sizeof(struct TraceEvent);
+   free(stTraceEvent);
+   stTraceEvent = NULL;
+   iTraceSize = 0;
+   iTraceLength = 0;
+}
+
+
+// ********************************************************************
+// traceSpan
+// ********************************************************************
+// RECORD A SPAN FROM llStart (traceNow) UNTIL NOW.
+
+void traceSpan(const char *szName, int fdSock, char *szTag, long long llStart) {
+   struct TraceEvent *stEvent;
+   long long llNow;
+   int i;
+
+   if (stTraceEvent == NULL) return;
+   llNow = traceNow();
+
+   if ((i = __atomic_fetch_add(&iTraceLength, 1, __ATOMIC_RELAXED)) >= iTraceSize) return; // full
+
+   stEvent = &stTraceEvent[i];
+   stEvent->szName = szName;
+   stEvent->fdSock = fdSock;
+   stEvent->llStart = llStart;
+   stEvent->llDuration = llNow - llStart;
+   stEvent->szTag[0] = 0;
+   if (szTag) {
+      strncpy(stEvent->szTag, szTag, TRACE_TAG_SIZE - 1);
+      stEvent->szTag[TRACE_TAG_SIZE - 1] = 0;
+   }
+}
+
+
+// ********************************************************************
+// traceSentenceTag
+// ********************************************************************
+// RETURN THE VALUE OF THE .tag= WORD OF A SENTENCE OR NULL.
+
+char *traceSentenceTag(char **szWord, int iLength) {
+   int i;
+
+   for (i = 0; i < iLength; i++) {
+      if (strncmp(szWord[i], ".tag=", 5) == 0) return (szWord[i] + 5);
+   }
+   return (NULL);
+}
+
+
+// ********************************************************************
+// traceWrite
+// ********************************************************************
+// WRITE THE RECORDED SPANS AS CHROME TRACE JSON.
+//
+// Times are relative to the first span.  Returns the number of spans
+// written or -1 if the file can't be created.
+
+int traceWrite(char *szFileName) {
+   FILE *fOut;
+   struct TraceEvent *stEvent;
+   long long llBase = 0;
+   int iEvents = iTraceLength < iTraceSize ? iTraceLength : iTraceSize;
+   int iPid = getpid();
+   int iMaxFd = 0;
+   char *cSeen;
+   int i, j;
+
+   if ((fOut = fopen(szFileName, "w")) == NULL) return (-1);
+
+   for (i = 0; i < iEvents; i++) {
+      if ((i == 0) || (stTraceEvent[i].llStart < llBase)) llBase = stTraceEvent[i].llStart;
+   }
+
+   fprintf(fOut, "{\"traceEvents\":[\n");
+   for (i = 0; i < iEvents; i++) {
+      stEvent = &stTraceEvent[i];
+      fprintf(fOut, "%s{\"name\":\"%s\",\"cat\":\"api\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"dur\":%lld",
+              i ? ",\n" : "", stEvent->szName, iPid, stEvent->fdSock, stEvent->llStart - llBase, stEvent->llDuration);
+      if (stEvent->szTag[0]) {
+         fprintf(fOut, ",\"args\":{\"tag\":\"");
+         for (j = 0; stEvent->szTag[j]; j++) {
+            if ((stEvent->szTag[j] == '"') || (stEvent->szTag[j] == '\\')) fputc('\\', fOut);
+            if ((unsigned char)stEvent->szTag[j] >= 0x20) fputc(stEvent->szTag[j], fOut);
+         }
+         fprintf(fOut, "\"}");
+      }
+      fprintf(fOut, "}");
+   }
+
+   // name the lanes after their connection, with the router address
+   // that apiConnect recorded as its tag.
+   for (i = 0; i < iEvents; i++) if (stTraceEvent[i].fdSock > iMaxFd) iMaxFd = stTraceEvent[i].fdSock;
+   cSeen = calloc(iMaxFd + 1, 1);
+   debug_ram += iMaxFd + 1;
+   for (i = 0; i < iEvents; i++) {
+      if (cSeen[stTraceEvent[i].fdSock]) continue;
+      cSeen[stTraceEvent[i].fdSock] = 1;
+      for (j = i; j < iEvents; j++) {
+         if ((stTraceEvent[j].fdSock == stTraceEvent[i].fdSock) && (strcmp(stTraceEvent[j].szName, "apiConnect") == 0)) break;
+      }
+      fprintf(fOut, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"fd %d%s%s\"}}",
+              iPid, stTraceEvent[i].fdSock, stTraceEvent[i].fdSock, j < iEvents ? " " : "", j < iEvents ? stTraceEvent[j].szTag : "");
+   }
+   debug_ram -= iMaxFd + 1;
+   free(cSeen);
+
+   fprintf(fOut, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%d}}\n",
+           iTraceLength > iTraceSize ? iTraceLength - iTraceSize : 0);
+   fclose(fOut);
+
+   return (iEvents);
+}
@@ -0,0 +1,47 @@
+//
+// Mikrotik API 2.0 // Span tracing.
+//
+// Build with -DAPI_TRACE to time apiConnect, login, writeSentence,
+// readSentence and readBlock.  Without it the TRACE_ macros expand to
+// nothing and the API is exactly as fast as before.
+//
+//    traceStart(0);
+//    ... use the API ...
+//    traceWrite("mk.trace.json");  // open in chrome://tracing or ui.perfetto.dev
+//
+
+#ifndef MK_TRACE
+#define MK_TRACE
+
+#define TRACE_DEFAULT_EVENTS (1 << 20) // spans kept when traceStart gets 0
+#define TRACE_TAG_SIZE 16              // bytes of .tag kept per span
+
+// struct TraceEvent
+//
+// One finished span.  szName must be a string literal (it is not
+// copied).  Spans are drawn per connection: fdSock is the lane.
+
+struct TraceEvent {
+        const char *szName;          // span name
+        int fdSock;                  // connection, 0 if none
+        long long llStart;           // start in microseconds
+        long long llDuration;        // duration in microseconds
+        char szTag[TRACE_TAG_SIZE];  // .tag of the sentence, "" if none
+};
+
+#ifdef API_TRACE
+#define TRACE_START(t)                      long long t = traceNow()
+#define TRACE_SPAN(t, szName, fdSock, szTag) traceSpan(szName, fdSock, szTag, t)
+#else
+#define TRACE_START(t)
+#define TRACE_SPAN(t, szName, fdSock, szTag) ((void)0)
+#endif
+
+int traceStart(int iMaxEvents);
+void traceStop(void);
+long long traceNow(void);
+void traceSpan(const char *szName, int fdSock, char *szTag, long long llStart);
+char *traceSentenceTag(char **szWord, int iLength);
+int traceWrite(char *szFileName);
+
+#endif // MK_TRACE
@@ -0,0 +1,594 @@
+//
+// Mikrotik API 2.0 // Address trie.
+//
+// Address lists gathered from several feeds repeat and overlap a lot.
+// Loaded into an AddressTrie they can be reduced to the fewest
+// prefixes covering the same addresses, compared with what another
+// router already has, and searched by address:
+//
+//    initializeAddressTrie(&stTrie);
+//    trieAddBlock(&stTrie, &stBlockADDRESS, NULL);
+//    triePrefixes(&stTrie, 1, &stSet);       // deduped and aggregated
+//    trieSubtract(&stTrie, &stSet, &stTarget); // minus what TARGET covers
+//    ...
+//    clearTrieSet(&stSet);
+//    clearAddressTrie(&stTrie);
+//
+// Entries that are not an address or a prefix (ranges, DNS names) are
+// left out.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+#include "api.h"
+#include "pool.h"
+#include "trie.h"
+#include "value.h"
+
+static const int iFamilyBits[2] = { 32, 128 };
+
+
+// ********************************************************************
+// keyBit
+// ********************************************************************
+// RETURN BIT i (0 = MOST SIGNIFICANT) OF A KEY.
+
+static inline int keyBit(const unsigned char *cKey, int i) {
+   return ((cKey[i >> 3] >> (7 - (i & 7))) & 1);
+}
+
+
+// ********************************************************************
+// commonBits
+// ********************************************************************
+// RETURN HOW MANY LEADING BITS (AT MOST iMax) TWO KEYS SHARE.
+
+static inline int commonBits(const unsigned char *cA, const unsigned char *cB, int iMax) {
+   int i;
+
+   for (i = 0; i < iMax; i += 8) {
+      if (cA[i >> 3] != cB[i >> 3]) {
+         i += __builtin_clz((unsigned int)(cA[i >> 3] ^ cB[i >> 3])) - 24;
+         break;
+      }
+   }
+   return (i < iMax ? i : iMax);
+}
+
+
+// ********************************************************************
+// maskKey
+// ********************************************************************
+// CLEAR THE BITS OF A KEY AFTER THE FIRST iLength.
+
+static void maskKey(unsigned char *cKey, int iLength) {
+   int i;
+
+   if (iLength & 7) cKey[iLength >> 3] &= (unsigned char)(0xff << (8 - (iLength & 7)));
+   for (i = (iLength + 7) >> 3; i < TRIE_KEY_SIZE; i++) cKey[i] = 0;
+}
+
+
+// ********************************************************************
+// initializeAddressTrie
+// ********************************************************************
+// INITIALIZE AN EMPTY TRIE.
+//
+// IMPORTANT: Use clearAddressTrie when finished with it.
+
+void initializeAddressTrie(struct AddressTrie *stTrie) {
+   memset(stTrie, 0, sizeof(struct AddressTrie));
+   initializeStringPool(&stTrie->stLists);
+}
+
+
+// ********************************************************************
+// clearAddressTrie
+// ********************************************************************
+// FREE ALL MEMORY OF A TRIE.
+
+void clearAddressTrie(struct AddressTrie *stTrie) {
+   int i;
+
+   for (i = 0; i < stTrie->iRoots / 2; i++) {
+      if (stTrie->stIndex[i] == NULL) continue;
+      debug_ram -= (1 << TRIE_INDEX_BITS) * sizeof(struct TrieJump);
+      free(stTrie->stIndex[i]);
+   }
+   debug_ram -= stTrie->iSize * sizeof(struct TrieNode) + stTrie->iRoots * (sizeof(int) + sizeof(struct TrieJump *) / 2);
+   free(stTrie->stNode);
+   free(stTrie->iRoot);
+   free(stTrie->stIndex);
+   clearStringPool(&stTrie->stLists);
+   initializeAddressTrie(stTrie);
+}
+
+
+// ********************************************************************
+// trieParseAddress
+// ********************************************************************
+// PARSE "address" OR "address/length", IPv4 OR IPv6.
+//
+// The key is stored with the bits after the length cleared, the way
+// RouterOS shows 10.1.2.3/8 as 10.0.0.0/8.  Returns 1, or 0 if
+// szAddress is not an address (a range or a DNS name, say).
+
+int trieParseAddress(char *szAddress, int *piFamily, unsigned char *cKey, int *piLength) {
+   if (!valueParseAddress(szAddress, piFamily, cKey, piLength)) return (0);
+   maskKey(cKey, *piLength);
+   return (1);
+}
+
+
+// ********************************************************************
+// newNode
+// ********************************************************************
+// ADD A NODE FOR THE FIRST iLength BITS OF cKey.  RETURN ITS INDEX.
+
+static int newNode(struct AddressTrie *stTrie, unsigned char *cKey, int iLength, int iValue) {
+   struct TrieNode *stNode;
+   int iNewSize;
+
+   if (stTrie->iNodes == stTrie->iSize) {
+      iNewSize = stTrie->iSize ? stTrie->iSize * 2 : 64;
+      stTrie->stNode = realloc(stTrie->stNode, iNewSize * sizeof(struct TrieNode));
+      debug_ram += (iNewSize - stTrie->iSize) * sizeof(struct TrieNode);
+      stTrie->iSize = iNewSize;
+   }
+
+   stNode = &stTrie->stNode[stTrie->iNodes];
+   memcpy(stNode->cKey, cKey, TRIE_KEY_SIZE);
+   maskKey(stNode->cKey, iLength);
+   stNode->iLength = iLength;
+   stNode->iChild[0] = stNode->iChild[1] = -1;
+   stNode->iValue = iValue;
+
+   return (stTrie->iNodes++);
+}
+
+
+// ********************************************************************
+// listId
+// ********************************************************************
+// RETURN THE ID OF A LIST, -1 IF THE TRIE DOESN'T HAVE IT.
+//
+// With iCreate a new list is added instead.
+
+static int listId(struct AddressTrie *stTrie, char *szList, int iCreate) {
+   int iList;
+   int iNewSize;
+
+   if ((iList = findStringInPool(&stTrie->stLists, szList, strlen(szList))) < 0) {
+      if (!iCreate) return (-1);
+      iList = addStringToPool(&stTrie->stLists, szList, strlen(szList));
+   }
+
+   if (2 * iList + 2 > stTrie->iRoots) {
+      iNewSize = stTrie->iRoots ? stTrie->iRoots * 2 : 16;
+      while (iNewSize < 2 * iList + 2) iNewSize *= 2;
+      stTrie->iRoot = realloc(stTrie->iRoot, iNewSize * sizeof(int));
+      stTrie->stIndex = realloc(stTrie->stIndex, iNewSize / 2 * sizeof(struct TrieJump *));
+      debug_ram += (iNewSize - stTrie->iRoots) * (sizeof(int) + sizeof(struct TrieJump *) / 2);
+      memset(stTrie->iRoot + stTrie->iRoots, 0xff, (iNewSize - stTrie->iRoots) * sizeof(int)); // -1
+      memset(stTrie->stIndex + stTrie->iRoots / 2, 0, (iNewSize - stTrie->iRoots) / 2 * sizeof(struct TrieJump *));
+      stTrie->iRoots = iNewSize;
+   }
+
+   return (iList);
+}
+
+
+// ********************************************************************
+// trieInsert
+// ********************************************************************
+// STORE THE FIRST iLength BITS OF cKEY IN LIST szList.
+//
+// Returns 1 if the prefix is new, 0 if the list already had it (its
+// value is kept).
+
+int trieInsert(struct AddressTrie *stTrie, char *szList, int iFamily, unsigned char *cKey, int iLength, int iValue) {
+   struct TrieNode *stNode;
+   int iParent = -1;
+   int iSide = 0;
+   int iList = listId(stTrie, szList, 1);
+   int *piRoot = &stTrie->iRoot[2 * iList + iFamily]; // iRoot doesn't move below
+   int iCurrent = *piRoot;
+   int iCommon;
+   int iNew;
+   int iBranch;
+
+   if (stTrie->stIndex[iList] && (iFamily == TRIE_IPV4)) { // out of date now
+      debug_ram -= (1 << TRIE_INDEX_BITS) * sizeof(struct TrieJump);
+      free(stTrie->stIndex[iList]);
+      stTrie->stIndex[iList] = NULL;
+   }
+
+   while (1) {
+      if (iCurrent < 0) { // empty spot: a leaf goes here
+         iNew = newNode(stTrie, cKey, iLength, iValue);
+         break;
+      }
+
+      stNode = &stTrie->stNode[iCurrent];
+      iCommon = commonBits(cKey, stNode->cKey, iLength < stNode->iLength ? iLength : stNode->iLength);
+
+      if (iCommon == stNode->iLength) { // the node is a prefix of the key
+         if (iLength == stNode->iLength) {
+            if (stNode->iValue >= 0) return (0);
+            stNode->iValue = iValue; // was a branch, now stored too
+            stTrie->iPrefixes++;
+            return (1);
+         }
+         iParent = iCurrent;
+         iSide = keyBit(cKey, stNode->iLength);
+         iCurrent = stNode->iChild[iSide];
+         continue;
+      }
+
+      if (iCommon == iLength) { // the key is a prefix of the node: insert above it
+         iNew = newNode(stTrie, cKey, iLength, iValue);
+         stTrie->stNode[iNew].iChild[keyBit(stTrie->stNode[iCurrent].cKey, iLength)] = iCurrent;
+         break;
+      }
+
+      // they part after iCommon bits: branch there.
+      iBranch = newNode(stTrie, cKey, iCommon, -1);
+      iNew = newNode(stTrie, cKey, iLength, iValue);
+      stTrie->stNode[iBranch].iChild[keyBit(cKey, iCommon)] = iNew;
+      stTrie->stNode[iBranch].iChild[keyBit(stTrie->stNode[iCurrent].cKey, iCommon)] = iCurrent;
+      iNew = iBranch;
+      break;
+   }
+
+   if (iParent < 0) *piRoot = iNew;
+   else stTrie->stNode[iParent].iChild[iSide] = iNew;
+   stTrie->iPrefixes++;
+
+   return (1);
+}
+
+
+// ********************************************************************
+// lookupRoot
+// ********************************************************************
+// LONGEST STORED PREFIX UNDER iCurrent COVERING THE FIRST iLength BITS
+// OF cKey.  RETURN ITS VALUE OR -1.
+
+static int lookupRoot(struct AddressTrie *stTrie, int iCurrent, int iBest, unsigned char *cKey, int iLength) {
+   struct TrieNode *stNode;
+
+   while (iCurrent >= 0) {
+      stNode = &stTrie->stNode[iCurrent];
+      if (stNode->iLength > iLength) break;
+      if (commonBits(cKey, stNode->cKey, stNode->iLength) < stNode->iLength) break;
+      if (stNode->iValue >= 0) iBest = stNode->iValue;
+      if (stNode->iLength == iLength) break;
+      iCurrent = stNode->iChild[keyBit(cKey, stNode->iLength)];
+   }
+   return (iBest);
+}
+
+
+// ********************************************************************
+// trieLookup
+// ********************************************************************
+// FIND THE MOST SPECIFIC PREFIX OF szList COVERING A PREFIX.
+//
+// Returns its value, or -1 if no prefix of the list covers all of the
+// first iLength bits of cKey.
+
+int trieLookup(struct AddressTrie *stTrie, char *szList, int iFamily, unsigned char *cKey, int iLength) {
+   struct TrieJump *stJump;
+   int iList = listId(stTrie, szList, 0);
+
+   if (iList < 0) return (-1);
+   if (stTrie->stIndex[iList] && (iFamily == TRIE_IPV4) && (iLength >= TRIE_INDEX_BITS)) {
+      stJump = &stTrie->stIndex[iList][(cKey[0] << 8) | cKey[1]];
+      return (lookupRoot(stTrie, stJump->iNode, stJump->iBest, cKey, iLength));
+   }
+   return (lookupRoot(stTrie, stTrie->iRoot[2 * iList + iFamily], -1, cKey, iLength));
+}
+
+
+// ********************************************************************
+// trieContains
+// ********************************************************************
+// trieLookup FOR AN ADDRESS OR PREFIX STRING.  -1 IF NOT COVERED.
+
+int trieContains(struct AddressTrie *stTrie, char *szList, char *szAddress) {
+   unsigned char cKey[TRIE_KEY_SIZE];
+   int iFamily;
+   int iLength;
+
+   if (!trieParseAddress(szAddress, &iFamily, cKey, &iLength)) return (-1);
+   return (trieLookup(stTrie, szList, iFamily, cKey, iLength));
+}
+
+
+// ********************************************************************
+// trieAddBlock
+// ********************************************************************
+// ADD THE ENTRIES OF AN ADDRESS-LIST PRINT TO THE TRIE.
+//
+// Every DATA sentence with =list= and =address= is added, with its
+// index in the Block as value, unless cSkip is not NULL and cSkip[i]
+// is set.  Returns the number of new prefixes.
+
+int trieAddBlock(struct AddressTrie *stTrie, struct Block *stBlock, char *cSkip) {
+   struct Sentence *stSentence;
+   unsigned char cKey[TRIE_KEY_SIZE];
+   char *szList;
+   char *szAddress;
+   int iFamily;
+   int iLength;
+   int iAdded = 0;
+   int i, j;
+
+   for (i = 0; i < stBlock->iLength; i++) {
+      stSentence = stBlock->stSentence[i];
+      if ((stSentence->iReturnValue != DATA) || (cSkip && cSkip[i])) continue;
+
+      szList = szAddress = NULL;
+      for (j = 1; j < stSentence->iLength; j++) {
+         if (strncmp(stSentence->szWord[j], "=list=", 6) == 0) szList = stSentence->szWord[j] + 6;
+         else if (strncmp(stSentence->szWord[j], "=address=", 9) == 0) szAddress = stSentence->szWord[j] + 9;
+      }
+      if ((szList == NULL) || (szAddress == NULL)) continue;
+      if (!trieParseAddress(szAddress, &iFamily, cKey, &iLength)) continue;
+
+      iAdded += trieInsert(stTrie, szList, iFamily, cKey, iLength, i);
+   }
+
+   return (iAdded);
+}
+
+
+// ********************************************************************
+// isSibling
+// ********************************************************************
+// TRUE IF TWO PREFIXES ARE THE TWO HALVES OF ONE PREFIX, A FIRST.
+
+static int isSibling(struct TriePrefix *stA, struct TriePrefix *stB) {
+   if ((stA->iList != stB->iList) || (stA->iFamily != stB->iFamily)) return (0);
+   if ((stA->iLength != stB->iLength) || (stA->iLength == 0)) return (0);
+   if (commonBits(stA->cKey, stB->cKey, stA->iLength) != stA->iLength - 1) return (0);
+   return (keyBit(stA->cKey, stA->iLength - 1) == 0);
+}
+
+
+// ********************************************************************
+// addPrefix
+// ********************************************************************
+// APPEND A PREFIX TO A SET.
+//
+// With iAggregate the last two prefixes are merged for as long as they
+// are the halves of a bigger one.  Prefixes come in address order and
+// don't overlap, so no mergeable pair is ever left behind.
+
+static void addPrefix(struct TrieSet *stSet, int iList, int iFamily, unsigned char *cKey, int iLength, int iValue, int iAggregate) {
+   struct TriePrefix *stLast;
+   struct TriePrefix *stPrefix;
+   int iNewSize;
+
+   if (stSet->iLength == stSet->iSize) {
+      iNewSize = stSet->iSize ? stSet->iSize * 2 : 64;
+      stSet->stPrefix = realloc(stSet->stPrefix, iNewSize * sizeof(struct TriePrefix));
+      debug_ram += (iNewSize - stSet->iSize) * sizeof(struct TriePrefix);
+      stSet->iSize = iNewSize;
+   }
+
+   stPrefix = &stSet->stPrefix[stSet->iLength++];
+   stPrefix->iList = iList;
+   stPrefix->iFamily = iFamily;
+   memcpy(stPrefix->cKey, cKey, TRIE_KEY_SIZE);
+   stPrefix->iLength = iLength;
+   stPrefix->iValue = iValue;
+
+   while (iAggregate && (stSet->iLength >= 2)) {
+      stLast = &stSet->stPrefix[stSet->iLength - 1];
+      if (!isSibling(stLast - 1, stLast)) break;
+      stSet->iLength--;
+      stLast--;
+      stLast->iLength--;
+      maskKey(stLast->cKey, stLast->iLength);
+      stLast->iValue = -1;
+   }
+}
+
+
+// ********************************************************************
+// collectPrefixes
+// ********************************************************************
+// ADD THE STORED PREFIXES UNDER iCurrent THAT NO OTHER PREFIX COVERS,
+// IN ADDRESS ORDER.
+
+static void collectPrefixes(struct AddressTrie *stTrie, int iCurrent, int iList, int iFamily, int iAggregate, struct TrieSet *stSet) {
+   struct TrieNode *stNode;
+
+   while (iCurrent >= 0) { // loop on child 1, recurse on child 0
+      stNode = &stTrie->stNode[iCurrent];
+      if (stNode->iValue >= 0) { // covers everything below it
+         addPrefix(stSet, iList, iFamily, stNode->cKey, stNode->iLength, stNode->iValue, iAggregate);
+         break;
+      }
+      collectPrefixes(stTrie, stNode->iChild[0], iList, iFamily, iAggregate, stSet);
+      iCurrent = stNode->iChild[1];
+   }
+}
+
+
+// ********************************************************************
+// triePrefixes
+// ********************************************************************
+// RETURN THE FEWEST PREFIXES OF EACH LIST COVERING ALL ITS ADDRESSES.
+//
+// Duplicates and prefixes inside another one of the same list are
+// left out.  With iAggregate, adjacent prefixes that together make a
+// bigger one are also replaced by it (iValue -1).  Returns the number
+// of prefixes put in stSet.
+//
+// IMPORTANT: Use clearTrieSet when finished with it.
+
+int triePrefixes(struct AddressTrie *stTrie, int iAggregate, struct TrieSet *stSet) {
+   int iList;
+   int iFamily;
+
+   memset(stSet, 0, sizeof(struct TrieSet));
+   for (iList = 0; 2 * iList < stTrie->iRoots; iList++) {
+      for (iFamily = TRIE_IPV4; iFamily <= TRIE_IPV6; iFamily++) {
+         collectPrefixes(stTrie, stTrie->iRoot[2 * iList + iFamily], iList, iFamily, iAggregate, stSet);
+      }
+   }
+   return (stSet->iLength);
+}
+
+
+// ********************************************************************
+// trieSubtract
+// ********************************************************************
+// DROP FROM stSet (PREFIXES OF stTrie) WHAT stOther ALREADY COVERS.
+//
+// A prefix stays unless the same list of stOther has it or a prefix
+// containing it.  Returns the number of prefixes left.
+
+int trieSubtract(struct AddressTrie *stTrie, struct TrieSet *stSet, struct AddressTrie *stOther) {
+   struct TriePrefix *stPrefix;
+   char *szList;
+   int iKept = 0;
+   int i;
+
+   for (i = 0; i < stSet->iLength; i++) {
+      stPrefix = &stSet->stPrefix[i];
+      szList = poolString(&stTrie->stLists, stPrefix->iList); // ids differ between tries
+      if (trieLookup(stOther, szList, stPrefix->iFamily, stPrefix->cKey, stPrefix->iLength) >= 0) continue;
+      stSet->stPrefix[iKept++] = *stPrefix;
+   }
+   stSet->iLength = iKept;
+
+   return (iKept);
+}
+
+
+// ********************************************************************
+// clearTrieSet
+// ********************************************************************
+// FREE THE PREFIXES OF A SET.
+
+void clearTrieSet(struct TrieSet *stSet) {
+   debug_ram -= stSet->iSize * sizeof(struct TriePrefix);
+   free(stSet->stPrefix);
+   memset(stSet, 0, sizeof(struct TrieSet));
+}
+
+
+// ********************************************************************
+// triePrefixString
+// ********************************************************************
+// WRITE A PREFIX THE WAY ROUTEROS SHOWS IT, E.G. 10.0.0.0/8 OR 10.1.1.1.
+//
+// szOut must have room for TRIE_STRING_SIZE bytes.  A single address
+// is written without its /32 or /128.
+
+void triePrefixString(struct TriePrefix *stPrefix, char *szOut) {
+   inet_ntop(stPrefix->iFamily == TRIE_IPV4 ? AF_INET : AF_INET6, stPrefix->cKey, szOut, TRIE_STRING_SIZE);
+   if (stPrefix->iLength != iFamilyBits[stPrefix->iFamily]) {
+      sprintf(szOut + strlen(szOut), "/%d", stPrefix->iLength);
+   }
+}
+
+
+// ********************************************************************
+// fillJumps
+// ********************************************************************
+// SET iCount INDEX SLOTS FROM iFirst TO THE SAME JUMP.
+
+static void fillJumps(struct TrieJump *stIndex, int iFirst, int iCount, int iNode, int iBest) {
+   int i;
+
+   for (i = iFirst; i < iFirst + iCount; i++) {
+      stIndex[i].iNode = iNode;
+      stIndex[i].iBest = iBest;
+   }
+}
+
+
+// ********************************************************************
+// fillIndex
+// ********************************************************************
+// FILL THE INDEX SLOTS OF THE PREFIX iFirst/iLength (IN SLOT BITS) FROM
+// iCurrent, THE NODE A LOOKUP OF THOSE ADDRESSES REACHES NEXT.
+
+static void fillIndex(struct AddressTrie *stTrie, struct TrieJump *stIndex, int iCurrent, int iBest, int iFirst, int iLength) {
+   struct TrieNode *stNode;
+   int iCount = 1 << (TRIE_INDEX_BITS - iLength);
+   int iSlot;
+   int iSize;
+
+   if (iCurrent < 0) {
+      fillJumps(stIndex, iFirst, iCount, -1, iBest);
+      return;
+   }
+   stNode = &stTrie->stNode[iCurrent];
+   if (stNode->iLength >= TRIE_INDEX_BITS) { // the lookup carries on from here
+      fillJumps(stIndex, iFirst, iCount, iCurrent, iBest);
+      return;
+   }
+
+   // the node is at least iLength bits long: it covers part of the slots
+   // or, if it parts from them, none.
+   iSlot = (stNode->cKey[0] << 8) | stNode->cKey[1];
+   if ((iSlot >> (TRIE_INDEX_BITS - iLength)) != (iFirst >> (TRIE_INDEX_BITS - iLength))) {
+      fillJumps(stIndex, iFirst, iCount, -1, iBest);
+      return;
+   }
+   iSize = 1 << (TRIE_INDEX_BITS - stNode->iLength);
+   fillJumps(stIndex, iFirst, iSlot - iFirst, -1, iBest);
+   fillJumps(stIndex, iSlot + iSize, iFirst + iCount - iSlot - iSize, -1, iBest);
+
+   if (stNode->iValue >= 0) iBest = stNode->iValue;
+   fillIndex(stTrie, stIndex, stNode->iChild[0], iBest, iSlot, stNode->iLength + 1);
+   fillIndex(stTrie, stIndex, stNode->iChild[1], iBest, iSlot + iSize / 2, stNode->iLength + 1);
+}
+
+
+// ********************************************************************
+// countPrefixes
+// ********************************************************************
+// RETURN THE NUMBER OF STORED PREFIXES UNDER iCurrent, AT MOST iMax.
+
+static int countPrefixes(struct AddressTrie *stTrie, int iCurrent, int iMax) {
+   int iCount = 0;
+
+   while ((iCurrent >= 0) && (iCount < iMax)) { // loop on child 1, recurse on child 0
+      if (stTrie->stNode[iCurrent].iValue >= 0) iCount++;
+      iCount += countPrefixes(stTrie, stTrie->stNode[iCurrent].iChild[0], iMax - iCount);
+      iCurrent = stTrie->stNode[iCurrent].iChild[1];
+   }
+   return (iCount);
+}
+
+
+// ********************************************************************
+// trieBuildIndex
+// ********************************************************************
+// GIVE EVERY BIG IPv4 LIST AN INDEX ON ITS FIRST TRIE_INDEX_BITS BITS.
+//
+// Call once loading is done, before the lookups.  Lists with fewer
+// than TRIE_INDEX_MIN IPv4 prefixes are left alone.
+
+void trieBuildIndex(struct AddressTrie *stTrie) {
+   int iRoot;
+   int iList;
+
+   for (iList = 0; 2 * iList < stTrie->iRoots; iList++) {
+      iRoot = stTrie->iRoot[2 * iList + TRIE_IPV4];
+      if (stTrie->stIndex[iList] || (countPrefixes(stTrie, iRoot, TRIE_INDEX_MIN) < TRIE_INDEX_MIN)) continue;
+
+      stTrie->stIndex[iList] = malloc((1 << TRIE_INDEX_BITS) * sizeof(struct TrieJump));
+      debug_ram += (1 << TRIE_INDEX_BITS) * sizeof(struct TrieJump);
+      fillIndex(stTrie, stTrie->stIndex[iList], iRoot, -1, 0, 0);
+   }
+}
@@ -0,0 +1,103 @@
+//
+// Mikrotik API 2.0 // Address trie.
+//
+
+#ifndef MK_TRIE
+#define MK_TRIE
+
+#include "api.h"
+#include "pool.h"
+
+#define TRIE_IPV4 0
+#define TRIE_IPV6 1
+
+#define TRIE_KEY_SIZE    16 // bytes of an address (IPv4 uses the first 4)
+#define TRIE_STRING_SIZE 64 // room for any address with its /length
+#define TRIE_INDEX_BITS  16 // IPv4 bits resolved by the index of a list
+#define TRIE_INDEX_MIN   4096 // IPv4 prefixes a list needs to get an index
+
+// struct TrieNode
+//
+// A node of a path compressed binary trie.  cKey holds the first
+// iLength bits of every address below it (the rest is zero).  A node
+// with iValue >= 0 is a stored prefix; the others only branch.
+
+struct TrieNode {
+        unsigned char cKey[TRIE_KEY_SIZE];
+        int iLength;               // prefix length in bits
+        int iChild[2];             // next bit 0 / 1, -1 if none
+        int iValue;                // value of the stored prefix, -1 if none
+};
+
+// struct TrieJump
+//
+// One slot of a list index: where a lookup of an IPv4 address whose
+// first TRIE_INDEX_BITS bits select the slot carries on, and the value
+// of the longest prefix matched on the way there.
+
+struct TrieJump {
+        int iNode;                 // next node to look at, -1 if none
+        int iBest;                 // value found above it, -1 if none
+};
+
+// struct TriePrefix
+//
+// A prefix returned by triePrefixes.  iValue is the value it was
+// inserted with, or -1 if it was made by merging two others.
+
+struct TriePrefix {
+        int iList;                 // list id (poolString of stLists)
+        int iFamily;               // TRIE_IPV4 or TRIE_IPV6
+        unsigned char cKey[TRIE_KEY_SIZE];
+        int iLength;
+        int iValue;
+};
+
+// struct TrieSet
+//
+// An array of prefixes from triePrefixes, in address order per list.
+
+struct TrieSet {
+        struct TriePrefix *stPrefix;
+        int iLength;               // prefixes in stPrefix
+        int iSize;                 // prefixes allocated
+};
+
+// struct AddressTrie
+//
+// The prefixes of any number of named address lists, one IPv4 and one
+// IPv6 trie per list.  Lists get ids from the string pool stLists; the
+// roots of list n are iRoot[2 * n + family].  Nodes live in one array
+// and refer to each other by index.
+//
+// A lookup walks at most one node per distinct prefix length on the
+// path, whatever the number of prefixes stored.  On a big list most
+// of those steps are cache misses; trieBuildIndex gives such lists a
+// table that skips the first TRIE_INDEX_BITS bits in one step.
+// Inserting into a list drops its index.
+
+struct AddressTrie {
+        struct TrieNode *stNode;
+        int iNodes;
+        int iSize;                 // nodes allocated
+        struct StringPool stLists; // list names
+        int *iRoot;                // 2 per list, -1 if empty
+        int iRoots;                // roots allocated
+        int iPrefixes;             // stored prefixes
+        struct TrieJump **stIndex; // per list (iRoots / 2), NULL if none
+};
+
+void initializeAddressTrie(struct AddressTrie *stTrie);
+void clearAddressTrie(struct AddressTrie *stTrie);
+int trieParseAddress(char *szAddress, int *piFamily, unsigned char *cKey, int *piLength);
+int trieInsert(struct AddressTrie *stTrie, char *szList, int iFamily, unsigned char *cKey, int iLength, int iValue);
+int trieLookup(struct AddressTrie *stTrie, char *szList, int iFamily, unsigned char *cKey, int iLength);
+int trieContains(struct AddressTrie *stTrie, char *szList, char *szAddress);
+int trieAddBlock(struct AddressTrie *stTrie, struct Block *stBlock, char *cSkip);
+int triePrefixes(struct AddressTrie *stTrie, int iAggregate, struct TrieSet *stSet);
+int trieSubtract(struct AddressTrie *stTrie, struct TrieSet *stSet, struct AddressTrie *stOther);
+void clearTrieSet(struct TrieSet *stSet);
+void triePrefixString(struct TriePrefix *stPrefix, char *szOut);
+void trieBuildIndex(struct AddressTrie *stTrie);
+
+#endif // MK_TRIE
@@ -0,0 +1,381 @@
+//
+// Mikrotik API 2.0 // Typed values.
+//
+// Every value arrives as text.  These parsers turn the kinds RouterOS
+// uses into numbers once, so code that works with counters, timeouts
+// or addresses doesn't run atoi/sscanf/inet_pton on every access:
+//
+//    struct Value stValue;
+//
+//    if (sentenceValue(stSentence, "uptime", VALUE_DURATION, &stValue)) {
+//       printf("up %lld ms\n", stValue.llNumber);
+//    }
+//
+// Whole ColumnBlock columns are converted in one go with convertColumn
+// (column.c), after which columnTyped and the queries read the numbers
+// directly.
+//
+// The parsers are hand written, take no locale into account and never
+// allocate.  Each one accepts the whole string or nothing.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "api.h"
+#include "value.h"
+
+#define IS_DIGIT(c) (((c) >= '0') && ((c) <= '9'))
+
+static const int iFamilyBits[2] = { 32, 128 };
+
+
+// ********************************************************************
+// hexDigit
+// ********************************************************************
+// RETURN THE VALUE OF A HEX DIGIT, -1 IF c ISN'T ONE.
+
+static int hexDigit(char c) {
+   if (IS_DIGIT(c)) return (c - '0');
+   if ((c >= 'a') && (c <= 'f')) return (c - 'a' + 10);
+   if ((c >= 'A') && (c <= 'F')) return (c - 'A' + 10);
+   return (-1);
+}
+
+
+// ********************************************************************
+// valueParseInt
+// ********************************************************************
+// PARSE A SIGNED DECIMAL INTEGER ("1500", "-3").
+//
+// Returns 1 on success, 0 if the value isn't an integer or doesn't fit
+// in 64 bits.
+
+int valueParseInt(char *szValue, long long *pllValue) {
+   unsigned long long llValue = 0;
+   unsigned long long llLimit = LLONG_MAX;
+   int iDigit;
+   char *ptr = szValue;
+
+   if (*ptr == '-') {
+      llLimit++;
+      ptr++;
+   }
+   if (!IS_DIGIT(*ptr)) return (0);
+
+   while (IS_DIGIT(*ptr)) {
+      iDigit = *ptr++ - '0';
+      if (llValue > (llLimit - iDigit) / 10) return (0);
+      llValue = llValue * 10 + iDigit;
+   }
+   if (*ptr) return (0);
+
+   *pllValue = (*szValue == '-') ? (long long)(0 - llValue) : (long long)llValue;
+   return (1);
+}
+
+
+// ********************************************************************
+// valueParseDuration
+// ********************************************************************
+// PARSE A RouterOS DURATION INTO MILLISECONDS.
+//
+// Accepts unit lists ("1w2d3h4m5s", "1s500ms", "350us", "1.5s"), clock
+// times ("01:02:03", "02:03.250") and both mixed ("1w2d03:04:05").  A
+// bare number is seconds.  Time below a millisecond is dropped.
+// Returns 1 on success, 0 if the value isn't a duration.
+
+int valueParseDuration(char *szValue, long long *pllMs) {
+   long long llTotal = 0;    // ms from the unit fields
+   long long llClock = 0;    // the clock fields so far, in units of the next one
+   long long llPart;
+   long long llFraction;
+   long long llScale;
+   long long llUnit;
+   int iClock = 0;           // clock fields seen
+   char *ptr = szValue;
+
+   if (!IS_DIGIT(*ptr)) return (0);
+
+   while (*ptr) {
+      llPart = 0;
+      if (!IS_DIGIT(*ptr)) return (0);
+      while (IS_DIGIT(*ptr)) {
+         if (llPart > (LLONG_MAX / 10) - 10) return (0);
+         llPart = llPart * 10 + (*ptr++ - '0');
+      }
+
+      llFraction = 0;
+      llScale = 1;
+      if (*ptr == '.') {
+         ptr++;
+         if (!IS_DIGIT(*ptr)) return (0);
+         for (; IS_DIGIT(*ptr); ptr++) {
+            if (llScale < 1000000000) {
+               llFraction = llFraction * 10 + (*ptr - '0');
+               llScale *= 10;
+            }
+         }
+      }
+
+      if (*ptr == ':') { // hours or minutes of a clock time
+         if ((iClock == 2) || (llScale > 1) || (llPart > LLONG_MAX / 3600000)) return (0);
+         llClock = (llClock + llPart) * 60;
+         iClock++;
+         ptr++;
+         continue;
+      }
+      if (iClock && *ptr) return (0); // nothing may follow the seconds of a clock
+
+      switch (*ptr) {
+         case 0:   llUnit = 1000; llPart += llClock; break; // bare seconds, or those of a clock
+         case 'w': llUnit = 604800000; ptr++; break;
+         case 'd': llUnit = 86400000; ptr++; break;
+         case 'h': llUnit = 3600000; ptr++; break;
+         case 's': llUnit = 1000; ptr++; break;
+         case 'm':
+            if (ptr[1] == 's') { llUnit = 1; ptr += 2; }
+            else { llUnit = 60000; ptr++; }
+            break;
+         case 'u':
+            if (ptr[1] != 's') return (0);
+            llPart /= 1000;
+            llFraction = 0;
+            llUnit = 1;
+            ptr += 2;
+            break;
+         default: return (0);
+      }
+
+      if (llPart > (LLONG_MAX - llTotal) / llUnit - 1) return (0);
+      llTotal += llPart * llUnit + llFraction * llUnit / llScale;
+   }
+   if (iClock && (ptr[-1] == ':')) return (0);
+
+   *pllMs = llTotal;
+   return (1);
+}
+
+
+// ********************************************************************
+// valueParseBool
+// ********************************************************************
+// PARSE "true"/"yes" AS 1 AND "false"/"no" AS 0.
+//
+// Returns 1 on success, 0 for anything else.
+
+int valueParseBool(char *szValue, int *piValue) {
+   if ((strcmp(szValue, "true") == 0) || (strcmp(szValue, "yes") == 0)) *piValue = 1;
+   else if ((strcmp(szValue, "false") == 0) || (strcmp(szValue, "no") == 0)) *piValue = 0;
+   else return (0);
+   return (1);
+}
+
+
+// ********************************************************************
+// parseIPv4
+// ********************************************************************
+// PARSE "a.b.c.d" INTO 4 BYTES.  RETURN WHERE IT ENDED, NULL IF NOT ONE.
+
+static char *parseIPv4(char *ptr, unsigned char *cBytes) {
+   int iByte;
+   int iDigits;
+   int i;
+
+   for (i = 0; i < 4; i++) {
+      if ((i > 0) && (*ptr++ != '.')) return (NULL);
+      iByte = 0;
+      for (iDigits = 0; IS_DIGIT(*ptr) && (iDigits < 3); iDigits++) iByte = iByte * 10 + (*ptr++ - '0');
+      if ((iDigits == 0) || (iByte > 255)) return (NULL);
+      cBytes[i] = iByte;
+   }
+   return (ptr);
+}
+
+
+// ********************************************************************
+// parseIPv6
+// ********************************************************************
+// PARSE AN IPv6 ADDRESS INTO 16 BYTES.  RETURN WHERE IT ENDED, NULL IF
+// NOT ONE.
+//
+// Groups of up to 4 hex digits, one "::" for a run of zero groups, and
+// an optional dotted IPv4 tail ("::ffff:10.0.0.1").
+
+static char *parseIPv6(char *ptr, unsigned char *cBytes) {
+   unsigned char cGroup[16];
+   char *szStart;
+   int iGroups = 0; // 16 bit groups in cGroup
+   int iGap = -1;   // group the "::" stands before
+   int iValue;
+   int iDigits;
+
+   if (*ptr == ':') {
+      if (ptr[1] != ':') return (NULL);
+      iGap = 0;
+      ptr += 2;
+   }
+
+   while (hexDigit(*ptr) >= 0) {
+      szStart = ptr;
+      iValue = 0;
+      for (iDigits = 0; (hexDigit(*ptr) >= 0) && (iDigits < 4); iDigits++) iValue = iValue * 16 + hexDigit(*ptr++);
+
+      if (*ptr == '.') { // IPv4 tail takes the last two groups
+         if ((iGroups > 6) || ((ptr = parseIPv4(szStart, cGroup + 2 * iGroups)) == NULL)) return (NULL);
+         iGroups += 2;
+         break;
+      }
+      if (iGroups == 8) return (NULL);
+      cGroup[2 * iGroups] = iValue >> 8;
+      cGroup[2 * iGroups + 1] = iValue & 0xff;
+      iGroups++;
+
+      if (*ptr != ':') break;
+      ptr++;
+      if (*ptr == ':') {
+         if (iGap >= 0) return (NULL);
+         iGap = iGroups;
+         ptr++;
+      } else if (hexDigit(*ptr) < 0) {
+         return (NULL); // a single trailing colon
+      }
+   }
+
+   if ((iGap < 0) ? (iGroups != 8) : (iGroups > 7)) return (NULL);
+
+   memset(cBytes, 0, 16);
+   if (iGap < 0) iGap = iGroups;
+   memcpy(cBytes, cGroup, 2 * iGap);
+   memcpy(cBytes + 16 - 2 * (iGroups - iGap), cGroup + 2 * iGap, 2 * (iGroups - iGap));
+   return (ptr);
+}
+
+
+// ********************************************************************
+// valueParseAddress
+// ********************************************************************
+// PARSE "address" OR "address/length", IPv4 OR IPv6.
+//
+// cBytes gets VALUE_ADDRESS_SIZE bytes: the address as written, zero
+// filled after it.  Without /length the length is the full 32 or 128.
+// Returns 1, or 0 if szValue is not an address (a range or a DNS name,
+// say).
+
+int valueParseAddress(char *szValue, int *piFamily, unsigned char *cBytes, int *piLength) {
+   char *ptr;
+   int iLength;
+   int iDigits;
+
+   memset(cBytes, 0, VALUE_ADDRESS_SIZE);
+   if (strchr(szValue, ':')) {
+      *piFamily = VALUE_IPV6;
+      ptr = parseIPv6(szValue, cBytes);
+   } else {
+      *piFamily = VALUE_IPV4;
+      ptr = parseIPv4(szValue, cBytes);
+   }
+   if (ptr == NULL) return (0);
+
+   *piLength = iFamilyBits[*piFamily];
+   if (*ptr == '/') {
+      ptr++;
+      iLength = 0;
+      for (iDigits = 0; IS_DIGIT(*ptr) && (iDigits < 3); iDigits++) iLength = iLength * 10 + (*ptr++ - '0');
+      if ((iDigits == 0) || (iLength > *piLength)) return (0);
+      *piLength = iLength;
+   }
+
+   return (*ptr == 0);
+}
+
+
+// ********************************************************************
+// valueParseMAC
+// ********************************************************************
+// PARSE "AA:BB:CC:DD:EE:FF" (OR WITH DASHES) INTO 6 BYTES.
+//
+// Returns 1 on success, 0 if szValue is not a MAC address.
+
+int valueParseMAC(char *szValue, unsigned char *cBytes) {
+   char *ptr = szValue;
+   int i;
+
+   for (i = 0; i < 6; i++) {
+      if ((i > 0) && (*ptr != ':') && (*ptr != '-')) return (0);
+      if (i > 0) ptr++;
+      if ((hexDigit(ptr[0]) < 0) || (hexDigit(ptr[1]) < 0)) return (0);
+      cBytes[i] = hexDigit(ptr[0]) * 16 + hexDigit(ptr[1]);
+      ptr += 2;
+   }
+   return (*ptr == 0);
+}
+
+
+// ********************************************************************
+// parseValue
+// ********************************************************************
+// PARSE szValue AS iType INTO stValue.
+//
+// Returns 1 on success.  On failure, or if szValue is NULL, stValue
+// gets VALUE_NONE and 0 is returned.
+
+int parseValue(char *szValue, int iType, struct Value *stValue) {
+   int iBool;
+   int iOk = 0;
+
+   memset(stValue, 0, sizeof(struct Value));
+   if (szValue == NULL) return (0);
+
+   switch (iType) {
+      case VALUE_INT:
+         iOk = valueParseInt(szValue, &stValue->llNumber);
+         break;
+      case VALUE_DURATION:
+         iOk = valueParseDuration(szValue, &stValue->llNumber);
+         break;
+      case VALUE_BOOL:
+         if ((iOk = valueParseBool(szValue, &iBool)) != 0) stValue->llNumber = iBool;
+         break;
+      case VALUE_ADDRESS:
+         iOk = valueParseAddress(szValue, &stValue->iFamily, stValue->cBytes, &stValue->iLength);
+         break;
+      case VALUE_MAC:
+         iOk = valueParseMAC(szValue, stValue->cBytes);
+         break;
+   }
+
+   if (!iOk) {
+      memset(stValue, 0, sizeof(struct Value));
+      return (0);
+   }
+   stValue->iType = iType;
+   return (1);
+}
+
+
+// ********************************************************************
+// sentenceValue
+// ********************************************************************
+// PARSE THE VALUE OF =szName= IN A SENTENCE AS iType.
+//
+// szName is the bare attribute name, "bytes" and not "=bytes=".
+// Unlike findWord it only matches the whole name.  Returns 1 on
+// success, 0 if the word is missing or not of that type.
+
+int sentenceValue(struct Sentence *stSentence, char *szName, int iType, struct Value *stValue) {
+   int iNameLen = strlen(szName);
+   char *szWord;
+   int i;
+
+   for (i = 0; i < stSentence->iLength; i++) {
+      szWord = stSentence->szWord[i];
+      if ((szWord[0] == '=') && (strncmp(szWord + 1, szName, iNameLen) == 0) && (szWord[iNameLen + 1] == '=')) {
+         return (parseValue(szWord + iNameLen + 2, iType, stValue));
+      }
+   }
+
+   return (parseValue(NULL, iType, stValue));
+}
@@ -0,0 +1,48 @@
+//
+// Mikrotik API 2.0 // Typed values.
+//
+
+#ifndef MK_VALUE
+#define MK_VALUE
+
+#include "api.h"
+
+#define VALUE_NONE     0 // missing, or not of the type asked for
+#define VALUE_INT      1 // signed 64 bit integer
+#define VALUE_DURATION 2 // RouterOS duration, in milliseconds
+#define VALUE_BOOL     3 // true/yes or false/no, as 1 or 0
+#define VALUE_ADDRESS  4 // IPv4 or IPv6 address, with optional /length
+#define VALUE_MAC      5 // 6 byte MAC address
+
+#define VALUE_IPV4 0 // same as TRIE_IPV4
+#define VALUE_IPV6 1 // same as TRIE_IPV6
+
+#define VALUE_ADDRESS_SIZE 16 // bytes of an address (IPv4 uses the first 4)
+
+// struct Value
+//
+// One word value parsed into its type.  Numbers, durations and
+// booleans are in llNumber.  Addresses are in cBytes in network byte
+// order with iFamily and the prefix length in iLength (32 or 128 when
+// the value had no /length); bytes past the address are zero.  A MAC
+// takes the first 6 bytes of cBytes.
+
+struct Value {
+        int iType;                 // VALUE_INT .. VALUE_MAC, or VALUE_NONE
+        int iFamily;               // address: VALUE_IPV4 or VALUE_IPV6
+        int iLength;               // address: prefix length in bits
+        union {
+           long long llNumber;
+           unsigned char cBytes[VALUE_ADDRESS_SIZE];
+        };
+};
+
+int valueParseInt(char *szValue, long long *pllValue);
+int valueParseDuration(char *szValue, long long *pllMs);
+int valueParseBool(char *szValue, int *piValue);
+int valueParseAddress(char *szValue, int *piFamily, unsigned char *cBytes, int *piLength);
+int valueParseMAC(char *szValue, unsigned char *cBytes);
+int parseValue(char *szValue, int iType, struct Value *stValue);
+int sentenceValue(struct Sentence *stSentence, char *szName, int iType, struct Value *stValue);
+
+#endif // MK_VALUE
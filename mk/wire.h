@@ -0,0 +1,154 @@
+//
+// Mikrotik API 2.0 // Wire codec.
+//
+// Encoding and decoding of RouterOS API word lengths.  Everything is
+// static inline so the 1 and 2 byte cases, which cover nearly every
+// word on the wire, compile down to a couple of instructions at the
+// call site.  Nothing here allocates, touches a socket or depends on
+// the byte order of the host.
+//
+//   0xxxxxxx                                 < 0x80        1 byte
+//   10xxxxxx xxxxxxxx                        < 0x4000      2 bytes
+//   110xxxxx xxxxxxxx xxxxxxxx               < 0x200000    3 bytes
+//   1110xxxx xxxxxxxx xxxxxxxx xxxxxxxx      < 0x10000000  4 bytes
+//   11110000 xxxxxxxx xxxxxxxx xxxxxxxx xxxxxxxx           5 bytes
+//
+// First bytes 0xF1 to 0xFF are reserved (0xF8 and up are control
+// bytes) and are rejected by the decoder.  test/wirefuzz.c checks the
+// round trip of every length class.
+//
+
+#ifndef MK_WIRE
+#define MK_WIRE
+
+#include <string.h>
+
+#define WIRE_MAX_LEN_SIZE 5 // longest encoded length in bytes
+
+// encoded size of a length, indexed by the top 5 bits of the first byte.
+// 0 marks a reserved byte.  11110xxx is only valid as 0xF0, see
+// wirePrefixSize.
+static const unsigned char wireSizeTable[32] = {
+   1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xxxxxxx
+   2, 2, 2, 2, 2, 2, 2, 2,                         // 10xxxxxx
+   3, 3, 3, 3,                                     // 110xxxxx
+   4, 4,                                           // 1110xxxx
+   5,                                              // 11110xxx
+   0                                               // 11111xxx
+};
+
+// bits of the first byte that belong to the length, indexed by size.
+static const unsigned char wireMaskTable[6] = { 0, 0x7f, 0x3f, 0x1f, 0x0f, 0x00 };
+
+// prefix bits of the first byte, indexed by size.
+static const unsigned char wirePrefixTable[6] = { 0, 0x00, 0x80, 0xc0, 0xe0, 0xf0 };
+
+
+// ********************************************************************
+// wireLenSize
+// ********************************************************************
+// RETURN THE NUMBER OF BYTES NEEDED TO ENCODE iLen (1 TO 5).
+
+static inline int wireLenSize(unsigned int iLen) {
+   return (1 + (iLen >= 0x80) + (iLen >= 0x4000) + (iLen >= 0x200000) + (iLen >= 0x10000000));
+}
+
+
+// ********************************************************************
+// wireEncodeLen
+// ********************************************************************
+// ENCODE iLen INTO cOut AND RETURN THE NUMBER OF BYTES WRITTEN.
+//
+// cOut must have room for WIRE_MAX_LEN_SIZE bytes.
+
+static inline int wireEncodeLen(unsigned int iLen, unsigned char *cOut) {
+   int iSize;
+   int i;
+
+   if (iLen < 0x80) { // 1 byte
+      cOut[0] = (unsigned char)iLen;
+      return (1);
+   }
+   if (iLen < 0x4000) { // 2 bytes
+      cOut[0] = (unsigned char)((iLen >> 8) | 0x80);
+      cOut[1] = (unsigned char)iLen;
+      return (2);
+   }
+
+   iSize = wireLenSize(iLen);
+   for (i = iSize - 1; i > 0; i--) {
+      cOut[i] = (unsigned char)iLen;
+      iLen >>= 8;
+   }
+   cOut[0] = (unsigned char)(iSize == 5 ? 0 : iLen) | wirePrefixTable[iSize];
+
+   return (iSize);
+}
+
+
+// ********************************************************************
+// wirePrefixSize
+// ********************************************************************
+// RETURN THE ENCODED SIZE STARTING WITH cFirst, OR 0 IF RESERVED.
+//
+// A 5 byte length carries no bits in its first byte, so 0xF1 to 0xF7
+// are reserved like the control bytes above them.
+
+static inline int wirePrefixSize(unsigned char cFirst) {
+   if ((cFirst > 0xf0) && (cFirst < 0xf8)) return (0);
+   return (wireSizeTable[cFirst >> 3]);
+}
+
+
+// ********************************************************************
+// wireDecodeLen
+// ********************************************************************
+// DECODE A LENGTH FROM THE iAvail BYTES AT cIn.
+//
+// Returns the number of bytes used and stores the length in *piLen.
+// Returns 0 if more bytes are needed and -1 for a reserved first byte.
+
+static inline int wireDecodeLen(const unsigned char *cIn, int iAvail, unsigned int *piLen) {
+   unsigned int iLen;
+   int iSize;
+   int i;
+
+   if (iAvail < 1) return (0);
+
+   if (cIn[0] < 0x80) { // 1 byte
+      *piLen = cIn[0];
+      return (1);
+   }
+   if ((cIn[0] & 0xc0) == 0x80) { // 2 bytes
+      if (iAvail < 2) return (0);
+      *piLen = ((unsigned int)(cIn[0] & 0x3f) << 8) | cIn[1];
+      return (2);
+   }
+
+   if ((iSize = wirePrefixSize(cIn[0])) == 0) return (-1);
+   if (iAvail < iSize) return (0);
+
+   iLen = cIn[0] & wireMaskTable[iSize];
+   for (i = 1; i < iSize; i++) iLen = (iLen << 8) | cIn[i];
+   *piLen = iLen;
+
+   return (iSize);
+}
+
+
+// ********************************************************************
+// wireEncodeWord
+// ********************************************************************
+// ENCODE A WORD (LENGTH + BYTES) INTO cOut.
+//
+// cOut must have room for iLen + WIRE_MAX_LEN_SIZE bytes.  Returns the
+// number of bytes written.
+
+static inline int wireEncodeWord(const char *szWord, unsigned int iLen, unsigned char *cOut) {
+   int iSize = wireEncodeLen(iLen, cOut);
+
+   memcpy(cOut + iSize, szWord, iLen);
+   return (iSize + iLen);
+}
+
+#endif // MK_WIRE